@@ -30,7 +30,9 @@
 #include "bleprph.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/semphr.h"
 #include "blePeripheralServer.h"
+#include "spscRing.h"
 
 #define CONNECTION_ESTABILISHED  0
 #define CONNECTION_ATTEMPT_FAILED 1
@@ -49,9 +51,90 @@ static void bleprph_advertise(void);
 static void bleprph_print_conn_desc(struct ble_gap_conn_desc *desc);
 
 QueueHandle_t blePeriph_appToBleQueue;
-QueueHandle_t blePeriph_bleToAppQueue;
 bool isConnectedToCentral = false;
 
+_Static_assert(sizeof(bleToAppQueueItem_t) == SPSC_RING_CACHE_LINE_BYTES, "app ring items should be one cache line");
+
+static spscRing_t appRing;
+static _Alignas(SPSC_RING_CACHE_LINE_BYTES) bleToAppQueueItem_t appRingStorage[BLE_TO_APP_RING_LENGTH]; //Internal ram, the ring is touched on every write
+static SemaphoreHandle_t appRingSignal = NULL; //Given after each push, the system loop waits on it when the ring is empty
+static StaticSemaphore_t appRingSignalBuffer;
+static bleToAppStats_t appRingStats;           //Written by the host task only
+
+//************************************
+//************ APP RING **************
+//************************************
+uint8_t blePeriphAPI_initAppRing(void)
+{
+    // Before the ble task is created, see blePeripheralServer.h
+    memset(&appRingStats, 0, sizeof(bleToAppStats_t));
+    if(!spscRing_init(&appRing, appRingStorage, sizeof(bleToAppQueueItem_t), BLE_TO_APP_RING_LENGTH)) return 1;
+
+    appRingSignal = xSemaphoreCreateBinaryStatic(&appRingSignalBuffer);
+    if(appRingSignal == NULL) return 1;
+
+    //** SUCCESS **//
+    return 0;
+}
+
+
+bool blePeriphAPI_receive(bleToAppQueueItem_t * item, TickType_t ticksToWait)
+{
+    // The signal can be left over from an item already taken, so an
+    // empty ring after it just means waiting again
+    while(!spscRing_pop(&appRing, item))
+    {
+        if(xSemaphoreTake(appRingSignal, ticksToWait) != pdTRUE) return spscRing_pop(&appRing, item);
+    }
+
+    return true;
+}
+
+
+void blePeriphAPI_getAppRingStats(bleToAppStats_t * stats)
+{
+    *stats = appRingStats;
+    stats->numOverflows = spscRing_getOverflowCount(&appRing);
+}
+
+
+bool blePeriph_hasAppRoom(void)
+{
+    return spscRing_freeSlots(&appRing) != 0;
+}
+
+
+uint8_t blePeriph_sendToApp(const bleToAppQueueItem_t * item)
+{
+    // Never blocks, the host task has the link to keep up with
+    uint32_t depth;
+
+    if(!spscRing_push(&appRing, item)) return 1;
+
+    appRingStats.numItems++;
+    depth = spscRing_count(&appRing);
+    if(depth > appRingStats.maxDepth) appRingStats.maxDepth = depth;
+    xSemaphoreGive(appRingSignal);
+
+    //** SUCCESS **//
+    return 0;
+}
+
+
+void blePeriph_countRefusedWrite(void)
+{
+    appRingStats.numRefusedWrites++;
+}
+
+
+void blePeriph_countHeldUploadChunk(void)
+{
+    appRingStats.numHeldUploadChunks++;
+}
+
+
+
+
 //************************************
 //This is the BLE peripheral RTOS task
 //************************************
@@ -75,15 +158,17 @@ void blePeriphAPI_task(void * param)
 
     bleToAppQueueItem_t responseForApp;
 
-    initNimBle();
-
-    //First queue item is just a dummy byte
-    if(xQueueSendToBack(blePeriph_bleToAppQueue, &responseForApp, pdMS_TO_TICKS(5000)) == pdFALSE)
+    //First item is just a dummy, pushed before the host task exists
+    //so the app ring only ever has the one producer at a time
+    memset(&responseForApp, 0, sizeof(bleToAppQueueItem_t));
+    if(blePeriph_sendToApp(&responseForApp))
     {
-        ESP_LOGE(LOG_TAG, "Failure adding item to blePeriph_appToBleQueue - ble task startup failed, deleting task");
+        ESP_LOGE(LOG_TAG, "Failure adding item to the app ring - ble task startup failed, deleting task");
         vTaskDelete(NULL); //Delete *this* task
     }
 
+    initNimBle();
+
     while(1)
     {
         if (uxQueueMessagesWaiting(blePeriph_appToBleQueue))
@@ -0,0 +1,182 @@
+#include <stdio.h>
+#include <string.h>
+#include "esp_log.h"
+#include "bleUpload.h"
+
+#define LOG_TAG "bleUpload"
+
+static uint32_t getWindowEnd(const bleUpload_t * upload);
+static void rejectChunk(bleUpload_t * upload, uint16_t payloadLength);
+static void writeLittleEndian(uint8_t * destination, uint32_t value, uint8_t numBytes);
+
+
+//**** Public
+uint16_t bleUpload_getChunkBytes(uint16_t mtu)
+{
+    // What is left of the write once the att header and the
+    // offset are taken off, capped by the flattening buffer
+    uint16_t chunkBytes;
+
+    if(mtu < BLE_UPLOAD_MIN_MTU) mtu = BLE_UPLOAD_MIN_MTU;
+    chunkBytes = mtu - BLE_UPLOAD_ATT_HEADER_BYTES - BLE_UPLOAD_OFFSET_BYTES;
+
+    return (chunkBytes > BLE_UPLOAD_MAX_CHUNK_BYTES) ? BLE_UPLOAD_MAX_CHUNK_BYTES : chunkBytes;
+}
+
+
+//**** Public
+uint8_t bleUpload_begin(bleUpload_t * upload, uint8_t * buffer, uint32_t capacity, uint32_t length, uint16_t mtu)
+{
+    // Starts over, whatever was in progress. The first ack (due straight
+    // away) opens the window, the client waits for it before sending.
+    if((buffer == NULL) || (length == 0) || (length > capacity))
+    {
+        ESP_LOGE(LOG_TAG, "Can't take an upload of %ld bytes (room for %ld)", length, capacity);
+        upload->isActive = false;
+        return 1;
+    }
+
+    memset(upload, 0, sizeof(bleUpload_t));
+    upload->buffer = buffer;
+    upload->length = length;
+    upload->chunkBytes = bleUpload_getChunkBytes(mtu);
+    upload->isAckDue = true;
+    upload->isActive = true;
+
+    //** SUCCESS **//
+    return 0;
+}
+
+
+//**** Public
+uint8_t bleUpload_receive(bleUpload_t * upload, const void * packet, uint16_t packetLength, bleUpload_copyFunction_t copy)
+{
+    // One write from the client: a 4 byte offset, then the payload. Only
+    // the chunk at the received offset is taken, anything else means one
+    // went missing before it. The offset is read first so the payload can
+    // go straight to the buffer. Returns 1 for a chunk that was not taken.
+    uint8_t header[BLE_UPLOAD_OFFSET_BYTES];
+    uint16_t payloadLength;
+    uint32_t offset;
+
+    if(!upload->isActive || (packetLength < BLE_UPLOAD_OFFSET_BYTES)) return 1;
+    payloadLength = packetLength - BLE_UPLOAD_OFFSET_BYTES;
+    upload->stats.numPackets++;
+
+    if(payloadLength == 0) //Asks for an ack
+    {
+        upload->isAckDue = true;
+        return 0;
+    }
+
+    if(copy(packet, 0, BLE_UPLOAD_OFFSET_BYTES, header)) return 1;
+    upload->stats.numBytesCopied += BLE_UPLOAD_OFFSET_BYTES;
+    offset = (uint32_t)header[0] | ((uint32_t)header[1] << 8) | ((uint32_t)header[2] << 16) | ((uint32_t)header[3] << 24);
+
+    if((offset < upload->received) && (payloadLength <= (upload->received - offset)))
+    {
+        upload->stats.numDuplicates++;
+        return 1;
+    }
+
+    if((offset != upload->received) || (payloadLength > upload->chunkBytes) || (payloadLength > (getWindowEnd(upload) - offset)))
+    {
+        rejectChunk(upload, payloadLength);
+        return 1;
+    }
+
+    //Nothing past 'received' counts until it is, so a failed copy is
+    //just another chunk to send again
+    if(copy(packet, BLE_UPLOAD_OFFSET_BYTES, payloadLength, &upload->buffer[offset]))
+    {
+        rejectChunk(upload, payloadLength);
+        return 1;
+    }
+    upload->stats.numBytesCopied += payloadLength;
+    upload->received += payloadLength;
+    upload->isInGap = false;
+    upload->stats.numChunks++;
+
+    if(((upload->received - upload->lastAcked) >= BLE_UPLOAD_ACK_BYTES) || (upload->received == upload->length)) upload->isAckDue = true;
+
+    //** SUCCESS **//
+    return 0;
+}
+
+
+//**** Public
+uint8_t bleUpload_copyFlat(const void * packet, uint16_t sourceOffset, uint16_t length, uint8_t * destination)
+{
+    // For packets already in one piece
+    memcpy(destination, (const uint8_t *)packet + sourceOffset, length);
+    return 0;
+}
+
+
+//**** Public
+bool bleUpload_isAckDue(const bleUpload_t * upload)
+{
+    return upload->isActive && upload->isAckDue;
+}
+
+
+//**** Public
+uint16_t bleUpload_makeAck(bleUpload_t * upload, uint8_t * ack)
+{
+    // [0-3] received offset, [4-7] window end (the client may send up to,
+    // not including, this offset), [8-9] chunk bytes, [10] gap count.
+    // All little endian, BLE_UPLOAD_ACK_LENGTH bytes in total.
+    writeLittleEndian(&ack[0], upload->received, 4);
+    writeLittleEndian(&ack[4], getWindowEnd(upload), 4);
+    writeLittleEndian(&ack[8], upload->chunkBytes, 2);
+    ack[10] = upload->numGaps;
+
+    upload->lastAcked = upload->received;
+    upload->isAckDue = false;
+    upload->stats.numAcks++;
+
+    return BLE_UPLOAD_ACK_LENGTH;
+}
+
+
+//**** Public
+bool bleUpload_isComplete(const bleUpload_t * upload)
+{
+    return upload->isActive && (upload->received == upload->length);
+}
+
+
+
+
+//**** Private
+static uint32_t getWindowEnd(const bleUpload_t * upload)
+{
+    return ((upload->length - upload->received) > BLE_UPLOAD_WINDOW_BYTES) ? (upload->received + BLE_UPLOAD_WINDOW_BYTES) : upload->length;
+}
+
+
+//**** Private
+static void rejectChunk(bleUpload_t * upload, uint16_t payloadLength)
+{
+    // The first chunk rejected is acked at once so the client goes back.
+    // Those it already had in flight are rejected quietly, unless a whole
+    // window's worth goes by - then the ack must have been lost.
+    upload->stats.numRejected++;
+    upload->gapBytes += payloadLength;
+
+    if(!upload->isInGap || (upload->gapBytes >= BLE_UPLOAD_WINDOW_BYTES))
+    {
+        upload->isInGap = true;
+        upload->gapBytes = 0;
+        upload->numGaps++;
+        upload->isAckDue = true;
+        upload->stats.numGapAcks++;
+    }
+}
+
+
+//**** Private
+static void writeLittleEndian(uint8_t * destination, uint32_t value, uint8_t numBytes)
+{
+    for(uint8_t i = 0; i < numBytes; i++) destination[i] = (uint8_t)(value >> (8 * i));
+}
@@ -23,6 +23,7 @@
 #include <stdbool.h>
 #include "nimble/ble.h"
 #include "modlog/modlog.h"
+#include "blePeripheralServer.h"
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -41,6 +42,14 @@ struct ble_gatt_register_ctxt;
 void gatt_svr_register_cb(struct ble_gatt_register_ctxt *ctxt, void *arg);
 int gatt_svr_init(void);
 
+/* The producer side of the app ring (see blePeripheralServer.h), only the
+ * host task may call these. Check for room before doing anything that
+ * can't be undone - with one producer, the room is still there after. */
+bool blePeriph_hasAppRoom(void);
+uint8_t blePeriph_sendToApp(const bleToAppQueueItem_t *item);
+void blePeriph_countRefusedWrite(void);
+void blePeriph_countHeldUploadChunk(void);
+
 /** Misc. */
 void print_bytes(const uint8_t *bytes, int len);
 void print_addr(const void *addr);
@@ -25,8 +25,10 @@
 #include "host/ble_uuid.h"
 #include "services/gap/ble_svc_gap.h"
 #include "services/gatt/ble_svc_gatt.h"
+#include "freertos/semphr.h"
 #include "bleprph.h"
 #include "include/blePeripheralServer.h"
+#include "bleUpload.h"
 
 #define LOG_TAG "gattServer"
 
@@ -36,6 +38,8 @@ static const ble_uuid128_t gatt_svr_service_uuid = BLE_UUID128_INIT(0x2d, 0x71,
 static const ble_uuid128_t gatt_svr_characteristic_eventBuffer = BLE_UUID128_INIT(0xf6, 0x6d, 0xc9, 0x07, 0x71, 0x00, 0x16, 0xb0, 0xe1, 0x45, 0x7e, 0x89, 0x9e, 0x65, 0x3a, 0x5c);
 /* 5c3a659e-897e-45e1-b016-007107c96df7 */
 static const ble_uuid128_t gatt_svr_characteristic_fileBuffer = BLE_UUID128_INIT(0xf7, 0x6d, 0xc9, 0x07, 0x71, 0x00, 0x16, 0xb0, 0xe1, 0x45, 0x7e, 0x89, 0x9e, 0x65, 0x3a, 0x5c);
+/* 5c3a659e-897e-45e1-b016-007107c96df8 */
+static const ble_uuid128_t gatt_svr_characteristic_upload = BLE_UUID128_INIT(0xf8, 0x6d, 0xc9, 0x07, 0x71, 0x00, 0x16, 0xb0, 0xe1, 0x45, 0x7e, 0x89, 0x9e, 0x65, 0x3a, 0x5c);
 
 #define CHAR_EVENT_BUFFER_BYTES 512
 #define CHAR_FILE_BUFFER_BYTES sizeof(uint16_t)
@@ -43,10 +47,21 @@ static const ble_uuid128_t gatt_svr_characteristic_fileBuffer = BLE_UUID128_INIT
 static uint8_t characteristic_eventBuffer[CHAR_EVENT_BUFFER_BYTES]; // Used to receive inividual events and commands
 
 uint8_t * playbackBufferBASE;
+uint32_t playbackBufferCapacity = 0;
 static uint8_t * playbackWritePtr = NULL;
+static uint32_t playbackBytesReceived;
+static volatile blePeriph_liveEventHandler_t liveEventHandler = NULL;
+
+static bleUpload_t upload;
+static SemaphoreHandle_t uploadMutex = NULL; //The system loop begins uploads, the host task receives them
+static uint16_t uploadConnHandle;           //Connection the last command came in on, acks go back on it
+static uint16_t uploadValueHandle;
 
 
 static int gatt_svr_chr_access(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg);
+static int receiveUploadChunk(uint16_t conn_handle, struct os_mbuf *om);
+static uint8_t copyFromMbuf(const void *packet, uint16_t sourceOffset, uint16_t length, uint8_t *destination);
+static void sendUploadAck(uint16_t conn_handle, const uint8_t *ack, uint16_t ackLength);
 
 // Array of services this GATT server hosts
 static const struct ble_gatt_svc_def gatt_svr_svcs[] = {
@@ -67,6 +82,13 @@ static const struct ble_gatt_svc_def gatt_svr_svcs[] = {
                                                            .flags = BLE_GATT_CHR_F_WRITE, BLE_GATT_CHR_F_WRITE_ENC
                                                            
                                                        },
+                                                       {
+                                                           // Characteristic: upload, song chunks as writes without response, acks notified back (see bleUpload.h)
+                                                           .uuid = &gatt_svr_characteristic_upload.u,
+                                                           .access_cb = gatt_svr_chr_access,
+                                                           .val_handle = &uploadValueHandle,
+                                                           .flags = BLE_GATT_CHR_F_WRITE_NO_RSP | BLE_GATT_CHR_F_NOTIFY
+                                                       },
                                                        {
                                                            0, /* No more characteristics in this service. */
                                                        }},
@@ -107,7 +129,7 @@ static int gatt_svr_chr_access(uint16_t conn_handle, uint16_t attr_handle, struc
     int rc;
 
 
-    ESP_LOGI(LOG_TAG, "Connected central/client attempted to access a charcteristic %ld", playbackPayloadsReceived);
+    ESP_LOGD(LOG_TAG, "Connected central/client attempted to access a charcteristic %ld", playbackPayloadsReceived);
 
     //This system uses this 
 
@@ -119,10 +141,14 @@ static int gatt_svr_chr_access(uint16_t conn_handle, uint16_t attr_handle, struc
             // This characteristic is used for receiving commands,
             // as well as individual midi events - both of which
             // are just a few bytes in size (see blePeripheralServer.h)
-            ESP_LOGI(LOG_TAG, "Event/command buffer write operation executed");
+            ESP_LOGD(LOG_TAG, "Event/command buffer write operation executed");
 
             rc = gatt_svr_chr_write(ctxt->om, 1, CHAR_EVENT_BUFFER_BYTES, characteristic_eventBuffer, &lengthWritten);
 
+            //A write the stack couldn't flatten leaves lengthWritten at 0,
+            //report that to the client rather than accepting it
+            if(rc != 0) return rc;
+
             if(lengthWritten < 4)
             {
                 ESP_LOGE(LOG_TAG, "Error recieved ble data format incorrect - aborting characteristic write");
@@ -130,28 +156,64 @@ static int gatt_svr_chr_access(uint16_t conn_handle, uint16_t attr_handle, struc
             }
 
             flags = characteristic_eventBuffer[0];
-            ESP_LOGI("DEBU8G", "flags=%0x", flags);
+            uploadConnHandle = conn_handle;
+
+            //Live events are played straight from here rather than waiting
+            //for the system loop, so nothing on this path logs. The opcode
+            //is only read from a write that holds one (flags, opcode)
+            if((lengthWritten >= 2) && (flags != 0x20) && (flags != 0x10) && (characteristic_eventBuffer[1] == BLE_LIVE_EVENT_OPCODE))
+            {
+                if(liveEventHandler != NULL) liveEventHandler((characteristic_eventBuffer + 2), lengthWritten - 2);
+                return rc;
+            }
+
+            //The system loop is behind: refuse the write rather than lose
+            //it (or its payload's length), the client writes it again
+            if(!blePeriph_hasAppRoom())
+            {
+                blePeriph_countRefusedWrite();
+                return BLE_ATT_ERR_INSUFFICIENT_RES;
+            }
+
+            //Playback payloads have to fit what is left of the buffer,
+            //and a continuation needs a first payload before it
+            if(((flags == 0x20) && ((lengthWritten - 2) > playbackBufferCapacity)) ||
+               ((flags == 0x10) && ((playbackWritePtr == NULL) || ((lengthWritten - 2) > (playbackBufferCapacity - playbackBytesReceived)))))
+            {
+                ESP_LOGE(LOG_TAG, "Playback payload doesn't fit the %ld byte buffer (%ld bytes in), refused", playbackBufferCapacity, playbackBytesReceived);
+                return BLE_ATT_ERR_INSUFFICIENT_RES;
+            }
+
+            queueItem.dataLength = 0;
+            ESP_LOGD("DEBU8G", "flags=%0x", flags);
 
             if(flags == 0x20) //first lot of multiple playback data
             {
                 ESP_LOGI(LOG_TAG, "Received start of multi-payload playback stream");
                 playbackWritePtr = playbackBufferBASE;
-                memcpy(playbackWritePtr, (characteristic_eventBuffer + 2), 510);
-                queueItem.dataLength = 510;
+                memcpy(playbackWritePtr, (characteristic_eventBuffer + 2), lengthWritten - 2);
+                queueItem.dataLength = lengthWritten - 2;
+                playbackBytesReceived = lengthWritten - 2;
                 playbackPayloadsReceived = 1;
             }
             else if(flags == 0x10) //part of ongoing multiple payload transaction
             {
 
-                memcpy(playbackWritePtr + (playbackPayloadsReceived * 510), (characteristic_eventBuffer + 2), lengthWritten - 2);
+                memcpy(playbackWritePtr + playbackBytesReceived, (characteristic_eventBuffer + 2), lengthWritten - 2);
                 queueItem.dataLength = lengthWritten - 2;
+                playbackBytesReceived += lengthWritten - 2;
                 playbackPayloadsReceived++;
                 ESP_LOGI(LOG_TAG, "playback payload %ld received", playbackPayloadsReceived);
             }
+            else //Command, any argument bytes follow the opcode
+            {
+                queueItem.dataLength = (lengthWritten - 2 > sizeof(queueItem.data)) ? sizeof(queueItem.data) : lengthWritten - 2;
+                memcpy(queueItem.data, (characteristic_eventBuffer + 2), queueItem.dataLength);
+            }
             
             queueItem.opcode = *(characteristic_eventBuffer + 1);
 
-            xQueueSendFromISR(blePeriph_bleToAppQueue, &queueItem, pdFALSE); // needs updating
+            blePeriph_sendToApp(&queueItem); //Can't fail, the room was checked above
             return rc;
 
         default:
@@ -160,11 +222,107 @@ static int gatt_svr_chr_access(uint16_t conn_handle, uint16_t attr_handle, struc
         }
     }
 
+    if (ble_uuid_cmp(uuid, &gatt_svr_characteristic_upload.u) == 0)
+    {
+        if (ctxt->op != BLE_GATT_ACCESS_OP_WRITE_CHR) return BLE_ATT_ERR_UNLIKELY;
+        return receiveUploadChunk(conn_handle, ctxt->om);
+    }
+
 
     assert(0);
     return BLE_ATT_ERR_UNLIKELY;
 }
 
+static int receiveUploadChunk(uint16_t conn_handle, struct os_mbuf *om)
+{
+    // Writes without response, so the client only finds out how far the
+    // upload got from the acks. Nothing on this path logs, it runs for
+    // every chunk. The payload goes from the mbuf chain straight into the
+    // upload buffer (no flattening into characteristic_eventBuffer), and
+    // the song goes to the system loop once it is all in.
+    bleToAppQueueItem_t queueItem;
+    uint8_t ack[BLE_UPLOAD_ACK_LENGTH];
+    uint16_t ackLength = 0;
+    uint16_t lengthWritten = OS_MBUF_PKTLEN(om);
+    uint32_t songLength = 0;
+    bool isComplete = false;
+
+    if ((lengthWritten < BLE_UPLOAD_OFFSET_BYTES) || (lengthWritten > (BLE_UPLOAD_OFFSET_BYTES + BLE_UPLOAD_MAX_CHUNK_BYTES)))
+    {
+        return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+    }
+
+    // No credit while the app ring is full, in case this chunk completes
+    // the upload. The client goes back for it, as for a lost chunk.
+    if (!blePeriph_hasAppRoom())
+    {
+        blePeriph_countHeldUploadChunk();
+        return 0;
+    }
+
+    xSemaphoreTake(uploadMutex, portMAX_DELAY);
+    if (bleUpload_receive(&upload, om, lengthWritten, copyFromMbuf) == 0) isComplete = bleUpload_isComplete(&upload);
+    if (bleUpload_isAckDue(&upload)) ackLength = bleUpload_makeAck(&upload, ack);
+    songLength = upload.length;
+    xSemaphoreGive(uploadMutex);
+
+    if (ackLength != 0) sendUploadAck(conn_handle, ack, ackLength);
+
+    if (isComplete && (lengthWritten > BLE_UPLOAD_OFFSET_BYTES))
+    {
+        memset(&queueItem, 0, sizeof(bleToAppQueueItem_t));
+        queueItem.opcode = BLE_UPLOAD_COMPLETE_OPCODE;
+        queueItem.dataLength = 4;
+        memcpy(queueItem.data, &songLength, 4); //Little endian, as the other commands
+        blePeriph_sendToApp(&queueItem); //Room checked before the chunk was taken
+    }
+
+    return 0;
+}
+
+static uint8_t copyFromMbuf(const void *packet, uint16_t sourceOffset, uint16_t length, uint8_t *destination)
+{
+    // Walks the chain, a segment at a time, into the destination
+    return (os_mbuf_copydata((const struct os_mbuf *)packet, sourceOffset, length, destination) == 0) ? 0 : 1;
+}
+
+static void sendUploadAck(uint16_t conn_handle, const uint8_t *ack, uint16_t ackLength)
+{
+    // A lost ack only costs time, the client asks again once it runs out of credit
+    struct os_mbuf *om = ble_hs_mbuf_from_flat(ack, ackLength);
+
+    if (om == NULL)
+    {
+        ESP_LOGE(LOG_TAG, "No mbuf for an upload ack");
+        return;
+    }
+
+    if (ble_gatts_notify_custom(conn_handle, uploadValueHandle, om) != 0) ESP_LOGE(LOG_TAG, "Upload ack notification failed");
+}
+
+uint8_t blePeriphAPI_beginUpload(uint8_t *buffer, uint32_t capacity, uint32_t length)
+{
+    uint8_t ack[BLE_UPLOAD_ACK_LENGTH];
+    uint16_t ackLength;
+    uint8_t failed;
+
+    xSemaphoreTake(uploadMutex, portMAX_DELAY);
+    failed = bleUpload_begin(&upload, buffer, capacity, length, ble_att_mtu(uploadConnHandle));
+    if (!failed) ackLength = bleUpload_makeAck(&upload, ack);
+    xSemaphoreGive(uploadMutex);
+
+    if (failed) return 1;
+    sendUploadAck(uploadConnHandle, ack, ackLength); //Opens the window
+
+    //** SUCCESS **//
+    return 0;
+}
+
+void blePeriphAPI_setLiveEventHandler(blePeriph_liveEventHandler_t handler)
+{
+    liveEventHandler = handler;
+}
+
 void gatt_svr_register_cb(struct ble_gatt_register_ctxt *ctxt, void *arg)
 {
     char buf[BLE_UUID_STR_LEN];
@@ -201,6 +359,12 @@ int gatt_svr_init(void)
 {
     int rc;
 
+    uploadMutex = xSemaphoreCreateMutex();
+    if (uploadMutex == NULL)
+    {
+        return BLE_HS_ENOMEM;
+    }
+
     ble_svc_gap_init();
     ble_svc_gatt_init();
 
@@ -1,5 +1,7 @@
+#ifndef BLE_PERIPHERAL_SERVER_H
+#define BLE_PERIPHERAL_SERVER_H
 
-
+#include <stdbool.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/queue.h"
 
@@ -7,14 +9,52 @@ void blePeriphAPI_task(void * param);
 
 extern uint8_t * playbackBufferPtr;
 extern uint8_t * playbackBufferBASE;
+extern uint32_t playbackBufferCapacity;    //Bytes at playbackBufferBASE, playback payloads past it are refused
+
+#define BLE_TO_APP_DATA_BYTES 28            //Fills the item out to a cache line
+#define BLE_TO_APP_RING_LENGTH 32           //Items, MUST be a power of two
 
-//Use this for ALL queue items sent from bt to app
+//Use this for ALL items sent from bt to app: a command (data holds its
+//arguments) or an upload descriptor (dataLength is the bytes that just
+//arrived in the upload buffer). One cache line each.
 typedef struct {
     uint8_t opcode;
     uint16_t dataLength;
-    uint8_t data[20];
+    uint8_t data[BLE_TO_APP_DATA_BYTES];
 } bleToAppQueueItem_t;
 
+typedef struct
+{
+    uint32_t numItems;                      //Passed to the app
+    uint32_t numRefusedWrites;              //Failed back to the client for lack of room, it writes them again
+    uint32_t numHeldUploadChunks;           //Upload chunks left for the client to send again, for the same reason
+    uint32_t numOverflows;                  //Pushes that found the ring full anyway (nothing should)
+    uint32_t maxDepth;                      //Most items waiting at once
+} bleToAppStats_t;
+
+//Items go from the ble host task to the system loop through a lock-free
+//single producer, single consumer ring (the two run on different cores).
+//The host task never blocks on it: when the ring is full, writes are
+//refused with an att error, so nothing is lost and the client retries.
+//Only the system loop receives, waiting up to 'ticksToWait' for an item.
+uint8_t blePeriphAPI_initAppRing(void);
+bool blePeriphAPI_receive(bleToAppQueueItem_t * item, TickType_t ticksToWait);
+void blePeriphAPI_getAppRingStats(bleToAppStats_t * stats);
+
 extern QueueHandle_t blePeriph_appToBleQueue;
-extern QueueHandle_t blePeriph_bleToAppQueue;
 
+//Live midi events skip the app ring: a write with this opcode is
+//handed to the live event handler straight from the access callback,
+//payload (data[0] onwards) and all
+#define BLE_LIVE_EVENT_OPCODE 15
+typedef void (*blePeriph_liveEventHandler_t)(const uint8_t * data, uint16_t length);
+void blePeriphAPI_setLiveEventHandler(blePeriph_liveEventHandler_t handler);
+
+//Songs can also come in on the upload characteristic (see bleUpload.h).
+//The system loop begins one with the length the client asked for, and
+//this opcode comes through the app ring once it has all arrived, data[0-3]
+//holding its length
+#define BLE_UPLOAD_COMPLETE_OPCODE 17
+uint8_t blePeriphAPI_beginUpload(uint8_t * buffer, uint32_t capacity, uint32_t length);
+
+#endif
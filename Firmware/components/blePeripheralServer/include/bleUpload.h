@@ -0,0 +1,71 @@
+#ifndef BLE_UPLOAD_H
+#define BLE_UPLOAD_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define BLE_UPLOAD_OFFSET_BYTES 4           //Each chunk starts with its byte offset into the upload (little endian)
+#define BLE_UPLOAD_ATT_HEADER_BYTES 3       //Opcode and handle of a write without response, the rest of the mtu is the value
+#define BLE_UPLOAD_MIN_MTU 23               //ATT default, before any exchange
+#define BLE_UPLOAD_MAX_CHUNK_BYTES 508      //Payload per write whatever the mtu, offset and all a write is at most 512 bytes (the att limit)
+#define BLE_UPLOAD_WINDOW_BYTES 8192        //How far past the received offset the client may send
+#define BLE_UPLOAD_ACK_BYTES 2048           //Bytes received between acks, so the window moves on before the client reaches its end
+#define BLE_UPLOAD_ACK_LENGTH 11            //Ack notification bytes, see bleUpload_makeAck
+
+typedef struct
+{
+    uint32_t numChunks;                     //Written into the buffer
+    uint32_t numRejected;                   //Past a lost chunk (or the window), the client sends them again
+    uint32_t numDuplicates;                 //Already received, ignored
+    uint32_t numGapAcks;                    //Acks sent because chunks were being rejected
+    uint32_t numAcks;
+    uint32_t numPackets;                    //Every write, polls included
+    uint32_t numBytesCopied;                //Out of the packets, offsets included
+} bleUploadStats_t;
+
+//Copies 'length' bytes from 'sourceOffset' into the packet to
+//'destination', 0 on success. Lets the packet stay where the transport
+//has it (an mbuf chain on the device) so each byte is copied only once.
+typedef uint8_t (*bleUpload_copyFunction_t)(const void * packet, uint16_t sourceOffset, uint16_t length, uint8_t * destination);
+
+//Reassembles a song sent as writes without response, so the client can
+//have a window of writes in flight each connection event instead of one
+//acknowledged write per round trip. Each chunk carries its byte offset
+//and is copied straight from the packet to its place in the buffer,
+//without being flattened first.
+//
+//Flow control is by credit. Every ack notification tells the client how
+//much has arrived without a gap and how far it may send, so it can keep
+//the link full without overrunning the device. A lost chunk is recovered
+//go-back-N: the chunks after it are rejected, and the ack's gap count
+//changes, the client then sends again from the received offset. A chunk
+//with no payload only asks for an ack, for a client whose credit ran out
+//while an ack was lost.
+//
+//No ble dependencies, gatt_svr.c is the transport - so the host build
+//runs it as a loopback against a model of the link (see Firmware/host).
+typedef struct
+{
+    bool isActive;
+    uint8_t * buffer;
+    uint32_t length;                        //Song bytes, as announced by the client
+    uint32_t received;                      //Bytes received without a gap, the next chunk has to start here
+    uint32_t lastAcked;                     //'received' as of the last ack
+    uint16_t chunkBytes;                    //Most payload per write at the connection's mtu
+    uint8_t numGaps;                        //Changes (wrapping) each time the client has to go back to 'received'
+    bool isInGap;                           //Rejecting chunks until the one at 'received' arrives
+    uint32_t gapBytes;                      //Rejected since the last gap ack
+    bool isAckDue;
+    bleUploadStats_t stats;
+} bleUpload_t;
+
+
+uint16_t bleUpload_getChunkBytes(uint16_t mtu);
+uint8_t bleUpload_begin(bleUpload_t * upload, uint8_t * buffer, uint32_t capacity, uint32_t length, uint16_t mtu);
+uint8_t bleUpload_receive(bleUpload_t * upload, const void * packet, uint16_t packetLength, bleUpload_copyFunction_t copy);
+uint8_t bleUpload_copyFlat(const void * packet, uint16_t sourceOffset, uint16_t length, uint8_t * destination);
+bool bleUpload_isAckDue(const bleUpload_t * upload);
+uint16_t bleUpload_makeAck(bleUpload_t * upload, uint8_t * ack);
+bool bleUpload_isComplete(const bleUpload_t * upload);
+
+#endif
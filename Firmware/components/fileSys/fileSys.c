@@ -244,6 +244,49 @@ uint8_t fileSys_readFile(uint8_t * dataBuffer, uint16_t numBytes)
 }
 
 
+//**** Public
+uint8_t fileSys_readFileAt(uint32_t offset, uint8_t * dataBuffer, uint16_t maxBytes, uint16_t * numBytesRead)
+{
+    //Random access read of the currently open file, for readers
+    //that keep several positions in the same file (the playback
+    //stream reads every track of a song through its own window).
+    //Reads up to maxBytes from 'offset', fewer at the end of the
+    //file - numBytesRead says how many were actually read.
+
+    *numBytesRead = 0;
+
+    //Abort if file system not mounted or file not currently open
+    if((fileSysLocalData.fileHandle == NULL) || (fileSysLocalData.isMounted == false))
+    {
+        ESP_LOGE(LOG_TAG, "Attempted to read from file when no file open");
+        return 1;
+    }
+
+    if(dataBuffer == NULL)
+    {
+        ESP_LOGE(LOG_TAG, "Buffer pointer has no memory allocated!");
+        return 1;
+    }
+
+    if(fseek(fileSysLocalData.fileHandle, (long)offset, SEEK_SET) != 0)
+    {
+        ESP_LOGE(LOG_TAG, "Call to fseek() failed. errno: %d", errno);
+        return 1;
+    }
+
+    *numBytesRead = (uint16_t)fread(dataBuffer, sizeof(uint8_t), maxBytes, fileSysLocalData.fileHandle);
+
+    if((*numBytesRead != maxBytes) && ferror(fileSysLocalData.fileHandle))
+    {
+        ESP_LOGE(LOG_TAG, "Call to fread() failed. errno: %d", errno);
+        clearerr(fileSysLocalData.fileHandle);
+        return 1;
+    }
+
+    return 0; //** SUCCESS **//
+}
+
+
 //**** Public
 uint8_t fileSys_writeFile(uint8_t * data, uint32_t numBytes, bool closeOnExit)
 {
@@ -294,6 +337,51 @@ uint8_t fileSys_writeFile(uint8_t * data, uint32_t numBytes, bool closeOnExit)
 }
 
 
+//**** Public
+uint8_t fileSys_writeFileAt(uint32_t offset, uint8_t * data, uint32_t numBytes)
+{
+    //Overwrites bytes already in the open file, for headers
+    //whose lengths are only known once everything after them
+    //has been written. The file can't grow this way, and the
+    //file position goes back to the end afterwards so that
+    //fileSys_writeFile carries on appending.
+
+    //Abort if file system not mounted or file not currently open
+    if((fileSysLocalData.fileHandle == NULL) || (fileSysLocalData.isMounted == false))
+    {
+        ESP_LOGE(LOG_TAG, "Cannot write data, no file currently open");
+        return 1;
+    }
+
+    if((offset + numBytes) > fileSysLocalData.openFileNumBytes)
+    {
+        ESP_LOGE(LOG_TAG, "Requested overwrite runs past the end of the file");
+        return 1;
+    }
+
+    if(fseek(fileSysLocalData.fileHandle, (long)offset, SEEK_SET) != 0)
+    {
+        ESP_LOGE(LOG_TAG, "Call to fseek() failed. errno: %d", errno);
+        return 1;
+    }
+
+    if(fwrite(data, sizeof(uint8_t), numBytes, fileSysLocalData.fileHandle) != numBytes)
+    {
+        ESP_LOGE(LOG_TAG, "fileWrite operation failed, errno: %d", errno);
+        return 1;
+    }
+
+    if(fseek(fileSysLocalData.fileHandle, 0, SEEK_END) != 0)
+    {
+        ESP_LOGE(LOG_TAG, "Call to fseek() failed. errno: %d", errno);
+        return 1;
+    }
+    fflush(fileSysLocalData.fileHandle);
+
+    return 0;   //** SUCCESS **//
+}
+
+
 //**** Public
 uint8_t fileSys_deleteFile(char * fileName)
 {
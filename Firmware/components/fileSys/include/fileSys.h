@@ -1,5 +1,6 @@
 
 #include <stdio.h>
+#include <stdint.h>
 #include <stdbool.h>
 
 
@@ -27,6 +28,8 @@ void deInitFileSystem(void);
 uint8_t fileSys_closeFile(void);
 uint8_t fileSys_openFileRW(char * fileName, bool createNew);
 uint8_t fileSys_readFile(uint8_t * dataBuffer, uint16_t numBytes);
+uint8_t fileSys_readFileAt(uint32_t offset, uint8_t * dataBuffer, uint16_t maxBytes, uint16_t * numBytesRead);
 uint8_t fileSys_deleteFile(char * fileName);
 uint8_t fileSys_writeFile(uint8_t * data, uint32_t numBytes, bool closeOnExit);
+uint8_t fileSys_writeFileAt(uint32_t offset, uint8_t * data, uint32_t numBytes);
 void fileSys_resetFilePtr(void);
\ No newline at end of file
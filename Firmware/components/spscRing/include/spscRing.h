@@ -0,0 +1,131 @@
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdatomic.h>
+
+//Lock-free single-producer/single-consumer ring of fixed size items.
+//The producer only ever writes 'head' and the consumer only ever writes
+//'tail', so no critical section is needed - even with producer and
+//consumer on different cores, or the producer in an ISR. Acquire/release
+//ordering makes sure item data is visible before the index that
+//publishes it. The two indices live on separate cache lines so each
+//core isn't forever invalidating the other's line.
+//
+//Header only (static inline) so push/pop can be called from IRAM ISRs.
+
+#define SPSC_RING_CACHE_LINE_BYTES 32
+
+typedef struct
+{
+    _Alignas(SPSC_RING_CACHE_LINE_BYTES) atomic_uint head; //Next slot to write, producer owned
+    _Alignas(SPSC_RING_CACHE_LINE_BYTES) atomic_uint tail; //Next slot to read, consumer owned
+    _Alignas(SPSC_RING_CACHE_LINE_BYTES) uint8_t * storage; //capacity * itemSize bytes
+    uint32_t itemSize;
+    uint32_t mask;                  //capacity - 1, capacity MUST be a power of two
+    atomic_uint overflowCount;      //Pushes rejected because the ring was full
+} spscRing_t;
+
+
+static inline bool spscRing_init(spscRing_t * ring, void * storage, uint32_t itemSize, uint32_t capacity)
+{
+    if((ring == NULL) || (storage == NULL) || (itemSize == 0) || (capacity == 0) || (capacity & (capacity - 1))) return false;
+
+    ring->storage = (uint8_t *)storage;
+    ring->itemSize = itemSize;
+    ring->mask = capacity - 1;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->overflowCount, 0);
+
+    return true;
+}
+
+
+//**** Producer side
+static inline bool spscRing_push(spscRing_t * ring, const void * item)
+{
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+    if((head - tail) > ring->mask) //Full
+    {
+        atomic_fetch_add_explicit(&ring->overflowCount, 1, memory_order_relaxed);
+        return false;
+    }
+
+    memcpy(ring->storage + ((head & ring->mask) * ring->itemSize), item, ring->itemSize);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+
+    return true;
+}
+
+
+//**** Producer side
+static inline uint32_t spscRing_freeSlots(spscRing_t * ring)
+{
+    return (ring->mask + 1) - (atomic_load_explicit(&ring->head, memory_order_relaxed) - atomic_load_explicit(&ring->tail, memory_order_acquire));
+}
+
+
+//**** Consumer side
+static inline bool spscRing_pop(spscRing_t * ring, void * item)
+{
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    if(head == tail) return false; //Empty
+
+    memcpy(item, ring->storage + ((tail & ring->mask) * ring->itemSize), ring->itemSize);
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+
+    return true;
+}
+
+
+//**** Consumer side - look at the oldest item without removing it
+static inline const void * spscRing_peek(spscRing_t * ring)
+{
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    if(head == tail) return NULL; //Empty
+
+    return ring->storage + ((tail & ring->mask) * ring->itemSize);
+}
+
+
+//**** Consumer side - look 'offset' items past the oldest, NULL if there aren't that many
+static inline const void * spscRing_peekAt(spscRing_t * ring, uint32_t offset)
+{
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    if((head - tail) <= offset) return NULL;
+
+    return ring->storage + (((tail + offset) & ring->mask) * ring->itemSize);
+}
+
+
+//**** Consumer side - discards the item returned by spscRing_peek
+static inline void spscRing_drop(spscRing_t * ring)
+{
+    atomic_store_explicit(&ring->tail, atomic_load_explicit(&ring->tail, memory_order_relaxed) + 1, memory_order_release);
+}
+
+
+//**** Either side
+static inline uint32_t spscRing_count(spscRing_t * ring)
+{
+    return atomic_load_explicit(&ring->head, memory_order_acquire) - atomic_load_explicit(&ring->tail, memory_order_acquire);
+}
+
+
+static inline uint32_t spscRing_getOverflowCount(spscRing_t * ring)
+{
+    return atomic_load_explicit(&ring->overflowCount, memory_order_relaxed);
+}
+
+#endif
@@ -0,0 +1,580 @@
+#include <stdio.h>
+#include <string.h>
+#include "esp_log.h"
+#include "midiCompiler.h"
+#include "midiOutput.h"
+
+#define LOG_TAG "midiCompiler"
+#define MAX_VARIABLE_LENGTH_BYTES 4
+#define CHUNK_HEADER_BYTES 8
+#define MTHD_MIN_DATA_BYTES 6
+
+//Events that share a tick are merged in this order, so a note that
+//ends and restarts on the same tick is never cut short by its own off
+typedef enum
+{
+    mergeClass_noteOff = 0,
+    mergeClass_metaOrSysEx = 1,
+    mergeClass_otherVoice = 2,
+    mergeClass_noteOn = 3,
+} mergeClass_t;
+
+typedef enum
+{
+    trackEvent_voice,
+    trackEvent_meta,
+    trackEvent_sysEx,
+} trackEventType_t;
+
+//Read position within one MTrk chunk, holds the decoded event
+//at the head of the track while it waits in the merge heap
+typedef struct
+{
+    const uint8_t * dataPtr;
+    const uint8_t * dataEnd;
+    uint32_t absoluteTime;
+    uint64_t mergeKey;              //absoluteTime, mergeClass, track index
+    uint8_t runningStatus;
+    uint8_t trackIndex;
+    uint8_t port;                   //Output port for the track's voice events
+    bool isInSysEx;                 //The track's last sysex packet didn't end its message
+    //--- Head event ---
+    trackEventType_t eventType;
+    const uint8_t * eventData;      //Voice data bytes, or meta/sysex payload
+    uint32_t eventDataLength;
+    uint8_t statusByte;             //Voice status (running status expanded) or meta type
+} midiTrackCursor_t;
+
+static midiTrackCursor_t trackCursors[MIDI_MAX_TRACKS];
+static uint8_t mergeHeap[MIDI_MAX_TRACKS]; //Min-heap of track indices, keyed on trackCursors[].mergeKey
+
+static uint8_t parseHeader(const uint8_t * fileData, uint32_t fileLength, midiCompiledSong_t * song);
+static uint8_t readNextTrackEvent(midiTrackCursor_t * cursor);
+static void mergeHeapSiftDown(uint8_t * heap, uint8_t heapSize, uint8_t position);
+static void mergeHeapSiftUp(uint8_t * heap, uint8_t position);
+static uint8_t getVoiceMessageLength(uint8_t statusByte);
+static uint32_t getMicroSecondsPerQuaterNote(const uint8_t * tempoData, uint32_t numBytes);
+static uint32_t readBigEndian(const uint8_t * data, uint8_t numBytes);
+
+
+//**** Public
+uint8_t midiCompiler_compileSong(const uint8_t * fileData, uint32_t fileLength, midiCompiledEvent_t * events, uint32_t maxEvents,
+                                 midiCompiledSysEx_t * sysEx, uint32_t maxSysEx, tempoMap_t * tempoMap, const uint8_t * trackPorts, midiCompiledSong_t * song)
+{
+    // This function runs ONCE when an upload completes, it takes the
+    // raw file data and resolves everything that used to be decoded
+    // on the timing critical path (delta-time VLQs, running status and
+    // meta events) into an array of fixed width records. Playback then
+    // only has to index the array and write bytes.
+    //
+    // Format 1 files hold one MTrk chunk per instrument, all playing
+    // at once. The tracks are merged into a single time ordered stream
+    // with a min-heap of track heads keyed on absolute tick, so each
+    // event costs O(log numTracks) however many tracks the file has.
+
+    midiTrackCursor_t * cursor;
+    uint32_t numEvents = 0;
+    uint32_t numSysEx = 0;
+    uint8_t heapSize = 0;
+
+    if((fileData == NULL) || (song == NULL))
+    {
+        ESP_LOGE(LOG_TAG, "Compile aborted - NULL file data or song pointer");
+        return 1;
+    }
+
+    song->events = events;
+    song->numEvents = 0;
+    song->sysEx = sysEx;
+    song->numSysEx = 0;
+    song->numSysExBytes = 0;
+    song->numTempoChanges = 0;
+    song->endOfTrackTime = 0;
+
+    if(parseHeader(fileData, fileLength, song)) return 1;
+
+    // Prime the heap with the first event of every track
+    for(uint8_t a = 0; a < song->numTracks; ++a)
+    {
+        trackCursors[a].port = (trackPorts != NULL) ? (trackPorts[a] % MIDI_OUTPUT_NUM_PORTS) : 0;
+        if(readNextTrackEvent(&trackCursors[a])) return 1;
+
+        if(trackCursors[a].dataPtr != NULL)
+        {
+            mergeHeap[heapSize] = a;
+            mergeHeapSiftUp(mergeHeap, heapSize);
+            heapSize++;
+        }
+    }
+
+    while(heapSize > 0)
+    {
+        cursor = &trackCursors[mergeHeap[0]];
+
+        if(cursor->absoluteTime > song->endOfTrackTime) song->endOfTrackTime = cursor->absoluteTime;
+
+        switch(cursor->eventType)
+        {
+            case trackEvent_voice:
+                if(events != NULL)
+                {
+                    if(numEvents >= maxEvents)
+                    {
+                        ESP_LOGE(LOG_TAG, "Compile aborted - event array too small");
+                        return 1;
+                    }
+
+                    events[numEvents].absoluteTime = cursor->absoluteTime;
+                    events[numEvents].length = (uint8_t)(cursor->eventDataLength + 1);
+                    events[numEvents].port = cursor->port;
+                    events[numEvents].data[0] = cursor->statusByte;
+                    memcpy(&events[numEvents].data[1], cursor->eventData, cursor->eventDataLength);
+                }
+                numEvents++;
+                break;
+
+            case trackEvent_meta:
+                // Meta events are NEVER sent over midi, they are
+                // resolved here so that playback never sees them
+                if(cursor->statusByte == metaEvent_setTempo)
+                {
+                    // Tempo is resolved into the tempo map here, playback
+                    // only ever converts ticks using the precomputed map.
+                    // The merge hands these over in tick order as required
+                    song->numTempoChanges++;
+                    if(tempoMap != NULL)
+                    {
+                        tempoMap_addTempoChange(tempoMap, cursor->absoluteTime, getMicroSecondsPerQuaterNote(cursor->eventData, cursor->eventDataLength));
+                    }
+                }
+                else if((cursor->statusByte == metaEvent_midiPort) && (cursor->eventDataLength >= 1))
+                {
+                    // Routes the rest of this track, the
+                    // track port map only sets where it starts
+                    cursor->port = cursor->eventData[0] % MIDI_OUTPUT_NUM_PORTS;
+                }
+                else if(cursor->statusByte == metaEvent_endOfTrack)
+                {
+                    cursor->dataPtr = NULL; // This track is finished
+                }
+                break;
+
+            case trackEvent_sysEx:
+                // Stays in the file data, the compiled event only
+                // refers to it. Where it goes out on the wire between
+                // the notes is up to playback (see playbackEngine.c)
+                if(numSysEx >= MIDI_MAX_SYSEX_PACKETS)
+                {
+                    ESP_LOGE(LOG_TAG, "Compile aborted - more than %d sysex packets", MIDI_MAX_SYSEX_PACKETS);
+                    return 1;
+                }
+
+                if(events != NULL)
+                {
+                    if((numEvents >= maxEvents) || (numSysEx >= maxSysEx))
+                    {
+                        ESP_LOGE(LOG_TAG, "Compile aborted - event array too small");
+                        return 1;
+                    }
+
+                    sysEx[numSysEx].dataOffset = (uint32_t)(cursor->eventData - fileData);
+                    sysEx[numSysEx].length = cursor->eventDataLength;
+                    sysEx[numSysEx].isContinuation = (cursor->statusByte == 0xF7) && cursor->isInSysEx;
+
+                    events[numEvents].absoluteTime = cursor->absoluteTime;
+                    events[numEvents].length = 3;
+                    events[numEvents].port = cursor->port;
+                    events[numEvents].data[0] = cursor->statusByte;
+                    events[numEvents].data[1] = (uint8_t)numSysEx;
+                    events[numEvents].data[2] = (uint8_t)(numSysEx >> 8);
+                }
+                // A message runs on (in 0xF7 packets) until a packet ends with 0xF7
+                if(cursor->statusByte == 0xF0) cursor->isInSysEx = true;
+                if((cursor->eventDataLength > 0) && (cursor->eventData[cursor->eventDataLength - 1] == 0xF7)) cursor->isInSysEx = false;
+                song->numSysExBytes += cursor->eventDataLength;
+                numSysEx++;
+                numEvents++;
+                break;
+
+            default:
+                break;
+        }
+
+        if((cursor->dataPtr != NULL) && readNextTrackEvent(cursor)) return 1;
+
+        if(cursor->dataPtr == NULL) // Track exhausted, drop it from the heap
+        {
+            heapSize--;
+            mergeHeap[0] = mergeHeap[heapSize];
+        }
+
+        mergeHeapSiftDown(mergeHeap, heapSize, 0);
+    }
+
+    song->numEvents = numEvents;
+    song->numSysEx = numSysEx;
+
+    return 0; //** SUCCESS **//
+}
+
+
+//**** Public
+uint8_t midiCompiler_readVariableLength(const uint8_t ** dataPtr, const uint8_t * const dataEnd, uint32_t * result)
+{
+    // Variable length values (delta-times, meta/sysex lengths)
+    // are ALWAYS four bytes max, MSB FIRST. Bit 8 of each byte is
+    // a flag - indicating more bytes to follow. The final value is
+    // created by removing the flag bit from each byte and
+    // concatenating the result (see midiNotes.txt)
+
+    uint32_t value = 0;
+
+    for(uint8_t a = 0; a < MAX_VARIABLE_LENGTH_BYTES; ++a)
+    {
+        if(*dataPtr >= dataEnd) return 1;
+
+        value = (value << 7) | (**dataPtr & 0x7F);
+
+        if((*(*dataPtr)++ & 0x80) == 0)
+        {
+            *result = value;
+            return 0; //** SUCCESS **//
+        }
+    }
+
+    return 1; // More than four bytes, malformed
+}
+
+
+//**** Private
+static uint8_t parseHeader(const uint8_t * fileData, uint32_t fileLength, midiCompiledSong_t * song)
+{
+    // MIDI FILE HEADER SECTION (see midiNotes.txt)
+    // MThd (4 bytes), chunk length (4 bytes, big endian),
+    // format (2 bytes), numTracks (2 bytes), timeDivision (2 bytes)
+    // followed by MTrk chunks: MTrk (4 bytes), length (4 bytes), data
+    //
+    // Uploads without an MThd chunk are treated as raw MTrk event data
+    // using MIDI_DEFAULT_TIME_DIVISION, which is how the client used to send them.
+
+    const uint8_t * chunkPtr;
+    const uint8_t * const dataEnd = fileData + fileLength;
+    uint32_t chunkLength;
+    uint16_t expectedTracks;
+    uint16_t format;
+
+    if((fileLength < CHUNK_HEADER_BYTES) || (memcmp(fileData, "MThd", 4) != 0))
+    {
+        ESP_LOGI(LOG_TAG, "No MThd chunk found, treating upload as raw track data");
+        song->timeDivision = MIDI_DEFAULT_TIME_DIVISION;
+        song->numTracks = 1;
+        memset(&trackCursors[0], 0, sizeof(midiTrackCursor_t));
+        trackCursors[0].dataPtr = fileData;
+        trackCursors[0].dataEnd = dataEnd;
+        return 0;
+    }
+
+    chunkLength = readBigEndian(fileData + 4, 4);
+
+    if((chunkLength < MTHD_MIN_DATA_BYTES) || (chunkLength > (fileLength - CHUNK_HEADER_BYTES)))
+    {
+        ESP_LOGE(LOG_TAG, "Malformed MThd chunk");
+        return 1;
+    }
+
+    format = (uint16_t)readBigEndian(fileData + 8, 2);
+    expectedTracks = (uint16_t)readBigEndian(fileData + 10, 2);
+    song->timeDivision = (uint16_t)readBigEndian(fileData + 12, 2);
+    song->numTracks = 0;
+
+    if(format == 2)
+    {
+        // Format 2 tracks are independent sequences, not
+        // simultaneous parts, so merging them makes no sense
+        ESP_LOGE(LOG_TAG, "Format 2 file, only the first sequence will be played");
+        expectedTracks = 1;
+    }
+
+    if(expectedTracks > MIDI_MAX_TRACKS)
+    {
+        ESP_LOGE(LOG_TAG, "File has %d tracks, only the first %d will be played", expectedTracks, MIDI_MAX_TRACKS);
+        expectedTracks = MIDI_MAX_TRACKS;
+    }
+
+    // Skip any unknown chunks (the spec says they must be ignored)
+    chunkPtr = fileData + CHUNK_HEADER_BYTES + chunkLength;
+
+    while(((chunkPtr + CHUNK_HEADER_BYTES) <= dataEnd) && (song->numTracks < expectedTracks))
+    {
+        chunkLength = readBigEndian(chunkPtr + 4, 4);
+
+        if(chunkLength > (uint32_t)(dataEnd - chunkPtr - CHUNK_HEADER_BYTES))
+        {
+            // Truncated upload, play as much as was received
+            chunkLength = (uint32_t)(dataEnd - chunkPtr - CHUNK_HEADER_BYTES);
+        }
+
+        if(memcmp(chunkPtr, "MTrk", 4) == 0)
+        {
+            memset(&trackCursors[song->numTracks], 0, sizeof(midiTrackCursor_t));
+            trackCursors[song->numTracks].dataPtr = chunkPtr + CHUNK_HEADER_BYTES;
+            trackCursors[song->numTracks].dataEnd = chunkPtr + CHUNK_HEADER_BYTES + chunkLength;
+            trackCursors[song->numTracks].trackIndex = (uint8_t)song->numTracks;
+            song->numTracks++;
+        }
+
+        chunkPtr += CHUNK_HEADER_BYTES + chunkLength;
+    }
+
+    if(song->numTracks == 0)
+    {
+        ESP_LOGE(LOG_TAG, "No MTrk chunk found in midi file");
+        return 1;
+    }
+
+    return 0; //** SUCCESS **//
+}
+
+
+//**** Private
+static uint8_t readNextTrackEvent(midiTrackCursor_t * cursor)
+{
+    // Decodes the next delta-time/event pair of a track into the
+    // cursor. When the track runs out cursor->dataPtr is set NULL.
+    // Returns non-zero only for malformed data.
+
+    uint32_t deltaTime;
+    uint32_t numBytes;
+    uint8_t statusByte;
+    uint8_t messageLength;
+    mergeClass_t mergeClass;
+
+    if(cursor->dataPtr >= cursor->dataEnd)
+    {
+        // Ran out of data without an end-of-track meta event,
+        // still playable so treat the last event as the end
+        cursor->dataPtr = NULL;
+        return 0;
+    }
+
+    if(midiCompiler_readVariableLength(&cursor->dataPtr, cursor->dataEnd, &deltaTime))
+    {
+        ESP_LOGE(LOG_TAG, "Compile aborted - malformed delta-time in track %d", cursor->trackIndex);
+        return 1;
+    }
+
+    cursor->absoluteTime += deltaTime;
+
+    if(cursor->dataPtr >= cursor->dataEnd) //Trailing delta-time with no event
+    {
+        cursor->dataPtr = NULL;
+        return 0;
+    }
+
+    statusByte = *cursor->dataPtr;
+
+    if(statusByte == 0xFF) //--- Meta Event ---//
+    {
+        // Format: 0xFF <type> <VLQ length> <data>
+        cursor->runningStatus = 0; // Meta events cancel running status
+
+        if((cursor->dataPtr + 2) > cursor->dataEnd)
+        {
+            cursor->dataPtr = NULL;
+            return 0;
+        }
+
+        cursor->eventType = trackEvent_meta;
+        cursor->statusByte = *(cursor->dataPtr + 1);
+        cursor->dataPtr += 2; // Now pointing at the length VLQ
+
+        if(midiCompiler_readVariableLength(&cursor->dataPtr, cursor->dataEnd, &numBytes) || ((cursor->dataPtr + numBytes) > cursor->dataEnd))
+        {
+            ESP_LOGE(LOG_TAG, "Compile aborted - malformed meta event in track %d", cursor->trackIndex);
+            return 1;
+        }
+
+        mergeClass = mergeClass_metaOrSysEx;
+    }
+    else if((statusByte == 0xF0) || (statusByte == 0xF7)) //--- SysEx Event ---//
+    {
+        // Format: 0xF0/0xF7 <VLQ length> <data>
+        cursor->runningStatus = 0; // SysEx events cancel running status
+        cursor->eventType = trackEvent_sysEx;
+        cursor->statusByte = statusByte;
+        cursor->dataPtr += 1;
+
+        if(midiCompiler_readVariableLength(&cursor->dataPtr, cursor->dataEnd, &numBytes) || ((cursor->dataPtr + numBytes) > cursor->dataEnd))
+        {
+            ESP_LOGE(LOG_TAG, "Compile aborted - malformed sysex event in track %d", cursor->trackIndex);
+            return 1;
+        }
+
+        mergeClass = mergeClass_metaOrSysEx;
+    }
+    else //--- Voice Message Type ---//
+    {
+        // The MIDI spec features 'running status' capability,
+        // if the current event type is the same as the event
+        // immediately before it, the status byte is omitted
+        if(statusByte >= 0x80)
+        {
+            cursor->runningStatus = statusByte;
+            cursor->dataPtr += 1; // Now pointing at first data byte
+        }
+        else if(cursor->runningStatus == 0)
+        {
+            ESP_LOGE(LOG_TAG, "Compile aborted - data byte with no running status in track %d", cursor->trackIndex);
+            return 1;
+        }
+
+        messageLength = getVoiceMessageLength(cursor->runningStatus);
+
+        if((messageLength == 0) || ((cursor->dataPtr + messageLength - 1) > cursor->dataEnd))
+        {
+            ESP_LOGE(LOG_TAG, "Compile aborted - unrecognised status byte 0x%0x in track %d", cursor->runningStatus, cursor->trackIndex);
+            return 1;
+        }
+
+        cursor->eventType = trackEvent_voice;
+        cursor->statusByte = cursor->runningStatus;
+        numBytes = messageLength - 1;
+
+        switch(cursor->statusByte >> 4)
+        {
+            case 0x08:
+                mergeClass = mergeClass_noteOff;
+                break;
+
+            case 0x09: // Note on with zero velocity is a note off
+                mergeClass = (*(cursor->dataPtr + 1) == 0) ? mergeClass_noteOff : mergeClass_noteOn;
+                break;
+
+            default:
+                mergeClass = mergeClass_otherVoice;
+                break;
+        }
+    }
+
+    cursor->eventData = cursor->dataPtr;
+    cursor->eventDataLength = numBytes;
+    cursor->dataPtr += numBytes; // Now pointing to delta-time of next event
+
+    // Ties on tick are broken by merge class then track index, which
+    // keeps the merge stable (file order) for everything else
+    cursor->mergeKey = ((uint64_t)cursor->absoluteTime << 16) | ((uint64_t)mergeClass << 8) | cursor->trackIndex;
+
+    return 0; //** SUCCESS **//
+}
+
+
+//**** Private
+static void mergeHeapSiftDown(uint8_t * heap, uint8_t heapSize, uint8_t position)
+{
+    uint8_t smallest;
+    uint8_t child;
+    uint8_t temp;
+
+    while(1)
+    {
+        smallest = position;
+        child = (2 * position) + 1;
+
+        if((child < heapSize) && (trackCursors[heap[child]].mergeKey < trackCursors[heap[smallest]].mergeKey)) smallest = child;
+        child++;
+        if((child < heapSize) && (trackCursors[heap[child]].mergeKey < trackCursors[heap[smallest]].mergeKey)) smallest = child;
+
+        if(smallest == position) return;
+
+        temp = heap[position];
+        heap[position] = heap[smallest];
+        heap[smallest] = temp;
+        position = smallest;
+    }
+}
+
+
+//**** Private
+static void mergeHeapSiftUp(uint8_t * heap, uint8_t position)
+{
+    uint8_t parent;
+    uint8_t temp;
+
+    while(position > 0)
+    {
+        parent = (position - 1) / 2;
+
+        if(trackCursors[heap[parent]].mergeKey <= trackCursors[heap[position]].mergeKey) return;
+
+        temp = heap[position];
+        heap[position] = heap[parent];
+        heap[parent] = temp;
+        position = parent;
+    }
+}
+
+
+//**** Private
+static uint8_t getVoiceMessageLength(uint8_t statusByte)
+{
+    // All voice message status bytes have the following format:
+    // StatusByte[4-7] = voice message opcode (voice message sub-type)
+    // StatusByte[0-3] = channel being addressed (0-15)
+    // Returned length INCLUDES the status byte
+
+    switch(statusByte >> 4)
+    {
+        case 0x08: //---Note Off---//
+        case 0x09: //---Note On---//
+        case 0x0A: //---Aftertouch---//
+        case 0x0B: //---Control Change---//
+        case 0x0E: //---Pitch Wheel---//
+            return 3;
+
+        case 0x0C: //---Program Change---//
+        case 0x0D: //---Channel Pressure---//
+            return 2;
+
+        default: //--- ERROR ---//
+            return 0;
+    }
+}
+
+
+//**** Private
+static uint32_t getMicroSecondsPerQuaterNote(const uint8_t * tempoData, uint32_t numBytes)
+{
+    // This function processes the SET TEMPO midi meta event,
+    // it expects a pointer to the base of the tempo data bytes
+
+    // The SET TEMPO meta event has the following layout:
+    // 0x51          //Set-Tempo opcode
+    // 0x03          //states number of remaining bytes
+    // byte byte 0   //MSB of 24-bit temp value <-- tempoData
+    // data byte 1
+    // data byte 2
+    //
+    // The tempo value is ALWAYS in microseconds per quater-note
+
+    if(numBytes != 3)
+    {
+        ESP_LOGE(LOG_TAG, "Set tempo event has %ld data bytes, expected 3", numBytes);
+        return 0;
+    }
+
+    return readBigEndian(tempoData, 3);
+}
+
+
+//**** Private
+static uint32_t readBigEndian(const uint8_t * data, uint8_t numBytes)
+{
+    uint32_t result = 0;
+
+    for(uint8_t a = 0; a < numBytes; ++a)
+    {
+        result = (result << 8) | data[a];
+    }
+
+    return result;
+}
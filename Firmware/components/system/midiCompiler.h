@@ -0,0 +1,90 @@
+#ifndef MIDI_COMPILER_H
+#define MIDI_COMPILER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "tempoMap.h"
+
+#define MIDI_COMPILED_EVENT_MAX_BYTES 3
+#define MIDI_DEFAULT_TIME_DIVISION 96 //Used for headerless uploads (raw MTrk event data only)
+#define MIDI_MAX_TRACKS 64 //Format 1 tracks merged at compile time
+#define MIDI_MAX_SYSEX_PACKETS 65536 //SysEx packets in a song, compiled events index them in 16 bits
+#define MIDI_IS_SYSEX_STATUS(status) ((status) >= 0xF0) //Compiled events only, voice status bytes are all below this
+
+typedef enum
+{
+    metaEvent_sequenceNum = 0x00,
+    metaEvent_textField = 0x01,
+    metaEvent_copyright = 0x02,
+    metaEvent_trackName = 0x03,
+    metaEvent_instrumentName = 0x04,
+    metaEvent_lyrics = 0x05,
+    metaEvent_marker = 0x06,
+    metaEvent_cuePoint = 0x07,
+    metaEvent_deviceName = 0x09, //new
+    metaEvent_channelPrefix = 0x20,
+    metaEvent_midiPort = 0x21, //new
+    metaEvent_endOfTrack = 0x2F,
+    metaEvent_setTempo = 0x51,
+    metaEvent_smpteOffset = 0x54,
+    metaEvent_setTimeSig = 0x58,
+    metaEvent_keySignature = 0x59,
+    metaEvent_sequencerSpecific = 0x7F,
+} midiMetaEventType_t;
+
+//A single playable midi event, fixed width (8 bytes) so that
+//playback can index straight into an array of them. Running
+//status has already been expanded, so data[0] is ALWAYS the
+//status byte, and meta events never appear in compiled output.
+//SysEx packets are too long to fit, data[0] is then 0xF0 or 0xF7
+//and data[1] (low) and data[2] (high) index the song's sysex table.
+typedef struct
+{
+    uint32_t absoluteTime;                      //Ticks from start of track
+    uint8_t length : 4;                         //Number of valid bytes in 'data'
+    uint8_t port : 4;                           //Output port, always below MIDI_OUTPUT_NUM_PORTS
+    uint8_t data[MIDI_COMPILED_EVENT_MAX_BYTES];
+} midiCompiledEvent_t;
+
+//One sysex event as stored in the file, the payload is left where it
+//is in the file data. A 0xF0 packet starts a message and goes out as
+//0xF0 followed by the payload. A 0xF7 packet goes out as the payload
+//alone, either continuing a message split over several packets (the
+//last one ends with 0xF7) or as an escape for arbitrary bytes.
+typedef struct
+{
+    uint32_t dataOffset;            //Payload, from the start of the file data
+    uint32_t length : 31;           //Payload bytes
+    uint32_t isContinuation : 1;    //0xF7 packet carrying on a message its track left open
+} midiCompiledSysEx_t;
+
+typedef struct
+{
+    midiCompiledEvent_t * events;   //Compiled event array (allocated by caller)
+    uint32_t numEvents;             //Number of valid entries in 'events', sysex packets included
+    midiCompiledSysEx_t * sysEx;    //SysEx packet table (allocated by caller)
+    uint32_t numSysEx;              //Number of valid entries in 'sysEx'
+    uint32_t numSysExBytes;         //Total payload, for sizing and reporting
+    uint32_t numTempoChanges;       //Number of set tempo meta events found
+    uint32_t endOfTrackTime;        //Absolute time of the last end-of-track meta event
+    uint16_t timeDivision;          //Raw MThd division, PPQN or SMPTE (see tempoMap.c)
+    uint16_t numTracks;             //Number of MTrk chunks merged
+} midiCompiledSong_t;
+
+
+//Parses the MThd/MTrk chunks and merges every track into the single
+//time ordered, fixed width event array used by playback. Uploads without
+//an MThd chunk are treated as raw MTrk event data. If 'events' is NULL
+//nothing is written and only the counts and time division are produced,
+//which allows the caller to size the allocations exactly (the same goes
+//for the sysex table, 'sysEx' and 'maxSysEx'). Set tempo
+//events are added to 'tempoMap' when it isn't NULL. Each track starts
+//out on the port 'trackPorts' gives it (port 0 for every track when
+//NULL) and midiPort meta events move it from there on, port numbers
+//beyond the ports available wrap round.
+uint8_t midiCompiler_compileSong(const uint8_t * fileData, uint32_t fileLength, midiCompiledEvent_t * events, uint32_t maxEvents,
+                                 midiCompiledSysEx_t * sysEx, uint32_t maxSysEx, tempoMap_t * tempoMap, const uint8_t * trackPorts, midiCompiledSong_t * song);
+
+uint8_t midiCompiler_readVariableLength(const uint8_t ** dataPtr, const uint8_t * const dataEnd, uint32_t * result);
+
+#endif
@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <string.h>
+#include "midiOutput.h"
+
+
+//**** Public
+void midiOutput_resetRunningStatus(midiOutputPort_t * port)
+{
+    // The next channel voice message will always carry its status
+    // byte, call this whenever the receiver's state is unknown
+    // (playback start, or after something bypassed the encoder)
+    port->runningStatus = 0;
+}
+
+
+//**** Public
+uint8_t midiOutput_encodeMessage(midiOutputPort_t * port, const uint8_t * message, uint8_t length, uint8_t * out)
+{
+    // Writes 'message' (which always starts with its status byte) to
+    // 'out' as it should go on the wire, returns the number of bytes
+    // written. At 31250 baud each status byte left off is 320uS saved
+    // for everything queued behind it. The rules are:
+    // 0x80-0xEF channel voice   - status omitted when it matches the last one sent
+    // 0xF0-0xF7 system common   - always sent, cancels running status
+    // 0xF8-0xFF system realtime - always sent, running status unaffected
+    uint8_t status = message[0];
+    uint8_t noteOn[3];
+
+    if(status >= 0xF8)
+    {
+        out[0] = status;
+        return 1;
+    }
+
+    if(status >= 0xF0)
+    {
+        port->runningStatus = 0;
+        memcpy(out, message, length);
+        return length;
+    }
+
+#if MIDI_OUTPUT_RUNNING_STATUS_ENABLED
+#if MIDI_OUTPUT_NOTE_OFF_AS_NOTE_ON
+    // A note-on with velocity 0 IS a note-off (midi 1.0 spec), so in
+    // the middle of a run of note-ons a note-off without a meaningful
+    // release velocity can ride on the running status as well
+    if(((status & 0xF0) == 0x80) && (port->runningStatus == (status | 0x10)) && ((message[2] == 0) || (message[2] == 0x40)))
+    {
+        noteOn[0] = status | 0x10;
+        noteOn[1] = message[1];
+        noteOn[2] = 0;
+        message = noteOn;
+        status = noteOn[0];
+    }
+#endif
+
+    if(status == port->runningStatus)
+    {
+        port->numStatusBytesSaved++;
+        memcpy(out, &message[1], length - 1);
+        return length - 1;
+    }
+#endif
+
+    port->runningStatus = status;
+    memcpy(out, message, length);
+    return length;
+}
+
+
+//**** Public
+void midiOutput_clearNotes(midiNoteSet_t * notes)
+{
+    memset(notes, 0, sizeof(midiNoteSet_t));
+}
+
+
+//**** Public
+void midiOutput_trackNote(midiNoteSet_t * notes, uint8_t status, uint8_t note, uint8_t velocity)
+{
+    // Call with every message sent (status as sent before running status
+    // is applied), anything other than a note-on or note-off is ignored.
+    // A note-on with velocity 0 is a note-off. Repeated note-ons of a
+    // sounding note are one bit, a single note-off releases them.
+    uint32_t * word;
+    uint32_t mask;
+
+    if((status & 0xE0) != 0x80) return;
+
+    word = &notes->bits[status & 0x0F][(note & 0x7F) >> 5];
+    mask = 1UL << (note & 0x1F);
+
+    if(((status & 0xF0) == 0x90) && (velocity != 0))
+    {
+        if(!(*word & mask)) notes->numNotes++;
+        *word |= mask;
+    }
+    else
+    {
+        if(*word & mask) notes->numNotes--;
+        *word &= ~mask;
+    }
+}
+
+
+//**** Public
+bool midiOutput_getNoteOff(const midiNoteSet_t * notes, uint8_t * message)
+{
+    // Writes the note-off for the lowest sounding note (channel first) to
+    // 'message', 3 bytes. Returns false when nothing is sounding. Tracking
+    // the note-off once sent clears it, so the next call moves on. Note-offs
+    // come out channel by channel, so they share a status byte on the wire.
+    if(notes->numNotes == 0) return false;
+
+    for(uint8_t channel = 0; channel < MIDI_OUTPUT_NUM_CHANNELS; channel++)
+    {
+        for(uint8_t i = 0; i < (128 / 32); i++)
+        {
+            if(notes->bits[channel][i] == 0) continue;
+
+            message[0] = 0x80 | channel;
+            message[1] = (i << 5) | (uint8_t)__builtin_ctz(notes->bits[channel][i]);
+            message[2] = 0x40;
+            return true;
+        }
+    }
+
+    return false;
+}
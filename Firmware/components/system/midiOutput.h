@@ -0,0 +1,37 @@
+#ifndef MIDI_OUTPUT_H
+#define MIDI_OUTPUT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define MIDI_OUTPUT_RUNNING_STATUS_ENABLED 1 //Set to 0 for receivers that mishandle running status
+#define MIDI_OUTPUT_NOTE_OFF_AS_NOTE_ON 1 //Send plain note-offs as velocity 0 note-ons when it saves a status byte
+#define MIDI_OUTPUT_NUM_CHANNELS 16
+#define MIDI_OUTPUT_NUM_PORTS 2 //Midi outs driven in parallel, each a uart of its own (see systemLowLevel.h), at most 16
+
+//Output side state of one midi port. Running status has to track what
+//was actually sent on the wire, so EVERYTHING written to a port other
+//than realtime bytes must either go through midiOutput_encodeMessage or
+//be followed by midiOutput_resetRunningStatus.
+typedef struct
+{
+    uint8_t runningStatus;          //Last channel voice status sent, 0 when none is in force
+    uint32_t numStatusBytesSaved;   //Status bytes left off thanks to running status
+} midiOutputPort_t;
+
+//Notes sounding, one bit per channel and note number. Kept up to date
+//from the messages sent so that releasing everything costs a couple of
+//bytes per held note, rather than an all notes off on every channel.
+typedef struct
+{
+    uint32_t bits[MIDI_OUTPUT_NUM_CHANNELS][128 / 32];
+    uint16_t numNotes;              //Bits set
+} midiNoteSet_t;
+
+void midiOutput_resetRunningStatus(midiOutputPort_t * port);
+uint8_t midiOutput_encodeMessage(midiOutputPort_t * port, const uint8_t * message, uint8_t length, uint8_t * out);
+void midiOutput_clearNotes(midiNoteSet_t * notes);
+void midiOutput_trackNote(midiNoteSet_t * notes, uint8_t status, uint8_t note, uint8_t velocity);
+bool midiOutput_getNoteOff(const midiNoteSet_t * notes, uint8_t * message);
+
+#endif
@@ -0,0 +1,354 @@
+#include <stdio.h>
+#include <string.h>
+#include "esp_log.h"
+#include "fileSys.h"
+#include "midiCompiler.h"
+#include "midiRecorder.h"
+
+#define LOG_TAG "midiRecorder"
+#define MTHD_CHUNK_BYTES 14
+#define MTRK_HEADER_BYTES 8
+#define TRACK_LENGTH_OFFSET (MTHD_CHUNK_BYTES + 4) //MTrk length, patched when the recording stops
+#define MAX_VARIABLE_LENGTH_BYTES 4
+#define MAX_EVENT_BYTES (MAX_VARIABLE_LENGTH_BYTES + 1 + 2 + MIDI_RECORDER_SYSEX_PACKET_BYTES + 1) //Delta, type, length, payload and 0xF7
+
+static void receiveByte(midiRecorder_t * recorder, const midiInputByte_t * input);
+static uint8_t writeChannelMessage(midiRecorder_t * recorder);
+static uint8_t writeSysExPacket(midiRecorder_t * recorder, bool isLastPacket);
+static uint8_t beginTrackEvent(midiRecorder_t * recorder, uint64_t time);
+static void appendTrackByte(midiRecorder_t * recorder, uint8_t byte);
+static void appendVariableLength(midiRecorder_t * recorder, uint32_t value);
+static uint8_t writeBlock(midiRecorder_t * recorder);
+static void abortRecording(midiRecorder_t * recorder);
+static uint8_t getVoiceMessageLength(uint8_t statusByte);
+
+
+//**** Public
+uint8_t midiRecorder_start(midiRecorder_t * recorder, char * fileName, uint8_t port)
+{
+    // The header goes at the front of the first block, with the track
+    // length left at zero until the stop. Ticks are fine enough (50uS)
+    // that rounding to them keeps well inside the input timing needed.
+    const uint8_t header[MTHD_CHUNK_BYTES + MTRK_HEADER_BYTES] = {
+        'M', 'T', 'h', 'd', 0, 0, 0, 6,
+        0, 0,                                                       //Format 0
+        0, 1,                                                       //One track
+        (uint8_t)(MIDI_RECORDER_DIVISION >> 8), (uint8_t)MIDI_RECORDER_DIVISION,
+        'M', 'T', 'r', 'k', 0, 0, 0, 0};
+
+    if(recorder->isRecording)
+    {
+        ESP_LOGE(LOG_TAG, "Already recording, stop first");
+        return 1;
+    }
+
+    if(port >= MIDI_OUTPUT_NUM_PORTS)
+    {
+        ESP_LOGE(LOG_TAG, "Can't record from port %d", port);
+        return 1;
+    }
+
+    fileSys_deleteFile(fileName); //Fails harmlessly when there's nothing to replace
+    if(fileSys_openFileRW(fileName, true))
+    {
+        ESP_LOGE(LOG_TAG, "Unable to create '%s'", fileName);
+        return 1;
+    }
+
+    memset(&recorder->stats, 0, sizeof(midiRecorderStats_t));
+    recorder->port = port;
+    recorder->inputStatus = 0;
+    recorder->numMessageBytes = 0;
+    recorder->isInSysEx = false;
+    recorder->trackStatus = 0;
+    recorder->lastTick = 0;
+    recorder->trackLength = 0;
+
+    memcpy(recorder->block, header, sizeof(header));
+    recorder->blockLength = sizeof(header);
+
+    //Set tempo at tick zero, so ticks come back as the same microseconds
+    appendTrackByte(recorder, 0);
+    appendTrackByte(recorder, 0xFF);
+    appendTrackByte(recorder, 0x51);
+    appendTrackByte(recorder, 3);
+    appendTrackByte(recorder, (uint8_t)(MIDI_RECORDER_TEMPO >> 16));
+    appendTrackByte(recorder, (uint8_t)(MIDI_RECORDER_TEMPO >> 8));
+    appendTrackByte(recorder, (uint8_t)MIDI_RECORDER_TEMPO);
+
+    spscRing_init(&recorder->input, recorder->inputStorage, sizeof(midiInputByte_t), MIDI_RECORDER_INPUT_BYTES);
+    recorder->startTime = getDeltaTimerNow();
+    recorder->isRecording = true;
+
+    ESP_LOGI(LOG_TAG, "Recording port %d to '%s'", port, fileName);
+
+    return 0; //** SUCCESS **//
+}
+
+
+//**** Public
+uint8_t midiRecorder_service(midiRecorder_t * recorder)
+{
+    // Everything in the input ring is encoded now, the bytes carry their
+    // own arrival times so how late this runs doesn't matter (as long as
+    // the ring doesn't fill). Returns 1 if the file couldn't be written,
+    // the recording is then abandoned.
+    midiInputByte_t received;
+    uint64_t now = getDeltaTimerNow();
+
+    if(!recorder->isRecording) return 1;
+
+    while(recorder->isRecording && spscRing_pop(&recorder->input, &received))
+    {
+        if((now > received.time) && ((now - received.time) > recorder->stats.maxInputLag)) recorder->stats.maxInputLag = (uint32_t)(now - received.time);
+        receiveByte(recorder, &received);
+    }
+    recorder->stats.numInputOverflows = spscRing_getOverflowCount(&recorder->input);
+
+    return recorder->isRecording ? 0 : 1;
+}
+
+
+//**** Public
+uint8_t midiRecorder_stop(midiRecorder_t * recorder)
+{
+    // A sysex message still open is closed off with 0xF7, a channel
+    // message part way in is dropped. The end of track goes at the stop.
+    uint8_t trackLength[4];
+
+    if(midiRecorder_service(recorder)) return 1;
+
+    if(recorder->isInSysEx)
+    {
+        recorder->sysEx[recorder->sysExLength++] = 0xF7;
+        recorder->stats.numAbortedSysEx++;
+        if(writeSysExPacket(recorder, true)) return 1;
+    }
+
+    if(beginTrackEvent(recorder, getDeltaTimerNow())) return 1;
+    appendTrackByte(recorder, 0xFF);
+    appendTrackByte(recorder, metaEvent_endOfTrack);
+    appendTrackByte(recorder, 0);
+
+    if(writeBlock(recorder)) return 1;
+
+    trackLength[0] = (uint8_t)(recorder->trackLength >> 24);
+    trackLength[1] = (uint8_t)(recorder->trackLength >> 16);
+    trackLength[2] = (uint8_t)(recorder->trackLength >> 8);
+    trackLength[3] = (uint8_t)recorder->trackLength;
+    if(fileSys_writeFileAt(TRACK_LENGTH_OFFSET, trackLength, sizeof(trackLength)))
+    {
+        abortRecording(recorder);
+        return 1;
+    }
+
+    fileSys_closeFile();
+    recorder->isRecording = false;
+
+    if(recorder->stats.numInputOverflows) ESP_LOGE(LOG_TAG, "%ld input bytes lost, the recorder fell behind", recorder->stats.numInputOverflows);
+    ESP_LOGI(LOG_TAG, "Recorded %ld events and %ld sysex packets, %ld bytes in %ld block writes, %ld input bytes ignored",
+             recorder->stats.numEvents, recorder->stats.numSysExPackets, recorder->stats.fileLength, recorder->stats.numBlockWrites, recorder->stats.numIgnoredBytes);
+
+    return 0; //** SUCCESS **//
+}
+
+
+//**** Private
+static void receiveByte(midiRecorder_t * recorder, const midiInputByte_t * input)
+{
+    // Parses the input a byte at a time. Realtime bytes can turn up
+    // anywhere, even inside other messages, and are skipped without
+    // disturbing them. Any other status byte ends a sysex message.
+    uint8_t byte = input->byte;
+
+    if(byte >= 0xF8)
+    {
+        recorder->stats.numIgnoredBytes++;
+        return;
+    }
+
+    if(recorder->isInSysEx)
+    {
+        if((recorder->sysExLength == 0) && recorder->isSysExContinued) recorder->sysExTime = input->time;
+
+        if(byte < 0x80)
+        {
+            recorder->sysEx[recorder->sysExLength++] = byte;
+            if(recorder->sysExLength == MIDI_RECORDER_SYSEX_PACKET_BYTES) writeSysExPacket(recorder, false);
+            return;
+        }
+
+        if(byte != 0xF7) recorder->stats.numAbortedSysEx++;
+        recorder->sysEx[recorder->sysExLength++] = 0xF7;
+        if(writeSysExPacket(recorder, true) || (byte == 0xF7)) return;
+    }
+
+    if(byte == 0xF0)
+    {
+        recorder->isInSysEx = true;
+        recorder->isSysExContinued = false;
+        recorder->sysExTime = input->time;
+        recorder->sysExLength = 0;
+        recorder->inputStatus = 0;
+        return;
+    }
+
+    if(byte >= 0xF0) //System common (or a stray 0xF7), not stored in midi files
+    {
+        recorder->inputStatus = 0;
+        recorder->stats.numIgnoredBytes++;
+        return;
+    }
+
+    if(byte & 0x80)
+    {
+        recorder->inputStatus = byte;
+        recorder->message[0] = byte;
+        recorder->messageLength = getVoiceMessageLength(byte);
+        recorder->numMessageBytes = 1;
+        recorder->messageTime = input->time;
+        return;
+    }
+
+    if(recorder->inputStatus == 0)
+    {
+        recorder->stats.numIgnoredBytes++;
+        return;
+    }
+
+    if(recorder->numMessageBytes == 0) //Running status, the message starts with this byte
+    {
+        recorder->numMessageBytes = 1;
+        recorder->messageTime = input->time;
+    }
+    recorder->message[recorder->numMessageBytes++] = byte;
+
+    if(recorder->numMessageBytes == recorder->messageLength)
+    {
+        writeChannelMessage(recorder);
+        recorder->numMessageBytes = 0;
+    }
+}
+
+
+//**** Private
+static uint8_t writeChannelMessage(midiRecorder_t * recorder)
+{
+    if(beginTrackEvent(recorder, recorder->messageTime)) return 1;
+
+    if(recorder->message[0] != recorder->trackStatus) appendTrackByte(recorder, recorder->message[0]);
+    else recorder->stats.numRunningStatusBytes++;
+    recorder->trackStatus = recorder->message[0];
+
+    for(uint8_t i = 1; i < recorder->messageLength; i++) appendTrackByte(recorder, recorder->message[i]);
+    recorder->stats.numEvents++;
+
+    return 0; //** SUCCESS **//
+}
+
+
+//**** Private
+static uint8_t writeSysExPacket(midiRecorder_t * recorder, bool isLastPacket)
+{
+    // The first packet of a message is an 0xF0 event, the rest carry on
+    // from it as 0xF7 events - the last of them ending with the 0xF7
+    if(beginTrackEvent(recorder, recorder->sysExTime)) return 1;
+
+    appendTrackByte(recorder, recorder->isSysExContinued ? 0xF7 : 0xF0);
+    appendVariableLength(recorder, recorder->sysExLength);
+    for(uint32_t i = 0; i < recorder->sysExLength; i++) appendTrackByte(recorder, recorder->sysEx[i]);
+
+    recorder->trackStatus = 0; //SysEx cancels running status
+    recorder->stats.numSysExPackets++;
+    recorder->isSysExContinued = true;
+    recorder->isInSysEx = !isLastPacket;
+    recorder->sysExLength = 0;
+
+    return 0; //** SUCCESS **//
+}
+
+
+//**** Private
+static uint8_t beginTrackEvent(midiRecorder_t * recorder, uint64_t time)
+{
+    // Writes out the block first if the event might not fit, then the
+    // delta time. Ticks are rounded from the start of the recording so
+    // the rounding never builds up from one event to the next.
+    uint32_t tick = 0;
+
+    if(recorder->blockLength > (MIDI_RECORDER_BLOCK_BYTES - MAX_EVENT_BYTES))
+    {
+        if(writeBlock(recorder)) return 1;
+    }
+
+    if(time > recorder->startTime) tick = (uint32_t)((time - recorder->startTime + (MIDI_RECORDER_US_PER_TICK / 2)) / MIDI_RECORDER_US_PER_TICK);
+    if(tick < recorder->lastTick) tick = recorder->lastTick; //A byte timed from when it was read (see readMidiIn)
+
+    appendVariableLength(recorder, tick - recorder->lastTick);
+    recorder->lastTick = tick;
+
+    return 0; //** SUCCESS **//
+}
+
+
+//**** Private
+static void appendTrackByte(midiRecorder_t * recorder, uint8_t byte)
+{
+    recorder->block[recorder->blockLength++] = byte;
+    recorder->trackLength++;
+}
+
+
+//**** Private
+static void appendVariableLength(midiRecorder_t * recorder, uint32_t value)
+{
+    // Seven bits per byte, most significant first, bit 7 set on all but the last
+    uint8_t bytes[MAX_VARIABLE_LENGTH_BYTES];
+    uint8_t numBytes = 0;
+
+    value &= 0x0FFFFFFF; //28 bits at most
+    do
+    {
+        bytes[numBytes++] = value & 0x7F;
+        value >>= 7;
+    } while(value);
+
+    while(numBytes > 1) appendTrackByte(recorder, bytes[--numBytes] | 0x80);
+    appendTrackByte(recorder, bytes[0]);
+}
+
+
+//**** Private
+static uint8_t writeBlock(midiRecorder_t * recorder)
+{
+    if(recorder->blockLength == 0) return 0;
+
+    if(fileSys_writeFile(recorder->block, recorder->blockLength, false))
+    {
+        ESP_LOGE(LOG_TAG, "Unable to write to the recording, abandoned");
+        abortRecording(recorder);
+        return 1;
+    }
+
+    recorder->stats.fileLength += recorder->blockLength;
+    recorder->stats.numBlockWrites++;
+    recorder->blockLength = 0;
+
+    return 0; //** SUCCESS **//
+}
+
+
+//**** Private
+static void abortRecording(midiRecorder_t * recorder)
+{
+    fileSys_closeFile();
+    recorder->isRecording = false;
+}
+
+
+//**** Private
+static uint8_t getVoiceMessageLength(uint8_t statusByte)
+{
+    if(((statusByte & 0xF0) == 0xC0) || ((statusByte & 0xF0) == 0xD0)) return 2;
+    return 3;
+}
@@ -0,0 +1,74 @@
+#ifndef MIDI_RECORDER_H
+#define MIDI_RECORDER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "systemLowLevel.h"
+#include "spscRing.h"
+
+#define MIDI_RECORDER_TEMPO 500000          //uS per quater-note, written as the file's set tempo (120bpm)
+#define MIDI_RECORDER_DIVISION 10000        //Ticks per quater-note, 50uS ticks at that tempo
+#define MIDI_RECORDER_US_PER_TICK (MIDI_RECORDER_TEMPO / MIDI_RECORDER_DIVISION)
+#define MIDI_RECORDER_BLOCK_BYTES 4096      //Track data is written to the file this many bytes at a time
+#define MIDI_RECORDER_SYSEX_PACKET_BYTES 128 //Longer sysex messages are split into 0xF7 continuation packets
+#define MIDI_RECORDER_INPUT_BYTES 1024      //Input bytes waiting to be encoded (16 bytes each), MUST be a power of two
+#define MIDI_RECORDER_POLL_MS 20            //How often input is encoded while recording, well inside the input ring
+
+typedef struct
+{
+    uint32_t numEvents;                     //Channel messages recorded
+    uint32_t numSysExPackets;
+    uint32_t numAbortedSysEx;               //Messages with no 0xF7, closed off by whatever came next (or the stop)
+    uint32_t numIgnoredBytes;               //Realtime, system common, and data bytes with no status to go with them
+    uint32_t numRunningStatusBytes;         //Status bytes left out of the file
+    uint32_t maxInputLag;                   //Longest a byte waited between its start bit and being encoded (uS)
+    uint32_t numBlockWrites;
+    uint32_t fileLength;                    //Bytes in the file so far, header included
+    uint32_t numInputOverflows;             //Bytes lost to a full input ring
+} midiRecorderStats_t;
+
+//Records one midi in to a format 0 standard midi file. Bytes arrive
+//already timed (see readMidiIn) through the input ring, which the
+//playback engine fills as the input's tap - so the encoder only has to
+//keep up with the ring, not the input timing. It runs at low priority
+//and writes the file in large blocks. Realtime messages (the
+//clock, active sensing) and system common messages are left out.
+typedef struct
+{
+    bool isRecording;
+    uint8_t port;
+    uint64_t startTime;                     //Delta timer count at tick zero
+    //--- Input ---
+    uint8_t inputStatus;                    //Running status on the wire, 0 when data bytes have nothing to go with
+    uint8_t message[3];
+    uint8_t messageLength;                  //Bytes the message at inputStatus takes, status included
+    uint8_t numMessageBytes;                //Status included, so 1 until the first data byte
+    uint64_t messageTime;                   //Start bit of the message's first byte (which may be data, running status)
+    bool isInSysEx;
+    bool isSysExContinued;                  //Packets of this message already written, the next is an 0xF7 continuation
+    uint64_t sysExTime;                     //Start bit of the packet's first byte
+    uint32_t sysExLength;
+    uint8_t sysEx[MIDI_RECORDER_SYSEX_PACKET_BYTES + 1]; //Room for the 0xF7
+    //--- Track ---
+    uint8_t trackStatus;                    //Running status in the file, sysex cancels it
+    uint32_t lastTick;
+    uint32_t trackLength;                   //MTrk data bytes, written or still in the block
+    uint32_t blockLength;
+    uint8_t block[MIDI_RECORDER_BLOCK_BYTES];
+    spscRing_t input;                       //midiInputByte_t, see playbackEngine_setInputTap
+    midiInputByte_t inputStorage[MIDI_RECORDER_INPUT_BYTES];
+    midiRecorderStats_t stats;
+} midiRecorder_t;
+
+
+//Start creates the file (replacing any old one) and empties the input
+//ring, service encodes whatever has arrived since it last ran and stop
+//writes out the rest and closes the file. The caller connects the ring
+//as the port's tap after the start, and removes it before the stop. The
+//file system holds one file open at a time, so callers have to keep
+//other file users off it meanwhile.
+uint8_t midiRecorder_start(midiRecorder_t * recorder, char * fileName, uint8_t port);
+uint8_t midiRecorder_service(midiRecorder_t * recorder);
+uint8_t midiRecorder_stop(midiRecorder_t * recorder);
+
+#endif
@@ -0,0 +1,2007 @@
+#include <stdio.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_heap_caps.h"
+#include "systemLowLevel.h"
+#include "systemTrace.h"
+#include "playbackEngine.h"
+
+#define LOG_TAG "playbackEngine"
+#define OUTPUT_QUEUE_MASK (PLAYBACK_OUTPUT_QUEUE_LENGTH - 1)
+#define SYSEX_QUEUE_MASK (PLAYBACK_SYSEX_QUEUE_LENGTH - 1)
+#define THRU_QUEUE_MASK (PLAYBACK_THRU_QUEUE_LENGTH - 1)
+
+static void renderOutput(midiPlaybackRuntimeData_t * playbackDataPtr, uint64_t now);
+static bool renderCluster(midiPlaybackRuntimeData_t * playbackDataPtr, uint64_t now);
+static void transmitOutput(midiPlaybackRuntimeData_t * playbackDataPtr, uint64_t now);
+static bool queueSysEx(midiPlaybackRuntimeData_t * playbackDataPtr, const midiCompiledEvent_t * event, uint64_t deadline);
+static void transmitSysEx(midiPlaybackRuntimeData_t * playbackDataPtr, uint8_t port, uint64_t now, uint8_t * burst, uint32_t * burstLength, uint64_t * lineEnd);
+static bool canStartSysEx(midiPlaybackRuntimeData_t * playbackDataPtr, uint8_t port, uint64_t now, uint64_t lineEnd, bool * isForced);
+static uint64_t getSysExWakeTime(midiPlaybackRuntimeData_t * playbackDataPtr, uint8_t port, uint64_t now);
+static uint64_t getSysExNextEventTime(midiPlaybackRuntimeData_t * playbackDataPtr, uint8_t port);
+static void restoreRunningStatus(playbackPort_t * port);
+static void transmitClock(midiPlaybackRuntimeData_t * playbackDataPtr, uint8_t port, uint8_t * burst, uint32_t * burstLength, uint64_t * lineEnd);
+static uint64_t getClockDueTime(midiPlaybackRuntimeData_t * playbackDataPtr, uint8_t port);
+static uint32_t getBytesBeforeClock(midiPlaybackRuntimeData_t * playbackDataPtr, uint8_t port, uint64_t lineEnd);
+static uint64_t getClockWakeTime(midiPlaybackRuntimeData_t * playbackDataPtr);
+static void setClockPosition(midiPlaybackRuntimeData_t * playbackDataPtr, uint8_t port, uint32_t clock);
+static void advanceClock(midiPlaybackRuntimeData_t * playbackDataPtr, uint8_t port);
+static uint32_t findFirstClockAtTime(midiPlaybackRuntimeData_t * playbackDataPtr, uint64_t songTime);
+static bool isClockPort(midiPlaybackRuntimeData_t * playbackDataPtr, uint8_t port);
+static void sendClockCommand(midiPlaybackRuntimeData_t * playbackDataPtr, uint8_t command);
+static uint64_t getNextWakeTime(midiPlaybackRuntimeData_t * playbackDataPtr, uint64_t now);
+static uint64_t getEventDeadline(midiPlaybackRuntimeData_t * playbackDataPtr, uint32_t eventIndex);
+static uint64_t getSongDeadline(midiPlaybackRuntimeData_t * playbackDataPtr, uint64_t songTime);
+static void updateTempoRamp(midiPlaybackRuntimeData_t * playbackDataPtr, uint64_t now);
+static void applyTempo(midiPlaybackRuntimeData_t * playbackDataPtr, uint64_t now, uint32_t multiplier, int64_t anchor);
+static int64_t getSongTimeNow(midiPlaybackRuntimeData_t * playbackDataPtr, uint64_t now);
+static int64_t scaleTime(int64_t time, uint32_t multiply, uint32_t divide);
+static bool hasNextEvent(midiPlaybackRuntimeData_t * playbackDataPtr);
+static bool isSongFinished(midiPlaybackRuntimeData_t * playbackDataPtr);
+static void getNextEvent(midiPlaybackRuntimeData_t * playbackDataPtr, midiCompiledEvent_t * event);
+static void fetchEvent(midiPlaybackRuntimeData_t * playbackDataPtr, uint32_t eventIndex, midiCompiledEvent_t * event);
+static uint64_t getNextDeadline(midiPlaybackRuntimeData_t * playbackDataPtr);
+static void advanceToNextEvent(midiPlaybackRuntimeData_t * playbackDataPtr);
+static uint64_t getFollowingDeadline(midiPlaybackRuntimeData_t * playbackDataPtr);
+static uint32_t findFirstEventAtTime(midiPlaybackRuntimeData_t * playbackDataPtr, uint64_t songTime);
+static void appendToBurst(midiPlaybackRuntimeData_t * playbackDataPtr, uint8_t port, uint8_t * burst, uint32_t * burstLength, const uint8_t * message, uint8_t length, uint64_t * lineEnd);
+static void dropOutput(midiPlaybackRuntimeData_t * playbackDataPtr, uint8_t port, uint8_t * burst, uint32_t * burstLength, uint64_t * lineEnd);
+static bool isOutputEmpty(midiPlaybackRuntimeData_t * playbackDataPtr);
+static uint64_t getLineEnd(const playbackPort_t * port, uint64_t now);
+static bool isKeptClear(midiPlaybackRuntimeData_t * playbackDataPtr, uint8_t port, uint64_t now);
+static void updateInputPorts(midiPlaybackRuntimeData_t * playbackDataPtr);
+static void receiveLiveEvents(midiPlaybackRuntimeData_t * playbackDataPtr);
+static bool parseInput(midiPlaybackRuntimeData_t * playbackDataPtr, playbackInput_t * input, uint8_t byte, uint64_t arrivalTime);
+static void queueThru(midiPlaybackRuntimeData_t * playbackDataPtr, const playbackInput_t * input, uint64_t arrivalTime);
+static void transmitThru(midiPlaybackRuntimeData_t * playbackDataPtr, uint8_t port, uint64_t now, uint8_t * burst, uint32_t * burstLength, uint64_t * lineEnd);
+static uint64_t getThruWakeTime(midiPlaybackRuntimeData_t * playbackDataPtr, uint8_t port, uint64_t now);
+static bool isSongEventDue(const playbackPort_t * output, uint64_t lineEnd);
+static bool isThruAllowanceSpent(const playbackPort_t * output, uint64_t lineEnd);
+
+
+static seekChaseState_t chaseState; //Too big for the caller's stack, only used inside playbackEngine_seek
+
+
+//**** Public
+void playbackEngine_init(midiPlaybackRuntimeData_t * playbackDataPtr, uint8_t * uploadBuffer)
+{
+    memset(playbackDataPtr, 0, sizeof(midiPlaybackRuntimeData_t));
+    playbackDataPtr->playbackDataBASE = uploadBuffer;
+    playbackDataPtr->lookAheadWindow = PLAYBACK_LOOKAHEAD_DEFAULT_US;
+    playbackDataPtr->tempo.multiplier = PLAYBACK_TEMPO_ONE;
+    playbackDataPtr->clockPorts = PLAYBACK_CLOCK_PORTS_DEFAULT;
+    for (uint8_t a = 0; a < MIDI_OUTPUT_NUM_PORTS; a++) playbackDataPtr->ports[a].clockSongTime = UINT64_MAX;
+    spscRing_init(&playbackDataPtr->liveQueue, playbackDataPtr->liveQueueStorage, sizeof(playbackLiveEvent_t), PLAYBACK_LIVE_QUEUE_LENGTH);
+}
+
+
+//**** Public
+uint8_t playbackEngine_compileSong(midiPlaybackRuntimeData_t * playbackDataPtr)
+{
+    // Runs ONCE per upload, off the timing critical path.
+    // First pass only counts events and tempo changes so the
+    // compiled array and tempo map can be allocated exactly
+
+    midiCompiledSong_t countOnly;
+    midiCompiledEvent_t * events;
+    midiCompiledSysEx_t * sysEx;
+    tempoMapSegment_t * tempoSegments;
+    seekCheckpoint_t * checkpoints;
+    uint32_t numCheckpoints;
+
+    playbackEngine_freeSong(playbackDataPtr);
+    playbackDataPtr->stream = NULL;
+
+    if(midiCompiler_compileSong(playbackDataPtr->playbackDataBASE, playbackDataPtr->totalDataLength, NULL, 0, NULL, 0, NULL, NULL, &countOnly))
+    {
+        ESP_LOGE(LOG_TAG, "Uploaded midi data failed to compile - playback aborted");
+        return 1;
+    }
+
+    events = heap_caps_malloc((countOnly.numEvents + 1) * sizeof(midiCompiledEvent_t), MALLOC_CAP_SPIRAM);
+    sysEx = heap_caps_malloc((countOnly.numSysEx + 1) * sizeof(midiCompiledSysEx_t), MALLOC_CAP_SPIRAM);
+
+    //The tempo map is read for every event, so keep it in internal ram when possible
+    tempoSegments = heap_caps_malloc((countOnly.numTempoChanges + 1) * sizeof(tempoMapSegment_t), MALLOC_CAP_INTERNAL);
+    if(tempoSegments == NULL) tempoSegments = heap_caps_malloc((countOnly.numTempoChanges + 1) * sizeof(tempoMapSegment_t), MALLOC_CAP_SPIRAM);
+
+    if((events == NULL) || (sysEx == NULL) || (tempoSegments == NULL))
+    {
+        ESP_LOGE(LOG_TAG, "fault allocating compiled song memory");
+        if(events != NULL) heap_caps_free(events);
+        if(sysEx != NULL) heap_caps_free(sysEx);
+        if(tempoSegments != NULL) heap_caps_free(tempoSegments);
+        return 1;
+    }
+
+    playbackDataPtr->song.events = events;
+    playbackDataPtr->song.sysEx = sysEx;
+    playbackDataPtr->tempoMap.segments = tempoSegments;
+
+    if(tempoMap_init(&playbackDataPtr->tempoMap, countOnly.timeDivision, tempoSegments, countOnly.numTempoChanges + 1) ||
+       midiCompiler_compileSong(playbackDataPtr->playbackDataBASE, playbackDataPtr->totalDataLength, events, countOnly.numEvents, sysEx, countOnly.numSysEx, &playbackDataPtr->tempoMap, playbackDataPtr->trackPorts, &playbackDataPtr->song))
+    {
+        playbackEngine_freeSong(playbackDataPtr);
+        return 1;
+    }
+
+    // Without the index a seek still works, it just
+    // replays the song from the start to find the state
+    numCheckpoints = seekIndex_getNumCheckpoints(playbackDataPtr->song.numEvents);
+    checkpoints = heap_caps_malloc((numCheckpoints + 1) * sizeof(seekCheckpoint_t), MALLOC_CAP_SPIRAM);
+    if(seekIndex_build(&playbackDataPtr->seekIndex, &playbackDataPtr->song, checkpoints, (checkpoints != NULL) ? (numCheckpoints + 1) : 0))
+    {
+        ESP_LOGE(LOG_TAG, "Seek index unavailable, seeking will be slow");
+        if(checkpoints != NULL) heap_caps_free(checkpoints);
+    }
+
+    ESP_LOGI(LOG_TAG, "Compiled %ld midi events from %d tracks, %ld tempo changes, %ld sysex packets (%ld bytes), time division 0x%0x",
+             playbackDataPtr->song.numEvents, playbackDataPtr->song.numTracks, playbackDataPtr->song.numTempoChanges,
+             playbackDataPtr->song.numSysEx, playbackDataPtr->song.numSysExBytes, playbackDataPtr->song.timeDivision);
+
+    return 0; //** SUCCESS **//
+}
+
+
+//**** Public
+void playbackEngine_freeSong(midiPlaybackRuntimeData_t * playbackDataPtr)
+{
+    if(playbackDataPtr->song.events != NULL) heap_caps_free(playbackDataPtr->song.events);
+    if(playbackDataPtr->song.sysEx != NULL) heap_caps_free(playbackDataPtr->song.sysEx);
+    if(playbackDataPtr->tempoMap.segments != NULL) heap_caps_free(playbackDataPtr->tempoMap.segments);
+    if(playbackDataPtr->seekIndex.checkpoints != NULL) heap_caps_free(playbackDataPtr->seekIndex.checkpoints);
+
+    playbackDataPtr->seekIndex.checkpoints = NULL;
+    playbackDataPtr->seekIndex.numCheckpoints = 0;
+    playbackDataPtr->isLooping = false;
+    playbackDataPtr->song.events = NULL;
+    playbackDataPtr->song.numEvents = 0;
+    playbackDataPtr->song.sysEx = NULL;
+    playbackDataPtr->song.numSysEx = 0;
+    playbackDataPtr->tempoMap.segments = NULL;
+    playbackDataPtr->tempoMap.numSegments = 0;
+}
+
+
+//**** Public
+void playbackEngine_start(midiPlaybackRuntimeData_t * playbackDataPtr)
+{
+    // Song time zero is one look-ahead window from now, so even the
+    // opening chord can be spread around its deadline. The caller then
+    // services the engine once to render (and schedule) the first events
+    playbackPort_t * port;
+
+    playbackDataPtr->nextEventIndex = 0;
+    playbackDataPtr->songStartTime = getDeltaTimerNow() + playbackDataPtr->lookAheadWindow;
+    playbackDataPtr->tempo.anchor = 0; //The multiplier carries over from the last song
+    playbackDataPtr->loopCount = 0;
+    playbackDataPtr->numLoopReleases = 0;
+    memset(&playbackDataPtr->timingStats, 0, sizeof(playbackTimingStats_t));
+    memset(&playbackDataPtr->sysExStats, 0, sizeof(playbackSysExStats_t));
+    memset(&playbackDataPtr->clockStats, 0, sizeof(playbackClockStats_t));
+
+    for(uint8_t a = 0; a < MIDI_OUTPUT_NUM_PORTS; a++)
+    {
+        port = &playbackDataPtr->ports[a];
+        port->outputQueueHead = 0;
+        port->outputQueueTail = 0;
+        midiOutput_resetRunningStatus(&port->outputPort); //Can't know what the receiver last saw
+        midiOutput_clearNotes(&port->renderedNotes);
+        midiOutput_clearNotes(&port->loopReleases);
+        port->sysExQueueHead = 0;
+        port->sysExQueueTail = 0;
+        port->sysExSent = 0;
+        port->sysExPendingBytes = 0;
+        port->itemSent = 0;
+        setClockPosition(playbackDataPtr, a, 0);
+    }
+
+    playbackDataPtr->isPlayingBack = true;
+
+    // Slaves begin at the first clock after a start, which is song time
+    // zero a look-ahead window from now
+    sendClockCommand(playbackDataPtr, 0xFA);
+
+    systemTrace_record(traceEvent_playbackStart, (uint32_t)playbackDataPtr->songStartTime, 0, (playbackDataPtr->stream != NULL) ? 0 : playbackDataPtr->song.numEvents, NULL, 0);
+}
+
+
+//**** Public
+void playbackEngine_startStream(midiPlaybackRuntimeData_t * playbackDataPtr, playbackStream_t * stream)
+{
+    // Plays a freshly opened stream instead of the compiled song. Events
+    // come out of the stream ring with their song time already resolved,
+    // everything from render onwards is the same. A stream only moves
+    // forward, so seek and loop are not available while streaming, and
+    // sysex is skipped (its payload would have to be read back from the file).
+    playbackDataPtr->stream = stream;
+    playbackDataPtr->isLooping = false;
+    playbackEngine_start(playbackDataPtr);
+}
+
+
+//**** Public
+void playbackEngine_stop(midiPlaybackRuntimeData_t * playbackDataPtr)
+{
+    // Any alarm still pending is harmless, servicing a
+    // stopped engine does nothing but midi thru
+    uint8_t burst[PLAYBACK_BURST_MAX_BYTES];
+    uint32_t burstLength;
+    uint64_t now = getDeltaTimerNow();
+    uint64_t lineEnd;
+
+    if(playbackDataPtr->isPlayingBack)
+    {
+        systemTrace_record(traceEvent_playbackStop, (uint32_t)now, 0, playbackDataPtr->nextEventIndex, NULL, 0);
+        sendClockCommand(playbackDataPtr, 0xFC); //Ahead of the note-offs, slaves stop straight away
+    }
+    playbackDataPtr->isPlayingBack = false;
+
+    for(uint8_t port = 0; port < MIDI_OUTPUT_NUM_PORTS; port++)
+    {
+        burstLength = 0;
+        lineEnd = getLineEnd(&playbackDataPtr->ports[port], now);
+        dropOutput(playbackDataPtr, port, burst, &burstLength, &lineEnd);
+        if(burstLength)
+        {
+            writeMidiOut(port, burst, burstLength);
+            playbackDataPtr->ports[port].lineFreeTime = lineEnd;
+        }
+    }
+}
+
+
+//**** Public
+uint8_t playbackEngine_setLoop(midiPlaybackRuntimeData_t * playbackDataPtr, uint64_t loopStartTime, uint64_t loopEndTime)
+{
+    // Loop points are song time in uS, a loop end of 0 means the end of
+    // track (so 0 to 0 loops the whole song). Playback runs on into the loop from wherever it
+    // is, and every time it reaches the loop end it carries on from the
+    // loop start with song time zero moved on by exactly one loop length.
+    // The wrap happens in the render stage, so the events after the loop
+    // start are already queued (and spread, if they collide) before the
+    // loop end goes out - no gap, and being whole microseconds the loop
+    // length adds no drift however many times it repeats.
+    uint32_t loopStartIndex, loopEndIndex;
+
+    if(playbackDataPtr->stream != NULL)
+    {
+        ESP_LOGE(LOG_TAG, "%s is not available while streaming", "Loop");
+        return 1;
+    }
+    if(playbackDataPtr->song.events == NULL) return 1;
+
+    loopStartIndex = findFirstEventAtTime(playbackDataPtr, loopStartTime);
+
+    if(loopEndTime == 0)
+    {
+        // Events sharing the end of track tick are still played,
+        // at the same time as the first event of the next loop
+        loopEndTime = tempoMap_tickToMicroSeconds(&playbackDataPtr->tempoMap, playbackDataPtr->song.endOfTrackTime);
+        loopEndIndex = playbackDataPtr->song.numEvents;
+    }
+    else loopEndIndex = findFirstEventAtTime(playbackDataPtr, loopEndTime);
+
+    if((loopEndTime <= loopStartTime) || (loopEndIndex <= loopStartIndex))
+    {
+        ESP_LOGE(LOG_TAG, "Loop %lld-%lldus contains no events - ignored", loopStartTime, loopEndTime);
+        return 1;
+    }
+
+    playbackDataPtr->loopStartTime = loopStartTime;
+    playbackDataPtr->loopEndTime = loopEndTime;
+    playbackDataPtr->loopStartIndex = loopStartIndex;
+    playbackDataPtr->loopEndIndex = loopEndIndex;
+    playbackDataPtr->isLooping = true;
+
+    return 0; //** SUCCESS **//
+}
+
+
+//**** Public
+void playbackEngine_clearLoop(midiPlaybackRuntimeData_t * playbackDataPtr)
+{
+    // Playback carries on past the loop end from here, the
+    // time offset from any loops already played is kept
+    playbackDataPtr->isLooping = false;
+}
+
+
+//**** Public
+uint8_t playbackEngine_seek(midiPlaybackRuntimeData_t * playbackDataPtr, uint32_t tick)
+{
+    // Jumps to 'tick' and plays on from there, whether or not playback
+    // was running. The seek index gives the channel state at the target
+    // (never more than one checkpoint interval of replay), then only the
+    // program/controller/pressure/bend values the song had set by that
+    // point are sent ahead of the first event, so the receiver ends up as
+    // if it had heard everything before it. The caller then services the
+    // engine once, as with playbackEngine_start.
+    //
+    // Clock slaves are stopped and sent the song position, in sixteenth
+    // notes, of the first whole sixteenth at or after 'tick'. They carry
+    // on from there at the next clock, which is at that position.
+    seekChaseCursor_t cursor;
+    uint8_t burst[PLAYBACK_BURST_MAX_BYTES];
+    uint8_t message[MIDI_COMPILED_EVENT_MAX_BYTES];
+    uint32_t burstLength;
+    uint8_t length;
+    uint8_t chasePort;
+    uint64_t now;
+    uint64_t lineEnd;
+    uint64_t startTime;
+    uint64_t songPosition;
+
+    if(playbackDataPtr->stream != NULL)
+    {
+        ESP_LOGE(LOG_TAG, "%s is not available while streaming", "Seek");
+        return 1;
+    }
+    if(playbackDataPtr->song.events == NULL) return 1;
+
+    playbackDataPtr->nextEventIndex = seekIndex_findState(&playbackDataPtr->seekIndex, &playbackDataPtr->song, tick, &chaseState);
+
+    // The first event goes out once the chase has left every wire (and
+    // at least a look-ahead window from now, same as a normal start).
+    // Unsigned wraparound keeps every deadline correct even when the
+    // song position is further in than the timer has run since boot.
+    now = getDeltaTimerNow();
+    startTime = now + playbackDataPtr->lookAheadWindow;
+
+    songPosition = (((uint64_t)tick * 4) + playbackDataPtr->tempoMap.timeDivision - 1) / playbackDataPtr->tempoMap.timeDivision;
+    if((songPosition > PLAYBACK_MAX_SONG_POSITION) && playbackDataPtr->clockPorts && !playbackDataPtr->tempoMap.isSmpte) ESP_LOGE(LOG_TAG, "Seek to tick %ld is past the last song position, no clock", tick);
+
+    for(uint8_t port = 0; port < MIDI_OUTPUT_NUM_PORTS; port++)
+    {
+        burstLength = 0;
+        lineEnd = getLineEnd(&playbackDataPtr->ports[port], now);
+
+        // Rendered output belongs to the old position, and
+        // notes sounding from before the jump would hang
+        dropOutput(playbackDataPtr, port, burst, &burstLength, &lineEnd);
+
+        setClockPosition(playbackDataPtr, port, (uint32_t)songPosition * PLAYBACK_CLOCKS_PER_POSITION);
+        if(songPosition > PLAYBACK_MAX_SONG_POSITION) playbackDataPtr->ports[port].clockSongTime = UINT64_MAX;
+        if(playbackDataPtr->ports[port].clockSongTime != UINT64_MAX)
+        {
+            message[0] = 0xFC;
+            appendToBurst(playbackDataPtr, port, burst, &burstLength, message, 1, &lineEnd);
+            message[0] = 0xF2;
+            message[1] = (uint8_t)(songPosition & 0x7F);
+            message[2] = (uint8_t)(songPosition >> 7);
+            appendToBurst(playbackDataPtr, port, burst, &burstLength, message, 3, &lineEnd);
+            message[0] = 0xFB;
+            appendToBurst(playbackDataPtr, port, burst, &burstLength, message, 1, &lineEnd);
+            playbackDataPtr->clockStats.numPositions++;
+        }
+
+        // The chase state holds each port's channels in turn
+        cursor.channel = port * MIDI_OUTPUT_NUM_CHANNELS;
+        cursor.step = 0;
+        while(((length = seekIndex_getChaseMessage(&chaseState, &cursor, message, &chasePort)) != 0) && (chasePort == port))
+        {
+            appendToBurst(playbackDataPtr, port, burst, &burstLength, message, length, &lineEnd);
+        }
+
+        if(burstLength) writeMidiOut(port, burst, burstLength);
+        playbackDataPtr->ports[port].lineFreeTime = lineEnd;
+        if(lineEnd > startTime) startTime = lineEnd;
+    }
+
+    playbackDataPtr->tempo.anchor = (int64_t)tempoMap_tickToMicroSeconds(&playbackDataPtr->tempoMap, tick);
+    playbackDataPtr->songStartTime = startTime - (uint64_t)playbackDataPtr->tempo.anchor;
+    playbackDataPtr->isPlayingBack = true;
+
+    systemTrace_record(traceEvent_seek, (uint32_t)now, 0, tick, NULL, 0);
+
+    return 0; //** SUCCESS **//
+}
+
+
+//**** Public
+uint32_t playbackEngine_getPendingSysExBytes(midiPlaybackRuntimeData_t * playbackDataPtr)
+{
+    // SysEx rendered but still to go out on the wire, every port.
+    // Only the packets within the look-ahead window count, the rest
+    // of the song's sysex is still in the compiled song.
+    uint32_t numBytes = 0;
+
+    for(uint8_t port = 0; port < MIDI_OUTPUT_NUM_PORTS; port++) numBytes += playbackDataPtr->ports[port].sysExPendingBytes;
+
+    return numBytes;
+}
+
+
+//**** Public
+void playbackEngine_setTempo(midiPlaybackRuntimeData_t * playbackDataPtr, uint32_t multiplier)
+{
+    // Playback speed as a 16.16 multiplier of the song's own tempo, any
+    // ramp under way is cancelled. Nothing is re-read: the events already
+    // rendered are re-timed where they sit and the next event rendered
+    // uses the new multiplier, so the change is heard straight away. The
+    // caller then services the engine, as the alarm may be set too late.
+    const uint64_t now = getDeltaTimerNow();
+
+    if (multiplier < PLAYBACK_TEMPO_MIN) multiplier = PLAYBACK_TEMPO_MIN;
+    if (multiplier > PLAYBACK_TEMPO_MAX) multiplier = PLAYBACK_TEMPO_MAX;
+
+    updateTempoRamp(playbackDataPtr, now); //Catch up with any ramp first, so the song position is exact
+    playbackDataPtr->tempo.isRamping = false;
+    applyTempo(playbackDataPtr, now, multiplier, getSongTimeNow(playbackDataPtr, now));
+}
+
+
+//**** Public
+void playbackEngine_rampTempo(midiPlaybackRuntimeData_t * playbackDataPtr, uint32_t multiplier, uint32_t duration)
+{
+    // Moves the multiplier linearly from where it is now to 'multiplier'
+    // over 'duration' uS of real time. The engine steps it along every
+    // PLAYBACK_TEMPO_RAMP_STEP_US (and at every service in between). The
+    // song position at each step is worked out from the start of the ramp,
+    // so rounding never builds up however many steps it takes.
+    const uint64_t now = getDeltaTimerNow();
+
+    if (duration == 0)
+    {
+        playbackEngine_setTempo(playbackDataPtr, multiplier);
+        return;
+    }
+
+    if (multiplier < PLAYBACK_TEMPO_MIN) multiplier = PLAYBACK_TEMPO_MIN;
+    if (multiplier > PLAYBACK_TEMPO_MAX) multiplier = PLAYBACK_TEMPO_MAX;
+    if (duration > INT32_MAX) duration = INT32_MAX;
+    updateTempoRamp(playbackDataPtr, now);
+
+    playbackDataPtr->tempo.rampStartTime = now;
+    playbackDataPtr->tempo.rampAnchor = getSongTimeNow(playbackDataPtr, now);
+    playbackDataPtr->tempo.rampDuration = duration;
+    playbackDataPtr->tempo.rampFrom = playbackDataPtr->tempo.multiplier;
+    playbackDataPtr->tempo.rampTo = multiplier;
+    playbackDataPtr->tempo.isRamping = true;
+}
+
+
+//**** Public
+void playbackEngine_setClockPorts(midiPlaybackRuntimeData_t * playbackDataPtr, uint8_t clockPorts)
+{
+    // Ports to act as midi clock master on, one bit each. Clock is 24 per
+    // quater-note from the song's tempo map (and the tempo multiplier),
+    // with start, stop, continue and song position pointer to match. It
+    // takes effect from the next start or seek.
+    playbackDataPtr->clockPorts = clockPorts & (uint8_t)((1 << MIDI_OUTPUT_NUM_PORTS) - 1);
+}
+
+
+//**** Public
+void playbackEngine_setThru(midiPlaybackRuntimeData_t * playbackDataPtr, uint8_t inputPort, uint8_t thruPorts)
+{
+    // Forwards the channel messages arriving on 'inputPort' to each port
+    // in 'thruPorts' (bit n for port n), 0 turns its thru off. Takes
+    // effect straight away, whether or not anything is playing.
+    if(inputPort >= MIDI_OUTPUT_NUM_PORTS) return;
+
+    playbackDataPtr->inputs[inputPort].thruPorts = thruPorts & (uint8_t)((1 << MIDI_OUTPUT_NUM_PORTS) - 1);
+    updateInputPorts(playbackDataPtr);
+}
+
+
+//**** Public
+void playbackEngine_setInputTap(midiPlaybackRuntimeData_t * playbackDataPtr, uint8_t inputPort, spscRing_t * tap)
+{
+    // From now on every byte read from 'inputPort' is pushed to 'tap' as
+    // a midiInputByte_t, NULL removes it. The tap's consumer has to keep
+    // up, a full ring counts the bytes it had to turn away.
+    if(inputPort >= MIDI_OUTPUT_NUM_PORTS) return;
+
+    playbackDataPtr->inputs[inputPort].tap = tap;
+    updateInputPorts(playbackDataPtr);
+}
+
+
+//**** Public
+void playbackEngine_setLivePorts(midiPlaybackRuntimeData_t * playbackDataPtr, uint8_t livePorts)
+{
+    // Live events only play on these ports (bit n for port n). Once one
+    // plays on a port, playback keeps it as clear as it does for thru for
+    // PLAYBACK_LIVE_HOLD_US - so while the client is playing, a live event
+    // waits for no more than the message going out. Until then the port
+    // is written as far ahead as any other. 0 ignores live events.
+    playbackDataPtr->livePorts = livePorts & (uint8_t)((1 << MIDI_OUTPUT_NUM_PORTS) - 1);
+    updateInputPorts(playbackDataPtr);
+}
+
+
+//**** Public
+uint8_t playbackEngine_queueLiveEvent(midiPlaybackRuntimeData_t * playbackDataPtr, uint64_t writeTime, uint8_t ports, const uint8_t * data, uint32_t length)
+{
+    // Producer side of the live queue, needs no lock (see the header) but
+    // only one caller at a time. 'data' is whole channel messages, to go
+    // out on 'ports' at their next message boundary. The caller then has
+    // the engine serviced, its latency counts from 'writeTime'.
+    playbackLiveEvent_t event;
+
+    if((length == 0) || (length > PLAYBACK_LIVE_EVENT_MAX_BYTES)) return 1;
+
+    event.writeTime = writeTime;
+    event.ports = ports;
+    event.length = (uint8_t)length;
+    memcpy(event.data, data, length);
+    if(!spscRing_push(&playbackDataPtr->liveQueue, &event)) return 1; //Full, counted by the ring
+
+    //** SUCCESS **//
+    return 0;
+}
+
+
+//**** Public
+uint32_t playbackEngine_readInput(midiPlaybackRuntimeData_t * playbackDataPtr)
+{
+    // Reads everything the enabled midi ins have received. Each byte is
+    // handed to the input's tap as it is, and parsed for thru. Returns the
+    // number of whole messages queued for thru, the caller only has to
+    // have the engine serviced when there are some.
+    playbackInput_t * input;
+    uint32_t numBytes;
+    uint32_t numMessages = 0;
+
+    for (uint8_t a = 0; a < MIDI_OUTPUT_NUM_PORTS; a++)
+    {
+        if (!(playbackDataPtr->inputPorts & (1 << a))) continue;
+        input = &playbackDataPtr->inputs[a];
+
+        do
+        {
+            numBytes = readMidiIn(a, playbackDataPtr->inputBytes, PLAYBACK_INPUT_READ_BYTES);
+            for (uint32_t i = 0; i < numBytes; i++)
+            {
+                if (input->tap != NULL) spscRing_push(input->tap, &playbackDataPtr->inputBytes[i]);
+                if ((input->thruPorts != 0) && parseInput(playbackDataPtr, input, playbackDataPtr->inputBytes[i].byte, playbackDataPtr->inputBytes[i].time + MIDI_UART_US_PER_BYTE)) numMessages++;
+            }
+        } while (numBytes == PLAYBACK_INPUT_READ_BYTES);
+    }
+
+    return numMessages;
+}
+
+
+//**** Public
+void playbackEngine_service(midiPlaybackRuntimeData_t * playbackDataPtr)
+{
+    // Runs each time the delta timer fires. All decoding was done by
+    // the compile stage, playback happens in two stages from here:
+    //
+    // RENDER   - events due within the look-ahead window are encoded
+    //            (running status applied) into the output queue, each with
+    //            the time its first byte should start on the wire. A byte
+    //            takes 320uS at 31250 baud, so events too close together to
+    //            all start on time are planned as a group: some go early,
+    //            some late, so the error is shared rather than piling up on
+    //            the last note of a chord. Whatever error is left is counted
+    //            as unavoidable.
+    // TRANSMIT - queued events whose send time has come are gathered into
+    //            one uart write. While the wire is still busy with earlier
+    //            bytes, later events can be written ahead of time and still
+    //            start exactly when planned, since the modelled line tells
+    //            us when the uart will get to them.
+    //
+    // Every time is absolute (song start + tempo map time) against a
+    // free-running timer, so time spent here or waking the task is
+    // measured as lateness but never carried into the next event. Nothing
+    // here formats text, each event only costs a 16 byte trace record.
+    //
+    // Live events are read first, so they (and midi thru, already queued
+    // by playbackEngine_readInput) can go out ahead of whatever playback
+    // has queued. Stopped, that is all there is to do.
+    playbackTimingStats_t * stats = &playbackDataPtr->timingStats;
+    uint64_t now = getDeltaTimerNow();
+    uint64_t wakeTime;
+    uint64_t clockWakeTime;
+
+    if (!playbackDataPtr->isPlayingBack && (playbackDataPtr->inputPorts == 0) && (playbackDataPtr->livePorts == 0)) return;
+
+    while (1)
+    {
+        receiveLiveEvents(playbackDataPtr);
+        if (playbackDataPtr->isPlayingBack) updateTempoRamp(playbackDataPtr, now);
+        transmitOutput(playbackDataPtr, now);
+
+        if (playbackDataPtr->isPlayingBack)
+        {
+            renderOutput(playbackDataPtr, now);
+
+            if (isOutputEmpty(playbackDataPtr) && isSongFinished(playbackDataPtr))
+            {
+                //Everything has been written
+                systemTrace_record(traceEvent_endOfTrack, (uint32_t)now, (int32_t)stats->maxLateness, stats->numLateEvents, NULL, 0);
+                sendClockCommand(playbackDataPtr, 0xFC);
+                playbackDataPtr->isPlayingBack = false;
+                playbackDataPtr->nextEventIndex = 0;
+            }
+        }
+
+        wakeTime = getNextWakeTime(playbackDataPtr, now);
+        if (playbackDataPtr->isPlayingBack && playbackDataPtr->tempo.isRamping && (wakeTime > (now + PLAYBACK_TEMPO_RAMP_STEP_US))) wakeTime = now + PLAYBACK_TEMPO_RAMP_STEP_US;
+        clockWakeTime = getClockWakeTime(playbackDataPtr);
+        if (clockWakeTime < wakeTime) wakeTime = clockWakeTime;
+        if (wakeTime == UINT64_MAX) return; //Nothing to do until more input
+
+        if (wakeTime > (now + DEADLINE_MIN_LEAD_US))
+        {
+            setDeltaTimerDeadline(wakeTime);
+
+            // If the time slipped past while arming, the
+            // alarm may never fire - so just keep going instead
+            now = getDeltaTimerNow();
+            if (wakeTime > now) return;
+        }
+        else
+        {
+            now = getDeltaTimerNow();
+        }
+    }
+}
+
+
+//**** Private
+static void renderOutput(midiPlaybackRuntimeData_t * playbackDataPtr, uint64_t now)
+{
+    const uint64_t horizon = now + playbackDataPtr->lookAheadWindow + DEADLINE_MIN_LEAD_US;
+
+    while (hasNextEvent(playbackDataPtr) && (getNextDeadline(playbackDataPtr) <= horizon))
+    {
+        if (!renderCluster(playbackDataPtr, now)) break; //The next event's port has a full queue
+    }
+}
+
+
+//**** Private
+static bool renderCluster(midiPlaybackRuntimeData_t * playbackDataPtr, uint64_t now)
+{
+    // A cluster is a run of events that would collide on the wire, each
+    // one due before the previous has finished sending. Starting everything
+    // as soon as possible (forward pass) makes all of the error lateness,
+    // finishing everything on time (backward pass) makes it all earliness.
+    // Planning halfway between the two halves the worst case error, and is
+    // still a valid plan because both passes keep the events in sequence.
+    // Earliness is limited by the look-ahead window (nothing is planned
+    // before 'now'), with a window of 0 this is just the forward pass.
+    //
+    // Events only collide with others on the same port, so each pass runs
+    // per port. The cluster carries on while any of its ports is busy.
+    // SysEx packets are queued apart (see transmitSysEx) and never take
+    // part in the plan. Returns false if nothing could be rendered (the
+    // port is full).
+    playbackTimingStats_t * stats = &playbackDataPtr->timingStats;
+    midiCompiledEvent_t event;
+    playbackPort_t * port;
+    playbackOutputItem_t * item;
+    const playbackOutputItem_t * lastQueued;
+    uint8_t itemPorts[PLAYBACK_OUTPUT_QUEUE_LENGTH * MIDI_OUTPUT_NUM_PORTS];
+    uint32_t slots[MIDI_OUTPUT_NUM_PORTS];       //First slot rendered into on each port
+    uint32_t cursors[MIDI_OUTPUT_NUM_PORTS];
+    int64_t lineEnd[MIDI_OUTPUT_NUM_PORTS];
+    int64_t earliest[MIDI_OUTPUT_NUM_PORTS];
+    int64_t latestStart[MIDI_OUTPUT_NUM_PORTS];
+    int64_t clusterEnd = 0;
+    int64_t deadline;
+    uint32_t numItems = 0;
+    uint32_t numSysEx = 0;
+    uint32_t error;
+
+    // Where each wire will be once everything already queued is sent
+    for (uint8_t a = 0; a < MIDI_OUTPUT_NUM_PORTS; a++)
+    {
+        port = &playbackDataPtr->ports[a];
+        lastQueued = &port->outputQueue[(port->outputQueueHead - 1) & OUTPUT_QUEUE_MASK];
+        if (port->outputQueueHead != port->outputQueueTail) lineEnd[a] = lastQueued->sendTime + ((uint64_t)lastQueued->length * MIDI_UART_US_PER_BYTE);
+        else lineEnd[a] = getLineEnd(port, now);
+        earliest[a] = lineEnd[a];
+        slots[a] = port->outputQueueHead;
+    }
+
+    //** Forward pass **//
+    deadline = getNextDeadline(playbackDataPtr);
+    do
+    {
+        getNextEvent(playbackDataPtr, &event);
+        port = &playbackDataPtr->ports[event.port];
+
+        if (MIDI_IS_SYSEX_STATUS(event.data[0]))
+        {
+            if (!queueSysEx(playbackDataPtr, &event, deadline)) break;
+            numSysEx++;
+        }
+        else
+        {
+            if ((port->outputQueueHead - port->outputQueueTail) >= PLAYBACK_OUTPUT_QUEUE_LENGTH) break;
+
+            item = &port->outputQueue[port->outputQueueHead & OUTPUT_QUEUE_MASK];
+            midiOutput_trackNote(&port->renderedNotes, event.data[0], event.data[1], event.data[2]);
+
+            item->status = event.data[0];
+            item->isHeld = false;
+            item->length = midiOutput_encodeMessage(&port->outputPort, event.data, event.length, item->data);
+            item->runningStatus = port->outputPort.runningStatus;
+            item->deadline = deadline;
+            item->sendTime = (deadline > lineEnd[event.port]) ? deadline : lineEnd[event.port];
+            lineEnd[event.port] = item->sendTime + ((uint64_t)item->length * MIDI_UART_US_PER_BYTE);
+            if (lineEnd[event.port] > clusterEnd) clusterEnd = lineEnd[event.port];
+            itemPorts[numItems++] = event.port;
+
+            port->outputQueueHead++;
+        }
+
+        advanceToNextEvent(playbackDataPtr);
+
+        if (!hasNextEvent(playbackDataPtr)) break;
+        deadline = getNextDeadline(playbackDataPtr);
+    } while (deadline < clusterEnd);
+
+    //** Backward pass, averaged into the forward plan **//
+    if ((numItems > 1) && (playbackDataPtr->lookAheadWindow > 0))
+    {
+        for (uint8_t a = 0; a < MIDI_OUTPUT_NUM_PORTS; a++)
+        {
+            cursors[a] = playbackDataPtr->ports[a].outputQueueHead;
+            latestStart[a] = INT64_MAX; //Nothing later on this port yet
+        }
+
+        for (uint32_t i = numItems; i-- > 0;)
+        {
+            port = &playbackDataPtr->ports[itemPorts[i]];
+            item = &port->outputQueue[--cursors[itemPorts[i]] & OUTPUT_QUEUE_MASK];
+            if (latestStart[itemPorts[i]] != INT64_MAX) latestStart[itemPorts[i]] -= (int64_t)item->length * MIDI_UART_US_PER_BYTE;
+            if ((int64_t)item->deadline < latestStart[itemPorts[i]]) latestStart[itemPorts[i]] = item->deadline;
+            item->sendTime = ((int64_t)item->sendTime + latestStart[itemPorts[i]]) / 2;
+        }
+    }
+
+    // Halfway can land before what is already queued (or before now
+    // when the window is short), so push forward again where needed.
+    // Whatever error is left is unavoidable.
+    for (uint32_t i = 0; i < numItems; i++)
+    {
+        port = &playbackDataPtr->ports[itemPorts[i]];
+        item = &port->outputQueue[slots[itemPorts[i]]++ & OUTPUT_QUEUE_MASK];
+        if ((int64_t)item->sendTime < earliest[itemPorts[i]]) item->sendTime = earliest[itemPorts[i]];
+        earliest[itemPorts[i]] = item->sendTime + ((uint64_t)item->length * MIDI_UART_US_PER_BYTE);
+
+        if (item->sendTime == item->deadline) continue;
+
+        stats->numCompensatedEvents++;
+        if ((int64_t)(item->sendTime - item->deadline) < 0)
+        {
+            error = (uint32_t)(item->deadline - item->sendTime);
+            if (error > stats->maxUnavoidableEarly) stats->maxUnavoidableEarly = error;
+        }
+        else
+        {
+            error = (uint32_t)(item->sendTime - item->deadline);
+            if (error > stats->maxUnavoidableLate) stats->maxUnavoidableLate = error;
+        }
+        stats->totalUnavoidableError += error;
+    }
+
+    return (numItems + numSysEx) > 0;
+}
+
+
+//**** Private
+static void transmitOutput(midiPlaybackRuntimeData_t * playbackDataPtr, uint64_t now)
+{
+    // Writes every queued event whose first byte should be on the wire
+    // by now, or that can be handed over early because the wire will
+    // still be busy with earlier bytes until its send time. Stops short of
+    // overfilling the uart tx ring so the write never blocks. Each port
+    // has a uart of its own, so they are written one after the other.
+    // Events come first, then any sysex that fits in around them. Clock
+    // goes ahead of both: nothing is written that would still be on the
+    // wire when the next clock is due, a message that would is split
+    // around it (realtime bytes may go between the bytes of a message).
+    // A port carrying midi thru, or recently live events, only gets
+    // PLAYBACK_THRU_LINE_AHEAD_US ahead of its wire, so live input never
+    // waits behind more than the event going out - even when playback has
+    // the wire saturated. Live input only goes ahead of a due event by
+    // PLAYBACK_THRU_MAX_AHEAD_BYTES, then the event goes first, so the
+    // song isn't held back for as long as the input keeps coming.
+    playbackTimingStats_t * stats = &playbackDataPtr->timingStats;
+    const uint64_t bufferLimit = now + DEADLINE_MIN_LEAD_US + ((uint64_t)MIDI_UART_TX_BUFFER_BYTES * MIDI_UART_US_PER_BYTE);
+    playbackOutputItem_t * item;
+    playbackPort_t * port;
+    uint8_t burst[PLAYBACK_BURST_MAX_BYTES];
+    uint32_t burstLength;
+    uint64_t lineEnd;
+    uint32_t lateness;
+    uint32_t numBytes;
+    uint32_t room;
+
+    for (uint8_t a = 0; a < MIDI_OUTPUT_NUM_PORTS; a++)
+    {
+        port = &playbackDataPtr->ports[a];
+        burstLength = 0;
+        lineEnd = getLineEnd(port, now);
+
+        transmitClock(playbackDataPtr, a, burst, &burstLength, &lineEnd);
+        transmitThru(playbackDataPtr, a, now, burst, &burstLength, &lineEnd);
+
+        while (port->outputQueueHead != port->outputQueueTail)
+        {
+            item = &port->outputQueue[port->outputQueueTail & OUTPUT_QUEUE_MASK];
+
+            if (port->itemSent == 0) //Otherwise the rest of it goes as soon as the clock is out
+            {
+                if (item->sendTime > (lineEnd + DEADLINE_MIN_LEAD_US)) break; //Not yet
+                if (port->isSysExOpen) //Its status byte would end the message
+                {
+                    item->isHeld = true;
+                    break;
+                }
+                if ((port->thruQueueHead != port->thruQueueTail) && !isThruAllowanceSpent(port, lineEnd)) break; //Live input goes first, it is waiting on the clock or the uart
+                if (isKeptClear(playbackDataPtr, a, now) && (lineEnd > (now + DEADLINE_MIN_LEAD_US + PLAYBACK_THRU_LINE_AHEAD_US))) break;
+            }
+
+            numBytes = item->length - port->itemSent;
+            if ((lineEnd + ((uint64_t)numBytes * MIDI_UART_US_PER_BYTE)) > bufferLimit) break; //Uart tx ring full
+            room = getBytesBeforeClock(playbackDataPtr, a, lineEnd);
+            if (numBytes > room) numBytes = room;
+            if (numBytes == 0) break; //Waits for the clock
+
+            if ((burstLength + numBytes) > PLAYBACK_BURST_MAX_BYTES)
+            {
+                writeMidiOut(a, burst, burstLength);
+                burstLength = 0;
+            }
+
+            if (port->itemSent == 0)
+            {
+                if (port->thruQueueHead != port->thruQueueTail)
+                {
+                    if (port->thruQueue[port->thruQueueTail & THRU_QUEUE_MASK].isLive) playbackDataPtr->liveStats.numYielded++;
+                    else playbackDataPtr->thruStats.numYielded++;
+                }
+                port->thruAheadBytes = 0;
+
+                if (lineEnd > item->sendTime)
+                {
+                    lateness = (uint32_t)(lineEnd - item->sendTime);
+                    stats->numLateEvents++;
+                    stats->totalLateness += lateness;
+                    if (lateness > stats->maxLateness) stats->maxLateness = lateness;
+                    if (item->isHeld) stats->numHeldEvents++;
+                }
+                if (numBytes < item->length) playbackDataPtr->clockStats.numSplitMessages++;
+
+                // Trace lateness is against the event's deadline, so includes the planned error
+                systemTrace_record(traceEvent_midiOut, (uint32_t)now, (int32_t)(lineEnd - item->deadline), item->length, item->data, item->length);
+
+                // Note messages are 2 or 3 bytes, the note and velocity are always last
+                if (item->length >= 2) midiOutput_trackNote(&port->soundingNotes, item->status, item->data[item->length - 2], item->data[item->length - 1]);
+            }
+
+            memcpy(&burst[burstLength], &item->data[port->itemSent], numBytes);
+            burstLength += numBytes;
+            lineEnd += (uint64_t)numBytes * MIDI_UART_US_PER_BYTE;
+            port->itemSent += numBytes;
+            if (port->itemSent == item->length)
+            {
+                port->itemSent = 0;
+                port->outputQueueTail++;
+            }
+
+            transmitClock(playbackDataPtr, a, burst, &burstLength, &lineEnd);
+            transmitThru(playbackDataPtr, a, now, burst, &burstLength, &lineEnd);
+        }
+
+        transmitSysEx(playbackDataPtr, a, now, burst, &burstLength, &lineEnd);
+
+        if (burstLength)
+        {
+            writeMidiOut(a, burst, burstLength);
+            port->lineFreeTime = lineEnd;
+        }
+    }
+}
+
+
+//**** Private
+static bool queueSysEx(midiPlaybackRuntimeData_t * playbackDataPtr, const midiCompiledEvent_t * event, uint64_t deadline)
+{
+    // Render side, the packet waits in the port's sysex queue until
+    // transmitSysEx finds it room. Returns false if the queue is full.
+    playbackPort_t * port = &playbackDataPtr->ports[event->port];
+    playbackSysExItem_t * item;
+    uint32_t numPending;
+
+    if ((port->sysExQueueHead - port->sysExQueueTail) >= PLAYBACK_SYSEX_QUEUE_LENGTH) return false;
+
+    item = &port->sysExQueue[port->sysExQueueHead & SYSEX_QUEUE_MASK];
+    item->deadline = deadline;
+    item->index = (uint32_t)event->data[1] | ((uint32_t)event->data[2] << 8);
+    item->hasStartByte = (event->data[0] == 0xF0);
+    item->isContinuation = playbackDataPtr->song.sysEx[item->index].isContinuation;
+    item->length = playbackDataPtr->song.sysEx[item->index].length + (item->hasStartByte ? 1 : 0);
+
+    port->sysExPendingBytes += item->length;
+    port->sysExQueueHead++;
+
+    numPending = playbackEngine_getPendingSysExBytes(playbackDataPtr);
+    if (numPending > playbackDataPtr->sysExStats.maxPendingBytes) playbackDataPtr->sysExStats.maxPendingBytes = numPending;
+
+    return true;
+}
+
+
+//**** Private
+static void transmitSysEx(midiPlaybackRuntimeData_t * playbackDataPtr, uint8_t port, uint64_t now, uint8_t * burst, uint32_t * burstLength, uint64_t * lineEnd)
+{
+    // A sysex message can't be broken up by anything but realtime bytes,
+    // so a dump of a few KB would hold the port's notes for over a second.
+    // To keep the notes on time a message is only started in a gap long
+    // enough for its packet to finish before the port's next event, unless
+    // it has been waiting PLAYBACK_SYSEX_MAX_DEFER_US already - then it goes
+    // once no event is due, and holds the events after it no longer than
+    // its own packets take on the wire (see canStartSysEx). Once started
+    // it is written in slices, as much as the uart tx ring has room for,
+    // so the task never blocks and other ports carry on meanwhile.
+    playbackSysExStats_t * stats = &playbackDataPtr->sysExStats;
+    playbackPort_t * output = &playbackDataPtr->ports[port];
+    const uint64_t bufferLimit = now + DEADLINE_MIN_LEAD_US + ((uint64_t)MIDI_UART_TX_BUFFER_BYTES * MIDI_UART_US_PER_BYTE);
+    const playbackSysExItem_t * item;
+    const uint8_t * payload;
+    uint32_t numBytes;
+    uint32_t room;
+    bool isForced;
+
+    while (output->sysExQueueHead != output->sysExQueueTail)
+    {
+        item = &output->sysExQueue[output->sysExQueueTail & SYSEX_QUEUE_MASK];
+
+        // After a seek or loop wrap into the middle of a message
+        // the rest of it would just be stray data bytes
+        if (item->isContinuation && !output->isSysExOpen && (output->sysExSent == 0))
+        {
+            output->sysExPendingBytes -= item->length;
+            output->sysExQueueTail++;
+            stats->numSkipped++;
+            continue;
+        }
+
+        if (!canStartSysEx(playbackDataPtr, port, now, *lineEnd, &isForced)) return;
+
+        room = (*lineEnd < bufferLimit) ? (uint32_t)((bufferLimit - *lineEnd) / MIDI_UART_US_PER_BYTE) : 0;
+        numBytes = item->length - output->sysExSent;
+        if (numBytes > PLAYBACK_SYSEX_SLICE_BYTES) numBytes = PLAYBACK_SYSEX_SLICE_BYTES;
+        if (numBytes > room) return; //Uart tx ring full, carries on as it drains
+        room = getBytesBeforeClock(playbackDataPtr, port, *lineEnd);
+        if (numBytes > room) numBytes = room;
+        if (numBytes == 0) return; //Carries on after the clock
+
+        if ((*burstLength + numBytes) > PLAYBACK_BURST_MAX_BYTES)
+        {
+            writeMidiOut(port, burst, *burstLength);
+            *burstLength = 0;
+        }
+
+        if (output->sysExSent == 0)
+        {
+            if (isForced) stats->numForcedStarts++;
+            restoreRunningStatus(output);
+        }
+
+        // The payload is read straight out of the upload buffer
+        payload = playbackDataPtr->playbackDataBASE + playbackDataPtr->song.sysEx[item->index].dataOffset;
+        for (uint32_t a = 0; a < numBytes; a++, output->sysExSent++)
+        {
+            if (item->hasStartByte) burst[*burstLength] = (output->sysExSent == 0) ? 0xF0 : payload[output->sysExSent - 1];
+            else burst[*burstLength] = payload[output->sysExSent];
+
+            if (burst[*burstLength] == 0xF0) output->isSysExOpen = true;
+            else if (burst[*burstLength] == 0xF7) output->isSysExOpen = false;
+            (*burstLength)++;
+        }
+
+        *lineEnd += (uint64_t)numBytes * MIDI_UART_US_PER_BYTE;
+        output->sysExPendingBytes -= numBytes;
+        stats->numBytes += numBytes;
+
+        if (output->sysExSent == item->length)
+        {
+            output->sysExSent = 0;
+            output->sysExQueueTail++;
+            stats->numPackets++;
+        }
+
+        transmitClock(playbackDataPtr, port, burst, burstLength, lineEnd);
+    }
+
+    // A song that never ends its last message would hold the port for good
+    if (output->isSysExOpen && isSongFinished(playbackDataPtr) && (*burstLength < PLAYBACK_BURST_MAX_BYTES))
+    {
+        burst[(*burstLength)++] = 0xF7;
+        *lineEnd += MIDI_UART_US_PER_BYTE;
+        output->isSysExOpen = false;
+        stats->numAborted++;
+    }
+}
+
+
+//**** Private
+static bool canStartSysEx(midiPlaybackRuntimeData_t * playbackDataPtr, uint8_t port, uint64_t now, uint64_t lineEnd, bool * isForced)
+{
+    // Whether the packet at the head of the port's sysex queue may go out
+    // from 'lineEnd'. The rest of a packet, or the next packet of a message
+    // already under way, goes as soon as it is queued, ahead of its own
+    // time - the port's events are waiting on it, and can't go until the
+    // message has ended. A message that has waited too long to find a gap
+    // is forced out, but never ahead of an event already due, so the
+    // events only wait out the message itself. 'isForced' is set when
+    // there was no gap for it.
+    const playbackPort_t * output = &playbackDataPtr->ports[port];
+    const playbackSysExItem_t * item = &output->sysExQueue[output->sysExQueueTail & SYSEX_QUEUE_MASK];
+    uint64_t nextEventTime;
+
+    *isForced = false;
+    if (item->isContinuation && !output->isSysExOpen) return true; //Its message never started, skipped
+    if ((output->itemSent != 0) || (output->thruSent != 0)) return false; //A message is split around a clock
+    if (output->isSysExOpen || (output->sysExSent != 0)) return true;
+    if (item->deadline > (lineEnd + DEADLINE_MIN_LEAD_US)) return false; //Not due yet
+    if (output->thruQueueHead != output->thruQueueTail) return false; //Live input goes first
+
+    nextEventTime = getSysExNextEventTime(playbackDataPtr, port);
+    if (nextEventTime == UINT64_MAX) return true;
+
+    if ((lineEnd + ((uint64_t)item->length * MIDI_UART_US_PER_BYTE)) <= nextEventTime) return true;
+    if (nextEventTime <= (lineEnd + DEADLINE_MIN_LEAD_US)) return false; //Goes first, even ahead of a message that has waited too long
+
+    *isForced = ((item->deadline + PLAYBACK_SYSEX_MAX_DEFER_US) <= now);
+    return *isForced;
+}
+
+
+//**** Private
+static uint64_t getSysExWakeTime(midiPlaybackRuntimeData_t * playbackDataPtr, uint8_t port, uint64_t now)
+{
+    // When transmitSysEx next has something to do on the port, UINT64_MAX
+    // if nothing is queued. A packet waiting for a gap is woken by the
+    // port's events as they go, or else when it has waited long enough.
+    const playbackPort_t * output = &playbackDataPtr->ports[port];
+    const playbackSysExItem_t * item = &output->sysExQueue[output->sysExQueueTail & SYSEX_QUEUE_MASK];
+    const uint64_t lineEnd = getLineEnd(output, now);
+    uint64_t roomTime;
+    uint32_t numBytes;
+    bool isForced;
+
+    if (output->sysExQueueHead == output->sysExQueueTail) return UINT64_MAX;
+    if (!canStartSysEx(playbackDataPtr, port, now, lineEnd, &isForced))
+    {
+        if (item->deadline > (lineEnd + DEADLINE_MIN_LEAD_US)) return item->deadline - DEADLINE_MIN_LEAD_US;
+        if (getSysExNextEventTime(playbackDataPtr, port) <= (lineEnd + DEADLINE_MIN_LEAD_US)) return UINT64_MAX; //Woken with the event, it goes first
+        return item->deadline + PLAYBACK_SYSEX_MAX_DEFER_US;
+    }
+    if (item->isContinuation && !output->isSysExOpen && (output->sysExSent == 0)) return now;
+
+    // Once the uart tx ring has room for the next slice, and after the clock if it is in the way
+    numBytes = item->length - output->sysExSent;
+    if (numBytes > PLAYBACK_SYSEX_SLICE_BYTES) numBytes = PLAYBACK_SYSEX_SLICE_BYTES;
+    roomTime = lineEnd + ((uint64_t)numBytes * MIDI_UART_US_PER_BYTE);
+    roomTime = (roomTime > ((uint64_t)MIDI_UART_TX_BUFFER_BYTES * MIDI_UART_US_PER_BYTE)) ? (roomTime - ((uint64_t)MIDI_UART_TX_BUFFER_BYTES * MIDI_UART_US_PER_BYTE)) : 0;
+    if ((getBytesBeforeClock(playbackDataPtr, port, lineEnd) == 0) && (getClockDueTime(playbackDataPtr, port) > roomTime)) roomTime = getClockDueTime(playbackDataPtr, port);
+    return roomTime;
+}
+
+
+//**** Private
+static uint64_t getSysExNextEventTime(midiPlaybackRuntimeData_t * playbackDataPtr, uint8_t port)
+{
+    // The next event a sysex message on the port has to fit in front of:
+    // the port's own if one is rendered, otherwise the next event of the
+    // song (on whichever port, it costs nothing to assume). UINT64_MAX
+    // once there are none left.
+    const playbackPort_t * output = &playbackDataPtr->ports[port];
+
+    if (output->outputQueueHead != output->outputQueueTail) return output->outputQueue[output->outputQueueTail & OUTPUT_QUEUE_MASK].sendTime;
+    if (hasNextEvent(playbackDataPtr)) return getNextDeadline(playbackDataPtr);
+    return UINT64_MAX;
+}
+
+
+//**** Private
+static void restoreRunningStatus(playbackPort_t * port)
+{
+    // SysEx cancels running status, but the port's queued events were
+    // encoded expecting it. Only the first of them can be relying on a
+    // status byte from before, the rest follow on from that one.
+    playbackOutputItem_t * item;
+
+    if (port->outputQueueHead == port->outputQueueTail)
+    {
+        midiOutput_resetRunningStatus(&port->outputPort);
+        return;
+    }
+
+    item = &port->outputQueue[port->outputQueueTail & OUTPUT_QUEUE_MASK];
+    if (item->data[0] & 0x80) return;
+
+    memmove(&item->data[1], &item->data[0], item->length);
+    item->data[0] = item->runningStatus;
+    item->length++;
+}
+
+
+//**** Private
+static void transmitClock(midiPlaybackRuntimeData_t * playbackDataPtr, uint8_t port, uint8_t * burst, uint32_t * burstLength, uint64_t * lineEnd)
+{
+    // Writes the port's clock bytes (and the song position after a loop
+    // wrap) that are due by the time the wire gets to them. Everything else
+    // keeps clear of the next clock, so the wire is idle when it falls due
+    // and it starts on time. A single byte is allowed past the uart tx ring
+    // limit, the write can only block for the rest of one byte.
+    playbackClockStats_t * stats = &playbackDataPtr->clockStats;
+    playbackPort_t * output = &playbackDataPtr->ports[port];
+    uint64_t deadline;
+    uint32_t songPosition;
+
+    while ((deadline = getClockDueTime(playbackDataPtr, port)) <= (*lineEnd + DEADLINE_MIN_LEAD_US))
+    {
+        if ((*burstLength + 5) > PLAYBACK_BURST_MAX_BYTES)
+        {
+            writeMidiOut(port, burst, *burstLength);
+            *burstLength = 0;
+        }
+
+        if (output->positionSongTime != UINT64_MAX)
+        {
+            // Stop, song position and continue, the clock at that
+            // position follows. Song position is system common so
+            // cancels running status.
+            songPosition = output->nextClock / PLAYBACK_CLOCKS_PER_POSITION;
+            burst[(*burstLength)++] = 0xFC;
+            burst[(*burstLength)++] = 0xF2;
+            burst[(*burstLength)++] = (uint8_t)(songPosition & 0x7F);
+            burst[(*burstLength)++] = (uint8_t)(songPosition >> 7);
+            burst[(*burstLength)++] = 0xFB;
+            *lineEnd += 5 * MIDI_UART_US_PER_BYTE;
+            restoreRunningStatus(output);
+            output->positionSongTime = UINT64_MAX;
+            stats->numPositions++;
+            continue;
+        }
+
+        if (*lineEnd > deadline)
+        {
+            stats->numLateClocks++;
+            if ((*lineEnd - deadline) > stats->maxClockLateness) stats->maxClockLateness = (uint32_t)(*lineEnd - deadline);
+        }
+
+        burst[(*burstLength)++] = 0xF8;
+        *lineEnd += MIDI_UART_US_PER_BYTE;
+        stats->numClocks++;
+        advanceClock(playbackDataPtr, port);
+    }
+}
+
+
+//**** Private
+static uint64_t getClockDueTime(midiPlaybackRuntimeData_t * playbackDataPtr, uint8_t port)
+{
+    // When the port's next clock byte (or song position) is due, UINT64_MAX
+    // if none is. The song position can't go in the middle of a message,
+    // until it has gone neither can the clock after it.
+    const playbackPort_t * output = &playbackDataPtr->ports[port];
+    const uint64_t loopLength = playbackDataPtr->loopEndTime - playbackDataPtr->loopStartTime;
+    uint64_t songTime = output->clockSongTime;
+
+    if ((songTime == UINT64_MAX) || !playbackDataPtr->isPlayingBack) return UINT64_MAX;
+
+    if (output->positionSongTime != UINT64_MAX)
+    {
+        if ((output->itemSent != 0) || (output->thruSent != 0) || output->isSysExOpen) return UINT64_MAX;
+        songTime = output->positionSongTime;
+    }
+
+    // Either side of a loop wrap from the events (unsigned wraparound
+    // gives the right answer when the clock has wrapped first)
+    return getSongDeadline(playbackDataPtr, songTime - ((uint64_t)(playbackDataPtr->loopCount - output->clockLoopCount) * loopLength));
+}
+
+
+//**** Private
+static uint32_t getBytesBeforeClock(midiPlaybackRuntimeData_t * playbackDataPtr, uint8_t port, uint64_t lineEnd)
+{
+    // How many bytes can be written from 'lineEnd' and be off the wire before the port's next clock
+    const uint64_t deadline = getClockDueTime(playbackDataPtr, port);
+
+    if (deadline == UINT64_MAX) return UINT32_MAX;
+    if ((deadline + DEADLINE_MIN_LEAD_US) <= lineEnd) return 0;
+    return (uint32_t)((deadline + DEADLINE_MIN_LEAD_US - lineEnd) / MIDI_UART_US_PER_BYTE);
+}
+
+
+//**** Private
+static uint64_t getClockWakeTime(midiPlaybackRuntimeData_t * playbackDataPtr)
+{
+    uint64_t wakeTime = UINT64_MAX;
+    uint64_t deadline;
+
+    for (uint8_t a = 0; a < MIDI_OUTPUT_NUM_PORTS; a++)
+    {
+        deadline = getClockDueTime(playbackDataPtr, a);
+        if (deadline < wakeTime) wakeTime = deadline;
+    }
+
+    return wakeTime;
+}
+
+
+//**** Private
+static void setClockPosition(midiPlaybackRuntimeData_t * playbackDataPtr, uint8_t port, uint32_t clock)
+{
+    playbackPort_t * output = &playbackDataPtr->ports[port];
+
+    output->nextClock = clock;
+    output->clockLoopCount = playbackDataPtr->loopCount;
+    output->positionSongTime = UINT64_MAX;
+    output->clockSongTime = isClockPort(playbackDataPtr, port) ? tempoMap_clockToMicroSeconds(&playbackDataPtr->tempoMap, clock) : UINT64_MAX;
+}
+
+
+//**** Private
+static void advanceClock(midiPlaybackRuntimeData_t * playbackDataPtr, uint8_t port)
+{
+    // Clock runs on in song time independently of the events. At the
+    // loop end it wraps on its own, to the first whole sixteenth in the
+    // loop, and slaves are moved there with a song position pointer
+    // (sent at the loop start time, which is when the loop end is reached).
+    playbackPort_t * output = &playbackDataPtr->ports[port];
+
+    output->nextClock++;
+    output->clockSongTime = tempoMap_clockToMicroSeconds(&playbackDataPtr->tempoMap, output->nextClock);
+
+    if ((output->clockSongTime >= playbackDataPtr->loopEndTime) && (playbackDataPtr->isLooping || (output->clockLoopCount != playbackDataPtr->loopCount)))
+    {
+        output->nextClock = findFirstClockAtTime(playbackDataPtr, playbackDataPtr->loopStartTime);
+        output->clockSongTime = tempoMap_clockToMicroSeconds(&playbackDataPtr->tempoMap, output->nextClock);
+        output->positionSongTime = playbackDataPtr->loopStartTime;
+        output->clockLoopCount++;
+    }
+}
+
+
+//**** Private
+static uint32_t findFirstClockAtTime(midiPlaybackRuntimeData_t * playbackDataPtr, uint64_t songTime)
+{
+    // First clock at a whole song position (sixteenth note) at or after 'songTime'
+    uint32_t low = 0;
+    uint32_t high = 1;
+    uint32_t mid;
+
+    while ((high < PLAYBACK_MAX_SONG_POSITION) && (tempoMap_clockToMicroSeconds(&playbackDataPtr->tempoMap, high * PLAYBACK_CLOCKS_PER_POSITION) < songTime)) high <<= 1;
+
+    while (low < high)
+    {
+        mid = (low + high) >> 1;
+        if (tempoMap_clockToMicroSeconds(&playbackDataPtr->tempoMap, mid * PLAYBACK_CLOCKS_PER_POSITION) < songTime) low = mid + 1;
+        else high = mid;
+    }
+
+    return low * PLAYBACK_CLOCKS_PER_POSITION;
+}
+
+
+//**** Private
+static bool isClockPort(midiPlaybackRuntimeData_t * playbackDataPtr, uint8_t port)
+{
+    // Clock needs the song's beat, so not while streaming or for SMPTE timed songs
+    if (!(playbackDataPtr->clockPorts & (1 << port))) return false;
+    if ((playbackDataPtr->stream != NULL) || (playbackDataPtr->song.events == NULL)) return false;
+    return !playbackDataPtr->tempoMap.isSmpte;
+}
+
+
+//**** Private
+static void sendClockCommand(midiPlaybackRuntimeData_t * playbackDataPtr, uint8_t command)
+{
+    // Start, stop or continue, straight out on every clock port. Realtime,
+    // so it can go whatever is already on the wire.
+    playbackPort_t * port;
+
+    for (uint8_t a = 0; a < MIDI_OUTPUT_NUM_PORTS; a++)
+    {
+        port = &playbackDataPtr->ports[a];
+        if (port->clockSongTime == UINT64_MAX) continue;
+
+        writeMidiOut(a, &command, 1);
+        port->lineFreeTime = getLineEnd(port, getDeltaTimerNow()) + MIDI_UART_US_PER_BYTE;
+    }
+}
+
+
+//**** Private
+static uint64_t getNextWakeTime(midiPlaybackRuntimeData_t * playbackDataPtr, uint64_t now)
+{
+    const playbackOutputItem_t * item;
+    const playbackPort_t * port;
+    uint64_t lineEnd = now;
+    uint64_t wakeTime = UINT64_MAX;
+    uint64_t portWakeTime;
+    uint64_t roomTime;
+    uint64_t deadline;
+
+    for (uint8_t a = 0; a < MIDI_OUTPUT_NUM_PORTS; a++)
+    {
+        port = &playbackDataPtr->ports[a];
+        if (getLineEnd(port, now) > lineEnd) lineEnd = getLineEnd(port, now);
+
+        portWakeTime = getSysExWakeTime(playbackDataPtr, a, now);
+        if (portWakeTime < wakeTime) wakeTime = portWakeTime;
+        portWakeTime = getThruWakeTime(playbackDataPtr, a, now);
+        if (portWakeTime < wakeTime) wakeTime = portWakeTime;
+
+        // Events held behind a sysex message are woken along with it
+        if ((port->outputQueueHead == port->outputQueueTail) || port->isSysExOpen) continue;
+
+        item = &port->outputQueue[port->outputQueueTail & OUTPUT_QUEUE_MASK];
+
+        // When the head is waiting on the uart rather than its send
+        // time, wake once enough of the tx ring has drained
+        roomTime = getLineEnd(port, now) + ((uint64_t)item->length * MIDI_UART_US_PER_BYTE);
+        roomTime = (roomTime > ((uint64_t)MIDI_UART_TX_BUFFER_BYTES * MIDI_UART_US_PER_BYTE)) ? (roomTime - ((uint64_t)MIDI_UART_TX_BUFFER_BYTES * MIDI_UART_US_PER_BYTE)) : 0;
+
+        if (item->sendTime <= (getLineEnd(port, now) + DEADLINE_MIN_LEAD_US)) portWakeTime = roomTime;
+        else portWakeTime = (item->sendTime > roomTime) ? item->sendTime : roomTime;
+
+        // Not even a byte of it fits before the clock
+        if ((getBytesBeforeClock(playbackDataPtr, a, getLineEnd(port, now)) == 0) && (getClockDueTime(playbackDataPtr, a) > portWakeTime)) portWakeTime = getClockDueTime(playbackDataPtr, a);
+
+        // Or the wire is too far ahead to leave room for midi thru
+        if (isKeptClear(playbackDataPtr, a, now) && (getLineEnd(port, now) > (portWakeTime + PLAYBACK_THRU_LINE_AHEAD_US))) portWakeTime = getLineEnd(port, now) - PLAYBACK_THRU_LINE_AHEAD_US;
+
+        if (portWakeTime < wakeTime) wakeTime = portWakeTime;
+    }
+
+    if ((wakeTime != UINT64_MAX) || !playbackDataPtr->isPlayingBack) return wakeTime;
+
+    // Nothing rendered, wake when the next event enters the window.
+    // An event with nothing near it is always planned at its deadline,
+    // so that (common) case skips the extra wake and renders on time.
+    // The busiest wire stands in for the event's own port, at worst
+    // that costs an extra wake. A stream that has run dry is retried shortly.
+    if (!hasNextEvent(playbackDataPtr)) return now + PLAYBACK_STREAM_RETRY_US;
+    deadline = getNextDeadline(playbackDataPtr);
+    if ((lineEnd <= deadline) && (getFollowingDeadline(playbackDataPtr) >= (deadline + (MIDI_COMPILED_EVENT_MAX_BYTES * MIDI_UART_US_PER_BYTE))))
+    {
+        return deadline;
+    }
+    return deadline - playbackDataPtr->lookAheadWindow;
+}
+
+
+//**** Private
+static uint64_t getEventDeadline(midiPlaybackRuntimeData_t * playbackDataPtr, uint32_t eventIndex)
+{
+    midiCompiledEvent_t event;
+
+    fetchEvent(playbackDataPtr, eventIndex, &event);
+    return getSongDeadline(playbackDataPtr, tempoMap_tickToMicroSeconds(&playbackDataPtr->tempoMap, event.absoluteTime));
+}
+
+
+//**** Private
+static uint64_t getSongDeadline(midiPlaybackRuntimeData_t * playbackDataPtr, uint64_t songTime)
+{
+    // Song time to delta timer count at the current tempo (see playbackTempo_t).
+    // At PLAYBACK_TEMPO_ONE this is exactly songStartTime + songTime.
+    const playbackTempo_t * tempo = &playbackDataPtr->tempo;
+
+    return playbackDataPtr->songStartTime + (uint64_t)tempo->anchor + (uint64_t)scaleTime((int64_t)songTime - tempo->anchor, PLAYBACK_TEMPO_ONE, tempo->multiplier);
+}
+
+
+//**** Private
+static void updateTempoRamp(midiPlaybackRuntimeData_t * playbackDataPtr, uint64_t now)
+{
+    // Song time covered since the ramp started is the integral of a
+    // straight line, from * t + (to - from) * t^2 / (2 * duration), all
+    // in 16.16. The t^2 term is split so it fits in 64 bits.
+    playbackTempo_t * tempo = &playbackDataPtr->tempo;
+    const int64_t duration = tempo->rampDuration;
+    const int64_t change = (int64_t)tempo->rampTo - (int64_t)tempo->rampFrom;
+    uint64_t elapsed;
+    int64_t product;
+    int64_t covered;
+    int64_t beyond = 0;             //Song time since the ramp ended, at the final multiplier
+    uint32_t multiplier;
+
+    if (!tempo->isRamping) return;
+
+    elapsed = now - tempo->rampStartTime;
+    if (elapsed >= (uint64_t)duration)
+    {
+        beyond = scaleTime((int64_t)(elapsed - (uint64_t)duration), tempo->rampTo, PLAYBACK_TEMPO_ONE);
+        elapsed = (uint64_t)duration;
+        tempo->isRamping = false;
+    }
+
+    product = change * (int64_t)elapsed;
+    multiplier = (uint32_t)((int64_t)tempo->rampFrom + (product / duration));
+    covered = ((int64_t)tempo->rampFrom * (int64_t)elapsed) + ((((product / duration) * (int64_t)elapsed) + (((product % duration) * (int64_t)elapsed) / duration)) / 2);
+
+    applyTempo(playbackDataPtr, now, multiplier, tempo->rampAnchor + (covered / PLAYBACK_TEMPO_ONE) + beyond);
+}
+
+
+//**** Private
+static void applyTempo(midiPlaybackRuntimeData_t * playbackDataPtr, uint64_t now, uint32_t multiplier, int64_t anchor)
+{
+    // Moves the anchor up to 'now', where the song has reached song time
+    // 'anchor', and switches to the new multiplier. Everything rendered
+    // but not yet due is re-timed from its position in song time, so
+    // cluster spacing and running status are kept.
+    playbackTempo_t * tempo = &playbackDataPtr->tempo;
+    const uint64_t anchorTime = playbackDataPtr->songStartTime + (uint64_t)tempo->anchor;
+    const uint32_t oldMultiplier = tempo->multiplier;
+    const int64_t elapsed = anchor - tempo->anchor; //Song time played since the old anchor
+    playbackOutputItem_t * item;
+    playbackPort_t * port;
+    uint64_t deadline;
+
+    tempo->multiplier = multiplier;
+    tempo->anchor = anchor;
+    playbackDataPtr->songStartTime = now - (uint64_t)tempo->anchor;
+
+    for (uint8_t a = 0; a < MIDI_OUTPUT_NUM_PORTS; a++)
+    {
+        port = &playbackDataPtr->ports[a];
+
+        for (uint32_t i = port->outputQueueTail; i != port->outputQueueHead; i++)
+        {
+            item = &port->outputQueue[i & OUTPUT_QUEUE_MASK];
+            deadline = now + (uint64_t)scaleTime(scaleTime((int64_t)(item->deadline - anchorTime), oldMultiplier, PLAYBACK_TEMPO_ONE) - elapsed, PLAYBACK_TEMPO_ONE, multiplier);
+            item->sendTime += deadline - item->deadline;
+            item->deadline = deadline;
+        }
+
+        for (uint32_t i = port->sysExQueueTail; i != port->sysExQueueHead; i++)
+        {
+            deadline = port->sysExQueue[i & SYSEX_QUEUE_MASK].deadline;
+            port->sysExQueue[i & SYSEX_QUEUE_MASK].deadline = now + (uint64_t)scaleTime(scaleTime((int64_t)(deadline - anchorTime), oldMultiplier, PLAYBACK_TEMPO_ONE) - elapsed, PLAYBACK_TEMPO_ONE, multiplier);
+        }
+    }
+
+    if (playbackDataPtr->numLoopReleases)
+    {
+        deadline = playbackDataPtr->loopReleaseTime;
+        playbackDataPtr->loopReleaseTime = now + (uint64_t)scaleTime(scaleTime((int64_t)(deadline - anchorTime), oldMultiplier, PLAYBACK_TEMPO_ONE) - elapsed, PLAYBACK_TEMPO_ONE, multiplier);
+    }
+}
+
+
+//**** Private
+static int64_t getSongTimeNow(midiPlaybackRuntimeData_t * playbackDataPtr, uint64_t now)
+{
+    // Song time (uS) reached at delta timer count 'now', negative during the look-ahead before song start
+    const playbackTempo_t * tempo = &playbackDataPtr->tempo;
+
+    return tempo->anchor + scaleTime((int64_t)(now - (playbackDataPtr->songStartTime + (uint64_t)tempo->anchor)), tempo->multiplier, PLAYBACK_TEMPO_ONE);
+}
+
+
+//**** Private
+static int64_t scaleTime(int64_t time, uint32_t multiply, uint32_t divide)
+{
+    // time * multiply / divide, for converting between song and real time
+    // with a 16.16 multiplier. Dividing by the multiplier itself (rather
+    // than multiplying by a rounded inverse) keeps long stretches at one
+    // tempo exact to the microsecond. Fine for a few days of song time.
+    return (time * (int64_t)multiply) / (int64_t)divide;
+}
+
+
+//**** Private
+static bool hasNextEvent(midiPlaybackRuntimeData_t * playbackDataPtr)
+{
+    if (playbackDataPtr->numLoopReleases) return true;
+    if (playbackDataPtr->stream != NULL) return playbackStream_peekEvent(playbackDataPtr->stream, 0) != NULL;
+    return playbackDataPtr->nextEventIndex < playbackDataPtr->song.numEvents;
+}
+
+
+//**** Private
+static bool isSongFinished(midiPlaybackRuntimeData_t * playbackDataPtr)
+{
+    if (playbackDataPtr->stream != NULL) return playbackStream_isFinished(playbackDataPtr->stream);
+    return playbackDataPtr->nextEventIndex >= playbackDataPtr->song.numEvents;
+}
+
+
+//**** Private
+static void getNextEvent(midiPlaybackRuntimeData_t * playbackDataPtr, midiCompiledEvent_t * event)
+{
+    // Only valid after hasNextEvent. The stream ring is already in internal ram
+    const playbackStreamEvent_t * streamEvent;
+
+    if (playbackDataPtr->numLoopReleases)
+    {
+        event->port = 0;
+        while (!midiOutput_getNoteOff(&playbackDataPtr->ports[event->port].loopReleases, event->data)) event->port++;
+        event->length = 3;
+        return;
+    }
+
+    if (playbackDataPtr->stream != NULL)
+    {
+        streamEvent = playbackStream_peekEvent(playbackDataPtr->stream, 0);
+        event->length = streamEvent->length;
+        event->port = streamEvent->port;
+        memcpy(event->data, streamEvent->data, MIDI_COMPILED_EVENT_MAX_BYTES);
+        return;
+    }
+
+    fetchEvent(playbackDataPtr, playbackDataPtr->nextEventIndex, event);
+}
+
+
+//**** Private
+static void fetchEvent(midiPlaybackRuntimeData_t * playbackDataPtr, uint32_t eventIndex, midiCompiledEvent_t * event)
+{
+    // Every read of the compiled song during playback comes through here
+    *event = playbackDataPtr->song.events[eventIndex];
+}
+
+
+//**** Private
+static uint64_t getNextDeadline(midiPlaybackRuntimeData_t * playbackDataPtr)
+{
+    // Only valid after hasNextEvent
+    if (playbackDataPtr->numLoopReleases) return playbackDataPtr->loopReleaseTime;
+    if (playbackDataPtr->stream != NULL) return getSongDeadline(playbackDataPtr, playbackStream_peekEvent(playbackDataPtr->stream, 0)->songTime);
+    return getEventDeadline(playbackDataPtr, playbackDataPtr->nextEventIndex);
+}
+
+
+//**** Private
+static void appendToBurst(midiPlaybackRuntimeData_t * playbackDataPtr, uint8_t port, uint8_t * burst, uint32_t * burstLength, const uint8_t * message, uint8_t length, uint64_t * lineEnd)
+{
+    // For output sent straight away rather than planned through the
+    // output queue, writes the burst out whenever the next message won't fit
+    if((*burstLength + length) > PLAYBACK_BURST_MAX_BYTES)
+    {
+        writeMidiOut(port, burst, *burstLength);
+        *burstLength = 0;
+    }
+
+    length = midiOutput_encodeMessage(&playbackDataPtr->ports[port].outputPort, message, length, &burst[*burstLength]);
+    *burstLength += length;
+    *lineEnd += (uint64_t)length * MIDI_UART_US_PER_BYTE;
+}
+
+
+//**** Private
+static void dropOutput(midiPlaybackRuntimeData_t * playbackDataPtr, uint8_t port, uint8_t * burst, uint32_t * burstLength, uint64_t * lineEnd)
+{
+    // Throws away the port's rendered but unsent output (sysex included)
+    // and appends note-offs for just the notes its receiver has sounding. The encoder's
+    // running status had run ahead to the end of the queue, so that is
+    // reset too.
+    playbackPort_t * output = &playbackDataPtr->ports[port];
+    uint8_t message[MIDI_COMPILED_EVENT_MAX_BYTES];
+
+    output->outputQueueTail = output->outputQueueHead;
+    output->itemSent = 0; //Cut off part way, the note-off status bytes end it
+    output->thruAheadBytes = 0;
+    if (output->thruSent != 0) //Likewise, the rest of the input waiting behind it still goes
+    {
+        output->thruSent = 0;
+        output->thruQueueTail++;
+    }
+    output->sysExQueueTail = output->sysExQueueHead;
+    output->sysExSent = 0;
+    output->sysExPendingBytes = 0;
+    playbackDataPtr->numLoopReleases -= output->loopReleases.numNotes;
+    midiOutput_resetRunningStatus(&output->outputPort);
+    midiOutput_clearNotes(&output->renderedNotes);
+    midiOutput_clearNotes(&output->loopReleases);
+
+    // A message cut off part way would swallow the note-offs
+    if (output->isSysExOpen)
+    {
+        message[0] = 0xF7;
+        appendToBurst(playbackDataPtr, port, burst, burstLength, message, 1, lineEnd);
+        output->isSysExOpen = false;
+        playbackDataPtr->sysExStats.numAborted++;
+    }
+
+    while (midiOutput_getNoteOff(&output->soundingNotes, message))
+    {
+        midiOutput_trackNote(&output->soundingNotes, message[0], message[1], 0);
+        appendToBurst(playbackDataPtr, port, burst, burstLength, message, 3, lineEnd);
+    }
+}
+
+
+//**** Private
+static bool isOutputEmpty(midiPlaybackRuntimeData_t * playbackDataPtr)
+{
+    for (uint8_t a = 0; a < MIDI_OUTPUT_NUM_PORTS; a++)
+    {
+        if (playbackDataPtr->ports[a].outputQueueHead != playbackDataPtr->ports[a].outputQueueTail) return false;
+        if (playbackDataPtr->ports[a].sysExQueueHead != playbackDataPtr->ports[a].sysExQueueTail) return false;
+    }
+
+    return true;
+}
+
+
+//**** Private
+static uint64_t getLineEnd(const playbackPort_t * port, uint64_t now)
+{
+    // When the port's wire is next free, going by what has been written
+    return (port->lineFreeTime > now) ? port->lineFreeTime : now;
+}
+
+
+//**** Private
+static bool isKeptClear(midiPlaybackRuntimeData_t * playbackDataPtr, uint8_t port, uint64_t now)
+{
+    // Whether the port is limited to PLAYBACK_THRU_LINE_AHEAD_US ahead of
+    // its wire: always while it carries thru, and for a while after each
+    // live event (the first one of a session waits behind what is queued).
+    return ((playbackDataPtr->thruOutputPorts & (1 << port)) != 0) || (playbackDataPtr->ports[port].liveHoldTime > now);
+}
+
+
+//**** Private
+static void advanceToNextEvent(midiPlaybackRuntimeData_t * playbackDataPtr)
+{
+    uint8_t message[MIDI_COMPILED_EVENT_MAX_BYTES];
+    playbackPort_t * port = playbackDataPtr->ports;
+
+    if (playbackDataPtr->numLoopReleases)
+    {
+        while (!midiOutput_getNoteOff(&port->loopReleases, message)) port++;
+        midiOutput_trackNote(&port->loopReleases, message[0], message[1], 0);
+        playbackDataPtr->numLoopReleases--;
+        return;
+    }
+
+    if (playbackDataPtr->stream != NULL) playbackStream_dropEvent(playbackDataPtr->stream);
+    playbackDataPtr->nextEventIndex++;
+
+    if (playbackDataPtr->isLooping && (playbackDataPtr->nextEventIndex == playbackDataPtr->loopEndIndex))
+    {
+        // Notes still held at the loop end have their note-offs after it,
+        // so they would never be released. They are rendered as note-offs
+        // at the wrap time, ahead of the events from the loop start.
+        playbackDataPtr->nextEventIndex = playbackDataPtr->loopStartIndex;
+        // Song time zero moves on a loop length, the anchor moves back by
+        // the same so the tempo carries on unchanged through the wrap
+        playbackDataPtr->songStartTime += playbackDataPtr->loopEndTime - playbackDataPtr->loopStartTime;
+        playbackDataPtr->tempo.anchor -= (int64_t)(playbackDataPtr->loopEndTime - playbackDataPtr->loopStartTime);
+        playbackDataPtr->loopCount++;
+        for (uint8_t a = 0; a < MIDI_OUTPUT_NUM_PORTS; a++)
+        {
+            port[a].loopReleases = port[a].renderedNotes;
+            playbackDataPtr->numLoopReleases += port[a].loopReleases.numNotes;
+        }
+        playbackDataPtr->loopReleaseTime = getSongDeadline(playbackDataPtr, playbackDataPtr->loopStartTime);
+
+        systemTrace_record(traceEvent_loop, (uint32_t)playbackDataPtr->loopReleaseTime, 0, playbackDataPtr->loopCount, NULL, 0);
+    }
+}
+
+
+//**** Private
+static uint64_t getFollowingDeadline(midiPlaybackRuntimeData_t * playbackDataPtr)
+{
+    // Deadline of the event after the next one, looking through a loop
+    // wrap. If a stream hasn't got that far yet it is assumed to be close.
+    const uint32_t followingIndex = playbackDataPtr->nextEventIndex + 1;
+    const playbackStreamEvent_t * streamEvent;
+    midiCompiledEvent_t event;
+
+    if (playbackDataPtr->numLoopReleases > 1) return playbackDataPtr->loopReleaseTime;
+    if (playbackDataPtr->numLoopReleases == 1) return getEventDeadline(playbackDataPtr, playbackDataPtr->nextEventIndex);
+
+    if (playbackDataPtr->stream != NULL)
+    {
+        streamEvent = playbackStream_peekEvent(playbackDataPtr->stream, 1);
+        if (streamEvent != NULL) return getSongDeadline(playbackDataPtr, streamEvent->songTime);
+        return playbackStream_isFinished(playbackDataPtr->stream) ? UINT64_MAX : getNextDeadline(playbackDataPtr);
+    }
+
+    if (playbackDataPtr->isLooping && (followingIndex == playbackDataPtr->loopEndIndex))
+    {
+        fetchEvent(playbackDataPtr, playbackDataPtr->loopStartIndex, &event);
+        return getSongDeadline(playbackDataPtr, tempoMap_tickToMicroSeconds(&playbackDataPtr->tempoMap, event.absoluteTime) + (playbackDataPtr->loopEndTime - playbackDataPtr->loopStartTime));
+    }
+
+    if (followingIndex >= playbackDataPtr->song.numEvents) return UINT64_MAX;
+
+    return getEventDeadline(playbackDataPtr, followingIndex);
+}
+
+
+//**** Private
+static uint32_t findFirstEventAtTime(midiPlaybackRuntimeData_t * playbackDataPtr, uint64_t songTime)
+{
+    uint32_t low = 0;
+    uint32_t high = playbackDataPtr->song.numEvents;
+    uint32_t mid;
+
+    while (low < high)
+    {
+        mid = (low + high) >> 1;
+        if (tempoMap_tickToMicroSeconds(&playbackDataPtr->tempoMap, playbackDataPtr->song.events[mid].absoluteTime) < songTime) low = mid + 1;
+        else high = mid;
+    }
+
+    return low;
+}
+
+
+//**** Private
+static void updateInputPorts(midiPlaybackRuntimeData_t * playbackDataPtr)
+{
+    // Midi in is only enabled while thru or a tap wants it. Enabling
+    // throws away whatever was received before, so inputs that are
+    // already on are left alone.
+    playbackInput_t * input;
+    uint8_t inputPorts = 0;
+
+    playbackDataPtr->thruOutputPorts = 0;
+    for (uint8_t a = 0; a < MIDI_OUTPUT_NUM_PORTS; a++)
+    {
+        input = &playbackDataPtr->inputs[a];
+        playbackDataPtr->thruOutputPorts |= input->thruPorts;
+        if ((input->thruPorts != 0) || (input->tap != NULL)) inputPorts |= (1 << a);
+
+        if ((inputPorts ^ playbackDataPtr->inputPorts) & (1 << a))
+        {
+            enableMidiIn(a, (inputPorts & (1 << a)) != 0);
+            input->status = 0;
+            input->numMessageBytes = 0;
+        }
+    }
+
+    playbackDataPtr->inputPorts = inputPorts;
+}
+
+
+//**** Private
+static void receiveLiveEvents(midiPlaybackRuntimeData_t * playbackDataPtr)
+{
+    // Consumer side of the live queue. Each event is parsed on its own,
+    // running status only holds within it, and plays on the live ports
+    // it asked for.
+    playbackInput_t * input = &playbackDataPtr->liveInput;
+    playbackLiveEvent_t event;
+
+    while (spscRing_pop(&playbackDataPtr->liveQueue, &event))
+    {
+        input->thruPorts = event.ports & playbackDataPtr->livePorts;
+        input->status = 0;
+        input->numMessageBytes = 0;
+        if (input->thruPorts == 0) continue;
+
+        for (uint8_t a = 0; a < MIDI_OUTPUT_NUM_PORTS; a++)
+        {
+            if (input->thruPorts & (1 << a)) playbackDataPtr->ports[a].liveHoldTime = event.writeTime + PLAYBACK_LIVE_HOLD_US;
+        }
+        for (uint8_t i = 0; i < event.length; i++) parseInput(playbackDataPtr, input, event.data[i], event.writeTime);
+    }
+}
+
+
+//**** Private
+static bool parseInput(midiPlaybackRuntimeData_t * playbackDataPtr, playbackInput_t * input, uint8_t byte, uint64_t arrivalTime)
+{
+    // Only channel messages go through, and only once the whole message
+    // is in. SysEx and system common would hold a port's playback for as
+    // long as they take, and realtime would fight with our own clock, so
+    // they are filtered out - a realtime byte part way through a message
+    // leaves it undisturbed, anything else cancels running status.
+    // Returns true once a whole message has been queued.
+    playbackThruStats_t * stats = (input == &playbackDataPtr->liveInput) ? &playbackDataPtr->liveStats : &playbackDataPtr->thruStats;
+
+    if (byte >= 0xF0)
+    {
+        if (byte < 0xF8)
+        {
+            input->status = 0;
+            input->numMessageBytes = 0;
+        }
+        stats->numFilteredBytes++;
+        return false;
+    }
+
+    if (byte & 0x80)
+    {
+        input->status = byte;
+        input->message[0] = byte;
+        input->messageLength = (((byte & 0xF0) == 0xC0) || ((byte & 0xF0) == 0xD0)) ? 2 : 3;
+        input->numMessageBytes = 1;
+        return false;
+    }
+
+    if (input->status == 0)
+    {
+        stats->numFilteredBytes++;
+        return false;
+    }
+
+    if (input->numMessageBytes == 0) input->numMessageBytes = 1; //Running status, message[0] still holds it
+    input->message[input->numMessageBytes++] = byte;
+
+    if (input->numMessageBytes == input->messageLength)
+    {
+        queueThru(playbackDataPtr, input, arrivalTime);
+        input->numMessageBytes = 0;
+        return true;
+    }
+
+    return false;
+}
+
+
+//**** Private
+static void queueThru(midiPlaybackRuntimeData_t * playbackDataPtr, const playbackInput_t * input, uint64_t arrivalTime)
+{
+    const bool isLive = (input == &playbackDataPtr->liveInput);
+    playbackPort_t * port;
+    playbackThruItem_t * item;
+
+    for (uint8_t a = 0; a < MIDI_OUTPUT_NUM_PORTS; a++)
+    {
+        if (!(input->thruPorts & (1 << a))) continue;
+        port = &playbackDataPtr->ports[a];
+
+        if ((port->thruQueueHead - port->thruQueueTail) >= PLAYBACK_THRU_QUEUE_LENGTH)
+        {
+            if (isLive) playbackDataPtr->liveStats.numDropped++;
+            else playbackDataPtr->thruStats.numDropped++;
+            continue;
+        }
+
+        item = &port->thruQueue[port->thruQueueHead & THRU_QUEUE_MASK];
+        item->arrivalTime = arrivalTime;
+        item->isHeld = false;
+        item->isLive = isLive;
+        item->length = input->messageLength;
+        memcpy(item->data, input->message, input->messageLength);
+        port->thruQueueHead++;
+    }
+}
+
+
+//**** Private
+static void transmitThru(midiPlaybackRuntimeData_t * playbackDataPtr, uint8_t port, uint64_t now, uint8_t * burst, uint32_t * burstLength, uint64_t * lineEnd)
+{
+    // Live input goes out at the port's next message boundary, ahead of
+    // its queued events (they are planned around each other, this only
+    // nudges them later). It never goes inside an event split around a
+    // clock, or inside a sysex message - the one case its latency isn't
+    // bounded, as dumps are only broken up by realtime bytes. The status
+    // byte is left off only when nothing is queued, as the encoder's
+    // running status is then what is on the wire. Otherwise it is sent in
+    // full and the next event gets its own status byte back. Once
+    // PLAYBACK_THRU_MAX_AHEAD_BYTES have gone ahead of a due event, the
+    // event is let out before any more (see isThruAllowanceSpent).
+    playbackThruStats_t * stats;
+    playbackPort_t * output = &playbackDataPtr->ports[port];
+    const uint64_t bufferLimit = now + DEADLINE_MIN_LEAD_US + ((uint64_t)MIDI_UART_TX_BUFFER_BYTES * MIDI_UART_US_PER_BYTE);
+    playbackThruItem_t * item;
+    uint8_t message[3];
+    uint32_t numBytes;
+    uint32_t room;
+    uint32_t latency;
+
+    while (output->thruQueueHead != output->thruQueueTail)
+    {
+        item = &output->thruQueue[output->thruQueueTail & THRU_QUEUE_MASK];
+        stats = item->isLive ? &playbackDataPtr->liveStats : &playbackDataPtr->thruStats;
+
+        if (output->thruSent == 0)
+        {
+            if (output->itemSent != 0) return; //The rest of the event goes first
+            if (output->isSysExOpen) //Its status byte would end the message
+            {
+                if (!item->isHeld) stats->numHeld++;
+                item->isHeld = true;
+                return;
+            }
+            if (isThruAllowanceSpent(output, *lineEnd)) return;
+        }
+
+        numBytes = item->length - output->thruSent;
+        if ((*lineEnd + ((uint64_t)numBytes * MIDI_UART_US_PER_BYTE)) > bufferLimit) return; //Uart tx ring full
+        room = getBytesBeforeClock(playbackDataPtr, port, *lineEnd);
+        if (numBytes > room) numBytes = room;
+        if (numBytes == 0) return; //Waits for the clock
+
+        if ((*burstLength + numBytes) > PLAYBACK_BURST_MAX_BYTES)
+        {
+            writeMidiOut(port, burst, *burstLength);
+            *burstLength = 0;
+        }
+
+        if (output->thruSent == 0)
+        {
+            if (output->outputQueueHead == output->outputQueueTail)
+            {
+                memcpy(message, item->data, item->length);
+                item->length = midiOutput_encodeMessage(&output->outputPort, message, item->length, item->data);
+                if (numBytes > item->length) numBytes = item->length;
+            }
+            else restoreRunningStatus(output);
+
+            latency = (*lineEnd > item->arrivalTime) ? (uint32_t)(*lineEnd - item->arrivalTime) : 0;
+            stats->numMessages++;
+            stats->totalLatency += latency;
+            if (!item->isHeld && (latency > stats->maxLatency)) stats->maxLatency = latency;
+            if (numBytes < item->length) playbackDataPtr->clockStats.numSplitMessages++;
+
+            // Trace lateness is the latency from the input
+            systemTrace_record(traceEvent_midiOut, (uint32_t)now, (int32_t)latency, item->length, item->data, item->length);
+        }
+
+        if (isSongEventDue(output, *lineEnd)) output->thruAheadBytes += (uint8_t)numBytes;
+        memcpy(&burst[*burstLength], &item->data[output->thruSent], numBytes);
+        *burstLength += numBytes;
+        *lineEnd += (uint64_t)numBytes * MIDI_UART_US_PER_BYTE;
+        output->thruSent += numBytes;
+        if (output->thruSent == item->length)
+        {
+            output->thruSent = 0;
+            output->thruQueueTail++;
+        }
+
+        transmitClock(playbackDataPtr, port, burst, burstLength, lineEnd);
+    }
+}
+
+
+//**** Private
+static uint64_t getThruWakeTime(midiPlaybackRuntimeData_t * playbackDataPtr, uint8_t port, uint64_t now)
+{
+    // When transmitThru next has something to do on the port, UINT64_MAX
+    // if nothing is queued. Input waiting on an event split around the
+    // clock, or on a sysex message, is woken along with those.
+    const playbackPort_t * output = &playbackDataPtr->ports[port];
+    const playbackThruItem_t * item = &output->thruQueue[output->thruQueueTail & THRU_QUEUE_MASK];
+    const uint64_t lineEnd = getLineEnd(output, now);
+    uint64_t roomTime;
+
+    if ((output->thruQueueHead == output->thruQueueTail) || (output->itemSent != 0) || output->isSysExOpen) return UINT64_MAX;
+    if (isThruAllowanceSpent(output, lineEnd)) return UINT64_MAX; //Behind the due event, which is woken for
+
+    roomTime = lineEnd + ((uint64_t)(item->length - output->thruSent) * MIDI_UART_US_PER_BYTE);
+    roomTime = (roomTime > ((uint64_t)MIDI_UART_TX_BUFFER_BYTES * MIDI_UART_US_PER_BYTE)) ? (roomTime - ((uint64_t)MIDI_UART_TX_BUFFER_BYTES * MIDI_UART_US_PER_BYTE)) : 0;
+    if ((getBytesBeforeClock(playbackDataPtr, port, lineEnd) == 0) && (getClockDueTime(playbackDataPtr, port) > roomTime)) roomTime = getClockDueTime(playbackDataPtr, port);
+    return roomTime;
+}
+
+
+//**** Private
+static bool isSongEventDue(const playbackPort_t * output, uint64_t lineEnd)
+{
+    // Whether the event at the port's output tail could be written now,
+    // as far as its send time goes (not one split around a clock)
+    const playbackOutputItem_t * item = &output->outputQueue[output->outputQueueTail & OUTPUT_QUEUE_MASK];
+
+    if ((output->outputQueueHead == output->outputQueueTail) || (output->itemSent != 0)) return false;
+    return item->sendTime <= (lineEnd + DEADLINE_MIN_LEAD_US);
+}
+
+
+//**** Private
+static bool isThruAllowanceSpent(const playbackPort_t * output, uint64_t lineEnd)
+{
+    // Whether the thru message at the tail has to let the port's due event
+    // go first - it would take the thru written ahead of that event past
+    // PLAYBACK_THRU_MAX_AHEAD_BYTES. Never part way through a message.
+    const playbackThruItem_t * item = &output->thruQueue[output->thruQueueTail & THRU_QUEUE_MASK];
+
+    if ((output->thruQueueHead == output->thruQueueTail) || (output->thruSent != 0)) return false;
+    if (!isSongEventDue(output, lineEnd)) return false;
+    return (output->thruAheadBytes + item->length) > PLAYBACK_THRU_MAX_AHEAD_BYTES;
+}
@@ -0,0 +1,261 @@
+#ifndef PLAYBACK_ENGINE_H
+#define PLAYBACK_ENGINE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "midiCompiler.h"
+#include "tempoMap.h"
+#include "midiOutput.h"
+#include "seekIndex.h"
+#include "playbackStream.h"
+#include "spscRing.h"
+#include "systemLowLevel.h"
+
+#define DEADLINE_MIN_LEAD_US 20 //Events due sooner than this are sent now rather than arming the alarm
+#define PLAYBACK_BURST_MAX_BYTES 128 //Events due together are sent in one uart write of up to this many bytes
+#define PLAYBACK_LOOKAHEAD_DEFAULT_US 20000 //How far ahead events are rendered into the output queue
+#define PLAYBACK_OUTPUT_QUEUE_LENGTH 64 //Rendered events waiting to be written, MUST be a power of two
+#define PLAYBACK_SYSEX_QUEUE_LENGTH 32 //SysEx packets waiting for the wire on each port, MUST be a power of two
+#define PLAYBACK_SYSEX_SLICE_BYTES 32 //SysEx is written in slices of up to this many bytes as the uart tx ring drains
+#define PLAYBACK_SYSEX_MAX_DEFER_US 250000 //A sysex message that finds no gap between the notes goes anyway after waiting this long
+#define PLAYBACK_TEMPO_ONE 65536 //Tempo multiplier of 1.0, the song as written (16.16 fixed point)
+#define PLAYBACK_TEMPO_MIN (PLAYBACK_TEMPO_ONE / 4)
+#define PLAYBACK_TEMPO_MAX (PLAYBACK_TEMPO_ONE * 4)
+#define PLAYBACK_TEMPO_RAMP_STEP_US 10000 //A tempo ramp moves the multiplier on at least this often
+#define PLAYBACK_CLOCK_PORTS_DEFAULT 0 //Ports sending midi clock and start/stop/continue, one bit per port
+#define PLAYBACK_CLOCKS_PER_POSITION 6 //Song position pointer counts sixteenth notes
+#define PLAYBACK_MAX_SONG_POSITION 0x3FFF //14 bits
+#define PLAYBACK_THRU_QUEUE_LENGTH 16 //Live input messages waiting for the wire on each port, MUST be a power of two
+#define PLAYBACK_THRU_LINE_AHEAD_US 160 //While a port carries midi thru, playback keeps at most this much ahead of its wire
+#define PLAYBACK_THRU_MAX_AHEAD_BYTES 6 //Thru (and live) bytes a due song event can be kept waiting behind, two messages
+#define PLAYBACK_INPUT_READ_BYTES 32 //Input bytes taken per readMidiIn
+#define PLAYBACK_LIVE_QUEUE_LENGTH 32 //Live events from the client waiting for the playback task, MUST be a power of two
+#define PLAYBACK_LIVE_EVENT_MAX_BYTES 16 //Midi bytes per live event, a few channel messages played together
+#define PLAYBACK_LIVE_HOLD_US 2000000 //After a live event, its ports are kept clear like thru ports for this long
+
+typedef struct
+{
+    uint32_t numLateEvents;         //Events written after their planned send time
+    uint32_t maxLateness;           //Worst case lateness (uS)
+    uint64_t totalLateness;         //Sum of lateness, for the average (uS)
+    uint32_t numHeldEvents;         //Late because a sysex message was still going out (counted in the above too)
+    uint32_t numCompensatedEvents;  //Events planned to start off their deadline (wire was busy)
+    uint32_t maxUnavoidableEarly;   //Worst case planned earliness (uS)
+    uint32_t maxUnavoidableLate;    //Worst case planned lateness (uS)
+    uint64_t totalUnavoidableError; //Sum of planned |error|, for the average (uS)
+} playbackTimingStats_t;
+
+typedef struct
+{
+    uint32_t numPackets;            //SysEx packets written in full
+    uint32_t numBytes;              //SysEx bytes written
+    uint32_t maxPendingBytes;       //Most sysex bytes waiting for the wire at once, every port
+    uint32_t numForcedStarts;       //Messages started without a gap, after PLAYBACK_SYSEX_MAX_DEFER_US
+    uint32_t numAborted;            //Messages cut short (stop, seek, or never ended by the song) and closed with 0xF7
+    uint32_t numSkipped;            //Continuation packets of a message that never started (playback joined it part way)
+} playbackSysExStats_t;
+
+typedef struct
+{
+    uint32_t numClocks;             //0xF8 bytes written, every port
+    uint32_t numLateClocks;         //Planned on the wire after their deadline
+    uint32_t maxClockLateness;      //uS
+    uint32_t numSplitMessages;      //Messages with a clock written between their bytes
+    uint32_t numPositions;          //Song position pointers sent (seek, loop wrap)
+} playbackClockStats_t;
+
+typedef struct
+{
+    uint32_t numMessages;           //Channel messages forwarded, every port
+    uint32_t numFilteredBytes;      //SysEx, system common and realtime input (and data bytes with no status), not forwarded
+    uint32_t numDropped;            //Messages lost to a full thru queue
+    uint32_t numHeld;               //Waited for a sysex message from playback to end, the latency isn't bounded for these
+    uint32_t numYielded;            //Song events let ahead of a waiting message, PLAYBACK_THRU_MAX_AHEAD_BYTES had gone before them
+    uint32_t maxLatency;            //Input stop bit (or live event write) to output start bit, worst case (uS)
+    uint64_t totalLatency;          //Sum of latency, for the average (uS)
+} playbackThruStats_t;
+
+//Runtime tempo, on top of the song's own tempo map. Song time (uS from
+//the tempo map) runs 'multiplier' times as fast as real time, counted
+//from the anchor: an event at song time t is due at
+//songStartTime + anchor + (t - anchor) / multiplier. Moving the anchor to
+//'now' whenever the multiplier changes keeps everything already played
+//where it was, so only deadlines still to come are affected.
+typedef struct
+{
+    uint32_t multiplier;            //16.16, PLAYBACK_TEMPO_ONE plays the song as written
+    int64_t anchor;                 //Song time (uS) the multiplier last changed at
+    bool isRamping;
+    uint64_t rampStartTime;         //Delta timer count
+    int64_t rampAnchor;             //Song time (uS) at rampStartTime
+    uint32_t rampDuration;          //uS, at most INT32_MAX
+    uint32_t rampFrom;              //Multipliers at either end of the ramp
+    uint32_t rampTo;
+} playbackTempo_t;
+
+//A sysex packet waiting for the wire, see midiCompiledSysEx_t
+typedef struct
+{
+    uint64_t deadline;              //When the packet is due, it never goes out before this
+    uint32_t index;                 //In the song's sysex table
+    uint32_t length;                //Bytes on the wire, 0xF0 included
+    bool hasStartByte;              //0xF0 packet, the payload follows a 0xF0
+    bool isContinuation;            //Only meaningful after the packets before it
+} playbackSysExItem_t;
+
+//An event rendered into output bytes (running status applied),
+//along with the time its first byte should go out on the wire
+typedef struct
+{
+    uint64_t sendTime;              //Planned wire start (delta timer count)
+    uint64_t deadline;              //When the event is due, sendTime - deadline is the error that could not be avoided
+    uint8_t status;                 //Before running status, for note tracking
+    uint8_t runningStatus;          //In force on the wire after this item, see restoreRunningStatus
+    bool isHeld;                    //Fell due while a sysex message was going out
+    uint8_t length;
+    uint8_t data[MIDI_COMPILED_EVENT_MAX_BYTES];
+} playbackOutputItem_t;
+
+//A channel message from a midi in or a live event, waiting to go out
+//through midi thru
+typedef struct
+{
+    uint64_t arrivalTime;           //When its last byte finished arriving, or the live event was written (delta timer count)
+    bool isHeld;                    //Counted as held behind a sysex message
+    bool isLive;                    //From a live event, counted in liveStats
+    uint8_t length;
+    uint8_t data[3];                //Status byte first, running status is only applied as it is written
+} playbackThruItem_t;
+
+//Input side of one midi in. Its channel messages are forwarded to the
+//thru ports, each a whole message at a time in between the port's own
+//messages, so neither stream breaks into the other.
+typedef struct
+{
+    uint8_t thruPorts;              //Ports its channel messages are forwarded to, one bit per port
+    spscRing_t * tap;               //Every byte read (midiInputByte_t) is passed on here too, NULL when nobody else wants them
+    uint8_t status;                 //Running status on the wire, 0 when data bytes have nothing to go with
+    uint8_t message[3];
+    uint8_t messageLength;          //Bytes the message at status takes, status included
+    uint8_t numMessageBytes;        //Status included, 0 until a message starts
+} playbackInput_t;
+
+//Channel messages the client wants played now, straight from the ble
+//write rather than from the song (see playbackEngine_queueLiveEvent)
+typedef struct
+{
+    uint64_t writeTime;             //Delta timer count when the client's write was handled
+    uint8_t ports;                  //Ports to play it on, one bit per port
+    uint8_t length;
+    uint8_t data[PLAYBACK_LIVE_EVENT_MAX_BYTES]; //Whole messages, running status allowed within the event
+} playbackLiveEvent_t;
+
+//Everything playback keeps for one midi out. Each port is a wire of its
+//own, so events are only planned around others on the same port.
+typedef struct
+{
+    midiOutputPort_t outputPort;    //Running status of the port's uart
+    midiNoteSet_t soundingNotes;    //Notes on at the receiver, as written to the uart
+    midiNoteSet_t renderedNotes;    //Notes on as of the last event rendered into the output queue
+    midiNoteSet_t loopReleases;     //Notes held over the last loop wrap, still to be rendered as note-offs
+    playbackOutputItem_t outputQueue[PLAYBACK_OUTPUT_QUEUE_LENGTH];
+    uint32_t outputQueueHead;       //Next slot to render into
+    uint32_t outputQueueTail;       //Next item to write to the uart
+    uint64_t lineFreeTime;          //When the uart finishes the last byte written (modelled from the bit time)
+    playbackSysExItem_t sysExQueue[PLAYBACK_SYSEX_QUEUE_LENGTH];
+    uint32_t sysExQueueHead;
+    uint32_t sysExQueueTail;
+    uint32_t sysExSent;             //Bytes of the packet at the tail already written
+    uint32_t sysExPendingBytes;     //Queued sysex bytes not yet written
+    bool isSysExOpen;               //A message is part way out on the wire, nothing but realtime may go until it ends
+    uint8_t itemSent;               //Bytes of the item at the tail already written, a clock went out part way through it
+    uint32_t nextClock;             //Number of the next 0xF8 (24 per quater-note from the song start)
+    uint64_t clockSongTime;         //Song time (uS) of that clock, UINT64_MAX when the port sends no clock
+    uint32_t clockLoopCount;        //Loop iteration the clock is in, it can be either side of a wrap from the events
+    uint64_t positionSongTime;      //Stop, song position and continue go out here ahead of the clock, UINT64_MAX when not needed
+    playbackThruItem_t thruQueue[PLAYBACK_THRU_QUEUE_LENGTH];
+    uint32_t thruQueueHead;
+    uint32_t thruQueueTail;
+    uint8_t thruSent;               //Bytes of the thru message at the tail already written, a clock went out part way through it
+    uint8_t thruAheadBytes;         //Thru bytes written while the song event at the output tail was due
+    uint64_t liveHoldTime;          //Kept clear for live events until then, set by each one that plays here
+} playbackPort_t;
+
+typedef struct
+{
+    uint8_t * playbackDataBASE;     //Raw upload buffer (PSRAM), written by the ble component
+    uint32_t totalDataLength;       //Number of raw bytes uploaded so far
+    midiCompiledSong_t song;        //Fixed width events, compiled once the upload completes
+    uint8_t trackPorts[MIDI_MAX_TRACKS]; //Port each track plays on until a midiPort meta event says otherwise
+    tempoMap_t tempoMap;            //Tick to microsecond conversion, built with the song
+    seekIndex_t seekIndex;          //Chase state checkpoints, built with the song
+    playbackStream_t * stream;      //Song streaming from the file system, NULL when playing the compiled song
+    uint32_t nextEventIndex;        //Index of the next event to be sent
+    uint64_t songStartTime;         //Delta timer count at song time zero (at the current tempo, see playbackTempo_t)
+    playbackTempo_t tempo;
+    volatile bool isPlayingBack;
+    uint32_t lookAheadWindow;       //uS, 0 disables compensation (every event is planned at its deadline or later)
+    playbackPort_t ports[MIDI_OUTPUT_NUM_PORTS];
+    playbackTimingStats_t timingStats;
+    playbackSysExStats_t sysExStats;
+    uint8_t clockPorts;             //Ports acting as clock master, one bit per port (compiled songs with a PPQN division only)
+    playbackClockStats_t clockStats;
+    bool isLooping;
+    uint64_t loopStartTime;         //Song time (uS), the loop length is loopEndTime - loopStartTime
+    uint64_t loopEndTime;
+    uint32_t loopStartIndex;        //First event at or after loopStartTime
+    uint32_t loopEndIndex;          //First event at or after loopEndTime (not played, wraps instead)
+    uint32_t loopCount;             //Wraps since playback started
+    uint32_t numLoopReleases;       //Note-offs still to render from the last wrap, every port (see playbackPort_t)
+    uint64_t loopReleaseTime;       //Delta timer count of that wrap
+    playbackInput_t inputs[MIDI_OUTPUT_NUM_PORTS]; //Midi ins, one per port
+    uint8_t inputPorts;             //Midi ins enabled (thru or a tap), one bit per port
+    uint8_t thruOutputPorts;        //Ports carrying thru from any input, one bit per port
+    playbackThruStats_t thruStats;
+    midiInputByte_t inputBytes[PLAYBACK_INPUT_READ_BYTES];
+    spscRing_t liveQueue;           //playbackLiveEvent_t, the only part of the runtime data written without the caller's lock
+    playbackLiveEvent_t liveQueueStorage[PLAYBACK_LIVE_QUEUE_LENGTH];
+    uint8_t livePorts;              //Ports live events may play on, kept clear like thru ports while they are in use
+    playbackInput_t liveInput;      //Parses each live event, as if it had come in on a midi in
+    playbackThruStats_t liveStats;
+} midiPlaybackRuntimeData_t;
+
+
+//Midi thru runs whether or not anything is playing. Midi in is read by
+//playbackEngine_readInput, called (with the lock, like everything else)
+//from a task of its own as the uart receives it - the engine then only
+//has to be serviced once a whole message is queued for thru. The engine
+//is the only reader of midi in, a tap hands every byte read on to a
+//consumer of its own, the recorder.
+//
+//Live events take the thru path too. playbackEngine_queueLiveEvent is
+//the exception to the locking below: it only pushes to a lock-free ring,
+//so the ble stack can call it from its access callback (one producer)
+//and then wake the playback task, which plays the event next service.
+//
+//The playback core has no RTOS or driver dependencies of its own, it
+//only reaches the hardware through systemLowLevel.h - so the same code
+//runs on target and in the host build (see Firmware/host). Callers are
+//responsible for serialising access to the runtime data, which should
+//be in internal ram.
+void playbackEngine_init(midiPlaybackRuntimeData_t * playbackDataPtr, uint8_t * uploadBuffer);
+uint8_t playbackEngine_compileSong(midiPlaybackRuntimeData_t * playbackDataPtr);
+void playbackEngine_freeSong(midiPlaybackRuntimeData_t * playbackDataPtr);
+void playbackEngine_start(midiPlaybackRuntimeData_t * playbackDataPtr);
+void playbackEngine_startStream(midiPlaybackRuntimeData_t * playbackDataPtr, playbackStream_t * stream);
+void playbackEngine_stop(midiPlaybackRuntimeData_t * playbackDataPtr);
+uint8_t playbackEngine_setLoop(midiPlaybackRuntimeData_t * playbackDataPtr, uint64_t loopStartTime, uint64_t loopEndTime);
+void playbackEngine_clearLoop(midiPlaybackRuntimeData_t * playbackDataPtr);
+uint8_t playbackEngine_seek(midiPlaybackRuntimeData_t * playbackDataPtr, uint32_t tick);
+uint32_t playbackEngine_getPendingSysExBytes(midiPlaybackRuntimeData_t * playbackDataPtr);
+void playbackEngine_setTempo(midiPlaybackRuntimeData_t * playbackDataPtr, uint32_t multiplier);
+void playbackEngine_rampTempo(midiPlaybackRuntimeData_t * playbackDataPtr, uint32_t multiplier, uint32_t duration);
+void playbackEngine_setClockPorts(midiPlaybackRuntimeData_t * playbackDataPtr, uint8_t clockPorts);
+void playbackEngine_setThru(midiPlaybackRuntimeData_t * playbackDataPtr, uint8_t inputPort, uint8_t thruPorts);
+void playbackEngine_setInputTap(midiPlaybackRuntimeData_t * playbackDataPtr, uint8_t inputPort, spscRing_t * tap);
+void playbackEngine_setLivePorts(midiPlaybackRuntimeData_t * playbackDataPtr, uint8_t livePorts);
+uint8_t playbackEngine_queueLiveEvent(midiPlaybackRuntimeData_t * playbackDataPtr, uint64_t writeTime, uint8_t ports, const uint8_t * data, uint32_t length);
+uint32_t playbackEngine_readInput(midiPlaybackRuntimeData_t * playbackDataPtr);
+void playbackEngine_service(midiPlaybackRuntimeData_t * playbackDataPtr);
+
+#endif
@@ -0,0 +1,476 @@
+#include <stdio.h>
+#include <string.h>
+#include "esp_log.h"
+#include "fileSys.h"
+#include "playbackStream.h"
+#include "midiOutput.h"
+
+#define LOG_TAG "playbackStream"
+#define CHUNK_HEADER_BYTES 8
+#define MTHD_MIN_DATA_BYTES 6
+#define MAX_VARIABLE_LENGTH_BYTES 4
+
+//Same tie-break on tick as the compiler, so a streamed song plays in
+//exactly the order the compiled song would (see midiCompiler.c)
+#define MERGE_CLASS_NOTE_OFF 0
+#define MERGE_CLASS_META_OR_SYSEX 1
+#define MERGE_CLASS_OTHER_VOICE 2
+#define MERGE_CLASS_NOTE_ON 3
+
+static uint8_t readNextTrackEvent(playbackStream_t * stream, playbackStreamTrack_t * track);
+static uint8_t readTrackByte(playbackStream_t * stream, playbackStreamTrack_t * track, uint8_t * byte);
+static uint8_t readTrackVariableLength(playbackStream_t * stream, playbackStreamTrack_t * track, uint32_t * result);
+static uint8_t skipTrackBytes(playbackStreamTrack_t * track, uint32_t numBytes);
+static uint8_t getVoiceMessageLength(uint8_t statusByte);
+static uint32_t readBigEndian(const uint8_t * data, uint8_t numBytes);
+
+
+//**** Public
+uint8_t playbackStream_open(playbackStream_t * stream, char * fileName, const uint8_t * trackPorts)
+{
+    // Only the chunk headers are read here, each MTrk chunk then gets a
+    // read window of its own so format 1 tracks can be merged as they
+    // stream - the file is never held in memory. Files without an MThd
+    // chunk are treated as raw track data, as with uploads.
+    uint8_t header[CHUNK_HEADER_BYTES + MTHD_MIN_DATA_BYTES];
+    uint16_t numBytesRead;
+    uint32_t chunkOffset;
+    uint32_t chunkLength;
+    uint16_t expectedTracks;
+    uint16_t timeDivision;
+
+    atomic_store_explicit(&stream->isComplete, true, memory_order_release); //Nothing to play unless the open succeeds
+    spscRing_init(&stream->ring, stream->ringStorage, sizeof(playbackStreamEvent_t), PLAYBACK_STREAM_RING_EVENTS);
+    memset(&stream->stats, 0, sizeof(playbackStreamStats_t));
+    stream->stats.minFill = PLAYBACK_STREAM_RING_EVENTS;
+    stream->isStarved = false;
+    stream->numTracks = 0;
+
+    if(fileSys_openFileRW(fileName, false) || fileSys_readFileAt(0, header, sizeof(header), &numBytesRead))
+    {
+        ESP_LOGE(LOG_TAG, "Unable to stream '%s'", fileName);
+        return 1;
+    }
+
+    if((numBytesRead < sizeof(header)) || (memcmp(header, "MThd", 4) != 0))
+    {
+        ESP_LOGI(LOG_TAG, "No MThd chunk found, streaming file as raw track data");
+        memset(&stream->tracks[0], 0, sizeof(playbackStreamTrack_t));
+        stream->tracks[0].fileEnd = UINT32_MAX;
+        stream->numTracks = 1;
+        timeDivision = MIDI_DEFAULT_TIME_DIVISION;
+    }
+    else
+    {
+        chunkLength = readBigEndian(header + 4, 4);
+        if(chunkLength < MTHD_MIN_DATA_BYTES)
+        {
+            ESP_LOGE(LOG_TAG, "Malformed MThd chunk");
+            return 1;
+        }
+
+        expectedTracks = (uint16_t)readBigEndian(header + 10, 2);
+        timeDivision = (uint16_t)readBigEndian(header + 12, 2);
+
+        if(readBigEndian(header + 8, 2) == 2) expectedTracks = 1; //Format 2, independent sequences - only the first is played
+
+        if(expectedTracks > PLAYBACK_STREAM_MAX_TRACKS)
+        {
+            ESP_LOGE(LOG_TAG, "File has %d tracks, only the first %d will be streamed", expectedTracks, PLAYBACK_STREAM_MAX_TRACKS);
+            expectedTracks = PLAYBACK_STREAM_MAX_TRACKS;
+        }
+
+        // Unknown chunks are skipped, a truncated last
+        // chunk just ends early when its reads come up short
+        chunkOffset = CHUNK_HEADER_BYTES + chunkLength;
+        while(stream->numTracks < expectedTracks)
+        {
+            if(fileSys_readFileAt(chunkOffset, header, CHUNK_HEADER_BYTES, &numBytesRead) || (numBytesRead < CHUNK_HEADER_BYTES)) break;
+
+            chunkLength = readBigEndian(header + 4, 4);
+
+            if(memcmp(header, "MTrk", 4) == 0)
+            {
+                memset(&stream->tracks[stream->numTracks], 0, sizeof(playbackStreamTrack_t));
+                stream->tracks[stream->numTracks].fileOffset = chunkOffset + CHUNK_HEADER_BYTES;
+                stream->tracks[stream->numTracks].fileEnd = chunkOffset + CHUNK_HEADER_BYTES + chunkLength;
+                stream->numTracks++;
+            }
+
+            chunkOffset += CHUNK_HEADER_BYTES + chunkLength;
+        }
+    }
+
+    if(stream->numTracks == 0)
+    {
+        ESP_LOGE(LOG_TAG, "No MTrk chunk found in '%s'", fileName);
+        return 1;
+    }
+
+    if(tempoMap_init(&stream->tempoMap, timeDivision, stream->tempoSegments, 2)) return 1;
+
+    // Prime every track with its first event
+    for(uint8_t a = 0; a < stream->numTracks; ++a)
+    {
+        stream->tracks[a].trackIndex = a;
+        stream->tracks[a].port = (trackPorts != NULL) ? (trackPorts[a] % MIDI_OUTPUT_NUM_PORTS) : 0;
+        if(readNextTrackEvent(stream, &stream->tracks[a])) return 1;
+    }
+
+    atomic_store_explicit(&stream->isComplete, false, memory_order_release);
+
+    ESP_LOGI(LOG_TAG, "Streaming '%s', %d tracks, time division 0x%0x", fileName, stream->numTracks, timeDivision);
+
+    return playbackStream_fill(stream);
+}
+
+
+//**** Public
+uint8_t playbackStream_fill(playbackStream_t * stream)
+{
+    // Runs on the low priority prefetch task. Takes the track with the
+    // earliest head event each time (at most PLAYBACK_STREAM_MAX_TRACKS
+    // to scan), resolves tempo as it goes and tops the ring up to the
+    // high watermark. Meta and sysex events never reach the ring.
+    playbackStreamTrack_t * track;
+    playbackStreamEvent_t event;
+
+    if(atomic_load_explicit(&stream->isComplete, memory_order_relaxed)) return 0;
+
+    while(spscRing_count(&stream->ring) < PLAYBACK_STREAM_HIGH_WATERMARK)
+    {
+        track = NULL;
+        for(uint8_t a = 0; a < stream->numTracks; ++a)
+        {
+            if(stream->tracks[a].isFinished) continue;
+            if((track == NULL) || (stream->tracks[a].mergeKey < track->mergeKey)) track = &stream->tracks[a];
+        }
+
+        if(track == NULL)
+        {
+            // Published after the last push, so the consumer
+            // never sees complete with events still to come
+            atomic_store_explicit(&stream->isComplete, true, memory_order_release);
+            return 0;
+        }
+
+        if(!track->isMeta)
+        {
+            event.songTime = tempoMap_tickToMicroSeconds(&stream->tempoMap, track->absoluteTime);
+            event.length = track->length;
+            event.port = track->port;
+            memcpy(event.data, track->data, MIDI_COMPILED_EVENT_MAX_BYTES);
+            spscRing_push(&stream->ring, &event);
+        }
+        else if(track->statusByte == metaEvent_setTempo)
+        {
+            tempoMap_addTempoChange(&stream->tempoMap, track->absoluteTime, track->tempo);
+            tempoMap_discardHistory(&stream->tempoMap);
+        }
+        else if(track->statusByte == metaEvent_endOfTrack)
+        {
+            track->isFinished = true;
+        }
+
+        if(!track->isFinished && readNextTrackEvent(stream, track))
+        {
+            atomic_store_explicit(&stream->isComplete, true, memory_order_release);
+            return 1;
+        }
+    }
+
+    return 0; //** SUCCESS **//
+}
+
+
+//**** Public
+bool playbackStream_needsFill(playbackStream_t * stream)
+{
+    return !atomic_load_explicit(&stream->isComplete, memory_order_acquire) && (spscRing_count(&stream->ring) <= PLAYBACK_STREAM_LOW_WATERMARK);
+}
+
+
+//**** Public
+const playbackStreamEvent_t * playbackStream_peekEvent(playbackStream_t * stream, uint32_t offset)
+{
+    // Consumer side. The next event (offset 0) not being there before
+    // the song has ended means the prefetch fell behind, counted once
+    // for each time it happens rather than for every retry
+    const playbackStreamEvent_t * event = spscRing_peekAt(&stream->ring, offset);
+
+    if(offset == 0)
+    {
+        if(event != NULL) stream->isStarved = false;
+        else if(!stream->isStarved && !atomic_load_explicit(&stream->isComplete, memory_order_acquire))
+        {
+            stream->isStarved = true;
+            stream->stats.numUnderruns++;
+        }
+    }
+
+    return event;
+}
+
+
+//**** Public
+void playbackStream_dropEvent(playbackStream_t * stream)
+{
+    uint32_t fill;
+
+    spscRing_drop(&stream->ring);
+
+    // The ring draining at the end of the song is no sign of trouble
+    if(atomic_load_explicit(&stream->isComplete, memory_order_acquire)) return;
+
+    fill = spscRing_count(&stream->ring);
+    if(fill < stream->stats.minFill) stream->stats.minFill = fill;
+}
+
+
+//**** Public
+bool playbackStream_isFinished(playbackStream_t * stream)
+{
+    // Complete is read first - once it is set every event has been pushed
+    return atomic_load_explicit(&stream->isComplete, memory_order_acquire) && (spscRing_count(&stream->ring) == 0);
+}
+
+
+//**** Private
+static uint8_t readNextTrackEvent(playbackStream_t * stream, playbackStreamTrack_t * track)
+{
+    // As the compiler's readNextTrackEvent, a byte at a time through the
+    // track's read window. Meta and sysex payloads are skipped without
+    // being read (apart from set tempo). A track that runs out of data
+    // mid event is treated as finished, only malformed data fails.
+    uint32_t deltaTime;
+    uint32_t numBytes;
+    uint8_t statusByte;
+    uint8_t mergeClass;
+    uint8_t tempoData[3];
+    uint8_t port;
+
+    if((track->bufferPosition == track->bufferLength) && (track->fileOffset >= track->fileEnd))
+    {
+        track->isFinished = true; //No end-of-track meta event, still playable
+        return 0;
+    }
+
+    if(readTrackVariableLength(stream, track, &deltaTime) || readTrackByte(stream, track, &statusByte))
+    {
+        track->isFinished = true;
+        return 0;
+    }
+
+    track->absoluteTime += deltaTime;
+
+    if(statusByte == 0xFF) //--- Meta Event ---//
+    {
+        track->runningStatus = 0;
+        track->isMeta = true;
+        track->tempo = 0;
+
+        if(readTrackByte(stream, track, &track->statusByte) || readTrackVariableLength(stream, track, &numBytes))
+        {
+            track->isFinished = true;
+            return 0;
+        }
+
+        if((track->statusByte == metaEvent_setTempo) && (numBytes == 3))
+        {
+            for(uint8_t a = 0; a < 3; ++a)
+            {
+                if(readTrackByte(stream, track, &tempoData[a])) { track->isFinished = true; return 0; }
+            }
+            track->tempo = readBigEndian(tempoData, 3);
+        }
+        else if((track->statusByte == metaEvent_midiPort) && (numBytes >= 1))
+        {
+            // Events are read in track order, so the rest of the track follows it from here
+            if(readTrackByte(stream, track, &port) || skipTrackBytes(track, numBytes - 1)) { track->isFinished = true; return 0; }
+            track->port = port % MIDI_OUTPUT_NUM_PORTS;
+        }
+        else if(skipTrackBytes(track, numBytes))
+        {
+            track->isFinished = true;
+            return 0;
+        }
+
+        mergeClass = MERGE_CLASS_META_OR_SYSEX;
+    }
+    else if((statusByte == 0xF0) || (statusByte == 0xF7)) //--- SysEx Event ---//
+    {
+        track->runningStatus = 0;
+        track->isMeta = true;
+        track->statusByte = statusByte;
+
+        if(readTrackVariableLength(stream, track, &numBytes) || skipTrackBytes(track, numBytes))
+        {
+            track->isFinished = true;
+            return 0;
+        }
+
+        mergeClass = MERGE_CLASS_META_OR_SYSEX;
+    }
+    else //--- Voice Message Type ---//
+    {
+        track->isMeta = false;
+        numBytes = 1; //Data bytes already read
+
+        if(statusByte >= 0x80)
+        {
+            track->runningStatus = statusByte;
+            numBytes = 0;
+        }
+        else if(track->runningStatus == 0)
+        {
+            ESP_LOGE(LOG_TAG, "Stream aborted - data byte with no running status");
+            return 1;
+        }
+
+        track->length = getVoiceMessageLength(track->runningStatus);
+        if(track->length == 0)
+        {
+            ESP_LOGE(LOG_TAG, "Stream aborted - unrecognised status byte 0x%0x", track->runningStatus);
+            return 1;
+        }
+
+        track->statusByte = track->runningStatus;
+        track->data[0] = track->runningStatus;
+        if(numBytes) track->data[1] = statusByte;
+
+        for(uint8_t a = (uint8_t)(numBytes + 1); a < track->length; ++a)
+        {
+            if(readTrackByte(stream, track, &track->data[a])) { track->isFinished = true; return 0; }
+        }
+
+        switch(track->statusByte >> 4)
+        {
+            case 0x08:
+                mergeClass = MERGE_CLASS_NOTE_OFF;
+                break;
+
+            case 0x09: // Note on with zero velocity is a note off
+                mergeClass = (track->data[2] == 0) ? MERGE_CLASS_NOTE_OFF : MERGE_CLASS_NOTE_ON;
+                break;
+
+            default:
+                mergeClass = MERGE_CLASS_OTHER_VOICE;
+                break;
+        }
+    }
+
+    track->mergeKey = ((uint64_t)track->absoluteTime << 16) | ((uint64_t)mergeClass << 8) | track->trackIndex;
+
+    return 0; //** SUCCESS **//
+}
+
+
+//**** Private
+static uint8_t readTrackByte(playbackStream_t * stream, playbackStreamTrack_t * track, uint8_t * byte)
+{
+    uint32_t numBytes;
+    uint16_t numBytesRead;
+
+    if(track->bufferPosition == track->bufferLength)
+    {
+        if(track->fileOffset >= track->fileEnd) return 1;
+
+        numBytes = track->fileEnd - track->fileOffset;
+        if(numBytes > PLAYBACK_STREAM_TRACK_BUFFER_BYTES) numBytes = PLAYBACK_STREAM_TRACK_BUFFER_BYTES;
+
+        if(fileSys_readFileAt(track->fileOffset, track->buffer, (uint16_t)numBytes, &numBytesRead) || (numBytesRead == 0)) return 1;
+
+        stream->stats.numBlockReads++;
+        stream->stats.numBytesRead += numBytesRead;
+        track->fileOffset += numBytesRead;
+        track->bufferLength = numBytesRead;
+        track->bufferPosition = 0;
+    }
+
+    *byte = track->buffer[track->bufferPosition++];
+
+    return 0; //** SUCCESS **//
+}
+
+
+//**** Private
+static uint8_t readTrackVariableLength(playbackStream_t * stream, playbackStreamTrack_t * track, uint32_t * result)
+{
+    // See midiCompiler_readVariableLength
+    uint32_t value = 0;
+    uint8_t byte;
+
+    for(uint8_t a = 0; a < MAX_VARIABLE_LENGTH_BYTES; ++a)
+    {
+        if(readTrackByte(stream, track, &byte)) return 1;
+
+        value = (value << 7) | (byte & 0x7F);
+
+        if((byte & 0x80) == 0)
+        {
+            *result = value;
+            return 0; //** SUCCESS **//
+        }
+    }
+
+    return 1; // More than four bytes, malformed
+}
+
+
+//**** Private
+static uint8_t skipTrackBytes(playbackStreamTrack_t * track, uint32_t numBytes)
+{
+    // Whatever isn't already in the window is skipped in the file without reading it
+    const uint32_t numBuffered = track->bufferLength - track->bufferPosition;
+
+    if(numBytes <= numBuffered)
+    {
+        track->bufferPosition += (uint16_t)numBytes;
+        return 0;
+    }
+
+    track->bufferPosition = track->bufferLength;
+    numBytes -= numBuffered;
+
+    if(numBytes > (track->fileEnd - track->fileOffset)) return 1;
+    track->fileOffset += numBytes;
+
+    return 0; //** SUCCESS **//
+}
+
+
+//**** Private
+static uint8_t getVoiceMessageLength(uint8_t statusByte)
+{
+    // Length INCLUDES the status byte, 0 for anything that isn't a voice message
+    switch(statusByte >> 4)
+    {
+        case 0x08: //---Note Off---//
+        case 0x09: //---Note On---//
+        case 0x0A: //---Aftertouch---//
+        case 0x0B: //---Control Change---//
+        case 0x0E: //---Pitch Wheel---//
+            return 3;
+
+        case 0x0C: //---Program Change---//
+        case 0x0D: //---Channel Pressure---//
+            return 2;
+
+        default:
+            return 0;
+    }
+}
+
+
+//**** Private
+static uint32_t readBigEndian(const uint8_t * data, uint8_t numBytes)
+{
+    uint32_t result = 0;
+
+    for(uint8_t a = 0; a < numBytes; ++a)
+    {
+        result = (result << 8) | data[a];
+    }
+
+    return result;
+}
@@ -0,0 +1,89 @@
+#ifndef PLAYBACK_STREAM_H
+#define PLAYBACK_STREAM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include "spscRing.h"
+#include "midiCompiler.h"
+#include "tempoMap.h"
+
+#define PLAYBACK_STREAM_RING_EVENTS 128         //Events prefetched ahead of playback, MUST be a power of two
+#define PLAYBACK_STREAM_LOW_WATERMARK 64        //Prefetch is woken when the ring drops to this many events (an output queue's worth)
+#define PLAYBACK_STREAM_HIGH_WATERMARK PLAYBACK_STREAM_RING_EVENTS //Prefetch fills the ring up to this many
+#define PLAYBACK_STREAM_MAX_TRACKS 16           //Format 1 tracks merged while streaming
+#define PLAYBACK_STREAM_TRACK_BUFFER_BYTES 128  //Read window kept for each track
+#define PLAYBACK_STREAM_RETRY_US 1000           //Playback retries this soon after finding the ring empty
+
+//An event ready to play, tempo already resolved into song time
+typedef struct
+{
+    uint64_t songTime;                          //uS from song start
+    uint8_t length;
+    uint8_t port;
+    uint8_t data[MIDI_COMPILED_EVENT_MAX_BYTES];
+} playbackStreamEvent_t;
+
+//One MTrk chunk being read through its own small window of the file
+typedef struct
+{
+    uint32_t fileOffset;                        //File offset of buffer[bufferLength]
+    uint32_t fileEnd;                           //End of the chunk
+    uint16_t bufferPosition;
+    uint16_t bufferLength;
+    uint8_t buffer[PLAYBACK_STREAM_TRACK_BUFFER_BYTES];
+    uint32_t absoluteTime;
+    uint64_t mergeKey;                          //absoluteTime, merge class, track index (as the compiler)
+    uint8_t trackIndex;
+    uint8_t runningStatus;
+    uint8_t port;                               //Output port, as the compiler
+    bool isFinished;
+    //--- Head event ---
+    uint8_t statusByte;                         //Voice status (running status expanded), or meta type
+    bool isMeta;
+    uint8_t length;                             //Voice bytes including the status
+    uint8_t data[MIDI_COMPILED_EVENT_MAX_BYTES];
+    uint32_t tempo;                             //Set tempo meta events only
+} playbackStreamTrack_t;
+
+typedef struct
+{
+    uint32_t numUnderruns;                      //Times playback found the ring empty before the song ended
+    uint32_t minFill;                           //Fewest events left in the ring as playback took one (before the last read)
+    uint32_t numBlockReads;                     //File reads by the prefetch
+    uint32_t numBytesRead;
+} playbackStreamStats_t;
+
+//Plays a song straight from the file system: a low priority prefetch
+//(playbackStream_fill) merges the tracks into a small ring of events
+//with their song time resolved, and playback consumes from the ring.
+//Memory use is fixed (sizeof this struct) whatever the song length.
+typedef struct
+{
+    spscRing_t ring;
+    playbackStreamEvent_t ringStorage[PLAYBACK_STREAM_RING_EVENTS];
+    atomic_bool isComplete;                     //Every track has been read, set after the last push
+    bool isStarved;                             //Consumer side, ring found empty (one underrun per episode)
+    playbackStreamStats_t stats;
+    //--- Producer side ---
+    playbackStreamTrack_t tracks[PLAYBACK_STREAM_MAX_TRACKS];
+    uint8_t numTracks;
+    tempoMap_t tempoMap;
+    tempoMapSegment_t tempoSegments[2];         //Ticks only move forward, see tempoMap_discardHistory
+} playbackStream_t;
+
+
+//Open and fill are the producer side and must be serialised with each
+//other (the system loop and the prefetch task share a mutex). Open
+//reads the header, then fills the ring once so playback can start.
+//Tracks are routed to output ports as midiCompiler_compileSong does.
+uint8_t playbackStream_open(playbackStream_t * stream, char * fileName, const uint8_t * trackPorts);
+uint8_t playbackStream_fill(playbackStream_t * stream);
+bool playbackStream_needsFill(playbackStream_t * stream);
+
+//Consumer side, only ever called by playback
+const playbackStreamEvent_t * playbackStream_peekEvent(playbackStream_t * stream, uint32_t offset);
+void playbackStream_dropEvent(playbackStream_t * stream);
+bool playbackStream_isFinished(playbackStream_t * stream);
+
+#endif
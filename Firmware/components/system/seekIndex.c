@@ -0,0 +1,260 @@
+#include <stdio.h>
+#include <string.h>
+#include "esp_log.h"
+#include "seekIndex.h"
+
+#define LOG_TAG "seekIndex"
+
+//Chase steps per channel, in the order they are sent. Bank select has
+//to reach the receiver before the program change it qualifies, and the
+//remaining controllers after it (some receivers reset them on a program
+//change). RPN/NRPN selection and data entry are skipped - replaying only
+//their final values would apply the data to the wrong parameter.
+#define CHASE_STEP_BANK_MSB 0
+#define CHASE_STEP_BANK_LSB 1
+#define CHASE_STEP_PROGRAM 2
+#define CHASE_STEP_CONTROLLERS 3 //Steps 3 to (3 + SEEK_NUM_CONTROLLERS - 1) are controller numbers
+#define CHASE_STEP_PRESSURE (CHASE_STEP_CONTROLLERS + SEEK_NUM_CONTROLLERS)
+#define CHASE_STEP_PITCH_BEND (CHASE_STEP_PRESSURE + 1)
+#define CHASE_NUM_STEPS (CHASE_STEP_PITCH_BEND + 1)
+
+static uint32_t getInterval(uint32_t numEvents);
+static bool isChasedController(uint8_t controller);
+
+
+//**** Public
+uint32_t seekIndex_getNumCheckpoints(uint32_t numEvents)
+{
+    // Used to size the checkpoint allocation before building
+    const uint32_t interval = getInterval(numEvents);
+
+    return (numEvents + interval - 1) / interval;
+}
+
+
+//**** Public
+uint8_t seekIndex_build(seekIndex_t * index, const midiCompiledSong_t * song, seekCheckpoint_t * checkpointBuffer, uint32_t maxCheckpoints)
+{
+    // One pass over the compiled song at load time, snapshotting
+    // the chase state every 'interval' events. A seek then starts
+    // from the nearest checkpoint at or before the target and never
+    // replays more than 'interval' events to get there.
+    seekChaseState_t state;
+    const uint32_t numCheckpoints = seekIndex_getNumCheckpoints(song->numEvents);
+
+    if((checkpointBuffer == NULL) || (numCheckpoints > maxCheckpoints))
+    {
+        ESP_LOGE(LOG_TAG, "Seek index needs %ld checkpoints, only %ld available", numCheckpoints, maxCheckpoints);
+        index->checkpoints = NULL;
+        index->numCheckpoints = 0;
+        return 1;
+    }
+
+    index->checkpoints = checkpointBuffer;
+    index->numCheckpoints = numCheckpoints;
+    index->interval = getInterval(song->numEvents);
+
+    seekIndex_resetState(&state);
+
+    for(uint32_t i = 0; i < song->numEvents; i++)
+    {
+        if((i % index->interval) == 0)
+        {
+            checkpointBuffer[i / index->interval].eventIndex = i;
+            checkpointBuffer[i / index->interval].tick = song->events[i].absoluteTime;
+            checkpointBuffer[i / index->interval].state = state;
+        }
+        seekIndex_applyEvent(&state, &song->events[i]);
+    }
+
+    return 0; //** SUCCESS **//
+}
+
+
+//**** Public
+uint32_t seekIndex_findState(const seekIndex_t * index, const midiCompiledSong_t * song, uint32_t tick, seekChaseState_t * state)
+{
+    // Binary searches the (tick ordered) event array for the first event
+    // at or after 'tick' and returns its index, with 'state' set to the
+    // channel state just before it. Events at exactly 'tick' are played
+    // rather than chased, so a seek to a bar line still sends that bar's
+    // first notes and controller changes.
+    uint32_t low = 0;
+    uint32_t high = song->numEvents;
+    uint32_t mid;
+    uint32_t eventIndex;
+    uint32_t checkpoint;
+
+    while(low < high)
+    {
+        mid = (low + high) >> 1;
+        if(song->events[mid].absoluteTime < tick) low = mid + 1;
+        else high = mid;
+    }
+
+    eventIndex = low;
+
+    if(index->numCheckpoints == 0)
+    {
+        seekIndex_resetState(state); //No index, replay from the start
+        for(uint32_t i = 0; i < eventIndex; i++) seekIndex_applyEvent(state, &song->events[i]);
+        return eventIndex;
+    }
+
+    checkpoint = eventIndex / index->interval;
+    if(checkpoint >= index->numCheckpoints) checkpoint = index->numCheckpoints - 1;
+
+    *state = index->checkpoints[checkpoint].state;
+    for(uint32_t i = index->checkpoints[checkpoint].eventIndex; i < eventIndex; i++)
+    {
+        seekIndex_applyEvent(state, &song->events[i]);
+    }
+
+    return eventIndex;
+}
+
+
+//**** Public
+void seekIndex_resetState(seekChaseState_t * state)
+{
+    memset(state, SEEK_STATE_UNSET, sizeof(seekChaseState_t));
+}
+
+
+//**** Public
+void seekIndex_applyEvent(seekChaseState_t * state, const midiCompiledEvent_t * event)
+{
+    seekChannelState_t * channel = &state->channels[(event->port * MIDI_OUTPUT_NUM_CHANNELS) + (event->data[0] & 0x0F)];
+
+    switch(event->data[0] & 0xF0)
+    {
+        case 0xB0: //Control change
+            if(event->data[1] < SEEK_NUM_CONTROLLERS)
+            {
+                channel->controllers[event->data[1]] = event->data[2];
+            }
+            else if(event->data[1] == 121) //Reset all controllers
+            {
+                memset(channel->controllers, SEEK_STATE_UNSET, sizeof(channel->controllers));
+                channel->channelPressure = SEEK_STATE_UNSET;
+                channel->pitchBend = 0xFFFF;
+            }
+            break;
+
+        case 0xC0: //Program change
+            channel->program = event->data[1];
+            break;
+
+        case 0xD0: //Channel pressure
+            channel->channelPressure = event->data[1];
+            break;
+
+        case 0xE0: //Pitch bend
+            channel->pitchBend = (uint16_t)event->data[1] | ((uint16_t)event->data[2] << 7);
+            break;
+
+        default: //Notes (and anything else) aren't chased
+            break;
+    }
+}
+
+
+//**** Public
+uint8_t seekIndex_getChaseMessage(const seekChaseState_t * state, seekChaseCursor_t * cursor, uint8_t * message, uint8_t * port)
+{
+    // Writes the next chase message to 'message', and the port it goes
+    // out on to 'port', and returns its length - 0 once everything has
+    // been produced. Only state the song actually set is chased, so the
+    // output is as small as it can be. Start with a zeroed cursor.
+    const seekChannelState_t * channel;
+    uint8_t channelNumber;
+    uint8_t step;
+
+    while(cursor->channel < SEEK_NUM_CHANNELS)
+    {
+        channel = &state->channels[cursor->channel];
+        channelNumber = cursor->channel % MIDI_OUTPUT_NUM_CHANNELS;
+        *port = cursor->channel / MIDI_OUTPUT_NUM_CHANNELS;
+        step = cursor->step++;
+
+        if(cursor->step >= CHASE_NUM_STEPS)
+        {
+            cursor->step = 0;
+            cursor->channel++;
+        }
+
+        if((step == CHASE_STEP_BANK_MSB) || (step == CHASE_STEP_BANK_LSB))
+        {
+            message[1] = (step == CHASE_STEP_BANK_MSB) ? 0 : 32;
+            if(channel->controllers[message[1]] == SEEK_STATE_UNSET) continue;
+            message[0] = 0xB0 | channelNumber;
+            message[2] = channel->controllers[message[1]];
+            return 3;
+        }
+
+        if(step == CHASE_STEP_PROGRAM)
+        {
+            if(channel->program == SEEK_STATE_UNSET) continue;
+            message[0] = 0xC0 | channelNumber;
+            message[1] = channel->program;
+            return 2;
+        }
+
+        if(step < CHASE_STEP_PRESSURE)
+        {
+            message[1] = step - CHASE_STEP_CONTROLLERS;
+            if(!isChasedController(message[1]) || (channel->controllers[message[1]] == SEEK_STATE_UNSET)) continue;
+            message[0] = 0xB0 | channelNumber;
+            message[2] = channel->controllers[message[1]];
+            return 3;
+        }
+
+        if(step == CHASE_STEP_PRESSURE)
+        {
+            if(channel->channelPressure == SEEK_STATE_UNSET) continue;
+            message[0] = 0xD0 | channelNumber;
+            message[1] = channel->channelPressure;
+            return 2;
+        }
+
+        if(channel->pitchBend == 0xFFFF) continue;
+        message[0] = 0xE0 | channelNumber;
+        message[1] = channel->pitchBend & 0x7F;
+        message[2] = (channel->pitchBend >> 7) & 0x7F;
+        return 3;
+    }
+
+    return 0;
+}
+
+
+//**** Private
+static uint32_t getInterval(uint32_t numEvents)
+{
+    const uint32_t interval = (numEvents + SEEK_INDEX_MAX_CHECKPOINTS - 1) / SEEK_INDEX_MAX_CHECKPOINTS;
+
+    return (interval < SEEK_INDEX_MIN_INTERVAL) ? SEEK_INDEX_MIN_INTERVAL : interval;
+}
+
+
+//**** Private
+static bool isChasedController(uint8_t controller)
+{
+    switch(controller)
+    {
+        case 0:     //Bank select, sent before the program change
+        case 32:
+        case 6:     //Data entry MSB/LSB
+        case 38:
+        case 96:    //Data increment/decrement
+        case 97:
+        case 98:    //NRPN LSB/MSB
+        case 99:
+        case 100:   //RPN LSB/MSB
+        case 101:
+            return false;
+
+        default:
+            return true;
+    }
+}
@@ -0,0 +1,61 @@
+#ifndef SEEK_INDEX_H
+#define SEEK_INDEX_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "midiCompiler.h"
+#include "midiOutput.h"
+
+#define SEEK_INDEX_MIN_INTERVAL 256     //Events between checkpoints, at least
+#define SEEK_INDEX_MAX_CHECKPOINTS 64   //Interval grows with the song to stay within this (~130KB per port)
+#define SEEK_NUM_CHANNELS (MIDI_OUTPUT_NUM_CHANNELS * MIDI_OUTPUT_NUM_PORTS) //Every channel of every port
+#define SEEK_NUM_CONTROLLERS 120        //120-127 are channel mode messages, never chased
+#define SEEK_STATE_UNSET 0xFF           //Nothing seen yet, so nothing to chase
+
+//Everything about a channel that a receiver would be left holding
+//at a given point in the song - which is what has to be re-sent
+//(chased) when playback jumps there without playing up to it
+typedef struct
+{
+    uint8_t program;
+    uint8_t channelPressure;
+    uint16_t pitchBend;             //14-bit, 0xFFFF when unset
+    uint8_t controllers[SEEK_NUM_CONTROLLERS];
+} seekChannelState_t;
+
+typedef struct
+{
+    seekChannelState_t channels[SEEK_NUM_CHANNELS];
+} seekChaseState_t;
+
+//Channel state BEFORE event 'eventIndex' is sent. Tempo isn't stored,
+//the tempo map already converts any tick straight to song time.
+typedef struct
+{
+    uint32_t eventIndex;
+    uint32_t tick;
+    seekChaseState_t state;
+} seekCheckpoint_t;
+
+typedef struct
+{
+    seekCheckpoint_t * checkpoints; //Allocated by the caller
+    uint32_t numCheckpoints;
+    uint32_t interval;              //Events between checkpoints
+} seekIndex_t;
+
+//Iterates the chase messages for a state, see seekIndex_getChaseMessage
+typedef struct
+{
+    uint8_t channel;
+    uint8_t step;
+} seekChaseCursor_t;
+
+uint32_t seekIndex_getNumCheckpoints(uint32_t numEvents);
+uint8_t seekIndex_build(seekIndex_t * index, const midiCompiledSong_t * song, seekCheckpoint_t * checkpointBuffer, uint32_t maxCheckpoints);
+uint32_t seekIndex_findState(const seekIndex_t * index, const midiCompiledSong_t * song, uint32_t tick, seekChaseState_t * state);
+void seekIndex_resetState(seekChaseState_t * state);
+void seekIndex_applyEvent(seekChaseState_t * state, const midiCompiledEvent_t * event);
+uint8_t seekIndex_getChaseMessage(const seekChaseState_t * state, seekChaseCursor_t * cursor, uint8_t * message, uint8_t * port);
+
+#endif
@@ -7,78 +7,87 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/queue.h"
+#include "freertos/semphr.h"
 #include "esp_system.h"
 #include "nvs_flash.h"
 #include "blePeripheralServer.h"
 #include "fileSys.h"
 #include "systemLowLevel.h"
+#include "midiCompiler.h"
+#include "playbackEngine.h"
+#include "midiRecorder.h"
+#include "systemTrace.h"
 
 
 #define LOG_TAG "SystemComponent"
 #define PLACYBACK_DATA_ALLOCATION_SIZE 1024*1024
-#define HAS_MORE_DELTA_TIME_BYTES(X) ((0x80 & X) && (1 << 8))
+#define PLAYBACK_TASK_STACK_SIZE 4096
+#define PLAYBACK_TASK_PRIORITY (configMAX_PRIORITIES - 2)
+#define PLAYBACK_NOTIFY_START (1 << 1) //DELTA_TIMER_NOTIFY_BIT is (1 << 0)
+#define MIDI_IN_NOTIFY_BIT (1 << 2) //Set by the midi in task once a thru message is queued
+#define PLAYBACK_NOTIFY_LIVE_EVENT (1 << 3)
+#define PREFETCH_TASK_STACK_SIZE 4096
+#define PREFETCH_TASK_PRIORITY 2 //Above the trace task, below everything timing related
+#define RECORDER_TASK_STACK_SIZE 4096
+#define RECORDER_TASK_PRIORITY 2 //Input is timed by its ISR, the encoder only has to keep up
+#define MIDI_IN_TASK_STACK_SIZE 3072
+#define MIDI_IN_TASK_PRIORITY (configMAX_PRIORITIES - 3) //Thru waits on it, above the ble host on its core
+
+static void playbackTask(void * param);
+static void prefetchTask(void * param);
+static void recorderTask(void * param);
+static void midiInTask(void * param);
+static void handleLiveEvent(const uint8_t * data, uint16_t length);
+static void stopPlayback(void);
+static void startUploadedSong(void);
+static bool isStreaming(void);
+
+
+static midiPlaybackRuntimeData_t playbackDataStore;
+static SemaphoreHandle_t playbackStateMutex = NULL; //Held by whoever is touching playbackDataStore
+
+static TaskHandle_t playbackTaskHandle = NULL;
+static StaticTask_t playbackTaskBuffer;
+static StackType_t playbackTaskStack[PLAYBACK_TASK_STACK_SIZE];
+
+static playbackStream_t playbackStreamStore; //A few KB, whatever the length of the song being streamed
+static SemaphoreHandle_t streamMutex = NULL; //Serialises file system access, the stream's producer side (open and fill) and the recorder
+
+static TaskHandle_t prefetchTaskHandle = NULL;
+static StaticTask_t prefetchTaskBuffer;
+static StackType_t prefetchTaskStack[PREFETCH_TASK_STACK_SIZE];
+
+static midiRecorder_t recorderStore; //Holds one block of the file being recorded
+static TaskHandle_t recorderTaskHandle = NULL;
+static StaticTask_t recorderTaskBuffer;
+static StackType_t recorderTaskStack[RECORDER_TASK_STACK_SIZE];
+static TaskHandle_t midiInTaskHandle = NULL;
+static StaticTask_t midiInTaskBuffer;
+static StackType_t midiInTaskStack[MIDI_IN_TASK_STACK_SIZE];
 
-typedef struct
-{
-    uint8_t * playbackPtr;
-    bool isRunningStatus;
-    uint32_t currentDeltaTime;
-    uint32_t totalDataLength;
-    const uint8_t * const playbackDataBASE;
-    uint8_t statusByte;
-    uint8_t previousStatusForRunningStatus;
-} midiPlaybackRuntimeData_t;
-
-static void playbackMidiData(midiPlaybackRuntimeData_t *playbackDataPtr);
-static uint32_t getMidiDeltaTime(uint8_t **deltaTimeBase);
-static uint32_t getMicroSecondsPerQuaterNote(uint8_t *const setTempoBase);
-static void processMetaMessage(uint8_t **playbackPtr);
-
-
-static bool isPlayingBack = false;
-static bool waitingForDeltaTimer = false;
 
 
-
-
-typedef enum 
-{
-    metaEvent_sequenceNum = 0x00,
-    metaEvent_textField = 0x01,
-    metaEvent_copyright = 0x02,
-    metaEvent_trackName = 0x03,
-    metaEvent_instrumentName = 0x04,
-    metaEvent_lyrics = 0x05,
-    metaEvent_marker = 0x06,
-    metaEvent_cuePoint = 0x07,
-    metaEvent_deviceName = 0x09, //new
-    metaEvent_channelPrefix = 0x20,
-    metaEvent_midiPort = 0x21, //new
-    metaEvent_endOfTrack = 0x2F,
-    metaEvent_setTempo = 0x51,
-    metaEvent_smpteOffset = 0x54,
-    metaEvent_setTimeSig = 0x58,
-    metaEvent_keySignature = 0x59,
-    metaEvent_sequencerSpecific = 0x7F,
-} midiMetaEventType_t;
-
 //*************************
 //***** SYSTEM LOOP *******
 //*************************
 void systemEntryPoint(void)
 {
     bleToAppQueueItem_t rxBleItem;
-    midiPlaybackRuntimeData_t playbackDataStore = 
-    {
-        .playbackPtr = heap_caps_malloc(PLACYBACK_DATA_ALLOCATION_SIZE, MALLOC_CAP_SPIRAM),
-        .playbackDataBASE = playbackDataStore.playbackPtr,
-        .isRunningStatus = false
-    };
+    uint8_t seekFailed;
+    uint8_t streamFailed;
+    uint8_t recordFailed;
+    uint32_t uploadLength;
+    uint32_t loopStartTime, loopEndTime;
+    uint32_t tempoMultiplier, tempoRampTime;
+    char streamFileName[MAX_FILENAME_CHARS];
+
+    playbackEngine_init(&playbackDataStore, heap_caps_malloc(PLACYBACK_DATA_ALLOCATION_SIZE, MALLOC_CAP_SPIRAM));
 
     playbackBufferBASE = playbackDataStore.playbackDataBASE;
+    playbackBufferCapacity = (playbackBufferBASE == NULL) ? 0 : PLACYBACK_DATA_ALLOCATION_SIZE;
 
     //Allocates from external-on-module PSRAM
-    if(playbackDataStore.playbackPtr == NULL)
+    if(playbackDataStore.playbackDataBASE == NULL)
     {
         while(1)
         {
@@ -87,22 +96,72 @@ void systemEntryPoint(void)
         }
     }
 
+    playbackStateMutex = xSemaphoreCreateMutex();
+    streamMutex = xSemaphoreCreateMutex();
+
+    //Playback gets its own high priority task on CPU CORE0 (BLE has core1), it
+    //sleeps until the delta timer ISR notifies it - so event timing is no longer
+    //quantised to the RTOS tick and no cpu time is spent polling
+    playbackTaskHandle = xTaskCreateStaticPinnedToCore(playbackTask, "playback", PLAYBACK_TASK_STACK_SIZE,
+                                                       NULL, PLAYBACK_TASK_PRIORITY, playbackTaskStack, &playbackTaskBuffer, 0);
+
+    //Reads ahead for songs streamed from the file system, on CPU CORE1
+    //so flash reads never hold up the playback task
+    prefetchTaskHandle = xTaskCreateStaticPinnedToCore(prefetchTask, "prefetch", PREFETCH_TASK_STACK_SIZE,
+                                                       NULL, PREFETCH_TASK_PRIORITY, prefetchTaskStack, &prefetchTaskBuffer, 1);
+
+    if((playbackStateMutex == NULL) || (streamMutex == NULL) || (playbackTaskHandle == NULL) || (prefetchTaskHandle == NULL))
+    {
+        while(1)
+        {
+            ESP_LOGE(LOG_TAG, "fault creating playback task");
+            vTaskDelay(pdMS_TO_TICKS(5000));
+        }
+    }
+
+
+    initSystemLowLevel(playbackTaskHandle);
+    systemTrace_init();
+
+    //Songs can still be uploaded and played without it
+    if(initFileSystem()->hasMountedSucessfully == false) ESP_LOGE(LOG_TAG, "File system unavailable, songs can't be streamed or recorded");
+
+    //Reads midi in, on CPU CORE1 - the task sets up the input edge
+    //interrupt, which then runs on that core too (clear of playback)
+    midiInTaskHandle = xTaskCreateStaticPinnedToCore(midiInTask, "midiIn", MIDI_IN_TASK_STACK_SIZE,
+                                                     NULL, MIDI_IN_TASK_PRIORITY, midiInTaskStack, &midiInTaskBuffer, 1);
+    if(midiInTaskHandle == NULL) ESP_LOGE(LOG_TAG, "fault creating midi in task, midi in is unavailable");
 
-    initSystemLowLevel();
+    //Records midi in, on CPU CORE1 with the reader
+    recorderTaskHandle = xTaskCreateStaticPinnedToCore(recorderTask, "recorder", RECORDER_TASK_STACK_SIZE,
+                                                       NULL, RECORDER_TASK_PRIORITY, recorderTaskStack, &recorderTaskBuffer, 1);
+    if(recorderTaskHandle == NULL) ESP_LOGE(LOG_TAG, "fault creating recorder task, midi in can't be recorded");
+
+    //Live events from the client can play on any port, straight from
+    //the ble stack to the playback task (see handleLiveEvent). Playback
+    //only keeps a port clear for them once they are coming in
+    xSemaphoreTake(playbackStateMutex, portMAX_DELAY);
+    playbackEngine_setLivePorts(&playbackDataStore, (1 << MIDI_OUTPUT_NUM_PORTS) - 1);
+    xSemaphoreGive(playbackStateMutex);
+    blePeriphAPI_setLiveEventHandler(handleLiveEvent);
 
 
     ESP_LOGI(LOG_TAG, "********* SYSTEM STARTUP SUCCESSFUL *******");
     while(1)
     {
-        if(xQueueReceive(blePeriph_bleToAppQueue, &rxBleItem, pdMS_TO_TICKS(1)) == pdTRUE)
+        //Commands from the client have their own blocking wait,
+        //playback timing never depends on this loop
+        if(blePeriphAPI_receive(&rxBleItem, portMAX_DELAY))
         {
             switch(rxBleItem.opcode)
             {
 
                 case 1: //initial playback payload received
                     ESP_LOGI(LOG_TAG, "Playback stream initiated by the client");
+                    //The upload buffer is being overwritten, so
+                    //whatever was playing from it must stop now
+                    stopPlayback();
                     playbackDataStore.totalDataLength = rxBleItem.dataLength;
-                    isPlayingBack = true;
                     break;
 
                 case 2: //additional playback payload recieved
@@ -112,419 +171,341 @@ void systemEntryPoint(void)
 
                 case 3: //stop playback
                     ESP_LOGI(LOG_TAG, "Stop playback command received from client");
-                    isPlayingBack = false;
-                    waitingForDeltaTimer = false;
+                    stopPlayback();
                     break;
 
-                case 4:
+                case 4: //playback upload complete - compile then start playback
+                    ESP_LOGI(LOG_TAG, "Playback upload complete, %ld bytes received", playbackDataStore.totalDataLength);
+                    startUploadedSong();
                     break;
 
-                case 5:
+                case 5: //seek - data[0-3] = target tick (little endian), plays on from there
+                    ESP_LOGI(LOG_TAG, "Seek command received from client");
+                    if(rxBleItem.dataLength < 4) break;
+                    xSemaphoreTake(playbackStateMutex, portMAX_DELAY);
+                    seekFailed = playbackEngine_seek(&playbackDataStore, (uint32_t)rxBleItem.data[0] | ((uint32_t)rxBleItem.data[1] << 8) |
+                                                                         ((uint32_t)rxBleItem.data[2] << 16) | ((uint32_t)rxBleItem.data[3] << 24));
+                    xSemaphoreGive(playbackStateMutex);
+                    if(!seekFailed) xTaskNotify(playbackTaskHandle, PLAYBACK_NOTIFY_START, eSetBits);
                     break;
 
-                case 0xFF:
+                case 6: //set loop - data[0-3] = loop start, data[4-7] = loop end (uS of song time, little endian), end of 0 loops to the end of the song
+                    ESP_LOGI(LOG_TAG, "Set loop command received from client");
+                    if(rxBleItem.dataLength < 8) break;
+                    loopStartTime = (uint32_t)rxBleItem.data[0] | ((uint32_t)rxBleItem.data[1] << 8) | ((uint32_t)rxBleItem.data[2] << 16) | ((uint32_t)rxBleItem.data[3] << 24);
+                    loopEndTime = (uint32_t)rxBleItem.data[4] | ((uint32_t)rxBleItem.data[5] << 8) | ((uint32_t)rxBleItem.data[6] << 16) | ((uint32_t)rxBleItem.data[7] << 24);
+                    xSemaphoreTake(playbackStateMutex, portMAX_DELAY);
+                    playbackEngine_setLoop(&playbackDataStore, loopStartTime, loopEndTime);
+                    xSemaphoreGive(playbackStateMutex);
                     break;
-            }
-        }
 
-        if (isPlayingBack) // tidy this up later
-        {
-            if (waitingForDeltaTimer)
-            {
-                if (deltaTimerFired)
-                {
-                    deltaTimerFired = false;
-                    waitingForDeltaTimer = false;
-                    playbackMidiData(&playbackDataStore);
-                }
-            }
-            else
-            {
-                playbackMidiData(&playbackDataStore);
-            }
-        }
+                case 7: //clear loop - plays on past the loop end
+                    ESP_LOGI(LOG_TAG, "Clear loop command received from client");
+                    xSemaphoreTake(playbackStateMutex, portMAX_DELAY);
+                    playbackEngine_clearLoop(&playbackDataStore);
+                    xSemaphoreGive(playbackStateMutex);
+                    break;
 
-        vTaskDelay(1);
-    }
-}
+                case 8: //stream a song from the file system - data = file name (no terminator needed)
+                    ESP_LOGI(LOG_TAG, "Stream playback command received from client");
+                    if((rxBleItem.dataLength == 0) || (rxBleItem.dataLength >= MAX_FILENAME_CHARS)) break;
+                    memset(streamFileName, 0, MAX_FILENAME_CHARS);
+                    memcpy(streamFileName, rxBleItem.data, rxBleItem.dataLength);
+                    if(recorderStore.isRecording) //Only one file can be open
+                    {
+                        ESP_LOGE(LOG_TAG, "Can't stream while recording");
+                        break;
+                    }
+                    stopPlayback(); //Playback may be consuming the stream being replaced
+                    xSemaphoreTake(streamMutex, portMAX_DELAY);
+                    streamFailed = playbackStream_open(&playbackStreamStore, streamFileName, playbackDataStore.trackPorts);
+                    xSemaphoreGive(streamMutex);
+                    if(streamFailed) break;
+                    xSemaphoreTake(playbackStateMutex, portMAX_DELAY);
+                    playbackEngine_startStream(&playbackDataStore, &playbackStreamStore);
+                    xSemaphoreGive(playbackStateMutex);
+                    xTaskNotify(playbackTaskHandle, PLAYBACK_NOTIFY_START, eSetBits);
+                    break;
 
+                case 9: //track port map - data[n] = output port for track n (later tracks port 0), used from the next upload or stream, midiPort meta events still override it
+                    ESP_LOGI(LOG_TAG, "Track port map received from client");
+                    xSemaphoreTake(playbackStateMutex, portMAX_DELAY);
+                    memset(playbackDataStore.trackPorts, 0, MIDI_MAX_TRACKS);
+                    memcpy(playbackDataStore.trackPorts, rxBleItem.data, (rxBleItem.dataLength < sizeof(rxBleItem.data)) ? rxBleItem.dataLength : sizeof(rxBleItem.data));
+                    xSemaphoreGive(playbackStateMutex);
+                    break;
 
+                case 10: //tempo - data[0-3] = multiplier (16.16 fixed point, 0x10000 as written), data[4-7] = ramp time (uS, little endian), absent or 0 changes straight away
+                    ESP_LOGI(LOG_TAG, "Tempo command received from client");
+                    if(rxBleItem.dataLength < 4) break;
+                    tempoMultiplier = (uint32_t)rxBleItem.data[0] | ((uint32_t)rxBleItem.data[1] << 8) | ((uint32_t)rxBleItem.data[2] << 16) | ((uint32_t)rxBleItem.data[3] << 24);
+                    tempoRampTime = 0;
+                    if(rxBleItem.dataLength >= 8) tempoRampTime = (uint32_t)rxBleItem.data[4] | ((uint32_t)rxBleItem.data[5] << 8) | ((uint32_t)rxBleItem.data[6] << 16) | ((uint32_t)rxBleItem.data[7] << 24);
+                    xSemaphoreTake(playbackStateMutex, portMAX_DELAY);
+                    playbackEngine_rampTempo(&playbackDataStore, tempoMultiplier, tempoRampTime);
+                    xSemaphoreGive(playbackStateMutex);
+                    xTaskNotify(playbackTaskHandle, PLAYBACK_NOTIFY_START, eSetBits); //Re-plans the next wake
+                    break;
 
+                case 11: //midi clock - data[0] = ports to send clock, start/stop/continue and song position on (bit n for port n), from the next start or seek
+                    ESP_LOGI(LOG_TAG, "Clock ports command received from client");
+                    if(rxBleItem.dataLength < 1) break;
+                    xSemaphoreTake(playbackStateMutex, portMAX_DELAY);
+                    playbackEngine_setClockPorts(&playbackDataStore, rxBleItem.data[0]);
+                    xSemaphoreGive(playbackStateMutex);
+                    break;
 
-static void playbackMidiData(midiPlaybackRuntimeData_t *playbackDataPtr)
-{
-    uint8_t bytesToSend = 0;
-    uint8_t messageSubType = 0;
+                case 12: //record - data[0] = midi in port, data[1-] = file name (no terminator needed), plays on alongside whatever is playing
+                    ESP_LOGI(LOG_TAG, "Record command received from client");
+                    if((rxBleItem.dataLength < 2) || ((rxBleItem.dataLength - 1) >= MAX_FILENAME_CHARS) || (recorderTaskHandle == NULL)) break;
+                    if(isStreaming()) //Only one file can be open
+                    {
+                        ESP_LOGE(LOG_TAG, "Can't record while streaming");
+                        break;
+                    }
+                    memset(streamFileName, 0, MAX_FILENAME_CHARS);
+                    memcpy(streamFileName, &rxBleItem.data[1], rxBleItem.dataLength - 1);
+                    xSemaphoreTake(streamMutex, portMAX_DELAY);
+                    recordFailed = midiRecorder_start(&recorderStore, streamFileName, rxBleItem.data[0]);
+                    xSemaphoreGive(streamMutex);
+                    if(recordFailed) break;
+                    //Playback reads the input, and hands every byte over
+                    xSemaphoreTake(playbackStateMutex, portMAX_DELAY);
+                    playbackEngine_setInputTap(&playbackDataStore, recorderStore.port, &recorderStore.input);
+                    xSemaphoreGive(playbackStateMutex);
+                    xTaskNotifyGive(recorderTaskHandle);
+                    break;
 
-    if (playbackDataPtr->isRunningStatus == false)
-    {
-        ESP_LOGI(LOG_TAG, "Fetching next midi event delta-time");
-        playbackDataPtr->currentDeltaTime = getMidiDeltaTime(&playbackDataPtr->playbackPtr);
-    }
+                case 13: //stop recording - finishes the file
+                    ESP_LOGI(LOG_TAG, "Stop recording command received from client");
+                    xSemaphoreTake(playbackStateMutex, portMAX_DELAY);
+                    playbackEngine_setInputTap(&playbackDataStore, recorderStore.port, NULL);
+                    xSemaphoreGive(playbackStateMutex);
+                    xSemaphoreTake(streamMutex, portMAX_DELAY);
+                    if(recorderStore.isRecording) midiRecorder_stop(&recorderStore);
+                    xSemaphoreGive(streamMutex);
+                    break;
 
-    playbackDataPtr->statusByte = *playbackDataPtr->playbackPtr;
+                case 14: //midi thru - data[0] = midi in port, data[1] = ports to forward its channel messages to (bit n for port n), 0 turns it off
+                    ESP_LOGI(LOG_TAG, "Midi thru command received from client");
+                    if(rxBleItem.dataLength < 2) break;
+                    xSemaphoreTake(playbackStateMutex, portMAX_DELAY);
+                    playbackEngine_setThru(&playbackDataStore, rxBleItem.data[0], rxBleItem.data[1]);
+                    xSemaphoreGive(playbackStateMutex);
+                    break;
 
-    if ((playbackDataPtr->previousStatusForRunningStatus != 0) && playbackDataPtr->isRunningStatus) // runs from second iteration
-    {
-        if (playbackDataPtr->previousStatusForRunningStatus < 0xF8) // Doesnt apply to System Real-Time Message type
-        {
-            playbackDataPtr->statusByte = playbackDataPtr->previousStatusForRunningStatus;
+                //Live events (BLE_LIVE_EVENT_OPCODE) never come through here, see handleLiveEvent
+
+                case 16: //begin upload - data[0-3] = song length (little endian), the song then comes in on the upload characteristic
+                    ESP_LOGI(LOG_TAG, "Upload begin command received from client");
+                    if(rxBleItem.dataLength < 4) break;
+                    uploadLength = (uint32_t)rxBleItem.data[0] | ((uint32_t)rxBleItem.data[1] << 8) | ((uint32_t)rxBleItem.data[2] << 16) | ((uint32_t)rxBleItem.data[3] << 24);
+                    //The upload buffer is being overwritten, as case 1
+                    stopPlayback();
+                    playbackDataStore.totalDataLength = 0;
+                    if(blePeriphAPI_beginUpload(playbackDataStore.playbackDataBASE, PLACYBACK_DATA_ALLOCATION_SIZE, uploadLength)) ESP_LOGE(LOG_TAG, "Upload refused");
+                    break;
+
+                case BLE_UPLOAD_COMPLETE_OPCODE: //sent by the ble side once the whole upload is in - data[0-3] = song length
+                    playbackDataStore.totalDataLength = (uint32_t)rxBleItem.data[0] | ((uint32_t)rxBleItem.data[1] << 8) | ((uint32_t)rxBleItem.data[2] << 16) | ((uint32_t)rxBleItem.data[3] << 24);
+                    ESP_LOGI(LOG_TAG, "Upload complete, %ld bytes received", playbackDataStore.totalDataLength);
+                    startUploadedSong();
+                    break;
+
+                case 0xFF:
+                    break;
+            }
         }
     }
+}
 
 
-    if (playbackDataPtr->statusByte == 0xFF) 
-    {
-        if (playbackDataPtr->isRunningStatus == false) playbackDataPtr->playbackPtr += 1; // now points to base of message data
-        else playbackDataPtr->isRunningStatus = false;
-        
-        processMetaMessage(&playbackDataPtr->playbackPtr);
 
-        if(isPlayingBack == false) //Was the last meta message end of file?
-        {
-            playbackDataPtr->playbackPtr = playbackDataPtr->playbackDataBASE;
-            return;
-        }
 
-    }
-    else if ((playbackDataPtr->statusByte >= 0x80) && (playbackDataPtr->statusByte <= 0xEF)) //--- Voice Message Type ---//
+//************************************
+//********* PLAYBACK TASK ************
+//************************************
+static void playbackTask(void * param)
+{
+    uint32_t notifyBits;
+    bool needsFill;
+
+    (void)param;
+
+    while(1)
     {
-        // All voice message status bytes have the following format:
-        // StatusByte[4-7] = voice message opcode (voice message sub-type)
-        // StatusByte[0-3] = channel being addressed (0-15)
-
-        // The MIDI spec features 'running status' capability,
-        // if the current event type is the event immediately
-        // before it, then the new event does not need a status byte
-        if (playbackDataPtr->isRunningStatus == false)
-        {
-            messageSubType = (playbackDataPtr->statusByte >> 4);
-        }
-        else
+        //Blocks until the delta timer ISR, a whole thru message from the
+        //midi in task, a live event or the system loop notifies this task,
+        //the ISR requests a context switch so this runs immediately after
+        //the alarm fires
+        xTaskNotifyWait(0, UINT32_MAX, &notifyBits, portMAX_DELAY);
+
+        xSemaphoreTake(playbackStateMutex, portMAX_DELAY);
+        if(notifyBits & (DELTA_TIMER_NOTIFY_BIT | PLAYBACK_NOTIFY_START | MIDI_IN_NOTIFY_BIT | PLAYBACK_NOTIFY_LIVE_EVENT))
         {
-            // isRunningStatus is set false later
-            messageSubType = (playbackDataPtr->previousStatusForRunningStatus >> 4);
+            playbackEngine_service(&playbackDataStore);
         }
+        needsFill = (playbackDataStore.stream != NULL) && playbackStream_needsFill(playbackDataStore.stream);
+        xSemaphoreGive(playbackStateMutex);
 
-        playbackDataPtr->previousStatusForRunningStatus = playbackDataPtr->statusByte;
+        //Reading ahead is left to the prefetch task, which
+        //only runs once this task is back to waiting
+        if(needsFill) xTaskNotifyGive(prefetchTaskHandle);
+    }
+}
 
-        switch (messageSubType)
-        {
-        case 0x08: //---Note Off---//
-            // Format (n = channel number)
-            // byte[0] = 0x8n <-- currently pointing at (if NOT running status)
-            // Byte[1] = Note Number <-- pointing here if this is 'running status'
-            // Byte[2] = Velocity
-            ESP_LOGI(LOG_TAG, "note_off channel=%0x, note=%d, velocity=%d, time=%ld",
-                     (0x0F & playbackDataPtr->statusByte), *playbackDataPtr->playbackPtr, *(playbackDataPtr->playbackPtr + 1), playbackDataPtr->currentDeltaTime);
-            bytesToSend = 3;
-            break;
-
-        case 0x09: //---Note On---//
-            // Format (n = channel number)
-            // byte[0] = 0x9n <-- currently pointing at (if NOT running status)
-            // Byte[1] = Note Number <-- pointing here if this is 'running status'
-            // Byte[2] = Velocity
-            ESP_LOGI(LOG_TAG, "note_on channel=%0x, note=%d, velocity=%d, time=%ld",
-                     (0x0F & playbackDataPtr->statusByte), *playbackDataPtr->playbackPtr, *(playbackDataPtr->playbackPtr + 1), playbackDataPtr->currentDeltaTime);
-            bytesToSend = 3;
-            break;
-
-        case 0x0A: //---Aftertouch---//
-            // Format (n = channel number)
-            // Byte[0] = 0xAn <-- currently pointing at (if NOT running status)
-            // Byte[1] = Note Number <-- pointing here if this is 'running status'
-            // Byte[2] = Pressure Value
-            ESP_LOGI(LOG_TAG, "aftertouch channel=%0x, note=%d, pressure=%d, time=%ld",
-                     (0x0F & playbackDataPtr->statusByte), *playbackDataPtr->playbackPtr, *(playbackDataPtr->playbackPtr + 1), playbackDataPtr->currentDeltaTime);
-            bytesToSend = 3;
-            break;
-
-        case 0x0B: //---Control Change---//
-            // Format (n = channel number)
-            // Byte[0] =  0xBn <-- currently pointing at (if NOT running status)
-            // Byte[1] = Control opcode <-- pointing here if this is 'running status'
-            // Byte[2] = Value
-            ESP_LOGI(LOG_TAG, "control_change channel=%0x, control=%d, value=%d, time=%ld",
-                     (0x0F & playbackDataPtr->statusByte), *playbackDataPtr->playbackPtr, *(playbackDataPtr->playbackPtr + 1), playbackDataPtr->currentDeltaTime);
-            bytesToSend = 3;
-            break;
-
-        case 0x0C: //---Program Change---//
-            // Format (n = channel num)
-            // Byte[0] = 0xCn <-- currently pointing at (if NOT running status)
-            // Byte[1] = Program value (selects instrument) <-- pointing here if this is 'running status'
-            ESP_LOGI(LOG_TAG, "program_change channel=%0x, program=%d, time=%ld",
-                     (0x0F & playbackDataPtr->statusByte), *playbackDataPtr->playbackPtr, playbackDataPtr->currentDeltaTime);
-            bytesToSend = 2;
-            break;
-
-        case 0x0D: //---Channel Pressure---//
-            // Format (n = channel num)
-            // Byte[0] = 0xDn <-- currently pointing at (if NOT running status)
-            // Byte[1] = Pressure value <-- pointing here if this is 'running status'
-            ESP_LOGI(LOG_TAG, "channel_pressure channel=%0x, value=%d, time=%ld",
-                     (0x0F & playbackDataPtr->statusByte), *playbackDataPtr->playbackPtr, playbackDataPtr->currentDeltaTime);
-            bytesToSend = 2;
-            break;
-
-        case 0x0E: //---Pitch Wheel---//
-            // Format (n = channel num)
-            // Byte[0] = 0xEn <-- currently pointing at (if NOT running status)
-            // Byte[1] = Pitch Value MSB (these two bytes must each have bit 8 removed, concatenate result) <-- pointing here if this is 'running status'
-            // Byte[2] = Pitch Value LSB
-            ESP_LOGI(LOG_TAG, "pitch_wheel channel=%0x, msb=%d, lsb=%d, time=%ld",
-                     (0x0F & playbackDataPtr->statusByte), *playbackDataPtr->playbackPtr, *(playbackDataPtr->playbackPtr + 1), playbackDataPtr->currentDeltaTime);
-            bytesToSend = 3;
-            break;
-
-        default: //--- ERROR ---//
-            ESP_LOGE(LOG_TAG, "VOICE MESSAGE: ERROR Unrecognised Message!");
-            // HANDLE ERROR!
-            break;
-        }
 
-        if ((playbackDataPtr->currentDeltaTime != 0) && (playbackDataPtr->isRunningStatus == false))
-        {
-            ESP_LOGI(LOG_TAG, "Just set delta timer running");
-            deltaTimerFired = false;
-            waitingForDeltaTimer = true;
-            startDeltaTimer(playbackDataPtr->currentDeltaTime);
-            //while(!deltaTimerFired){};
-        }
 
-        if (playbackDataPtr->isRunningStatus)
-        {
-            playbackDataPtr->isRunningStatus = false;
-            --bytesToSend; // no status byte to send
-            ESP_LOGI(LOG_TAG, "Sending following midi message (this is a running status):");
-            for (uint8_t a = 0; a < bytesToSend; ++a)
-            {
-                ESP_LOGI(LOG_TAG, "0x%0x", *(playbackDataPtr->playbackPtr + a));
-            }
-            uart_write_bytes(MIDI_UART_NUM, playbackDataPtr->playbackPtr, bytesToSend);
-            playbackDataPtr->playbackPtr += bytesToSend;
-        }
-        else
-        {
-            uart_write_bytes(MIDI_UART_NUM, playbackDataPtr->playbackPtr, bytesToSend);
-            ESP_LOGI(LOG_TAG, "Sending following midi message:");
-            for (uint8_t a = 0; a < bytesToSend; ++a)
-            {
-                ESP_LOGI(LOG_TAG, "0x%0x", *(playbackDataPtr->playbackPtr + a));
-            }
-            playbackDataPtr->playbackPtr += bytesToSend;
-        }
 
-        ESP_LOGI(LOG_TAG, "Event processed");
-        ESP_LOGI(LOG_TAG, "\n");
-    }
-    else
+//************************************
+//********* PREFETCH TASK ************
+//************************************
+static void prefetchTask(void * param)
+{
+    (void)param;
+
+    while(1)
     {
-        // In order to reach here the playback pointer has
-        // reached a status byte that it doesn't recognise.
-        // This must be a 'running status', where subsequent
-        // events of the same type may ommit the status byte
-        ESP_LOGI(LOG_TAG, "Running status detected");
-        playbackDataPtr->isRunningStatus = true; // Must be running status?
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        xSemaphoreTake(streamMutex, portMAX_DELAY);
+        playbackStream_fill(&playbackStreamStore);
+        xSemaphoreGive(streamMutex);
     }
 }
 
 
 
-static void processMetaMessage(uint8_t **playbackPtr)
+
+//************************************
+//********* MIDI IN TASK *************
+//************************************
+static void midiInTask(void * param)
 {
-    // This function deals with midi meta event messages.
-    // A meta message is NEVER sent over midi, it is information
-    // about the file being played, intended for the playback device.
+    uint32_t numThru;
 
-    // Meta messages ONLY exist in midi FILES, they are NEVER sent or revieved over midi.
+    (void)param;
 
-    uint8_t numBytes;
+    initMidiIn(); //Edge interrupt on this core
 
-    switch (**playbackPtr)
+    while(1)
     {
-    case metaEvent_deviceName:
-        ESP_LOGI(LOG_TAG, "Device Name meta event detected, ignoring");
-        *playbackPtr += 1;            // Will be pointing at data length after this
-        numBytes = **playbackPtr;     // Get number of data bytes assosiated with thing meta event
-        *playbackPtr += numBytes + 1; // Now pointing to delta-time of next event
-        break;
-
-    case metaEvent_midiPort:
-        *playbackPtr += 1;            // Will be pointing at data length after this
-        numBytes = **playbackPtr;     // Get number of data bytes assosiated with thing meta event
-        *playbackPtr += numBytes + 1; // Now pointing to delta-time of next event
-        ESP_LOGI(LOG_TAG, "Midi Port meta event detected, ignoring");
-        break;
-
-    case metaEvent_sequenceNum:
-        // Two bytes
-        *playbackPtr += 3;
-        ESP_LOGI(LOG_TAG, "Sequence Number meta event detected, ignoring");
-        break;
-
-    case metaEvent_cuePoint:
-    case metaEvent_marker:
-    case metaEvent_lyrics:
-    case metaEvent_instrumentName:
-    case metaEvent_trackName:
-    case metaEvent_copyright:
-    case metaEvent_textField:
-        ESP_LOGI(LOG_TAG, "HERE!");
-        // All mevta events of variable length
-        // Not bothered about any of these so just increment
-        // file pointer onto the delta-time base of the next event
-        *playbackPtr += 1;            // Will be pointing at data length after this
-        numBytes = **playbackPtr;     // Get number of data bytes assosiated with thing meta event
-        *playbackPtr += numBytes + 1; // Now pointing to delta-time of next event
-        ESP_LOGI(LOG_TAG, "Ignored variable-length meta message");
-        break;
-
-    case metaEvent_channelPrefix:
-        // Single byte
-        *playbackPtr += 1;            // Will be pointing at data length after this
-        numBytes = **playbackPtr;     // Get number of data bytes assosiated with thing meta event
-        *playbackPtr += numBytes + 1; // Now pointing to delta-time of next event
-        ESP_LOGI(LOG_TAG, "Channel prefix meta event detected, ignoring");
-        break;
-
-    case metaEvent_endOfTrack:
-        // Single byte
-        ESP_LOGI(LOG_TAG, "End of midi track detected!");
-        isPlayingBack = false;
-        break;
-
-    case metaEvent_setTempo:
-        // Three bytes
-        //ESP_LOGI(LOG_TAG, "Set tempo to %ld microseconds per quater-note", getMicroSecondsPerQuaterNote(*playbackPtr));
-        *playbackPtr += 1;            // Will be pointing at data length after this
-        numBytes = **playbackPtr;     // Get number of data bytes assosiated with thing meta event
-        *playbackPtr += numBytes + 1; // Now pointing to delta-time of next event
-        break;
-
-    case metaEvent_smpteOffset:
-        // Five bytes
-        *playbackPtr += 1;            // Will be pointing at data length after this
-        numBytes = **playbackPtr;     // Get number of data bytes assosiated with thing meta event
-        *playbackPtr += numBytes + 1; // Now pointing to delta-time of next event
-        ESP_LOGI(LOG_TAG, "SmpteOffset meta event detected, ignoring");
-        break;
-
-    case metaEvent_setTimeSig:
-        // Four bytes
-        *playbackPtr += 1;            // Will be pointing at data length after this
-        numBytes = **playbackPtr;     // Get number of data bytes assosiated with thing meta event
-        *playbackPtr += numBytes + 1; // Now pointing to delta-time of next event
-        ESP_LOGI(LOG_TAG, "Time signature meta event detected, ignoring");
-        break;
-
-    case metaEvent_keySignature:
-        // Two bytes
-        *playbackPtr += 1;            // Will be pointing at data length after this
-        numBytes = **playbackPtr;     // Get number of data bytes assosiated with thing meta event
-        *playbackPtr += numBytes + 1; // Now pointing to delta-time of next event
-        ESP_LOGI(LOG_TAG, "Key signature meta event detected, ignoring");
-        break;
-
-    case metaEvent_sequencerSpecific:
-        // for device specific use
-        ESP_LOGE(LOG_TAG, "Device specific meta event detected");
-        break;
-
-    default:
-        ESP_LOGE(LOG_TAG, "Unrecognised meta event opcode");
-        // HANDLE ERROR!
-        break;
+        //Wakes as the uart hands over each byte, the input goes to the
+        //recorder's tap and the thru queues straight away. Playback is
+        //only woken once a whole message is waiting to go out - so
+        //recording alone never takes time from it
+        waitMidiIn();
+
+        xSemaphoreTake(playbackStateMutex, portMAX_DELAY);
+        numThru = playbackEngine_readInput(&playbackDataStore);
+        xSemaphoreGive(playbackStateMutex);
+
+        if(numThru) xTaskNotify(playbackTaskHandle, MIDI_IN_NOTIFY_BIT, eSetBits);
     }
 }
 
 
 
-static uint32_t getMicroSecondsPerQuaterNote(uint8_t *const setTempoBase)
+
+//************************************
+//********* RECORDER TASK ************
+//************************************
+static void recorderTask(void * param)
 {
-    // This function processes the SET TEMPO midi meta event
-    // it expects a pointer to the base of the event
-
-    // The SET TEMPO meta event has the following layout:
-    // 0x51          //Set-Tempo opcode
-    // 0x03          //states number of remaining bytes
-    // byte byte 0   //MSB of 24-bit temp value
-    // data byte 1
-    // data byte 2
-    //
-    // The tempo value is ALWAYS in microseconds per quater-note
-
-    if (*setTempoBase != 0x51)
-    {
-        ESP_LOGE(LOG_TAG, "Incorrect base address passed to 'getMicroSecondsPerQuaterNote' - operation aborted");
-        return 0;
-    }
+    uint8_t recordFailed = 0;
 
-    uint32_t result = 0;
-    uint8_t buffer[4] = {0};
-    uint8_t iterator = 0;
+    (void)param;
 
-    if (*(setTempoBase + 1) > sizeof(uint32_t))
+    while(1)
     {
-        ESP_LOGE(LOG_TAG, "Error, number of data bytes in set tempo exceeds expected size - operation aborted");
-        return 0;
+        //Sleeps until a recording starts, then encodes the input every
+        //MIDI_RECORDER_POLL_MS - the bytes are already timed, so how
+        //promptly this runs has no effect on the recording
+        if(recorderStore.isRecording) vTaskDelay(pdMS_TO_TICKS(MIDI_RECORDER_POLL_MS));
+        else ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        xSemaphoreTake(streamMutex, portMAX_DELAY);
+        if(recorderStore.isRecording) recordFailed = midiRecorder_service(&recorderStore);
+        xSemaphoreGive(streamMutex);
+
+        //Abandoned, the input has nowhere to go
+        if(recordFailed)
+        {
+            xSemaphoreTake(playbackStateMutex, portMAX_DELAY);
+            playbackEngine_setInputTap(&playbackDataStore, recorderStore.port, NULL);
+            xSemaphoreGive(playbackStateMutex);
+            recordFailed = 0;
+        }
     }
+}
 
-    memcpy(buffer, setTempoBase + 2, *(setTempoBase + 1));
 
-    iterator = 0;
-    for (int8_t a = (*(setTempoBase + 1) - 1); a >= 0; --a)
-    {
-        result |= buffer[iterator] << (a * 8);
-        iterator++;
-    }
 
-    ESP_LOGI(LOG_TAG, "Tempo in uS per quater-note: %ld", result);
 
-    return result;
+//************************************
+//******** LIVE EVENT HANDLER ********
+//************************************
+static void handleLiveEvent(const uint8_t * data, uint16_t length)
+{
+    //Called by the ble stack as the client's write is handled, data[0] =
+    //ports to play on (bit n for port n), data[1-] = channel messages.
+    //It only queues the event (the ble host task is its one producer, no
+    //lock needed) and wakes the playback task, which on core 0 and at its
+    //priority gets to it straight away. Latency is measured from here
+    uint64_t writeTime = getDeltaTimerNow();
+
+    if(length < 2) return;
+    if(playbackEngine_queueLiveEvent(&playbackDataStore, writeTime, data[0], &data[1], length - 1)) return; //Too long, or the queue is full (counted)
+
+    xTaskNotify(playbackTaskHandle, PLAYBACK_NOTIFY_LIVE_EVENT, eSetBits);
 }
 
 
 
-static uint32_t getMidiDeltaTime(uint8_t **deltaTimeBase)
+
+static void stopPlayback(void)
 {
-    // This function processes the delta-time bytes of a midi event
-    // it exptects a pointer to the base of a delta-time.
+    uint32_t pendingSysExBytes;
 
-    // Delta times are ALWAYS four bytes max, MSB FIRST.
-    // Bit 8 of a delta-time byte is a flag - indicating more bytes to follow.
-    // The final delta-time value is created by removing the flag bit from each
-    // byte and concatenating the result.
+    xSemaphoreTake(playbackStateMutex, portMAX_DELAY);
+    pendingSysExBytes = playbackEngine_getPendingSysExBytes(&playbackDataStore);
+    playbackEngine_stop(&playbackDataStore);
+    xSemaphoreGive(playbackStateMutex);
 
-    uint32_t tempStore = 0;
-    uint32_t result = 0;
-    uint8_t numBytes = 0;
+    if(pendingSysExBytes) ESP_LOGI(LOG_TAG, "Stopped with %ld sysex bytes still pending, dropped", pendingSysExBytes);
+}
 
-loopDeltaTime: //--- TIGHT LOOP ---//
 
-    // Always have at least one byte
-    tempStore |= **deltaTimeBase;
+static void startUploadedSong(void)
+{
+    // Whichever way the song came in, it is in the upload buffer now
+    bleToAppStats_t ringStats;
+    uint8_t songFailed;
 
-    if (HAS_MORE_DELTA_TIME_BYTES(**deltaTimeBase)) // IF BIT 8 SET THEN TRUE
-    {
-        if (numBytes < 3) // A midi delta-time has 4 bytes MAX
-        {
-            tempStore <<= 8;
-            ++numBytes;
-            *deltaTimeBase += 1;
-            goto loopDeltaTime; //--- TIGHT LOOP ---//
-        }
-    }
+    blePeriphAPI_getAppRingStats(&ringStats);
+    ESP_LOGI(LOG_TAG, "App ring: %ld items, %ld writes refused, %ld upload chunks held, %ld overflows, at most %ld waiting",
+             ringStats.numItems, ringStats.numRefusedWrites, ringStats.numHeldUploadChunks, ringStats.numOverflows, ringStats.maxDepth);
 
-    for (uint8_t a = 0; a <= numBytes; ++a)
-    {
-        // For each delta-time byte we need to
-        // remove bit 8 and concatenate the result
-        result |= ((tempStore & (0x0000007F << (a * 8))) >> ((a ? 1 : 0) * a));
-    }
+    stopPlayback();
 
-    *deltaTimeBase += 1; // Set to point at delta time of next midi event
+    //Compiling rewrites the event array and seek index the playback task
+    //reads (and takes trackPorts), so it holds the lock like the start does
+    xSemaphoreTake(playbackStateMutex, portMAX_DELAY);
+    songFailed = playbackEngine_compileSong(&playbackDataStore);
+    if(!songFailed) playbackEngine_start(&playbackDataStore);
+    xSemaphoreGive(playbackStateMutex);
 
-    return result;
-}
\ No newline at end of file
+    if(!songFailed) xTaskNotify(playbackTaskHandle, PLAYBACK_NOTIFY_START, eSetBits);
+}
+
+
+static bool isStreaming(void)
+{
+    bool streaming;
+
+    xSemaphoreTake(playbackStateMutex, portMAX_DELAY);
+    streaming = (playbackDataStore.stream != NULL) && playbackDataStore.isPlayingBack;
+    xSemaphoreGive(playbackStateMutex);
+
+    return streaming;
+}
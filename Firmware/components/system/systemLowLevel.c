@@ -1,45 +1,241 @@
 
+#include <assert.h>
 #include "esp_err.h"
 #include "esp_log.h"
+#include "esp_attr.h"
+#include "driver/gptimer.h"
+#include "driver/uart.h"
+#include "driver/gpio.h"
+#include "freertos/queue.h"
+#include "spscRing.h"
 #include "systemLowLevel.h"
 
 
 
-static void configureUart(void);
-static void configureTimers(void);
+static void configureUarts(void);
+static void configureTimers(TaskHandle_t deltaTimerTask);
 static bool timerISR_midiDeltaTimeClock(gptimer_handle_t timer, const gptimer_alarm_event_data_t *edata, void *user_ctx);
+static void gpioISR_midiInStartBit(void * arg);
 
 
 gptimer_handle_t gptimer = NULL; //Handle for timer used to generate delta-times
+static const uart_port_t midiPortUarts[] = {MIDI_PORT_0_UART, MIDI_PORT_1_UART};
+static const int midiPortTxPins[] = {MIDI_PORT_0_TX_PIN, MIDI_PORT_1_TX_PIN};
+static const int midiPortRxPins[] = {MIDI_PORT_0_RX_PIN, MIDI_PORT_1_RX_PIN};
 
+//Start bit times (low 32 bits of the delta timer) waiting for the uart
+//to deliver their byte, pushed by the edge ISR and popped by readMidiIn
+static spscRing_t midiInTimestamps[MIDI_OUTPUT_NUM_PORTS];
+static uint32_t midiInTimestampStorage[MIDI_OUTPUT_NUM_PORTS][MIDI_INPUT_TIMESTAMPS];
+static uint32_t midiInLastStartBit[MIDI_OUTPUT_NUM_PORTS]; //ISR only, once enabled
+static midiInputStats_t midiInStats[MIDI_OUTPUT_NUM_PORTS];
+static QueueHandle_t midiInUartEvents[MIDI_OUTPUT_NUM_PORTS]; //Posted by each uart driver's ISR
+static QueueSetHandle_t midiInEvents = NULL; //All of the above, for waitMidiIn
 
-volatile bool deltaTimerFired = false;
-static bool timerISR_midiDeltaTimeClock(gptimer_handle_t timer, const gptimer_alarm_event_data_t *edata, void *user_ctx)
+
+static bool IRAM_ATTR timerISR_midiDeltaTimeClock(gptimer_handle_t timer, const gptimer_alarm_event_data_t *edata, void *user_ctx)
+{
+    //Wake the playback task directly from the alarm, the return
+    //value tells the driver to context switch on ISR exit if the
+    //woken task is higher priority than whatever was interrupted
+    BaseType_t higherPriorityTaskWoken = pdFALSE;
+    (void)timer;
+    (void)edata;
+    xTaskNotifyFromISR((TaskHandle_t)user_ctx, DELTA_TIMER_NOTIFY_BIT, eSetBits, &higherPriorityTaskWoken);
+    return (higherPriorityTaskWoken == pdTRUE);
+}
+
+
+static void IRAM_ATTR gpioISR_midiInStartBit(void * arg)
+{
+    //Every falling edge on a midi in lands here, only the first of each
+    //byte (its start bit) is kept - the data bits that follow all fall
+    //within MIDI_INPUT_START_BIT_GAP_US of it, and the stop bit holds the
+    //line high until the next start. The timer read and the ring are in
+    //IRAM/DRAM, so bytes are still timed properly during flash writes.
+    //Nothing is woken from here, the reader waits on the uart itself
+    //so it only runs once the byte can be read (see waitMidiIn).
+    uint8_t port = (uint8_t)(uintptr_t)arg;
+    uint64_t count;
+    uint32_t startBit;
+
+    gptimer_get_raw_count(gptimer, &count);
+    startBit = (uint32_t)count;
+
+    if((startBit - midiInLastStartBit[port]) < MIDI_INPUT_START_BIT_GAP_US) return;
+    midiInLastStartBit[port] = startBit;
+    spscRing_push(&midiInTimestamps[port], &startBit); //Counts its own overflows
+}
+
+
+void initSystemLowLevel(TaskHandle_t deltaTimerTask)
 {
-    deltaTimerFired = true;
-    return false;
+    configureTimers(deltaTimerTask);
+    configureUarts();
 }
 
 
-void initSystemLowLevel(void)
+uint64_t getDeltaTimerNow(void)
 {
-    configureTimers();
-    configureUart();
+    // The timer is free-running from startup (1us per count),
+    // all playback deadlines are absolute values of this count
+    uint64_t count;
+    gptimer_get_raw_count(gptimer, &count);
+    return count;
 }
 
 
-inline void startDeltaTimer(uint32_t deltaTime)
+void setDeltaTimerDeadline(uint64_t deadline)
 {
+    // Arms the alarm against an absolute count, the timer is never
+    // stopped or reset so time spent between the alarm firing and
+    // this call is no longer lost from every event
     gptimer_alarm_config_t alarm_config = {
-        .alarm_count = deltaTime, //Count in microseconds
+        .alarm_count = deadline, //Absolute count in microseconds
     };
-    gptimer_set_raw_count(gptimer, 0);
-    ESP_ERROR_CHECK(gptimer_set_alarm_action(gptimer, &alarm_config));
-    ESP_ERROR_CHECK(gptimer_start(gptimer));
+    gptimer_set_alarm_action(gptimer, &alarm_config);
+}
+
+
+void writeMidiOut(uint8_t port, const uint8_t * data, uint32_t length)
+{
+    // Copies into the port's uart driver tx ring, this only blocks
+    // if the ring is full (each wire runs at 3.125 bytes/ms)
+    uart_write_bytes(midiPortUarts[port], data, length);
+}
+
+
+void initMidiIn(void)
+{
+    BaseType_t rc;
+
+    // The gpio ISR service is allocated on the calling core. The uart
+    // itself buffers the bytes, the edge interrupt only times them.
+    // Every port's driver events go into the one set, so the reader
+    // sleeps in waitMidiIn until any of them has input
+    ESP_ERROR_CHECK(gpio_install_isr_service(ESP_INTR_FLAG_IRAM));
+    midiInEvents = xQueueCreateSet(MIDI_OUTPUT_NUM_PORTS * MIDI_UART_EVENT_QUEUE_LENGTH);
+    assert(midiInEvents != NULL);
+
+    for(uint8_t port = 0; port < MIDI_OUTPUT_NUM_PORTS; port++)
+    {
+        xQueueReset(midiInUartEvents[port]); //A queue must be empty to join a set
+        rc = xQueueAddToSet(midiInUartEvents[port], midiInEvents);
+        assert(rc == pdPASS);
+        spscRing_init(&midiInTimestamps[port], midiInTimestampStorage[port], sizeof(uint32_t), MIDI_INPUT_TIMESTAMPS);
+        ESP_ERROR_CHECK(gpio_set_intr_type(midiPortRxPins[port], GPIO_INTR_NEGEDGE));
+        ESP_ERROR_CHECK(gpio_isr_handler_add(midiPortRxPins[port], gpioISR_midiInStartBit, (void *)(uintptr_t)port));
+        gpio_intr_disable(midiPortRxPins[port]); //Until enableMidiIn
+    }
+}
+
+
+void enableMidiIn(uint8_t port, bool enable)
+{
+    uint32_t discarded;
+
+    gpio_intr_disable(midiPortRxPins[port]);
+    uart_disable_rx_intr(midiPortUarts[port]); //No driver events (or reader wakes) either
+    if(!enable) return;
+
+    // Nothing received before now is wanted. With the interrupt off
+    // this side can empty the ring, the ISR is the only producer
+    uart_flush_input(midiPortUarts[port]);
+    while(spscRing_pop(&midiInTimestamps[port], &discarded));
+    midiInLastStartBit[port] = (uint32_t)getDeltaTimerNow() - MIDI_INPUT_START_BIT_GAP_US;
+    gpio_intr_enable(midiPortRxPins[port]);
+    uart_enable_rx_intr(midiPortUarts[port]);
+}
+
+
+void waitMidiIn(void)
+{
+    // The driver posts an event each time its ISR moves input out of the
+    // hardware fifo (every byte, with the rx full threshold at 1), so the
+    // reader wakes once a byte can be read rather than at its start bit.
+    // Events don't carry the bytes, readMidiIn still reads everything
+    // there - a wake for bytes already read just finds nothing. When the
+    // driver's buffering filled up the input is no longer in step with
+    // its start bit times, so it is dropped (the orphaned times follow)
+    QueueSetMemberHandle_t member = xQueueSelectFromSet(midiInEvents, portMAX_DELAY);
+    uart_event_t event;
+
+    for(uint8_t port = 0; port < MIDI_OUTPUT_NUM_PORTS; port++)
+    {
+        if(member != midiInUartEvents[port]) continue;
+        if(xQueueReceive(member, &event, 0) != pdTRUE) return;
+
+        if((event.type == UART_FIFO_OVF) || (event.type == UART_BUFFER_FULL))
+        {
+            uart_flush_input(midiPortUarts[port]);
+            midiInStats[port].numUartOverflows++;
+        }
+        return;
+    }
+}
+
+
+uint32_t readMidiIn(uint8_t port, midiInputByte_t * bytes, uint32_t maxBytes)
+{
+    // Pairs each byte the uart driver has received with the oldest
+    // unclaimed start bit time. Bytes and start bits are one to one on a
+    // clean line, the stats show when they weren't (a glitch, or input
+    // already part way through a byte when enabled) - the pairing is back
+    // in step once the line has been idle for MIDI_INPUT_ORPHAN_US
+    uint8_t data[64];
+    const uint32_t * oldest;
+    uint32_t numRead = 0;
+    uint32_t startBit;
+    uint64_t now;
+    int chunk;
+
+    while(numRead < maxBytes)
+    {
+        chunk = uart_read_bytes(midiPortUarts[port], data, ((maxBytes - numRead) < sizeof(data)) ? (maxBytes - numRead) : sizeof(data), 0);
+        if(chunk <= 0) break;
+
+        now = getDeltaTimerNow();
+        for(int i = 0; i < chunk; i++)
+        {
+            if(spscRing_pop(&midiInTimestamps[port], &startBit))
+            {
+                bytes[numRead].time = now - (uint32_t)((uint32_t)now - startBit);
+            }
+            else
+            {
+                bytes[numRead].time = now - ((uint64_t)(chunk - i) * MIDI_UART_US_PER_BYTE);
+                midiInStats[port].numMissingTimestamps++;
+            }
+            bytes[numRead].byte = data[i];
+            numRead++;
+        }
+    }
+    midiInStats[port].numBytes += numRead;
+
+    // Everything received has been read, any start bit old
+    // enough to have finished its byte by now lost that byte
+    if(numRead < maxBytes)
+    {
+        now = getDeltaTimerNow();
+        while(((oldest = spscRing_peek(&midiInTimestamps[port])) != NULL) && (((uint32_t)now - *oldest) > MIDI_INPUT_ORPHAN_US))
+        {
+            spscRing_drop(&midiInTimestamps[port]);
+            midiInStats[port].numOrphanTimestamps++;
+        }
+    }
+
+    return numRead;
+}
+
+
+const midiInputStats_t * getMidiInStats(uint8_t port)
+{
+    midiInStats[port].numTimestampOverflows = spscRing_getOverflowCount(&midiInTimestamps[port]);
+    return &midiInStats[port];
 }
 
 
-static void configureTimers(void)
+static void configureTimers(TaskHandle_t deltaTimerTask)
 {
     gptimer_config_t timer_config = {
         .clk_src = GPTIMER_CLK_SRC_DEFAULT,
@@ -53,13 +249,19 @@ static void configureTimers(void)
         .on_alarm = timerISR_midiDeltaTimeClock, // register user callback
 
     };
-    ESP_ERROR_CHECK(gptimer_register_event_callbacks(gptimer, &cbs, NULL));
+    ESP_ERROR_CHECK(gptimer_register_event_callbacks(gptimer, &cbs, deltaTimerTask));
     ESP_ERROR_CHECK(gptimer_enable(gptimer));
+    ESP_ERROR_CHECK(gptimer_start(gptimer)); //Free-running from here on
 }
 
 
-static void configureUart(void)
+static void configureUarts(void)
 {
+    // Every port runs off its own uart and tx ring, so they all send in
+    // parallel with no cpu involvement. Input is buffered by the driver
+    // until readMidiIn, its ISR is in IRAM so the hardware fifo is still
+    // emptied during flash writes (CONFIG_UART_ISR_IN_IRAM). Input is
+    // off, events and all, until enableMidiIn
     uart_config_t uart_config = {
         .baud_rate = 31250,
         .data_bits = UART_DATA_8_BITS,
@@ -69,7 +271,14 @@ static void configureUart(void)
         .source_clk = UART_SCLK_APB
     };
 
-    ESP_ERROR_CHECK(uart_param_config(MIDI_UART_NUM, &uart_config));
-    ESP_ERROR_CHECK(uart_set_pin(MIDI_UART_NUM, 43, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE));
-    ESP_ERROR_CHECK(uart_driver_install(MIDI_UART_NUM, 140, 140, 0, NULL, 0));
+    for(uint8_t port = 0; port < MIDI_OUTPUT_NUM_PORTS; port++)
+    {
+        ESP_ERROR_CHECK(uart_param_config(midiPortUarts[port], &uart_config));
+        ESP_ERROR_CHECK(uart_set_pin(midiPortUarts[port], midiPortTxPins[port], midiPortRxPins[port], UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE));
+        ESP_ERROR_CHECK(uart_driver_install(midiPortUarts[port], MIDI_UART_RX_BUFFER_BYTES, MIDI_UART_TX_BUFFER_BYTES,
+                                            MIDI_UART_EVENT_QUEUE_LENGTH, &midiInUartEvents[port], ESP_INTR_FLAG_IRAM));
+        ESP_ERROR_CHECK(uart_set_rx_full_threshold(midiPortUarts[port], MIDI_UART_RX_FULL_THRESHOLD));
+        ESP_ERROR_CHECK(uart_set_rx_timeout(midiPortUarts[port], MIDI_UART_RX_TIMEOUT_SYMBOLS));
+        ESP_ERROR_CHECK(uart_disable_rx_intr(midiPortUarts[port]));
+    }
 }
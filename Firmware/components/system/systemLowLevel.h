@@ -1,9 +1,68 @@
-#include "driver/gptimer.h"
-#include "driver/uart.h"
+#ifndef SYSTEM_LOW_LEVEL_H
+#define SYSTEM_LOW_LEVEL_H
 
-#define MIDI_UART_NUM 1
+#include <stdint.h>
+#include <stdbool.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "midiOutput.h"
 
-extern volatile bool deltaTimerFired;
+//Midi port n is uart MIDI_PORT_n_UART on MIDI_PORT_n_TX_PIN (out) and
+//MIDI_PORT_n_RX_PIN (in), one entry per port (MIDI_OUTPUT_NUM_PORTS).
+//Uart 0 is left for the console.
+#define MIDI_PORT_0_UART 1
+#define MIDI_PORT_0_TX_PIN 43
+#define MIDI_PORT_0_RX_PIN 44
+#define MIDI_PORT_1_UART 2
+#define MIDI_PORT_1_TX_PIN 17
+#define MIDI_PORT_1_RX_PIN 18
+#define MIDI_UART_US_PER_BYTE 320 //Start bit + 8 data bits + stop bit at 31250 baud
+#define MIDI_UART_TX_BUFFER_BYTES 140 //Driver tx ring, the hardware fifo (128 bytes) sits behind it
+#define MIDI_UART_RX_BUFFER_BYTES 1024 //Driver rx ring, 320ms of input at full rate before it has to be read
+#define MIDI_UART_RX_FULL_THRESHOLD 1 //Input bytes are moved out of the hardware fifo once this many arrive (1 for midi thru),
+#define MIDI_UART_RX_TIMEOUT_SYMBOLS 2 //or the line has been idle this long (byte times)
+#define MIDI_UART_EVENT_QUEUE_LENGTH 16 //Driver events waiting for waitMidiIn, each port
+#define MIDI_INPUT_TIMESTAMPS 1024 //Start bit times waiting for their byte, each port, MUST be a power of two
+#define MIDI_INPUT_START_BIT_GAP_US 304 //Falling edges sooner than this (9.5 bits) after a start bit are inside its byte
+#define MIDI_INPUT_ORPHAN_US 20000 //Start bit times still unclaimed this long after the uart has been read lost their byte
+#define DELTA_TIMER_NOTIFY_BIT (1 << 0) //Task notification bit set by the delta timer ISR
 
-void initSystemLowLevel(void);
-void startDeltaTimer(uint32_t deltaTime);
\ No newline at end of file
+void initSystemLowLevel(TaskHandle_t deltaTimerTask);
+uint64_t getDeltaTimerNow(void);
+void setDeltaTimerDeadline(uint64_t deadline);
+void writeMidiOut(uint8_t port, const uint8_t * data, uint32_t length);
+
+//A byte received on a midi in, with the delta timer count its start bit
+//arrived at (taken in the edge interrupt, not when the byte was read)
+typedef struct
+{
+    uint64_t time;
+    uint8_t byte;
+} midiInputByte_t;
+
+typedef struct
+{
+    uint32_t numBytes;              //Bytes read from the uart
+    uint32_t numMissingTimestamps;  //Bytes read with no start bit time to pair with, timed from when they were read
+    uint32_t numOrphanTimestamps;   //Start bit times discarded with no byte to pair with
+    uint32_t numTimestampOverflows; //Start bit times lost to a full ring
+    uint32_t numUartOverflows;      //Times the uart's rx buffering filled and its input was flushed
+} midiInputStats_t;
+
+//Midi in is off until enabled, so nothing is interrupted while nobody
+//is listening. initMidiIn installs the edge interrupt on the core it is
+//called from, which should not be the playback task's, and must be
+//called from the task that reads midi in - only the one task may.
+//waitMidiIn blocks that task until a uart has handed over input on an
+//enabled port, readMidiIn never blocks, it returns the bytes already
+//received (at most maxBytes).
+void initMidiIn(void);
+void enableMidiIn(uint8_t port, bool enable);
+void waitMidiIn(void);
+uint32_t readMidiIn(uint8_t port, midiInputByte_t * bytes, uint32_t maxBytes);
+const midiInputStats_t * getMidiInStats(uint8_t port);
+
+//Playback only reaches the hardware through the functions above, the
+//host build (Firmware/host) provides mock versions with a virtual clock
+
+#endif
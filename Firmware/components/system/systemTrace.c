@@ -0,0 +1,151 @@
+#include <stdio.h>
+#include <string.h>
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "spscRing.h"
+#include "systemTrace.h"
+
+#define LOG_TAG "systemTrace"
+#define TRACE_TASK_STACK_SIZE 3072
+#define TRACE_TASK_PRIORITY 1
+#define TRACE_TASK_PERIOD_MS 100
+#define TRACE_RECORDS_PER_DUMP 32 //Bounds how long one dump can hog the console
+
+static void traceTask(void * param);
+static void decodeRecord(const systemTraceRecord_t * record);
+
+//Static, so the ring lives in internal DRAM
+static systemTraceRecord_t traceStorage[SYSTEM_TRACE_NUM_RECORDS];
+static spscRing_t traceRing;
+
+static TaskHandle_t traceTaskHandle = NULL;
+static StaticTask_t traceTaskBuffer;
+static StackType_t traceTaskStack[TRACE_TASK_STACK_SIZE];
+
+
+//**** Public
+void systemTrace_init(void)
+{
+    spscRing_init(&traceRing, traceStorage, sizeof(systemTraceRecord_t), SYSTEM_TRACE_NUM_RECORDS);
+
+#if SYSTEM_TRACE_ENABLED
+    //Decoding shares core1 with BLE at the lowest priority,
+    //so console output can never delay playback on core0
+    traceTaskHandle = xTaskCreateStaticPinnedToCore(traceTask, "trace", TRACE_TASK_STACK_SIZE,
+                                                    NULL, TRACE_TASK_PRIORITY, traceTaskStack, &traceTaskBuffer, 1);
+    if(traceTaskHandle == NULL) ESP_LOGE(LOG_TAG, "Trace task creation failed, trace will only be available on demand");
+#endif
+}
+
+
+//**** Public
+void systemTrace_record(uint8_t type, uint32_t timestamp, int32_t lateness, uint32_t value, const uint8_t * data, uint8_t numDataBytes)
+{
+    // The ring has a single producer, so callers MUST be serialised -
+    // system.c only records while holding playbackStateMutex. Costs a
+    // handful of stores, when the ring is full the record is dropped
+    // and counted rather than blocking playback.
+
+#if SYSTEM_TRACE_ENABLED
+    systemTraceRecord_t record;
+
+    record.timestamp = timestamp;
+    record.lateness = lateness;
+    record.value = value;
+    record.type = type;
+    memset(record.data, 0, sizeof(record.data));
+    if(data != NULL) memcpy(record.data, data, (numDataBytes > sizeof(record.data)) ? sizeof(record.data) : numDataBytes);
+
+    spscRing_push(&traceRing, &record);
+#endif
+}
+
+
+//**** Public
+uint32_t systemTrace_dump(uint32_t maxRecords)
+{
+    // Decodes and prints up to maxRecords from the ring, only ever
+    // call this from one task (the ring has a single consumer)
+    systemTraceRecord_t record;
+    uint32_t numDecoded = 0;
+
+    while((numDecoded < maxRecords) && spscRing_pop(&traceRing, &record))
+    {
+        decodeRecord(&record);
+        numDecoded++;
+    }
+
+    return numDecoded;
+}
+
+
+//**** Public
+uint32_t systemTrace_getDroppedCount(void)
+{
+    return spscRing_getOverflowCount(&traceRing);
+}
+
+
+//**** Private
+static void traceTask(void * param)
+{
+    uint32_t lastDroppedCount = 0;
+    uint32_t droppedCount;
+
+    (void)param;
+
+    while(1)
+    {
+        while(systemTrace_dump(TRACE_RECORDS_PER_DUMP) == TRACE_RECORDS_PER_DUMP)
+        {
+            vTaskDelay(1); //Let other core1 work in between bursts
+        }
+
+        droppedCount = systemTrace_getDroppedCount();
+        if(droppedCount != lastDroppedCount)
+        {
+            ESP_LOGE(LOG_TAG, "%ld trace records dropped (ring full)", droppedCount - lastDroppedCount);
+            lastDroppedCount = droppedCount;
+        }
+
+        vTaskDelay(pdMS_TO_TICKS(TRACE_TASK_PERIOD_MS));
+    }
+}
+
+
+//**** Private
+static void decodeRecord(const systemTraceRecord_t * record)
+{
+    switch(record->type)
+    {
+        case traceEvent_midiOut:
+            ESP_LOGI(LOG_TAG, "[%ld] midi out 0x%02x 0x%02x 0x%02x (%ld bytes), late by %ldus",
+                     record->timestamp, record->data[0], record->data[1], record->data[2], record->value, record->lateness);
+            break;
+
+        case traceEvent_playbackStart:
+            ESP_LOGI(LOG_TAG, "[%ld] playback started, %ld events", record->timestamp, record->value);
+            break;
+
+        case traceEvent_playbackStop:
+            ESP_LOGI(LOG_TAG, "[%ld] playback stopped before event %ld", record->timestamp, record->value);
+            break;
+
+        case traceEvent_endOfTrack:
+            ESP_LOGI(LOG_TAG, "[%ld] end of track, %ld late events, max lateness %ldus", record->timestamp, record->value, record->lateness);
+            break;
+
+        case traceEvent_seek:
+            ESP_LOGI(LOG_TAG, "[%ld] seek to tick %ld", record->timestamp, record->value);
+            break;
+
+        case traceEvent_loop:
+            ESP_LOGI(LOG_TAG, "[%ld] loop %ld starts", record->timestamp, record->value);
+            break;
+
+        default:
+            ESP_LOGE(LOG_TAG, "[%ld] unknown trace record type %d", record->timestamp, record->type);
+            break;
+    }
+}
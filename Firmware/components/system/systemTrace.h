@@ -0,0 +1,36 @@
+#ifndef SYSTEM_TRACE_H
+#define SYSTEM_TRACE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define SYSTEM_TRACE_ENABLED 1          //Cheap enough to leave on in production
+#define SYSTEM_TRACE_NUM_RECORDS 512    //MUST be a power of two (8KB of internal ram)
+
+typedef enum
+{
+    traceEvent_midiOut = 0,             //data = bytes as sent (running status applied), value = number of bytes
+    traceEvent_playbackStart,           //value = number of compiled events
+    traceEvent_playbackStop,            //value = index of next unsent event
+    traceEvent_endOfTrack,              //value = number of late events, lateness = max lateness
+    traceEvent_seek,                    //value = target tick
+    traceEvent_loop,                    //value = loop count, timestamp = when the loop start plays
+} systemTraceEventType_t;
+
+//Compact binary record, formatting into text happens later on a
+//low priority task - never on the path being measured
+typedef struct
+{
+    uint32_t timestamp;                 //Delta timer count (uS) when recorded, low 32 bits
+    int32_t lateness;                   //Sent time minus scheduled time (uS)
+    uint32_t value;                     //Meaning depends on type, see above
+    uint8_t type;                       //systemTraceEventType_t
+    uint8_t data[3];
+} systemTraceRecord_t;
+
+void systemTrace_init(void);
+void systemTrace_record(uint8_t type, uint32_t timestamp, int32_t lateness, uint32_t value, const uint8_t * data, uint8_t numDataBytes);
+uint32_t systemTrace_dump(uint32_t maxRecords);
+uint32_t systemTrace_getDroppedCount(void);
+
+#endif
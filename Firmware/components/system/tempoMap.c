@@ -0,0 +1,232 @@
+#include <stdio.h>
+#include "esp_log.h"
+#include "tempoMap.h"
+
+#define LOG_TAG "tempoMap"
+
+static void setSegmentRate(tempoMapSegment_t * segment, uint32_t numerator, uint32_t denominator);
+
+
+//**** Public
+uint8_t tempoMap_init(tempoMap_t * map, uint16_t timeDivision, tempoMapSegment_t * segmentBuffer, uint32_t maxSegments)
+{
+    // The MThd time division has two possible formats:
+    // bit 15 CLEAR - bits[0-14] = ticks per quater-note (PPQN)
+    // bit 15 SET   - bits[8-15] = negative SMPTE frames per second (-24,-25,-29,-30)
+    //                bits[0-7]  = ticks per frame
+    // With SMPTE the tick length is fixed, set tempo events are ignored
+
+    int8_t smpteFormat;
+    uint8_t ticksPerFrame;
+
+    if((map == NULL) || (segmentBuffer == NULL) || (maxSegments == 0))
+    {
+        ESP_LOGE(LOG_TAG, "Tempo map init aborted - no segment storage");
+        return 1;
+    }
+
+    map->segments = segmentBuffer;
+    map->maxSegments = maxSegments;
+    map->numSegments = 1;
+    map->cursor = 0;
+    map->timeDivision = timeDivision;
+
+    map->segments[0].startTick = 0;
+    map->segments[0].startTime = 0;
+    map->segments[0].startFraction = 0;
+    map->segments[0].microSecondsPerQuaterNote = TEMPO_MAP_DEFAULT_TEMPO;
+
+    if(timeDivision & 0x8000)
+    {
+        smpteFormat = (int8_t)(timeDivision >> 8);
+        ticksPerFrame = (uint8_t)(timeDivision & 0xFF);
+
+        if((ticksPerFrame == 0) || ((smpteFormat != -24) && (smpteFormat != -25) && (smpteFormat != -29) && (smpteFormat != -30)))
+        {
+            ESP_LOGE(LOG_TAG, "Unsupported SMPTE time division 0x%0x", timeDivision);
+            return 1;
+        }
+
+        map->isSmpte = true;
+
+        if(smpteFormat == -29) //30 drop-frame, actually 29.97fps
+        {
+            map->smpteNumerator = 1001000;
+            map->smpteDenominator = 30 * ticksPerFrame;
+        }
+        else
+        {
+            map->smpteNumerator = 1000000;
+            map->smpteDenominator = (uint32_t)(-smpteFormat) * ticksPerFrame;
+        }
+
+        setSegmentRate(&map->segments[0], map->smpteNumerator, map->smpteDenominator);
+    }
+    else
+    {
+        if(timeDivision == 0)
+        {
+            ESP_LOGE(LOG_TAG, "Invalid time division of zero ticks per quater-note");
+            return 1;
+        }
+
+        map->isSmpte = false;
+        map->smpteNumerator = 0;
+        map->smpteDenominator = 0;
+
+        setSegmentRate(&map->segments[0], TEMPO_MAP_DEFAULT_TEMPO, timeDivision);
+    }
+
+    return 0; //** SUCCESS **//
+}
+
+
+//**** Public
+uint8_t tempoMap_addTempoChange(tempoMap_t * map, uint32_t tick, uint32_t microSecondsPerQuaterNote)
+{
+    // Set tempo events MUST be added in tick order (which is the order
+    // the compile stage finds them in). The start time of the new segment
+    // is calculated exactly from the previous segment - the integer part
+    // via 64-bit divide and the remainder as a 32-bit binary fraction -
+    // so thousands of tempo changes don't drift away from true time.
+
+    tempoMapSegment_t * previous;
+    tempoMapSegment_t * segment;
+    uint64_t elapsedNumerator;
+    uint64_t fraction;
+    uint32_t elapsedTicks;
+
+    if(map->isSmpte) return 0; //Tempo is meaningless with SMPTE timing
+
+    if(microSecondsPerQuaterNote == 0)
+    {
+        ESP_LOGE(LOG_TAG, "Ignoring set tempo event of zero");
+        return 1;
+    }
+
+    previous = &map->segments[map->numSegments - 1];
+
+    if(tick < previous->startTick)
+    {
+        ESP_LOGE(LOG_TAG, "Tempo change at tick %ld is out of order", tick);
+        return 1;
+    }
+
+    if(tick == previous->startTick) //Replaces the tempo in force at this tick
+    {
+        previous->microSecondsPerQuaterNote = microSecondsPerQuaterNote;
+        setSegmentRate(previous, microSecondsPerQuaterNote, map->timeDivision);
+        return 0;
+    }
+
+    if(map->numSegments >= map->maxSegments)
+    {
+        ESP_LOGE(LOG_TAG, "Tempo map full - tempo change at tick %ld dropped", tick);
+        return 1;
+    }
+
+    // Work from the exact tempo of the previous segment
+    // rather than its (rounded) per-tick rate
+    elapsedTicks = tick - previous->startTick;
+    elapsedNumerator = (uint64_t)elapsedTicks * previous->microSecondsPerQuaterNote;
+
+    segment = &map->segments[map->numSegments];
+    segment->startTick = tick;
+    segment->startTime = previous->startTime + (elapsedNumerator / map->timeDivision);
+
+    fraction = (((elapsedNumerator % map->timeDivision) << 32) / map->timeDivision) + previous->startFraction;
+    segment->startTime += (fraction >> 32);
+    segment->startFraction = (uint32_t)fraction;
+
+    segment->microSecondsPerQuaterNote = microSecondsPerQuaterNote;
+    setSegmentRate(segment, microSecondsPerQuaterNote, map->timeDivision);
+    map->numSegments++;
+
+    return 0; //** SUCCESS **//
+}
+
+
+//**** Public
+uint64_t tempoMap_tickToMicroSeconds(tempoMap_t * map, uint32_t tick)
+{
+    // Per-event conversion, no divides. Playback asks for ticks in
+    // order so the cursor normally stays put or steps forward once,
+    // anything else (seek, loop) falls back to a binary search.
+
+    const tempoMapSegment_t * segment;
+    uint32_t low, high, mid;
+    uint32_t elapsedTicks;
+    uint64_t fraction;
+
+    if(tick < map->segments[map->cursor].startTick)
+    {
+        low = 0;
+        high = map->cursor;
+        while(low < high) //Find last segment starting at or before 'tick'
+        {
+            mid = (low + high + 1) >> 1;
+            if(map->segments[mid].startTick <= tick) low = mid;
+            else high = mid - 1;
+        }
+        map->cursor = low;
+    }
+    else
+    {
+        while(((map->cursor + 1) < map->numSegments) && (map->segments[map->cursor + 1].startTick <= tick))
+        {
+            map->cursor++;
+        }
+    }
+
+    segment = &map->segments[map->cursor];
+    elapsedTicks = tick - segment->startTick;
+
+    // Rounded to the nearest microsecond, the truncated per-tick
+    // fraction would otherwise always land a fraction early
+    fraction = ((uint64_t)elapsedTicks * segment->usPerTickFraction) + segment->startFraction + 0x80000000ULL;
+
+    return segment->startTime + ((uint64_t)elapsedTicks * segment->usPerTickWhole) + (fraction >> 32);
+}
+
+
+//**** Public
+uint64_t tempoMap_clockToMicroSeconds(tempoMap_t * map, uint32_t clock)
+{
+    // Time of midi timing clock number 'clock' (24 per quater-note). The
+    // division rarely splits into whole ticks per clock, so the leftover
+    // part of a tick is added at the rate of the segment it falls in.
+    // Only meaningful for PPQN divisions, SMPTE songs have no beat.
+    const uint64_t position = (uint64_t)clock * map->timeDivision;
+    const uint32_t tick = (uint32_t)(position / TEMPO_MAP_CLOCKS_PER_QUATER_NOTE);
+    const uint32_t remainder = (uint32_t)(position % TEMPO_MAP_CLOCKS_PER_QUATER_NOTE);
+    const uint64_t time = tempoMap_tickToMicroSeconds(map, tick); //Also moves the cursor to the segment
+    const tempoMapSegment_t * segment = &map->segments[map->cursor];
+    uint64_t part;
+
+    if(remainder == 0) return time;
+
+    part = ((uint64_t)remainder * segment->microSecondsPerQuaterNote) + ((uint64_t)map->timeDivision * TEMPO_MAP_CLOCKS_PER_QUATER_NOTE / 2);
+    return time + (part / ((uint64_t)map->timeDivision * TEMPO_MAP_CLOCKS_PER_QUATER_NOTE));
+}
+
+
+//**** Public
+void tempoMap_discardHistory(tempoMap_t * map)
+{
+    // For readers that only ever convert ticks moving forward (the
+    // playback stream), keeps just the segment in force at the latest
+    // tempo change - so two segments of storage cover any song
+    map->segments[0] = map->segments[map->numSegments - 1];
+    map->numSegments = 1;
+    map->cursor = 0;
+}
+
+
+//**** Private
+static void setSegmentRate(tempoMapSegment_t * segment, uint32_t numerator, uint32_t denominator)
+{
+    // uS per tick = numerator / denominator, split into
+    // a whole part and a 32-bit binary fraction
+    segment->usPerTickWhole = numerator / denominator;
+    segment->usPerTickFraction = (uint32_t)((((uint64_t)(numerator % denominator)) << 32) / denominator);
+}
@@ -0,0 +1,43 @@
+#ifndef TEMPO_MAP_H
+#define TEMPO_MAP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define TEMPO_MAP_DEFAULT_TEMPO 500000 //uS per quater-note, 120bpm (midi standard default)
+#define TEMPO_MAP_CLOCKS_PER_QUATER_NOTE 24 //Midi timing clock rate
+
+//One constant-tempo stretch of the song. Everything that needs a
+//division is done when the map is built, converting a tick that
+//falls inside a segment is then just multiplies, adds and a shift.
+//Times are kept as whole microseconds plus a 32-bit binary fraction
+//so that rounding never accumulates across tempo changes.
+typedef struct
+{
+    uint64_t startTime;             //Whole microseconds at startTick
+    uint32_t startTick;             //First tick covered by this segment
+    uint32_t startFraction;         //Fractional microseconds at startTick (Q0.32)
+    uint32_t usPerTickWhole;        //Whole microseconds per tick
+    uint32_t usPerTickFraction;     //Fractional microseconds per tick (Q0.32)
+    uint32_t microSecondsPerQuaterNote; //Exact tempo, used to build the next segment
+} tempoMapSegment_t;
+
+typedef struct
+{
+    tempoMapSegment_t * segments;   //Allocated by the caller
+    uint32_t numSegments;
+    uint32_t maxSegments;
+    uint32_t cursor;                //Last segment used, playback is (mostly) monotonic
+    uint16_t timeDivision;          //Raw MThd time division
+    bool isSmpte;                   //SMPTE divisions ignore set tempo events
+    uint32_t smpteNumerator;        //uS per tick = numerator / denominator
+    uint32_t smpteDenominator;
+} tempoMap_t;
+
+uint8_t tempoMap_init(tempoMap_t * map, uint16_t timeDivision, tempoMapSegment_t * segmentBuffer, uint32_t maxSegments);
+uint8_t tempoMap_addTempoChange(tempoMap_t * map, uint32_t tick, uint32_t microSecondsPerQuaterNote);
+uint64_t tempoMap_tickToMicroSeconds(tempoMap_t * map, uint32_t tick);
+uint64_t tempoMap_clockToMicroSeconds(tempoMap_t * map, uint32_t clock);
+void tempoMap_discardHistory(tempoMap_t * map);
+
+#endif
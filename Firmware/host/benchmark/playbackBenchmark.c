@@ -0,0 +1,1787 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "esp_log.h"
+#include "playbackEngine.h"
+#include "midiRecorder.h"
+#include "systemTrace.h"
+#include "hostLowLevel.h"
+#include "hostBleQueue.h"
+#include "hostFileSys.h"
+#include "syntheticMidi.h"
+
+#ifndef MIDI_SAMPLE_FILE
+#define MIDI_SAMPLE_FILE "../components/fileSys/fileIMAGE/output.mid"
+#endif
+
+#define UPLOAD_BUFFER_SIZE (1024 * 1024)    //Same as the firmware's PSRAM upload buffer
+#define MAX_CAPTURED_BYTES (4 * 1024 * 1024)
+#define SONG_START_TIME 1000000             //Virtual clock when the upload completes (uS)
+#define WAKE_LATENCY_MAX_US 50              //Injected between the alarm and the task running
+#define DENSE_NUM_TRACKS 16
+#define DENSE_NOTES_PER_TRACK 4000
+#define DENSE_TICKS_PER_NOTE 60             //Eighth notes at 480ppqn
+#define SWEEP_NUM_EVENTS 100000
+#define SWEEP_WINDOW_EVENTS 1000            //Events averaged at each end of the drift check
+#define NUM_SEEKS 32                        //Seeks spread across each song after it has played
+#define SEEK_PLAY_US 100000                 //Played after each seek before stopping, so notes are held at the stop
+#define LOOP_FIRST_EVENT 1000               //Loop region of the tempo sweep, the loop points sit
+#define LOOP_LAST_EVENT 1100                //between events at arbitrary microseconds
+#define LOOP_START_OFFSET_US 613            //Loop start, before the first event
+#define LOOP_END_OFFSET_US 701              //Loop end, after the last event
+#define LOOP_ITERATIONS 2000
+#define LOOP_RELEASE_SHARE_US (((2 * HOST_UART_US_PER_BYTE) - LOOP_START_OFFSET_US + 1) / 2) //The wrap's 2 byte note-off collides with the first event, which takes half
+#define TEMPO_FIRST_MULTIPLIER (PLAYBACK_TEMPO_ONE * 3 / 2) //Set before the first event
+#define TEMPO_JUMP_MULTIPLIER 52429         //0.8, not exact in 16.16
+#define TEMPO_JUMP_US 3000000               //Real time into the song of the jump
+#define TEMPO_RAMP_MULTIPLIER (PLAYBACK_TEMPO_ONE * 2) //Events are 1ms apart here, just clear of each other on the wire
+#define TEMPO_RAMP_US 6000000               //Real time into the song the ramp starts
+#define TEMPO_RAMP_DURATION_US 3000000
+#define TEMPO_PLAY_US 12000000              //Real time played before stopping
+#define TEMPO_RAMP_ERROR_US 10              //Error allowed for stepping the ramp, (slope * step^2 / 8) is under 1us
+#define CLOCK_SEEK_QUATER_NOTES 37          //Clock check seeks to here, plus a few ticks
+#define CLOCK_SEEK_EXTRA_TICKS 7            //so it isn't on a sixteenth
+#define STREAM_FILE_NAME "stream.mid"
+#define SYSEX_NUM_BEATS 64
+#define SYSEX_PATCH_BYTES 200               //64ms of wire, fits between the notes
+#define SYSEX_BULK_BYTES 4096               //1.3s of wire, can't
+#define SYSEX_BULK_INTERVAL 16              //Beats between bulk dumps
+#define RECORD_FILE_NAME "take.mid"
+#define RECORD_ISR_LATENCY_MAX_US 5         //Start bit edge to the timer being read
+#define RECORD_ERROR_US 100                 //Recorded times have to be this close to the wire (rounding to ticks is 25us at most)
+#define THRU_TEMPO_MULTIPLIER (PLAYBACK_TEMPO_ONE * 3) //Plays the dense song faster than port 0 can carry it
+#define THRU_PLAY_US 10000000               //Real time played before stopping
+#define THRU_INTERVAL_US 23071              //Between live input messages, off any beat of the song
+#define THRU_NUM_MESSAGES 400               //Live input messages, all received before the stop
+#define THRU_LATENCY_MAX_US (1000 + (4 * HOST_UART_US_PER_BYTE)) //1ms, plus the wire time of the event (and a clock) it can queue behind
+#define THRU_SONG_DELAY_MAX_US (PLAYBACK_THRU_MAX_AHEAD_BYTES * HOST_UART_US_PER_BYTE) //Input wire time a song message can be held back by
+#define LIVE_INTERVAL_US 31013              //Between live events from the client
+#define LIVE_NUM_EVENTS 300                 //All written before the stop, every third with two messages
+
+typedef struct
+{
+    int64_t min;
+    int64_t max;
+    double total;
+    uint32_t count;
+} errorStats_t;
+
+typedef struct
+{
+    uint32_t numEvents;                     //Compiled events
+    uint32_t numMatched;                    //Messages on the wire matching the compiled event
+    uint32_t numMismatched;
+    uint32_t numServiceCalls;
+    double compileSeconds;
+    double serviceSeconds;                  //Host cpu time inside playbackEngine_service
+    errorStats_t dispatchError;             //Scheduled -> uart write (uS)
+    errorStats_t wireError;                 //Scheduled -> first byte on the wire (uS)
+    errorStats_t referenceError;            //Uart write vs independently calculated time (uS)
+    double referenceFirstWindow;
+    double referenceLastWindow;
+    uint32_t numSysExBytes;                 //SysEx bytes on the wire, F0 to F7
+    uint32_t numSysExWrong;                 //Ports whose sysex didn't arrive exactly as in the song
+    uint32_t numBrokenSysEx;                //Messages cut short by another status byte
+    uint32_t maxSysExMessageBytes;          //Longest sysex message on the wire, F0 to F7
+} benchmarkResult_t;
+
+typedef struct
+{
+    uint32_t position;                      //Next captured byte
+    uint8_t port;                           //Only this port's bytes are read
+    uint8_t runningStatus;
+    uint32_t numStrayBytes;                 //Data bytes with no status to go with them
+    bool isInSysEx;
+    uint32_t numSysExBytes;                 //SysEx bytes read, F0 to F7
+    uint32_t sysExHash;                     //Of those bytes, see hashByte
+    uint32_t numBrokenSysEx;                //Messages cut short by another status byte
+    uint32_t numMessageBytes;               //Of the sysex message being read
+    uint32_t maxMessageBytes;               //Longest sysex message read
+} captureReader_t;
+
+typedef struct
+{
+    double realTime;                        //uS, virtual clock when the segment starts
+    double songTime;                        //uS, song position at that time
+    double multiplier;
+    double slope;                           //Multiplier change per uS, while ramping
+} tempoModelSegment_t;
+
+static uint8_t runScenario(const char * name, const uint8_t * fileData, uint32_t fileLength, const double * referenceTimes, const uint8_t * trackPorts);
+static void handleBleItem(const bleToAppQueueItem_t * item, benchmarkResult_t * result);
+static void serviceEngine(benchmarkResult_t * result);
+static uint8_t runSeekCheck(void);
+static uint8_t runLoopCheck(const double * referenceTimes);
+static uint8_t runTempoCheck(const double * referenceTimes);
+static double getTempoModelRealTime(const tempoModelSegment_t * segments, uint32_t numSegments, double songTime);
+static double getTempoModelSongTime(const tempoModelSegment_t * segments, uint32_t numSegments, double realTime);
+static uint8_t runStreamCheck(const uint8_t * fileData, uint32_t fileLength);
+static uint8_t runRecordCheck(void);
+static uint8_t runThruCheck(void);
+static uint8_t runLiveCheck(void);
+static uint32_t getSaturatedLateness(void);
+static uint8_t runClockCheck(void);
+static uint8_t runBootCheck(void);
+static uint8_t runDenseRoutingCheck(uint8_t numPorts);
+static void analyseCapture(const double * referenceTimes, benchmarkResult_t * result);
+static uint8_t readCapturedMessage(captureReader_t * reader, uint8_t * message, const hostUartByte_t ** firstByte);
+static uint8_t getMessageLength(uint8_t status);
+static uint32_t findEventOnPort(uint32_t eventIndex, uint8_t port);
+static uint32_t hashSongSysEx(const midiCompiledSong_t * song, const uint8_t * fileData, uint8_t port, uint32_t * numBytes);
+static uint32_t hashByte(uint32_t hash, uint8_t byte);
+static bool isSameMessage(const midiCompiledEvent_t * event, const uint8_t * message, uint8_t length);
+static bool trackHeldNote(midiNoteSet_t * heldNotes, const uint8_t * message, uint8_t length);
+static void addError(errorStats_t * stats, int64_t error);
+static void printResult(const char * name, const benchmarkResult_t * result);
+static uint32_t nextWakeLatency(void);
+static double getSeconds(void);
+static uint32_t loadFile(const char * path, uint8_t * buffer, uint32_t maxLength);
+
+
+static midiPlaybackRuntimeData_t playbackData;
+static playbackStream_t playbackStream;
+static uint8_t uploadBuffer[UPLOAD_BUFFER_SIZE];
+static uint8_t fileBuffer[UPLOAD_BUFFER_SIZE];
+static uint8_t recordBuffer[UPLOAD_BUFFER_SIZE];
+static hostUartByte_t captureBuffer[MAX_CAPTURED_BYTES];
+static double referenceBuffer[SWEEP_NUM_EVENTS];
+static uint32_t wakeLatencySeed;
+static uint8_t alternatingPorts[MIDI_MAX_TRACKS];
+
+
+
+
+//*************************
+//******** MAIN ***********
+//*************************
+int main(int argc, char ** argv)
+{
+    // With no arguments plays the sample file from the littlefs image and
+    // the synthetic files, otherwise plays every file given on the command
+    // line. Returns non-zero if anything failed to play back correctly.
+    uint32_t fileLength;
+    uint8_t failed = 0;
+
+    playbackEngine_init(&playbackData, uploadBuffer);
+    systemTrace_init();
+
+    printf("Virtual uart at %d us/byte, %d bytes tx buffering, 0-%d us injected wake latency, %d us look-ahead\n",
+           HOST_UART_US_PER_BYTE, HOST_UART_TX_BUFFER_BYTES, WAKE_LATENCY_MAX_US, PLAYBACK_LOOKAHEAD_DEFAULT_US);
+
+    if(argc > 1)
+    {
+        for(int i = 1; i < argc; i++)
+        {
+            fileLength = loadFile(argv[i], fileBuffer, sizeof(fileBuffer));
+            failed |= (fileLength == 0) ? 1 : runScenario(argv[i], fileBuffer, fileLength, NULL, NULL);
+        }
+        return failed;
+    }
+
+    fileLength = loadFile(MIDI_SAMPLE_FILE, fileBuffer, sizeof(fileBuffer));
+    failed |= (fileLength == 0) ? 1 : runScenario("output.mid", fileBuffer, fileLength, NULL, NULL);
+    failed |= runBootCheck();
+
+    fileLength = syntheticMidi_denseTracks(fileBuffer, sizeof(fileBuffer), DENSE_NUM_TRACKS, DENSE_NOTES_PER_TRACK, DENSE_TICKS_PER_NOTE, 1);
+    failed |= (fileLength == 0) ? 1 : runScenario("synthetic dense (16 tracks in step)", fileBuffer, fileLength, NULL, NULL);
+    failed |= runBootCheck();
+    failed |= runClockCheck();
+    failed |= runThruCheck();
+    failed |= runLiveCheck();
+
+#if MIDI_OUTPUT_NUM_PORTS > 1
+    // The same tracks spread over every port, first by the
+    // file's own midiPort meta events then by a track port map
+    for(uint8_t track = 0; track < MIDI_MAX_TRACKS; track++) alternatingPorts[track] = track % MIDI_OUTPUT_NUM_PORTS;
+
+    fileLength = syntheticMidi_denseTracks(fileBuffer, sizeof(fileBuffer), DENSE_NUM_TRACKS, DENSE_NOTES_PER_TRACK, DENSE_TICKS_PER_NOTE, MIDI_OUTPUT_NUM_PORTS);
+    failed |= (fileLength == 0) ? 1 : runScenario("synthetic dense, midiPort meta events (every port)", fileBuffer, fileLength, NULL, NULL);
+    failed |= runDenseRoutingCheck(MIDI_OUTPUT_NUM_PORTS);
+
+    fileLength = syntheticMidi_denseTracks(fileBuffer, sizeof(fileBuffer), DENSE_NUM_TRACKS, DENSE_NOTES_PER_TRACK, DENSE_TICKS_PER_NOTE, 1);
+    failed |= (fileLength == 0) ? 1 : runScenario("synthetic dense, track port map (every port)", fileBuffer, fileLength, NULL, alternatingPorts);
+    failed |= runDenseRoutingCheck(MIDI_OUTPUT_NUM_PORTS);
+#endif
+
+    fileLength = syntheticMidi_sysExDumps(fileBuffer, sizeof(fileBuffer), SYSEX_NUM_BEATS, SYSEX_PATCH_BYTES, SYSEX_BULK_BYTES, SYSEX_BULK_INTERVAL);
+    failed |= (fileLength == 0) ? 1 : runScenario("synthetic sysex dumps between notes", fileBuffer, fileLength, NULL, NULL);
+    failed |= runRecordCheck();
+
+    fileLength = syntheticMidi_tempoSweep(fileBuffer, sizeof(fileBuffer), SWEEP_NUM_EVENTS, referenceBuffer);
+    failed |= (fileLength == 0) ? 1 : runScenario("synthetic tempo sweep (drift check)", fileBuffer, fileLength, referenceBuffer, NULL);
+
+    return failed;
+}
+
+
+
+
+//****************************
+//******** SCENARIOS *********
+//****************************
+static uint8_t runScenario(const char * name, const uint8_t * fileData, uint32_t fileLength, const double * referenceTimes, const uint8_t * trackPorts)
+{
+    // Uploads the file through the mock ble queue exactly as a client
+    // would, then plays it against the virtual clock: each time the engine
+    // arms the alarm the clock jumps to the deadline plus a wake latency
+    // and the engine is serviced again, as the playback task would be.
+    // 'trackPorts' is the track port map, NULL leaves every track on port 0.
+    benchmarkResult_t result;
+    bleToAppQueueItem_t item;
+    uint64_t deadline;
+    uint32_t offset = 0;
+    uint32_t consumed;
+    uint8_t failed = 0;
+
+    memset(&result, 0, sizeof(benchmarkResult_t));
+    hostLowLevel_reset(SONG_START_TIME, captureBuffer, MAX_CAPTURED_BYTES);
+    playbackEngine_freeSong(&playbackData);
+    playbackEngine_init(&playbackData, uploadBuffer); //Fresh device, the virtual clock starts again
+    if(trackPorts != NULL) memcpy(playbackData.trackPorts, trackPorts, MIDI_MAX_TRACKS);
+    wakeLatencySeed = 12345;
+
+    while(offset < fileLength)
+    {
+        consumed = hostBleQueue_writePlaybackPayload(fileData, fileLength, offset, uploadBuffer);
+        offset += consumed;
+        if(consumed == 0)
+        {
+            while(hostBleQueue_receive(&item)) handleBleItem(&item, &result);
+        }
+    }
+    while(hostBleQueue_receive(&item)) handleBleItem(&item, &result);
+
+    hostBleQueue_sendCommand(4); //Upload complete, compiles and starts playback
+    while(hostBleQueue_receive(&item)) handleBleItem(&item, &result);
+
+    if(playbackData.song.events == NULL)
+    {
+        printf("\n== %s ==\n  FAILED to compile\n", name);
+        return 1;
+    }
+
+    while(playbackData.isPlayingBack)
+    {
+        if(!hostLowLevel_takeAlarm(&deadline))
+        {
+            ESP_LOGE("benchmark", "Playback stalled with no alarm armed at event %u", playbackData.nextEventIndex);
+            failed = 1;
+            break;
+        }
+
+        hostLowLevel_advanceTo(deadline + nextWakeLatency());
+        serviceEngine(&result);
+    }
+
+    analyseCapture(referenceTimes, &result);
+    printResult(name, &result);
+    failed |= runSeekCheck();
+    failed |= runStreamCheck(fileData, fileLength);
+
+    if(result.numMismatched || (result.numMatched != (result.numEvents - playbackData.song.numSysEx))) failed = 1;
+    if(result.numSysExWrong || result.numBrokenSysEx || playbackEngine_getPendingSysExBytes(&playbackData)) failed = 1;
+
+    // Nothing but realtime can go inside a sysex message, so events can
+    // be held for as long as the longest takes on the wire - no longer
+    if(playbackData.song.numSysEx && (result.wireError.max > ((int64_t)result.maxSysExMessageBytes * HOST_UART_US_PER_BYTE))) failed = 1;
+
+    if(referenceTimes != NULL)
+    {
+        // Sending early by up to the minimum lead is expected, anything
+        // else outside the injected latency means time is drifting
+        if((result.referenceError.min < -(DEADLINE_MIN_LEAD_US + 1)) || (result.referenceError.max > (WAKE_LATENCY_MAX_US + 1))) failed = 1;
+        printf("  drift check       %s\n", failed ? "FAIL" : "PASS");
+        failed |= runLoopCheck(referenceTimes);
+        failed |= runTempoCheck(referenceTimes);
+    }
+
+    return failed;
+}
+
+
+static uint8_t runSeekCheck(void)
+{
+    // Seeks to points spread across the song, timing each one and
+    // checking the chased state against a replay from the very start.
+    // Each seek plays for a moment before stopping, and a receiver
+    // following the wire must be left with no notes hanging.
+    static seekChaseState_t indexedState;
+    static seekChaseState_t replayedState;
+    static uint8_t message[MIDI_COMPILED_EVENT_MAX_BYTES];
+    const uint32_t lastTick = playbackData.song.events[playbackData.song.numEvents - 1].absoluteTime;
+    const hostUartByte_t * firstByte;
+    captureReader_t reader;
+    midiNoteSet_t heldNotes[MIDI_OUTPUT_NUM_PORTS];
+    uint32_t numHanging = 0;
+    uint32_t numStrayBytes = 0;
+    uint32_t firstCaptured = hostLowLevel_getNumCaptured();
+    uint64_t stopTime;
+    uint64_t deadline;
+    uint32_t numCapturedBefore;
+    uint32_t numChaseBytes;
+    uint32_t maxChaseBytes = 0;
+    uint32_t numReleaseBytes;
+    uint32_t maxReleaseBytes = 0;
+    uint32_t numBadStates = 0;
+    uint32_t eventIndex;
+    uint32_t tick;
+    uint8_t length;
+    double seekTime;
+    double totalSeekTime = 0.0;
+    double maxSeekTime = 0.0;
+
+    for(uint32_t i = 0; i < NUM_SEEKS; i++)
+    {
+        tick = (uint32_t)(((uint64_t)lastTick * i) / NUM_SEEKS) + (i & 1); //Odd seeks land between events
+
+        numCapturedBefore = hostLowLevel_getNumCaptured();
+        seekTime = getSeconds();
+        playbackEngine_seek(&playbackData, tick);
+        seekTime = getSeconds() - seekTime;
+        numChaseBytes = hostLowLevel_getNumCaptured() - numCapturedBefore;
+
+        stopTime = hostLowLevel_getTime() + SEEK_PLAY_US;
+        playbackEngine_service(&playbackData);
+        while(playbackData.isPlayingBack && hostLowLevel_takeAlarm(&deadline) && (deadline < stopTime))
+        {
+            hostLowLevel_advanceTo(deadline + nextWakeLatency());
+            playbackEngine_service(&playbackData);
+        }
+
+        numCapturedBefore = hostLowLevel_getNumCaptured();
+        playbackEngine_stop(&playbackData);
+        numReleaseBytes = hostLowLevel_getNumCaptured() - numCapturedBefore;
+
+        if(numChaseBytes > maxChaseBytes) maxChaseBytes = numChaseBytes;
+        if(numReleaseBytes > maxReleaseBytes) maxReleaseBytes = numReleaseBytes;
+        totalSeekTime += seekTime;
+        if(seekTime > maxSeekTime) maxSeekTime = seekTime;
+
+        eventIndex = seekIndex_findState(&playbackData.seekIndex, &playbackData.song, tick, &indexedState);
+        seekIndex_resetState(&replayedState);
+        for(uint32_t j = 0; j < eventIndex; j++) seekIndex_applyEvent(&replayedState, &playbackData.song.events[j]);
+
+        if((memcmp(&indexedState, &replayedState, sizeof(seekChaseState_t)) != 0) ||
+           ((eventIndex > 0) && (playbackData.song.events[eventIndex - 1].absoluteTime >= tick)) ||
+           ((eventIndex < playbackData.song.numEvents) && (playbackData.song.events[eventIndex].absoluteTime < tick)))
+        {
+            numBadStates++;
+        }
+    }
+
+    for(uint8_t port = 0; port < MIDI_OUTPUT_NUM_PORTS; port++)
+    {
+        memset(&reader, 0, sizeof(captureReader_t));
+        reader.position = firstCaptured;
+        reader.port = port;
+        midiOutput_clearNotes(&heldNotes[port]);
+        while((length = readCapturedMessage(&reader, message, &firstByte)) != 0) trackHeldNote(&heldNotes[port], message, length);
+        numHanging += heldNotes[port].numNotes;
+        numStrayBytes += reader.numStrayBytes;
+    }
+
+    printf("  seek              %d seeks, %u checkpoints, mean %.1f / max %.1f us cpu, up to %u chase bytes, %u bad states\n",
+           NUM_SEEKS, playbackData.seekIndex.numCheckpoints, (totalSeekTime / NUM_SEEKS) * 1e6, maxSeekTime * 1e6, maxChaseBytes, numBadStates);
+    printf("  stop              up to %u note-off bytes (%.2f ms of wire), %u notes left hanging\n",
+           maxReleaseBytes, (maxReleaseBytes * HOST_UART_US_PER_BYTE) / 1e3, numHanging + numStrayBytes);
+
+    return (numBadStates || numHanging || numStrayBytes) ? 1 : 0;
+}
+
+
+static uint8_t runLoopCheck(const double * referenceTimes)
+{
+    // Plays into a loop region and round it thousands of times. Every
+    // message must be the right event at its reference time plus a whole
+    // number of loop lengths, so any drift - or a gap at the wrap - shows
+    // up as an error that grows with the iteration count.
+    static uint8_t message[MIDI_COMPILED_EVENT_MAX_BYTES];
+    const uint64_t loopStartTime = (uint64_t)(referenceTimes[LOOP_FIRST_EVENT] + 0.5) - LOOP_START_OFFSET_US;
+    const uint64_t loopEndTime = (uint64_t)(referenceTimes[LOOP_LAST_EVENT] + 0.5) + LOOP_END_OFFSET_US;
+    const hostUartByte_t * firstByte;
+    captureReader_t reader;
+    errorStats_t error;
+    midiNoteSet_t heldNotes;
+    uint64_t songStartTime;
+    uint64_t deadline;
+    uint32_t eventIndex = 0;
+    uint32_t iteration = 0;
+    uint32_t numMismatched = 0;
+    uint32_t numReleases = 0;
+    uint8_t length;
+    bool isRelease;
+    int64_t eventError;
+    double firstIterationTotal = 0.0;
+    double lastIterationTotal = 0.0;
+    const uint32_t eventsPerIteration = LOOP_LAST_EVENT - LOOP_FIRST_EVENT + 1;
+
+    memset(&reader, 0, sizeof(captureReader_t));
+    memset(&error, 0, sizeof(errorStats_t));
+    midiOutput_clearNotes(&heldNotes);
+    error.min = INT64_MAX;
+    error.max = INT64_MIN;
+
+    hostLowLevel_reset(hostLowLevel_getTime() + SONG_START_TIME, captureBuffer, MAX_CAPTURED_BYTES);
+
+    if(playbackEngine_setLoop(&playbackData, loopStartTime, loopEndTime) ||
+       (playbackData.loopStartIndex != LOOP_FIRST_EVENT) || (playbackData.loopEndIndex != (LOOP_LAST_EVENT + 1)))
+    {
+        printf("  loop              FAILED to set loop points\n");
+        return 1;
+    }
+
+    playbackEngine_start(&playbackData);
+    songStartTime = playbackData.songStartTime;
+    playbackEngine_service(&playbackData);
+
+    while(playbackData.isPlayingBack && (playbackData.loopCount <= LOOP_ITERATIONS))
+    {
+        if(!hostLowLevel_takeAlarm(&deadline)) break;
+        hostLowLevel_advanceTo(deadline + nextWakeLatency());
+        playbackEngine_service(&playbackData);
+        systemTrace_dump(UINT32_MAX);
+    }
+
+    playbackEngine_stop(&playbackData);
+    playbackEngine_clearLoop(&playbackData);
+
+    //** Only whole iterations are checked, the last one rendered may be cut short by the stop **//
+    // The last event of the region is a note-on with its note-off
+    // after the loop end, so every wrap has to release it
+    while((iteration < LOOP_ITERATIONS) && ((length = readCapturedMessage(&reader, message, &firstByte)) != 0))
+    {
+        isRelease = trackHeldNote(&heldNotes, message, length);
+
+        if(!isSameMessage(&playbackData.song.events[eventIndex], message, length))
+        {
+            if(isRelease) numReleases++;
+            else numMismatched++;
+            continue;
+        }
+        else
+        {
+            // Measured on the wire, the release shares the wire with the
+            // first event of the loop so they are written out together
+            eventError = (int64_t)(firstByte->wireTime - songStartTime - ((loopEndTime - loopStartTime) * iteration)) -
+                         (int64_t)(referenceTimes[eventIndex] + 0.5);
+            addError(&error, eventError);
+            if((iteration == 1) && (eventIndex >= LOOP_FIRST_EVENT)) firstIterationTotal += eventError;
+            if(iteration == (LOOP_ITERATIONS - 1)) lastIterationTotal += eventError;
+        }
+
+        if(++eventIndex > LOOP_LAST_EVENT)
+        {
+            eventIndex = LOOP_FIRST_EVENT;
+            iteration++;
+        }
+    }
+
+    while((length = readCapturedMessage(&reader, message, &firstByte)) != 0) trackHeldNote(&heldNotes, message, length);
+
+    // Iteration 0 includes the run in from the start of the song, so
+    // the first full pass of the loop region is the second one
+    printf("  loop              %u iterations of %.3f ms, %u mismatched, error min %lld / max %lld us, mean first %.2f us, last %.2f us\n",
+           iteration, (loopEndTime - loopStartTime) / 1e3, numMismatched + reader.numStrayBytes, (long long)error.min, (long long)error.max,
+           firstIterationTotal / eventsPerIteration, lastIterationTotal / eventsPerIteration);
+    printf("  loop releases     %u notes released at the wrap, %u left hanging after the stop\n", numReleases, heldNotes.numNotes);
+
+    if((iteration < LOOP_ITERATIONS) || numMismatched || reader.numStrayBytes ||
+       (numReleases != (LOOP_ITERATIONS - 1)) || heldNotes.numNotes ||
+       (error.min < -(DEADLINE_MIN_LEAD_US + 1)) || (error.max > (WAKE_LATENCY_MAX_US + LOOP_RELEASE_SHARE_US + 1)))
+    {
+        printf("  loop drift check  FAIL\n");
+        return 1;
+    }
+
+    printf("  loop drift check  PASS\n");
+    return 0;
+}
+
+
+static uint8_t runTempoCheck(const double * referenceTimes)
+{
+    // Plays with the tempo multiplier set at the start, jumped part way
+    // through and then ramped. Each change is modelled independently in
+    // real numbers from the time it was made, so every message has to
+    // match the model to within the wake latency - any rounding that
+    // builds up over the song, or a queued event left at the old tempo,
+    // shows up as an error.
+    static uint8_t message[MIDI_COMPILED_EVENT_MAX_BYTES];
+    tempoModelSegment_t segments[4];
+    uint32_t numSegments;
+    const hostUartByte_t * firstByte;
+    captureReader_t reader;
+    errorStats_t error;
+    uint64_t startTime;
+    uint64_t deadline;
+    uint64_t now;
+    uint32_t eventIndex = 0;
+    uint32_t numMismatched = 0;
+    uint8_t length;
+    double modelTime;
+    double jumpError = 0.0;
+    bool isJumpChecked = false;
+
+    memset(&reader, 0, sizeof(captureReader_t));
+    memset(&error, 0, sizeof(errorStats_t));
+    error.min = INT64_MAX;
+    error.max = INT64_MIN;
+
+    hostLowLevel_reset(hostLowLevel_getTime() + SONG_START_TIME, captureBuffer, MAX_CAPTURED_BYTES);
+
+    startTime = hostLowLevel_getTime();
+    playbackEngine_start(&playbackData);
+    playbackEngine_setTempo(&playbackData, TEMPO_FIRST_MULTIPLIER);
+    segments[0].realTime = (double)startTime;
+    segments[0].songTime = (double)startTime - (double)playbackData.songStartTime; //Negative, the look-ahead before song start
+    segments[0].multiplier = (double)TEMPO_FIRST_MULTIPLIER / PLAYBACK_TEMPO_ONE;
+    segments[0].slope = 0.0;
+    numSegments = 1;
+    playbackEngine_service(&playbackData);
+
+    while(playbackData.isPlayingBack)
+    {
+        if(!hostLowLevel_takeAlarm(&deadline)) break;
+        hostLowLevel_advanceTo(deadline + nextWakeLatency());
+        playbackEngine_service(&playbackData);
+        systemTrace_dump(UINT32_MAX);
+
+        now = hostLowLevel_getTime();
+        if(now >= (startTime + TEMPO_PLAY_US)) break;
+        if(((numSegments == 1) && (now < (startTime + TEMPO_JUMP_US))) || ((numSegments == 2) && (now < (startTime + TEMPO_RAMP_US))) || (numSegments > 2)) continue;
+
+        segments[numSegments].realTime = (double)now;
+        segments[numSegments].songTime = getTempoModelSongTime(segments, numSegments, (double)now);
+        segments[numSegments].multiplier = (double)TEMPO_JUMP_MULTIPLIER / PLAYBACK_TEMPO_ONE;
+        segments[numSegments].slope = 0.0;
+
+        if(numSegments == 1)
+        {
+            playbackEngine_setTempo(&playbackData, TEMPO_JUMP_MULTIPLIER);
+        }
+        else
+        {
+            // Ramps from the jump multiplier, then carries on at the end one
+            playbackEngine_rampTempo(&playbackData, TEMPO_RAMP_MULTIPLIER, TEMPO_RAMP_DURATION_US);
+            segments[numSegments].slope = ((double)(TEMPO_RAMP_MULTIPLIER - TEMPO_JUMP_MULTIPLIER) / PLAYBACK_TEMPO_ONE) / TEMPO_RAMP_DURATION_US;
+            segments[numSegments + 1].realTime = (double)(now + TEMPO_RAMP_DURATION_US);
+            segments[numSegments + 1].songTime = getTempoModelSongTime(segments, numSegments + 1, (double)(now + TEMPO_RAMP_DURATION_US));
+            segments[numSegments + 1].multiplier = (double)TEMPO_RAMP_MULTIPLIER / PLAYBACK_TEMPO_ONE;
+            segments[numSegments + 1].slope = 0.0;
+            numSegments++;
+        }
+        numSegments++;
+
+        playbackEngine_service(&playbackData); //As the system task does after a change
+    }
+
+    playbackEngine_stop(&playbackData);
+    playbackEngine_setTempo(&playbackData, PLAYBACK_TEMPO_ONE);
+
+    while((length = readCapturedMessage(&reader, message, &firstByte)) != 0)
+    {
+        if((eventIndex >= playbackData.song.numEvents) || !isSameMessage(&playbackData.song.events[eventIndex], message, length))
+        {
+            // Releases of the notes held at the stop come after everything else
+            if(firstByte->writeTime < (startTime + TEMPO_PLAY_US)) numMismatched++;
+            continue;
+        }
+
+        modelTime = getTempoModelRealTime(segments, numSegments, referenceTimes[eventIndex]);
+        addError(&error, (int64_t)firstByte->writeTime - (int64_t)(modelTime + 0.5));
+        if(!isJumpChecked && (modelTime >= segments[1].realTime))
+        {
+            jumpError = (double)firstByte->writeTime - modelTime;
+            isJumpChecked = true;
+        }
+        eventIndex++;
+    }
+
+    printf("  tempo             %u events at 1.5x, 0.8x, then a %.1f s ramp to 2x, %u mismatched, error min %lld / max %lld us, first after the jump %.1f us\n",
+           eventIndex, TEMPO_RAMP_DURATION_US / 1e6, numMismatched + reader.numStrayBytes, (long long)error.min, (long long)error.max, jumpError);
+
+    if((numSegments != 4) || numMismatched || reader.numStrayBytes ||
+       (error.min < -(DEADLINE_MIN_LEAD_US + TEMPO_RAMP_ERROR_US + 1)) || (error.max > (WAKE_LATENCY_MAX_US + TEMPO_RAMP_ERROR_US + 1)))
+    {
+        printf("  tempo check       FAIL\n");
+        return 1;
+    }
+
+    printf("  tempo check       PASS\n");
+    return 0;
+}
+
+
+static double getTempoModelRealTime(const tempoModelSegment_t * segments, uint32_t numSegments, double songTime)
+{
+    // When the model reaches 'songTime', solving the quadratic while ramping
+    const tempoModelSegment_t * segment = &segments[0];
+    double covered;
+
+    for(uint32_t i = 1; i < numSegments; i++)
+    {
+        if(segments[i].songTime <= songTime) segment = &segments[i];
+    }
+
+    covered = songTime - segment->songTime;
+    if(segment->slope == 0.0) return segment->realTime + (covered / segment->multiplier);
+    return segment->realTime + ((sqrt((segment->multiplier * segment->multiplier) + (2.0 * segment->slope * covered)) - segment->multiplier) / segment->slope);
+}
+
+
+static double getTempoModelSongTime(const tempoModelSegment_t * segments, uint32_t numSegments, double realTime)
+{
+    const tempoModelSegment_t * segment = &segments[numSegments - 1];
+    const double elapsed = realTime - segment->realTime;
+
+    return segment->songTime + (segment->multiplier * elapsed) + (segment->slope * elapsed * elapsed / 2.0);
+}
+
+
+static uint8_t runClockCheck(void)
+{
+    // Plays the song again as clock master on every port, one of them
+    // busy with the song and any others idle. Each clock byte is timed on
+    // the wire against its tempo map time, the notes around it must all
+    // still arrive intact. Then a seek must stop the slaves, point them at
+    // the next whole sixteenth and have the clock carry on from there.
+    static uint8_t message[MIDI_COMPILED_EVENT_MAX_BYTES];
+    const uint32_t seekTick = ((uint32_t)playbackData.tempoMap.timeDivision * CLOCK_SEEK_QUATER_NOTES) + CLOCK_SEEK_EXTRA_TICKS;
+    const uint32_t seekPosition = ((seekTick * 4) + playbackData.tempoMap.timeDivision - 1) / playbackData.tempoMap.timeDivision;
+    const hostUartByte_t * firstByte;
+    const hostUartByte_t * captured;
+    captureReader_t reader;
+    errorStats_t clockError;
+    errorStats_t noteError;
+    uint64_t deadline;
+    uint64_t scheduled;
+    uint32_t numClocks[MIDI_OUTPUT_NUM_PORTS];
+    uint32_t numBadCommands = 0;
+    uint32_t numMatched = 0;
+    uint32_t numMismatched = 0;
+    uint32_t numEvents = 0;
+    uint32_t eventIndex;
+    uint32_t position = UINT32_MAX;
+    uint8_t lastCommand[MIDI_OUTPUT_NUM_PORTS];
+    uint8_t length;
+    int64_t seekClockError = INT64_MAX;
+    bool isStarted;
+
+    memset(&clockError, 0, sizeof(errorStats_t));
+    memset(&noteError, 0, sizeof(errorStats_t));
+    clockError.min = noteError.min = INT64_MAX;
+    clockError.max = noteError.max = INT64_MIN;
+
+    hostLowLevel_reset(hostLowLevel_getTime() + SONG_START_TIME, captureBuffer, MAX_CAPTURED_BYTES);
+    playbackEngine_setClockPorts(&playbackData, (1 << MIDI_OUTPUT_NUM_PORTS) - 1);
+    playbackEngine_start(&playbackData);
+    playbackEngine_service(&playbackData);
+
+    while(playbackData.isPlayingBack)
+    {
+        if(!hostLowLevel_takeAlarm(&deadline)) break;
+        hostLowLevel_advanceTo(deadline + nextWakeLatency());
+        playbackEngine_service(&playbackData);
+        systemTrace_dump(UINT32_MAX);
+    }
+
+    //** Clock, start and stop **//
+    for(uint8_t port = 0; port < MIDI_OUTPUT_NUM_PORTS; port++)
+    {
+        numClocks[port] = 0;
+        lastCommand[port] = 0;
+        isStarted = false;
+
+        for(uint32_t i = 0; i < hostLowLevel_getNumCaptured(); i++)
+        {
+            captured = &captureBuffer[i];
+            if((captured->port != port) || (captured->byte < 0xF8)) continue;
+
+            if(captured->byte == 0xF8)
+            {
+                if(!isStarted) numBadCommands++;
+                addError(&clockError, (int64_t)captured->wireTime - (int64_t)(playbackData.songStartTime + tempoMap_clockToMicroSeconds(&playbackData.tempoMap, numClocks[port])));
+                numClocks[port]++;
+            }
+            else
+            {
+                if((captured->byte == 0xFA) && isStarted) numBadCommands++;
+                isStarted |= (captured->byte == 0xFA);
+                lastCommand[port] = captured->byte;
+            }
+        }
+
+        if(lastCommand[port] != 0xFC) numBadCommands++; //The song end stops the slaves
+    }
+
+    //** Notes, split around the clock **//
+    memset(&reader, 0, sizeof(captureReader_t));
+    eventIndex = findEventOnPort(0, 0);
+    while((length = readCapturedMessage(&reader, message, &firstByte)) != 0)
+    {
+        if((eventIndex < playbackData.song.numEvents) && isSameMessage(&playbackData.song.events[eventIndex], message, length))
+        {
+            scheduled = playbackData.songStartTime + tempoMap_tickToMicroSeconds(&playbackData.tempoMap, playbackData.song.events[eventIndex].absoluteTime);
+            addError(&noteError, (int64_t)(firstByte->wireTime - scheduled));
+            numMatched++;
+        }
+        else numMismatched++;
+
+        eventIndex = findEventOnPort(eventIndex + 1, 0);
+    }
+    for(uint32_t i = 0; i < playbackData.song.numEvents; i++) numEvents += (playbackData.song.events[i].port == 0) ? 1 : 0;
+
+    printf("  clock             %u clocks on port 0, %u on the idle port(s), error min %lld / max %lld / mean %.1f us, %u late, %u messages split\n",
+           numClocks[0], (MIDI_OUTPUT_NUM_PORTS > 1) ? numClocks[MIDI_OUTPUT_NUM_PORTS - 1] : 0, (long long)clockError.min, (long long)clockError.max,
+           clockError.total / clockError.count, playbackData.clockStats.numLateClocks, playbackData.clockStats.numSplitMessages);
+    printf("  clocked notes     %u of %u matched, %u mismatched, on the wire min %lld / max %lld / mean %.1f us, %u start/stop errors\n",
+           numMatched, numEvents, numMismatched + reader.numStrayBytes, (long long)noteError.min, (long long)noteError.max,
+           noteError.total / noteError.count, numBadCommands);
+
+    //** Song position after a seek **//
+    hostLowLevel_reset(hostLowLevel_getTime() + SONG_START_TIME, captureBuffer, MAX_CAPTURED_BYTES);
+    playbackEngine_seek(&playbackData, seekTick);
+    playbackEngine_service(&playbackData);
+
+    while(playbackData.isPlayingBack && (hostLowLevel_getTime() < (playbackData.songStartTime + tempoMap_clockToMicroSeconds(&playbackData.tempoMap, seekPosition * PLAYBACK_CLOCKS_PER_POSITION) + SEEK_PLAY_US)))
+    {
+        if(!hostLowLevel_takeAlarm(&deadline)) break;
+        hostLowLevel_advanceTo(deadline + nextWakeLatency());
+        playbackEngine_service(&playbackData);
+        systemTrace_dump(UINT32_MAX);
+    }
+
+    for(uint32_t i = 0; i < hostLowLevel_getNumCaptured(); i++)
+    {
+        captured = &captureBuffer[i];
+        if(captured->port != 0) continue;
+
+        // Stop, song position, continue, then the first clock at that position
+        if((captured->byte == 0xF2) && ((i + 3) < hostLowLevel_getNumCaptured()) && (captureBuffer[i - 1].byte == 0xFC) && (captureBuffer[i + 3].byte == 0xFB))
+        {
+            position = (uint32_t)captureBuffer[i + 1].byte | ((uint32_t)captureBuffer[i + 2].byte << 7);
+        }
+        if((captured->byte == 0xF8) && (position != UINT32_MAX))
+        {
+            seekClockError = (int64_t)captured->wireTime - (int64_t)(playbackData.songStartTime + tempoMap_clockToMicroSeconds(&playbackData.tempoMap, position * PLAYBACK_CLOCKS_PER_POSITION));
+            break;
+        }
+    }
+
+    playbackEngine_stop(&playbackData);
+    playbackEngine_setClockPorts(&playbackData, 0);
+
+    printf("  song position     seek to tick %u sent position %u (expected %u), first clock after it %lld us out\n",
+           seekTick, position, seekPosition, (long long)seekClockError);
+
+    if(numBadCommands || numMismatched || reader.numStrayBytes || (numMatched != numEvents) ||
+       (numClocks[0] == 0) || (numClocks[0] != numClocks[MIDI_OUTPUT_NUM_PORTS - 1]) ||
+       (clockError.min < -(DEADLINE_MIN_LEAD_US + 1)) || (clockError.max > (WAKE_LATENCY_MAX_US + DEADLINE_MIN_LEAD_US + 1)) ||
+       (position != seekPosition) || (seekClockError < -(DEADLINE_MIN_LEAD_US + 1)) || (seekClockError > (WAKE_LATENCY_MAX_US + DEADLINE_MIN_LEAD_US + 1)))
+    {
+        printf("  clock check       FAIL\n");
+        return 1;
+    }
+
+    printf("  clock check       PASS\n");
+    return 0;
+}
+
+
+static uint8_t runStreamCheck(const uint8_t * fileData, uint32_t fileLength)
+{
+    // Streams the same file from the mock file system. Draining the
+    // stream directly has to give exactly the compiled events and times,
+    // then playing it has to put them all on the wire with the prefetch
+    // only running between services (as the low priority task would)
+    // and the ring never running dry.
+    static uint8_t message[MIDI_COMPILED_EVENT_MAX_BYTES];
+    const playbackStreamEvent_t * streamEvent;
+    const hostUartByte_t * firstByte;
+    const midiCompiledEvent_t * event;
+    captureReader_t reader;
+    uint64_t deadline;
+    uint32_t numEvents = 0;
+    uint32_t numWrong = 0;
+    uint32_t numMatched = 0;
+    uint32_t eventIndex;
+    uint8_t length;
+
+    hostFileSys_setFile(STREAM_FILE_NAME, fileData, fileLength);
+
+    //** Stream contents **//
+    eventIndex = 0;
+    if(playbackStream_open(&playbackStream, STREAM_FILE_NAME, playbackData.trackPorts)) numWrong++;
+    while(!playbackStream_isFinished(&playbackStream))
+    {
+        if((streamEvent = playbackStream_peekEvent(&playbackStream, 0)) == NULL)
+        {
+            playbackStream_fill(&playbackStream);
+            continue;
+        }
+
+        eventIndex = findEventOnPort(eventIndex, streamEvent->port); //SysEx isn't streamed
+        event = &playbackData.song.events[eventIndex];
+        if((eventIndex >= playbackData.song.numEvents) || (streamEvent->length != event->length) || (streamEvent->port != event->port) || memcmp(streamEvent->data, event->data, event->length) ||
+           (streamEvent->songTime != tempoMap_tickToMicroSeconds(&playbackData.tempoMap, event->absoluteTime)))
+        {
+            numWrong++;
+        }
+
+        playbackStream_dropEvent(&playbackStream);
+        numEvents++;
+        eventIndex++;
+    }
+
+    //** Stream playback **//
+    hostLowLevel_reset(hostLowLevel_getTime() + SONG_START_TIME, captureBuffer, MAX_CAPTURED_BYTES);
+
+    if(playbackStream_open(&playbackStream, STREAM_FILE_NAME, playbackData.trackPorts)) numWrong++;
+    playbackEngine_startStream(&playbackData, &playbackStream);
+    playbackEngine_service(&playbackData);
+
+    while(playbackData.isPlayingBack)
+    {
+        if(playbackStream_needsFill(&playbackStream)) playbackStream_fill(&playbackStream);
+        if(!hostLowLevel_takeAlarm(&deadline)) break;
+        hostLowLevel_advanceTo(deadline + nextWakeLatency());
+        playbackEngine_service(&playbackData);
+        systemTrace_dump(UINT32_MAX);
+    }
+
+    for(uint8_t port = 0; port < MIDI_OUTPUT_NUM_PORTS; port++)
+    {
+        memset(&reader, 0, sizeof(captureReader_t));
+        reader.port = port;
+        eventIndex = findEventOnPort(0, port);
+
+        while((length = readCapturedMessage(&reader, message, &firstByte)) != 0)
+        {
+            if((eventIndex < playbackData.song.numEvents) && isSameMessage(&playbackData.song.events[eventIndex], message, length)) numMatched++;
+            else numWrong++;
+            eventIndex = findEventOnPort(eventIndex + 1, port);
+        }
+
+        numWrong += reader.numStrayBytes;
+    }
+
+    printf("  stream            %u of %u events matched, %u wrong, %u underruns, min fill %u of %d, %u reads (%u bytes), %u bytes of ram\n",
+           numMatched, numEvents, numWrong, playbackStream.stats.numUnderruns, playbackStream.stats.minFill,
+           PLAYBACK_STREAM_RING_EVENTS, playbackStream.stats.numBlockReads, playbackStream.stats.numBytesRead, (uint32_t)sizeof(playbackStream_t));
+
+    // Back to the compiled song for anything that follows
+    playbackEngine_stop(&playbackData);
+    playbackData.stream = NULL;
+
+    return (numWrong || playbackStream.stats.numUnderruns ||
+            (numEvents != (playbackData.song.numEvents - playbackData.song.numSysEx)) || (numMatched != numEvents)) ? 1 : 0;
+}
+
+
+static uint8_t runRecordCheck(void)
+{
+    // Plays the song again as clock master on port 0, with port 0 looped
+    // back to its midi in and recorded. Each byte reaches the input timed
+    // at its start bit plus an interrupt latency, and the recorder is only
+    // serviced every MIDI_RECORDER_POLL_MS (as its task would be). The
+    // recording is then compiled like any upload: every message on the
+    // wire has to be in it at the right time, with the sysex intact and
+    // the realtime bytes (clock, start and stop) left out.
+    static midiRecorder_t recorder;
+    static uint8_t message[MIDI_COMPILED_EVENT_MAX_BYTES];
+    const hostUartByte_t * firstByte;
+    const hostUartByte_t * captured;
+    const uint8_t * recording;
+    midiCompiledSong_t recorded;
+    midiCompiledEvent_t * events = NULL;
+    midiCompiledSysEx_t * sysEx = NULL;
+    tempoMapSegment_t tempoSegments[2];
+    tempoMap_t tempoMap;
+    captureReader_t reader;
+    errorStats_t recordError;
+    uint64_t deadline;
+    uint64_t nextPoll;
+    uint64_t lastStopBit = 0;
+    bool isMidiIn;
+    uint32_t numLooped = 0;
+    uint32_t numRealtime = 0;
+    uint32_t numMessages = 0;
+    uint32_t numMatched = 0;
+    uint32_t numMismatched = 0;
+    uint32_t numRecorded = 0;
+    uint32_t numSysExBytes = 0;
+    uint32_t sysExHash = 0;
+    uint32_t recordingLength;
+    uint32_t eventIndex = 0;
+    uint8_t length;
+    uint8_t failed = 0;
+
+    memset(&recordError, 0, sizeof(errorStats_t));
+    recordError.min = INT64_MAX;
+    recordError.max = INT64_MIN;
+
+    hostLowLevel_reset(hostLowLevel_getTime() + SONG_START_TIME, captureBuffer, MAX_CAPTURED_BYTES);
+    hostFileSys_setWriteBuffer(recordBuffer, sizeof(recordBuffer));
+    if(midiRecorder_start(&recorder, RECORD_FILE_NAME, 0))
+    {
+        printf("  record check      FAILED to start\n");
+        return 1;
+    }
+    playbackEngine_setInputTap(&playbackData, 0, &recorder.input);
+    nextPoll = hostLowLevel_getTime() + (MIDI_RECORDER_POLL_MS * 1000);
+
+    playbackEngine_setClockPorts(&playbackData, 1 << 0);
+    playbackEngine_start(&playbackData);
+    playbackEngine_service(&playbackData);
+
+    while(playbackData.isPlayingBack)
+    {
+        if(!hostLowLevel_takeWake(&deadline, &isMidiIn)) break;
+        hostLowLevel_advanceTo(deadline + nextWakeLatency());
+        if(!isMidiIn || playbackEngine_readInput(&playbackData)) playbackEngine_service(&playbackData);
+        systemTrace_dump(UINT32_MAX);
+
+        for(; numLooped < hostLowLevel_getNumCaptured(); numLooped++)
+        {
+            captured = &captureBuffer[numLooped];
+            if(captured->port != 0) continue;
+            hostLowLevel_receiveMidiIn(0, captured->wireTime + (nextWakeLatency() % (RECORD_ISR_LATENCY_MAX_US + 1)), captured->byte);
+            lastStopBit = captured->wireTime + HOST_UART_US_PER_BYTE + RECORD_ISR_LATENCY_MAX_US;
+        }
+
+        if(hostLowLevel_getTime() >= nextPoll)
+        {
+            failed |= midiRecorder_service(&recorder);
+            nextPoll = hostLowLevel_getTime() + (MIDI_RECORDER_POLL_MS * 1000);
+        }
+    }
+
+    hostLowLevel_advanceTo(lastStopBit);
+    playbackEngine_readInput(&playbackData); //The input left after the song ended
+    playbackEngine_setInputTap(&playbackData, 0, NULL);
+    failed |= midiRecorder_stop(&recorder);
+    playbackEngine_setClockPorts(&playbackData, 0);
+
+    //** Compile the recording **//
+    recordingLength = hostFileSys_getFile(RECORD_FILE_NAME, &recording);
+    if(failed || midiCompiler_compileSong(recording, recordingLength, NULL, 0, NULL, 0, NULL, NULL, &recorded) || (recorded.numTempoChanges >= 2))
+    {
+        printf("  record check      FAILED to compile the recording\n");
+        return 1;
+    }
+
+    events = malloc(recorded.numEvents * sizeof(midiCompiledEvent_t));
+    sysEx = malloc((recorded.numSysEx + 1) * sizeof(midiCompiledSysEx_t));
+    recorded.events = events;
+    if((events == NULL) || (sysEx == NULL) || tempoMap_init(&tempoMap, recorded.timeDivision, tempoSegments, 2) ||
+       midiCompiler_compileSong(recording, recordingLength, events, recorded.numEvents, sysEx, recorded.numSysEx, &tempoMap, NULL, &recorded))
+    {
+        failed = 1;
+        recorded.numEvents = 0;
+    }
+
+    //** Every message on the wire, in the recording **//
+    memset(&reader, 0, sizeof(captureReader_t));
+    while((length = readCapturedMessage(&reader, message, &firstByte)) != 0)
+    {
+        while((eventIndex < recorded.numEvents) && MIDI_IS_SYSEX_STATUS(events[eventIndex].data[0])) eventIndex++;
+
+        if((eventIndex < recorded.numEvents) && isSameMessage(&events[eventIndex], message, length))
+        {
+            addError(&recordError, (int64_t)(recorder.startTime + tempoMap_tickToMicroSeconds(&tempoMap, events[eventIndex].absoluteTime)) - (int64_t)firstByte->wireTime);
+            numMatched++;
+        }
+        else numMismatched++;
+
+        numMessages++;
+        eventIndex++;
+    }
+
+    for(uint32_t i = 0; i < recorded.numEvents; i++) numRecorded += MIDI_IS_SYSEX_STATUS(events[i].data[0]) ? 0 : 1;
+    for(uint32_t i = 0; i < hostLowLevel_getNumCaptured(); i++) numRealtime += ((captureBuffer[i].port == 0) && (captureBuffer[i].byte >= 0xF8)) ? 1 : 0;
+    if(recorded.numEvents) sysExHash = hashSongSysEx(&recorded, recording, 0, &numSysExBytes);
+
+    printf("  record            %u of %u messages recorded (%u wrong), error min %lld / max %lld / mean %.1f us, max input lag %u us\n",
+           numMatched, numMessages, numMismatched + (numRecorded - numMatched), (long long)recordError.min, (long long)recordError.max,
+           recordError.count ? (recordError.total / recordError.count) : 0.0, recorder.stats.maxInputLag);
+    printf("  recorded file     %u bytes in %u block writes, %u status bytes saved by running status, %u sysex packets (%u of %u bytes %s), %u realtime bytes left out\n",
+           recorder.stats.fileLength, recorder.stats.numBlockWrites, recorder.stats.numRunningStatusBytes, recorder.stats.numSysExPackets,
+           numSysExBytes, reader.numSysExBytes, ((sysExHash == reader.sysExHash) && (numSysExBytes == reader.numSysExBytes)) ? "intact" : "WRONG", recorder.stats.numIgnoredBytes);
+
+    if(failed || numMismatched || (numMatched != numMessages) || (numRecorded != numMatched) || reader.numStrayBytes ||
+       (sysExHash != reader.sysExHash) || (numSysExBytes != reader.numSysExBytes) || (recorder.stats.numIgnoredBytes != numRealtime) ||
+       (recordError.min <= -RECORD_ERROR_US) || (recordError.max >= RECORD_ERROR_US))
+    {
+        failed = 1;
+    }
+    printf("  record check      %s\n", failed ? "FAIL" : "PASS");
+
+    free(events);
+    free(sysEx);
+    return failed;
+}
+
+
+static uint8_t runThruCheck(void)
+{
+    // Plays the song again at THRU_TEMPO_MULTIPLIER, so port 0 is
+    // saturated, as clock master with midi in 0 forwarded to it. The input
+    // is key and channel pressure (which the song never uses) numbered
+    // through their data bytes, partly sent with running status. Every
+    // message has to arrive once, in order and within THRU_LATENCY_MAX_US
+    // of its last input byte. The song's own messages around them must
+    // all still be intact, however running status fell, and with the port
+    // saturated every one of them is due as soon as the one before is out
+    // - so none may wait behind more than THRU_SONG_DELAY_MAX_US of input,
+    // and none may end up later than with no input at all by more than
+    // the input's own wire time (see getSaturatedLateness).
+    static uint8_t message[MIDI_COMPILED_EVENT_MAX_BYTES];
+    const hostUartByte_t * firstByte;
+    captureReader_t reader;
+    errorStats_t latency;
+    uint64_t inputTime;
+    uint64_t wakeTime;
+    bool isMidiIn;
+    uint64_t stopTime;
+    uint64_t arrivalTimes[THRU_NUM_MESSAGES];
+    uint32_t songDelay = 0;
+    uint32_t maxSongDelay = 0;
+    uint32_t inputWireTime = 0;
+    uint32_t songAloneLateness;
+    uint32_t numInput = 0;
+    uint32_t numForwarded = 0;
+    uint32_t numOutOfOrder = 0;
+    uint32_t numMatched = 0;
+    uint32_t numMismatched = 0;
+    uint32_t numThru;
+    uint32_t eventIndex;
+    uint8_t length;
+    uint8_t failed = 0;
+
+    memset(&latency, 0, sizeof(errorStats_t));
+    latency.min = INT64_MAX;
+    latency.max = INT64_MIN;
+
+    songAloneLateness = getSaturatedLateness();
+    hostLowLevel_reset(hostLowLevel_getTime() + SONG_START_TIME, captureBuffer, MAX_CAPTURED_BYTES);
+    memset(&playbackData.thruStats, 0, sizeof(playbackThruStats_t));
+    playbackEngine_setThru(&playbackData, 0, 1 << 0);
+
+    // Message n is key pressure n, or every fourth one channel pressure
+    // n, with the input's running status used whenever it can be
+    inputTime = hostLowLevel_getTime() + PLAYBACK_LOOKAHEAD_DEFAULT_US;
+    for(uint8_t status = 0; numInput < THRU_NUM_MESSAGES; numInput++)
+    {
+        inputTime += THRU_INTERVAL_US;
+        message[0] = ((numInput % 4) == 3) ? 0xD5 : 0xA5;
+        length = ((numInput % 4) == 3) ? 2 : 3;
+        message[1] = (uint8_t)(numInput & 0x7F);
+        message[2] = (uint8_t)(numInput >> 7);
+
+        for(uint8_t i = (message[0] == status) ? 1 : 0; i < length; i++)
+        {
+            hostLowLevel_receiveMidiIn(0, inputTime, message[i]);
+            inputTime += HOST_UART_US_PER_BYTE;
+        }
+        status = message[0];
+        arrivalTimes[numInput] = inputTime;
+    }
+
+    playbackEngine_setClockPorts(&playbackData, 1 << 0);
+    playbackEngine_setTempo(&playbackData, THRU_TEMPO_MULTIPLIER);
+    playbackEngine_start(&playbackData);
+    playbackEngine_service(&playbackData);
+    stopTime = playbackData.songStartTime + THRU_PLAY_US;
+
+    while(playbackData.isPlayingBack && (hostLowLevel_getTime() < stopTime))
+    {
+        if(!hostLowLevel_takeWake(&wakeTime, &isMidiIn)) break;
+        hostLowLevel_advanceTo(wakeTime + nextWakeLatency());
+        if(!isMidiIn || playbackEngine_readInput(&playbackData)) playbackEngine_service(&playbackData);
+        systemTrace_dump(UINT32_MAX);
+    }
+
+    hostLowLevel_advanceTo(hostLowLevel_getTime() + 1); //Everything written from here is the stop's note-offs
+    stopTime = hostLowLevel_getTime();
+    playbackEngine_stop(&playbackData);
+    playbackEngine_setThru(&playbackData, 0, 0);
+    playbackEngine_setTempo(&playbackData, PLAYBACK_TEMPO_ONE);
+    playbackEngine_setClockPorts(&playbackData, 0);
+
+    //** Thru messages, and the song's around them **//
+    memset(&reader, 0, sizeof(captureReader_t));
+    eventIndex = findEventOnPort(0, 0);
+    while((length = readCapturedMessage(&reader, message, &firstByte)) != 0)
+    {
+        if(firstByte->writeTime >= stopTime) break;
+
+        if(((message[0] == 0xA5) && (length == 3)) || ((message[0] == 0xD5) && (length == 2)))
+        {
+            numThru = (uint32_t)message[1] | ((length == 3) ? ((uint32_t)message[2] << 7) : 0);
+            if((numThru & ((length == 3) ? 0x3FFF : 0x7F)) != (numForwarded & ((length == 3) ? 0x3FFF : 0x7F))) numOutOfOrder++;
+            else addError(&latency, (int64_t)firstByte->wireTime - (int64_t)arrivalTimes[numForwarded]);
+            numForwarded++;
+            songDelay += length * HOST_UART_US_PER_BYTE;
+            inputWireTime += length * HOST_UART_US_PER_BYTE;
+            continue;
+        }
+
+        if(songDelay > maxSongDelay) maxSongDelay = songDelay;
+        songDelay = 0;
+        if((eventIndex < playbackData.song.numEvents) && isSameMessage(&playbackData.song.events[eventIndex], message, length)) numMatched++;
+        else numMismatched++;
+        eventIndex = findEventOnPort(eventIndex + 1, 0);
+    }
+
+    printf("  thru              %u of %u input messages forwarded (%u out of order, %u dropped), latency min %lld / max %lld / mean %.1f us (engine max %u us)\n",
+           numForwarded, numInput, numOutOfOrder, playbackData.thruStats.numDropped, (long long)latency.min, (long long)latency.max,
+           latency.count ? (latency.total / latency.count) : 0.0, playbackData.thruStats.maxLatency);
+    printf("  thru under load   %u song messages intact around them (%u mismatched), %u late by up to %u us, %u messages split by the clock\n",
+           numMatched, numMismatched + reader.numStrayBytes, playbackData.timingStats.numLateEvents, playbackData.timingStats.maxLateness,
+           playbackData.clockStats.numSplitMessages);
+    printf("  thru song delay   song messages held back by up to %u us of input at a time (limit %u us), %u let ahead of it, song alone late by up to %u us (+%u us of input wire)\n",
+           maxSongDelay, THRU_SONG_DELAY_MAX_US, playbackData.thruStats.numYielded, songAloneLateness, inputWireTime);
+
+    if((numForwarded != numInput) || numOutOfOrder || (numMatched == 0) || numMismatched || reader.numStrayBytes || (maxSongDelay > THRU_SONG_DELAY_MAX_US) ||
+       (playbackData.timingStats.maxLateness > (songAloneLateness + inputWireTime + WAKE_LATENCY_MAX_US)) ||
+       (latency.max > THRU_LATENCY_MAX_US) || (playbackData.thruStats.maxLatency > THRU_LATENCY_MAX_US) || (playbackData.thruStats.numMessages != numInput))
+    {
+        failed = 1;
+    }
+    printf("  thru check        %s\n", failed ? "FAIL" : "PASS");
+
+    return failed;
+}
+
+
+static uint8_t runLiveCheck(void)
+{
+    // Saturates port 0 again, this time with live events written to it
+    // as the client would, each serviced after a wake latency as the
+    // playback task would be once notified. They are key pressure on
+    // another channel, numbered through their data bytes, and every third
+    // event carries a second message with running status. Each message
+    // has to arrive once and in order, with the song intact around them.
+    // Each event has to start on the wire within THRU_LATENCY_MAX_US of
+    // its write - except the first, which finds the port written as far
+    // ahead as any other and only clears it for the ones after. No song
+    // message may wait behind more than THRU_SONG_DELAY_MAX_US of them, or
+    // be later than with no live events by more than their wire time.
+    static uint8_t message[MIDI_COMPILED_EVENT_MAX_BYTES];
+    const hostUartByte_t * firstByte;
+    captureReader_t reader;
+    errorStats_t latency;
+    uint8_t event[5];
+    uint64_t writeTimes[LIVE_NUM_EVENTS * 2];
+    uint64_t nextWrite;
+    uint64_t wakeTime = UINT64_MAX;
+    uint64_t stopTime;
+    int64_t firstLatency = 0;
+    uint32_t songDelay = 0;
+    uint32_t maxSongDelay = 0;
+    uint32_t inputWireTime = 0;
+    uint32_t songAloneLateness;
+    bool hasWake = false;
+    bool isMidiIn;
+    uint32_t numEvents = 0;
+    uint32_t numWritten = 0;
+    uint32_t numForwarded = 0;
+    uint32_t numOutOfOrder = 0;
+    uint32_t numMatched = 0;
+    uint32_t numMismatched = 0;
+    uint32_t eventIndex;
+    uint8_t length;
+    uint8_t failed = 0;
+
+    memset(&latency, 0, sizeof(errorStats_t));
+    latency.min = INT64_MAX;
+    latency.max = INT64_MIN;
+
+    songAloneLateness = getSaturatedLateness();
+    hostLowLevel_reset(hostLowLevel_getTime() + SONG_START_TIME, captureBuffer, MAX_CAPTURED_BYTES);
+    memset(&playbackData.liveStats, 0, sizeof(playbackThruStats_t));
+    playbackEngine_setLivePorts(&playbackData, 1 << 0);
+    playbackEngine_setClockPorts(&playbackData, 1 << 0);
+    playbackEngine_setTempo(&playbackData, THRU_TEMPO_MULTIPLIER);
+    playbackEngine_start(&playbackData);
+    playbackEngine_service(&playbackData);
+    stopTime = playbackData.songStartTime + THRU_PLAY_US;
+    nextWrite = hostLowLevel_getTime() + LIVE_INTERVAL_US;
+
+    // The wake taken but not yet reached stays pending while live events
+    // are written ahead of it, the engine re-arms the alarm each service
+    while(playbackData.isPlayingBack && (hostLowLevel_getTime() < stopTime))
+    {
+        if(!hasWake) hasWake = hostLowLevel_takeWake(&wakeTime, &isMidiIn); //No midi in enabled, always the alarm
+
+        if((numEvents < LIVE_NUM_EVENTS) && (!hasWake || (nextWrite < wakeTime)))
+        {
+            hostLowLevel_advanceTo(nextWrite);
+            event[0] = 0xA6;
+            event[1] = (uint8_t)(numWritten & 0x7F);
+            event[2] = (uint8_t)(numWritten >> 7);
+            writeTimes[numWritten++] = nextWrite;
+            length = 3;
+            if((numEvents % 3) == 2)
+            {
+                event[3] = (uint8_t)(numWritten & 0x7F);
+                event[4] = (uint8_t)(numWritten >> 7);
+                writeTimes[numWritten++] = UINT64_MAX; //Its latency includes the first's wire time
+                length = 5;
+            }
+            if(playbackEngine_queueLiveEvent(&playbackData, nextWrite, 1 << 0, event, length)) failed = 1;
+            numEvents++;
+            nextWrite += LIVE_INTERVAL_US;
+        }
+        else if(hasWake)
+        {
+            hostLowLevel_advanceTo(wakeTime);
+            hasWake = false;
+        }
+        else break;
+
+        hostLowLevel_advanceTo(hostLowLevel_getTime() + nextWakeLatency());
+        playbackEngine_service(&playbackData);
+        systemTrace_dump(UINT32_MAX);
+    }
+
+    hostLowLevel_advanceTo(hostLowLevel_getTime() + 1); //Everything written from here is the stop's note-offs
+    stopTime = hostLowLevel_getTime();
+    playbackEngine_stop(&playbackData);
+    playbackEngine_setLivePorts(&playbackData, 0);
+    playbackEngine_setTempo(&playbackData, PLAYBACK_TEMPO_ONE);
+    playbackEngine_setClockPorts(&playbackData, 0);
+
+    //** Live messages, and the song's around them **//
+    memset(&reader, 0, sizeof(captureReader_t));
+    eventIndex = findEventOnPort(0, 0);
+    while((length = readCapturedMessage(&reader, message, &firstByte)) != 0)
+    {
+        if(firstByte->writeTime >= stopTime) break;
+
+        if((message[0] == 0xA6) && (length == 3))
+        {
+            if(((uint32_t)message[1] | ((uint32_t)message[2] << 7)) != numForwarded) numOutOfOrder++;
+            else if(numForwarded == 0) firstLatency = (int64_t)firstByte->wireTime - (int64_t)writeTimes[0];
+            else if(writeTimes[numForwarded] != UINT64_MAX) addError(&latency, (int64_t)firstByte->wireTime - (int64_t)writeTimes[numForwarded]);
+            numForwarded++;
+            songDelay += length * HOST_UART_US_PER_BYTE;
+            inputWireTime += length * HOST_UART_US_PER_BYTE;
+            continue;
+        }
+
+        if(songDelay > maxSongDelay) maxSongDelay = songDelay;
+        songDelay = 0;
+        if((eventIndex < playbackData.song.numEvents) && isSameMessage(&playbackData.song.events[eventIndex], message, length)) numMatched++;
+        else numMismatched++;
+        eventIndex = findEventOnPort(eventIndex + 1, 0);
+    }
+
+    printf("  live              %u of %u messages (%u events) played (%u out of order, %u dropped), write to wire first %lld, then min %lld / max %lld / mean %.1f us (engine max %u us, second messages included)\n",
+           numForwarded, numWritten, numEvents, numOutOfOrder, playbackData.liveStats.numDropped, (long long)firstLatency, (long long)latency.min, (long long)latency.max,
+           latency.count ? (latency.total / latency.count) : 0.0, playbackData.liveStats.maxLatency);
+    printf("  live under load   %u song messages intact around them (%u mismatched), %u late by up to %u us\n",
+           numMatched, numMismatched + reader.numStrayBytes, playbackData.timingStats.numLateEvents, playbackData.timingStats.maxLateness);
+    printf("  live song delay   song messages held back by up to %u us of live events at a time (limit %u us), %u let ahead of them, song alone late by up to %u us (+%u us of live wire)\n",
+           maxSongDelay, THRU_SONG_DELAY_MAX_US, playbackData.liveStats.numYielded, songAloneLateness, inputWireTime);
+
+    if(failed || (numEvents != LIVE_NUM_EVENTS) || (numForwarded != numWritten) || numOutOfOrder || (numMatched == 0) || numMismatched || reader.numStrayBytes ||
+       (maxSongDelay > THRU_SONG_DELAY_MAX_US) || (playbackData.timingStats.maxLateness > (songAloneLateness + inputWireTime + WAKE_LATENCY_MAX_US)) ||
+       (latency.max > THRU_LATENCY_MAX_US) || (playbackData.liveStats.numMessages != numWritten))
+    {
+        failed = 1;
+    }
+    printf("  live check        %s\n", failed ? "FAIL" : "PASS");
+
+    return failed;
+}
+
+
+static uint32_t getSaturatedLateness(void)
+{
+    // Plays the song as runThruCheck and runLiveCheck do, with no input,
+    // and returns how late port 0 gets on its own. The wire can't carry
+    // it, so input can only ever push the song later by the time its
+    // own bytes take on the wire - anything more is input holding it up.
+    uint64_t wakeTime;
+    uint64_t stopTime;
+    bool isMidiIn;
+
+    hostLowLevel_reset(hostLowLevel_getTime() + SONG_START_TIME, captureBuffer, MAX_CAPTURED_BYTES);
+    playbackEngine_setClockPorts(&playbackData, 1 << 0);
+    playbackEngine_setTempo(&playbackData, THRU_TEMPO_MULTIPLIER);
+    playbackEngine_start(&playbackData);
+    playbackEngine_service(&playbackData);
+    stopTime = playbackData.songStartTime + THRU_PLAY_US;
+
+    while(playbackData.isPlayingBack && (hostLowLevel_getTime() < stopTime))
+    {
+        if(!hostLowLevel_takeWake(&wakeTime, &isMidiIn)) break;
+        hostLowLevel_advanceTo(wakeTime + nextWakeLatency());
+        playbackEngine_service(&playbackData);
+        systemTrace_dump(UINT32_MAX);
+    }
+
+    hostLowLevel_advanceTo(hostLowLevel_getTime() + 1);
+    playbackEngine_stop(&playbackData);
+    playbackEngine_setTempo(&playbackData, PLAYBACK_TEMPO_ONE);
+    playbackEngine_setClockPorts(&playbackData, 0);
+
+    return playbackData.timingStats.maxLateness;
+}
+
+
+static uint8_t runBootCheck(void)
+{
+    // Replays the song as the firmware boots: live events allowed on every
+    // port (see systemEntryPoint), but none written. Until one is, each
+    // port has to be written exactly as with live events off - the same
+    // uart writes and bytes, and nothing later.
+    static const char * const names[] = {"live off", "firmware boot"};
+    const uint8_t livePorts[] = {0, (1 << MIDI_OUTPUT_NUM_PORTS) - 1};
+    hostUartStats_t uart[2];
+    playbackTimingStats_t timing[2];
+    double serviceSeconds[2];
+    double startTime;
+    uint64_t deadline;
+    uint8_t failed = 0;
+
+    for(uint8_t i = 0; i < 2; i++)
+    {
+        hostLowLevel_reset(hostLowLevel_getTime() + SONG_START_TIME, captureBuffer, MAX_CAPTURED_BYTES);
+        wakeLatencySeed = 12345;
+        serviceSeconds[i] = 0.0;
+        playbackEngine_setLivePorts(&playbackData, livePorts[i]);
+        playbackEngine_start(&playbackData);
+
+        while(1)
+        {
+            startTime = getSeconds();
+            playbackEngine_service(&playbackData);
+            serviceSeconds[i] += getSeconds() - startTime;
+            systemTrace_dump(UINT32_MAX);
+
+            if(!playbackData.isPlayingBack) break;
+            if(!hostLowLevel_takeAlarm(&deadline))
+            {
+                ESP_LOGE("benchmark", "Playback stalled with no alarm armed at event %u", playbackData.nextEventIndex);
+                playbackEngine_stop(&playbackData);
+                failed = 1;
+                break;
+            }
+            hostLowLevel_advanceTo(deadline + nextWakeLatency());
+        }
+
+        uart[i] = *hostLowLevel_getUartStats();
+        timing[i] = playbackData.timingStats;
+    }
+    playbackEngine_setLivePorts(&playbackData, 0);
+
+    for(uint8_t i = 0; i < 2; i++)
+    {
+        printf("  %-17s %u writes, %u bytes, %u late by up to %u us, %.1f ns/event\n", names[i], uart[i].numWrites, uart[i].numBytes,
+               timing[i].numLateEvents, timing[i].maxLateness, serviceSeconds[i] * 1e9 / playbackData.song.numEvents);
+    }
+
+    if((uart[1].numWrites != uart[0].numWrites) || (uart[1].numBytes != uart[0].numBytes) ||
+       (timing[1].numLateEvents != timing[0].numLateEvents) || (timing[1].maxLateness != timing[0].maxLateness))
+    {
+        failed = 1;
+    }
+    printf("  boot check        %s\n", failed ? "FAIL" : "PASS");
+
+    return failed;
+}
+
+
+static uint8_t runDenseRoutingCheck(uint8_t numPorts)
+{
+    // Each synthetic dense track plays on its own channel, so
+    // after routing every event's port follows from its channel
+    uint32_t numWrong = 0;
+
+    for(uint32_t i = 0; i < playbackData.song.numEvents; i++)
+    {
+        if(playbackData.song.events[i].port != ((playbackData.song.events[i].data[0] & 0x0F) % numPorts)) numWrong++;
+    }
+
+    printf("  routing           %u events on the wrong port\n", numWrong);
+
+    return (numWrong) ? 1 : 0;
+}
+
+
+static void handleBleItem(const bleToAppQueueItem_t * item, benchmarkResult_t * result)
+{
+    // Mirrors the command handling in systemEntryPoint
+    double startTime;
+
+    switch(item->opcode)
+    {
+        case 1: //initial playback payload received
+            playbackEngine_stop(&playbackData);
+            playbackData.totalDataLength = item->dataLength;
+            break;
+
+        case 2: //additional playback payload recieved
+            playbackData.totalDataLength += item->dataLength;
+            break;
+
+        case 3: //stop playback
+            playbackEngine_stop(&playbackData);
+            break;
+
+        case 4: //playback upload complete - compile then start playback
+            playbackEngine_stop(&playbackData);
+            startTime = getSeconds();
+            if(playbackEngine_compileSong(&playbackData) == 0)
+            {
+                result->compileSeconds = getSeconds() - startTime;
+                result->numEvents = playbackData.song.numEvents;
+                playbackEngine_start(&playbackData);
+                serviceEngine(result);
+            }
+            break;
+    }
+}
+
+
+static void serviceEngine(benchmarkResult_t * result)
+{
+    double startTime = getSeconds();
+
+    playbackEngine_service(&playbackData);
+    result->serviceSeconds += getSeconds() - startTime;
+    result->numServiceCalls++;
+
+    //What the trace task would do, kept out of the measured time
+    systemTrace_dump(UINT32_MAX);
+}
+
+
+
+
+//****************************
+//********* ANALYSIS *********
+//****************************
+static void analyseCapture(const double * referenceTimes, benchmarkResult_t * result)
+{
+    // Matches each message in the capture, in order, against
+    // the compiled event it should have come from
+    const midiCompiledEvent_t * event;
+    const hostUartByte_t * firstByte;
+    captureReader_t reader;
+    uint8_t message[MIDI_COMPILED_EVENT_MAX_BYTES];
+    uint8_t messageLength;
+    uint32_t eventIndex;
+    uint32_t numSysExBytes;
+    uint64_t scheduled;
+    int64_t error;
+    double windowTotalFirst = 0.0;
+    double windowTotalLast = 0.0;
+
+    result->dispatchError.min = result->wireError.min = result->referenceError.min = INT64_MAX;
+    result->dispatchError.max = result->wireError.max = result->referenceError.max = INT64_MIN;
+
+    for(uint8_t port = 0; port < MIDI_OUTPUT_NUM_PORTS; port++)
+    {
+        memset(&reader, 0, sizeof(captureReader_t));
+        reader.port = port;
+        eventIndex = findEventOnPort(0, port);
+
+        while((messageLength = readCapturedMessage(&reader, message, &firstByte)) != 0)
+        {
+            if((eventIndex >= result->numEvents) ||
+               !isSameMessage(&playbackData.song.events[eventIndex], message, messageLength))
+            {
+                result->numMismatched++;
+            }
+            else
+            {
+                event = &playbackData.song.events[eventIndex];
+                scheduled = playbackData.songStartTime + tempoMap_tickToMicroSeconds(&playbackData.tempoMap, event->absoluteTime);
+
+                addError(&result->dispatchError, (int64_t)(firstByte->writeTime - scheduled));
+                addError(&result->wireError, (int64_t)(firstByte->wireTime - scheduled));
+
+                if(referenceTimes != NULL)
+                {
+                    error = (int64_t)(firstByte->writeTime - playbackData.songStartTime) - (int64_t)(referenceTimes[eventIndex] + 0.5);
+                    addError(&result->referenceError, error);
+                    if(eventIndex < SWEEP_WINDOW_EVENTS) windowTotalFirst += error;
+                    if(eventIndex >= (result->numEvents - SWEEP_WINDOW_EVENTS)) windowTotalLast += error;
+                }
+
+                result->numMatched++;
+            }
+
+            eventIndex = findEventOnPort(eventIndex + 1, port);
+        }
+
+        result->numMismatched += reader.numStrayBytes;
+
+        // SysEx can go out late, but every byte of it has to be there
+        if((hashSongSysEx(&playbackData.song, uploadBuffer, port, &numSysExBytes) != reader.sysExHash) || (numSysExBytes != reader.numSysExBytes)) result->numSysExWrong++;
+        result->numSysExBytes += reader.numSysExBytes;
+        result->numBrokenSysEx += reader.numBrokenSysEx;
+        if(reader.maxMessageBytes > result->maxSysExMessageBytes) result->maxSysExMessageBytes = reader.maxMessageBytes;
+    }
+    result->referenceFirstWindow = windowTotalFirst / SWEEP_WINDOW_EVENTS;
+    result->referenceLastWindow = windowTotalLast / SWEEP_WINDOW_EVENTS;
+}
+
+
+static uint8_t readCapturedMessage(captureReader_t * reader, uint8_t * message, const hostUartByte_t ** firstByte)
+{
+    // Returns the length of the next complete message on the reader's port
+    // in the capture, or 0 once it is exhausted. Running status is expanded
+    // and realtime bytes skipped, so output optimisations are measured the
+    // same way. SysEx is hashed into the reader rather than returned.
+    const uint32_t numCaptured = hostLowLevel_getNumCaptured();
+    uint8_t messageLength = 0;
+    uint8_t numBytes = 0;
+
+    while(reader->position < numCaptured)
+    {
+        const hostUartByte_t * captured = &captureBuffer[reader->position++];
+
+        if(captured->port != reader->port) continue;
+        if(captured->byte >= 0xF8) continue; //Realtime, can appear anywhere
+
+        if(reader->isInSysEx)
+        {
+            if((captured->byte < 0x80) || (captured->byte == 0xF7))
+            {
+                reader->sysExHash = hashByte(reader->sysExHash, captured->byte);
+                reader->numSysExBytes++;
+                reader->numMessageBytes++;
+                reader->isInSysEx = (captured->byte != 0xF7);
+                if(!reader->isInSysEx && (reader->numMessageBytes > reader->maxMessageBytes)) reader->maxMessageBytes = reader->numMessageBytes;
+                continue;
+            }
+
+            reader->numBrokenSysEx++;
+            reader->isInSysEx = false;
+        }
+
+        if(captured->byte == 0xF0)
+        {
+            reader->sysExHash = hashByte(reader->sysExHash, captured->byte);
+            reader->numSysExBytes++;
+            reader->numMessageBytes = 1;
+            reader->isInSysEx = true;
+            reader->runningStatus = 0;
+            numBytes = 0;
+            continue;
+        }
+
+        if(captured->byte & 0x80)
+        {
+            reader->runningStatus = (captured->byte < 0xF0) ? captured->byte : 0;
+            message[0] = captured->byte;
+            messageLength = getMessageLength(captured->byte);
+            numBytes = 1;
+            *firstByte = captured;
+        }
+        else
+        {
+            if(numBytes == 0) //Data byte with nothing open, running status
+            {
+                if(reader->runningStatus == 0) { reader->numStrayBytes++; continue; }
+                message[0] = reader->runningStatus;
+                messageLength = getMessageLength(reader->runningStatus);
+                numBytes = 1;
+                *firstByte = captured;
+            }
+            if(numBytes < MIDI_COMPILED_EVENT_MAX_BYTES) message[numBytes] = captured->byte;
+            numBytes++;
+        }
+
+        if(numBytes >= messageLength) return messageLength;
+    }
+
+    return 0;
+}
+
+
+static uint32_t findEventOnPort(uint32_t eventIndex, uint8_t port)
+{
+    // First compiled event from 'eventIndex' on that goes out on 'port'
+    // as a message, sysex packets are checked by hashSongSysEx instead
+    while((eventIndex < playbackData.song.numEvents) &&
+          ((playbackData.song.events[eventIndex].port != port) || MIDI_IS_SYSEX_STATUS(playbackData.song.events[eventIndex].data[0])))
+    {
+        eventIndex++;
+    }
+    return eventIndex;
+}
+
+
+static uint32_t hashSongSysEx(const midiCompiledSong_t * song, const uint8_t * fileData, uint8_t port, uint32_t * numBytes)
+{
+    // Every sysex byte the song puts on 'port', as the capture reader sees them
+    const midiCompiledEvent_t * event;
+    const midiCompiledSysEx_t * packet;
+    uint32_t hash = 0;
+
+    *numBytes = 0;
+    for(uint32_t i = 0; i < song->numEvents; i++)
+    {
+        event = &song->events[i];
+        if((event->port != port) || !MIDI_IS_SYSEX_STATUS(event->data[0])) continue;
+
+        packet = &song->sysEx[(uint32_t)event->data[1] | ((uint32_t)event->data[2] << 8)];
+        if(event->data[0] == 0xF0)
+        {
+            hash = hashByte(hash, 0xF0);
+            (*numBytes)++;
+        }
+        for(uint32_t j = 0; j < packet->length; j++) hash = hashByte(hash, fileData[packet->dataOffset + j]);
+        *numBytes += packet->length;
+    }
+
+    return hash;
+}
+
+
+static uint32_t hashByte(uint32_t hash, uint8_t byte)
+{
+    // Order sensitive (FNV-1a style, from 0)
+    return (hash ^ byte) * 16777619u;
+}
+
+
+static uint8_t getMessageLength(uint8_t status)
+{
+    if(status < 0xC0) return 3;
+    if(status < 0xE0) return 2;
+    if(status < 0xF0) return 3;
+    if((status == 0xF1) || (status == 0xF3)) return 2;
+    if(status == 0xF2) return 3;
+    return 1;
+}
+
+
+static bool isSameMessage(const midiCompiledEvent_t * event, const uint8_t * message, uint8_t length)
+{
+    // The output encoder may turn a note-off into a velocity 0 note-on
+    if(((event->data[0] & 0xF0) == 0x80) && (length == 3) && (message[0] == (event->data[0] | 0x10)) &&
+       (message[1] == event->data[1]) && (message[2] == 0) && ((event->data[2] == 0) || (event->data[2] == 0x40)))
+    {
+        return true;
+    }
+
+    return (event->length == length) && (memcmp(event->data, message, length) == 0);
+}
+
+
+static bool trackHeldNote(midiNoteSet_t * heldNotes, const uint8_t * message, uint8_t length)
+{
+    // Follows the notes a receiver would have sounding, returns
+    // true if 'message' released one (any note-off form)
+    const uint16_t numHeld = heldNotes->numNotes;
+
+    if(length != 3) return false;
+    midiOutput_trackNote(heldNotes, message[0], message[1], message[2]);
+    return heldNotes->numNotes < numHeld;
+}
+
+
+static void addError(errorStats_t * stats, int64_t error)
+{
+    if(error < stats->min) stats->min = error;
+    if(error > stats->max) stats->max = error;
+    stats->total += error;
+    stats->count++;
+}
+
+
+static void printResult(const char * name, const benchmarkResult_t * result)
+{
+    const hostUartStats_t * uart = hostLowLevel_getUartStats();
+    const double perEvent = (result->numEvents) ? (result->serviceSeconds / result->numEvents) : 0.0;
+
+    printf("\n== %s ==\n", name);
+    printf("  events            %u compiled, %u matched on the wire, %u mismatched\n", result->numEvents, result->numMatched, result->numMismatched);
+    printf("  compile           %.3f ms\n", result->compileSeconds * 1e3);
+    printf("  playback cpu      %.3f ms total, %.1f ns/event, %.2f M events/s\n",
+           result->serviceSeconds * 1e3, perEvent * 1e9, (perEvent > 0.0) ? (1e-6 / perEvent) : 0.0);
+    printf("  service calls     %u (%.2f events/call)\n", result->numServiceCalls,
+           (result->numServiceCalls) ? ((double)result->numEvents / result->numServiceCalls) : 0.0);
+    printf("  late events       %u (max %u us) behind their planned send time\n", playbackData.timingStats.numLateEvents, playbackData.timingStats.maxLateness);
+    printf("  unavoidable error %u events planned off their deadline, max %u us early / %u us late, mean %.1f us\n",
+           playbackData.timingStats.numCompensatedEvents, playbackData.timingStats.maxUnavoidableEarly, playbackData.timingStats.maxUnavoidableLate,
+           (playbackData.timingStats.numCompensatedEvents) ? ((double)playbackData.timingStats.totalUnavoidableError / playbackData.timingStats.numCompensatedEvents) : 0.0);
+
+    if(result->dispatchError.count)
+    {
+        printf("  dispatch error    min %lld / mean %.1f / max %lld us (scheduled -> uart write)\n",
+               (long long)result->dispatchError.min, result->dispatchError.total / result->dispatchError.count, (long long)result->dispatchError.max);
+        printf("  wire error        min %lld / mean %.1f / max %lld us (scheduled -> first byte on the wire)\n",
+               (long long)result->wireError.min, result->wireError.total / result->wireError.count, (long long)result->wireError.max);
+    }
+    if(result->referenceError.count)
+    {
+        printf("  reference error   min %lld / max %lld us, mean first %d %.2f us, last %d %.2f us\n",
+               (long long)result->referenceError.min, (long long)result->referenceError.max,
+               SWEEP_WINDOW_EVENTS, result->referenceFirstWindow, SWEEP_WINDOW_EVENTS, result->referenceLastWindow);
+    }
+
+    printf("  uart              %u writes, %u bytes, %u blocked writes (%llu us blocked)\n",
+           uart->numWrites, uart->numBytes, uart->numBlockedWrites, (unsigned long long)uart->totalBlockedTime);
+#if MIDI_OUTPUT_NUM_PORTS > 1
+    printf("  ports            ");
+    for(uint8_t port = 0; port < MIDI_OUTPUT_NUM_PORTS; port++) printf(" %u", uart->numPortBytes[port]);
+    printf(" bytes\n");
+#endif
+    if(playbackData.song.numSysEx)
+    {
+        printf("  sysex             %u packets, %u bytes on the wire (%u wrong ports, %u broken messages), max %u pending\n",
+               playbackData.sysExStats.numPackets, result->numSysExBytes, result->numSysExWrong, result->numBrokenSysEx, playbackData.sysExStats.maxPendingBytes);
+        printf("  sysex priority    %u messages forced out with no gap, %u events held behind one, longest message %u bytes (%u us of wire)\n",
+               playbackData.sysExStats.numForcedStarts, playbackData.timingStats.numHeldEvents, result->maxSysExMessageBytes,
+               result->maxSysExMessageBytes * HOST_UART_US_PER_BYTE);
+    }
+    if(systemTrace_getDroppedCount()) printf("  trace             %u records dropped\n", systemTrace_getDroppedCount());
+}
+
+
+
+
+//****************************
+//********* HELPERS **********
+//****************************
+static uint32_t nextWakeLatency(void)
+{
+    //Fixed seed LCG so every run injects the same latencies
+    wakeLatencySeed = (wakeLatencySeed * 1103515245) + 12345;
+    return (wakeLatencySeed >> 16) % (WAKE_LATENCY_MAX_US + 1);
+}
+
+
+static double getSeconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + (now.tv_nsec * 1e-9);
+}
+
+
+static uint32_t loadFile(const char * path, uint8_t * buffer, uint32_t maxLength)
+{
+    FILE * file = fopen(path, "rb");
+    size_t length;
+
+    if(file == NULL)
+    {
+        ESP_LOGE("benchmark", "Unable to open %s", path);
+        return 0;
+    }
+
+    length = fread(buffer, 1, maxLength, file);
+    fclose(file);
+
+    return (uint32_t)length;
+}
@@ -0,0 +1,301 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include "syntheticMidi.h"
+
+#define SWEEP_TIME_DIVISION 96
+#define SWEEP_TICKS_PER_EVENT 1
+#define SWEEP_NUM_TEMPOS 5
+
+//Deliberately awkward tempos, none divide evenly by the time division
+static const uint32_t sweepTempos[SWEEP_NUM_TEMPOS] = {192001, 187503, 199999, 190477, 181819};
+
+typedef struct
+{
+    uint8_t * base;
+    uint32_t length;
+    uint32_t maxLength;
+    uint32_t trackStart;
+} midiWriter_t;
+
+static void writeBytes(midiWriter_t * writer, const uint8_t * data, uint32_t numBytes);
+static void writeByte(midiWriter_t * writer, uint8_t data);
+static void writeBigEndian(midiWriter_t * writer, uint32_t value, uint8_t numBytes);
+static void writeVariableLength(midiWriter_t * writer, uint32_t value);
+static void writeHeader(midiWriter_t * writer, uint16_t format, uint16_t numTracks, uint16_t timeDivision);
+static void beginTrack(midiWriter_t * writer);
+static void endTrack(midiWriter_t * writer, uint32_t delta);
+static void writeTempo(midiWriter_t * writer, uint32_t delta, uint32_t microSecondsPerQuaterNote);
+static void writeSysEx(midiWriter_t * writer, uint32_t delta, uint8_t status, uint32_t numBytes, uint32_t seed, bool endsMessage);
+
+
+//**** Public
+uint32_t syntheticMidi_denseTracks(uint8_t * out, uint32_t maxLength, uint16_t numTracks, uint32_t notesPerTrack, uint32_t ticksPerNote, uint8_t numPorts)
+{
+    midiWriter_t writer = {out, 0, maxLength, 0};
+    uint8_t channel;
+    uint8_t note = 0;
+
+    writeHeader(&writer, 1, numTracks, 480);
+
+    for(uint16_t track = 0; track < numTracks; track++)
+    {
+        beginTrack(&writer);
+        if(track == 0) writeTempo(&writer, 0, 500000);
+        if(numPorts > 1)
+        {
+            writeVariableLength(&writer, 0);
+            writeByte(&writer, 0xFF);
+            writeByte(&writer, 0x21);
+            writeByte(&writer, 0x01);
+            writeByte(&writer, track % numPorts);
+        }
+
+        // Program, volume and pan up front, modulation and pitch bend
+        // moving through the track - gives seeks some state to chase
+        channel = track & 0x0F;
+        writeVariableLength(&writer, 0);
+        writeByte(&writer, 0xC0 | channel);
+        writeByte(&writer, track);
+        writeVariableLength(&writer, 0);
+        writeByte(&writer, 0xB0 | channel);
+        writeByte(&writer, 7);
+        writeByte(&writer, 100);
+        writeVariableLength(&writer, 0);
+        writeByte(&writer, 0xB0 | channel);
+        writeByte(&writer, 10);
+        writeByte(&writer, (track * 8) & 0x7F);
+
+        for(uint32_t i = 0; i < notesPerTrack; i++)
+        {
+            // Each note ends as the next begins, so every
+            // step is a note-off and a note-on per track
+            if(i > 0)
+            {
+                writeVariableLength(&writer, ticksPerNote);
+                writeByte(&writer, 0x80 | channel);
+                writeByte(&writer, note);
+                writeByte(&writer, 0);
+            }
+
+            note = 36 + ((i + track) % 48);
+            writeVariableLength(&writer, 0);
+            writeByte(&writer, 0x90 | channel);
+            writeByte(&writer, note);
+            writeByte(&writer, 100);
+
+            if((i % 16) == 0)
+            {
+                writeVariableLength(&writer, 0);
+                writeByte(&writer, 0xB0 | channel);
+                writeByte(&writer, 1);
+                writeByte(&writer, (i / 16) & 0x7F);
+                writeVariableLength(&writer, 0);
+                writeByte(&writer, 0xE0 | channel);
+                writeByte(&writer, i & 0x7F);
+                writeByte(&writer, (i >> 7) & 0x7F);
+            }
+        }
+
+        writeVariableLength(&writer, ticksPerNote);
+        writeByte(&writer, 0x80 | channel);
+        writeByte(&writer, note);
+        writeByte(&writer, 0);
+        endTrack(&writer, 0);
+    }
+
+    return (writer.length <= writer.maxLength) ? writer.length : 0;
+}
+
+
+//**** Public
+uint32_t syntheticMidi_sysExDumps(uint8_t * out, uint32_t maxLength, uint32_t numBeats, uint32_t patchBytes, uint32_t bulkBytes, uint32_t bulkInterval)
+{
+    midiWriter_t writer = {out, 0, maxLength, 0};
+    const uint32_t bulkPacketBytes = bulkBytes / 4;
+    uint32_t delta = 0;
+
+    writeHeader(&writer, 1, 2, 480);
+
+    beginTrack(&writer);
+    writeTempo(&writer, 0, 500000);
+    for(uint32_t beat = 0; beat < numBeats; beat++)
+    {
+        writeVariableLength(&writer, (beat > 0) ? 240 : 0);
+        writeByte(&writer, 0x90);
+        writeByte(&writer, 48 + (beat % 24));
+        writeByte(&writer, 100);
+        writeVariableLength(&writer, 240);
+        writeByte(&writer, 0x80);
+        writeByte(&writer, 48 + (beat % 24));
+        writeByte(&writer, 0);
+    }
+    endTrack(&writer, 0);
+
+    // On the beat, so each one is due alongside a note-on
+    beginTrack(&writer);
+    for(uint32_t beat = 0; beat < numBeats; beat++)
+    {
+        // Manufacturer id (0x43) first, the payload ends the message
+        writeSysEx(&writer, delta, 0xF0, patchBytes, beat, true);
+        delta = 480;
+
+        if((beat % bulkInterval) == (bulkInterval / 2))
+        {
+            writeSysEx(&writer, 0, 0xF0, bulkPacketBytes, beat, false);
+            writeSysEx(&writer, 0, 0xF7, bulkPacketBytes, beat + 1, false);
+            writeSysEx(&writer, 0, 0xF7, bulkPacketBytes, beat + 2, false);
+            writeSysEx(&writer, 0, 0xF7, bulkPacketBytes, beat + 3, true);
+        }
+    }
+    endTrack(&writer, 0);
+
+    return (writer.length <= writer.maxLength) ? writer.length : 0;
+}
+
+
+//**** Public
+uint32_t syntheticMidi_tempoSweep(uint8_t * out, uint32_t maxLength, uint32_t numEvents, double * referenceTimes)
+{
+    // Tempo changes happen on the same tick as a note event and are
+    // written first, so that event (and the ones after) use the new tempo
+    midiWriter_t writer = {out, 0, maxLength, 0};
+    uint32_t tempoIndex = 0;
+    uint32_t tempo = sweepTempos[0];
+    double time = 0.0;
+    uint32_t delta = 0;
+
+    writeHeader(&writer, 0, 1, SWEEP_TIME_DIVISION);
+    beginTrack(&writer);
+    writeTempo(&writer, 0, tempo);
+
+    for(uint32_t i = 0; i < numEvents; i++)
+    {
+        if((i > 0) && ((i % SWEEP_TIME_DIVISION) == 0))
+        {
+            tempoIndex = (tempoIndex + 1) % SWEEP_NUM_TEMPOS;
+            writeTempo(&writer, delta, sweepTempos[tempoIndex]);
+            time += ((double)delta * tempo) / SWEEP_TIME_DIVISION;
+            tempo = sweepTempos[tempoIndex];
+            delta = 0;
+        }
+
+        time += ((double)delta * tempo) / SWEEP_TIME_DIVISION;
+        referenceTimes[i] = time;
+
+        writeVariableLength(&writer, delta);
+        writeByte(&writer, (i & 1) ? 0x80 : 0x90);
+        writeByte(&writer, 60 + ((i >> 1) % 24));
+        writeByte(&writer, (i & 1) ? 0 : 100);
+        delta = SWEEP_TICKS_PER_EVENT;
+    }
+
+    endTrack(&writer, 0);
+
+    return (writer.length <= writer.maxLength) ? writer.length : 0;
+}
+
+
+//**** Private
+static void writeBytes(midiWriter_t * writer, const uint8_t * data, uint32_t numBytes)
+{
+    // Keeps counting once full so the caller can see
+    // the output overflowed, but never writes past the end
+    if((writer->length + numBytes) <= writer->maxLength) memcpy(writer->base + writer->length, data, numBytes);
+    writer->length += numBytes;
+}
+
+
+//**** Private
+static void writeByte(midiWriter_t * writer, uint8_t data)
+{
+    writeBytes(writer, &data, 1);
+}
+
+
+//**** Private
+static void writeBigEndian(midiWriter_t * writer, uint32_t value, uint8_t numBytes)
+{
+    while(numBytes--) writeByte(writer, (uint8_t)(value >> (numBytes * 8)));
+}
+
+
+//**** Private
+static void writeVariableLength(midiWriter_t * writer, uint32_t value)
+{
+    uint8_t bytes[4];
+    uint8_t numBytes = 0;
+
+    do
+    {
+        bytes[numBytes++] = value & 0x7F;
+        value >>= 7;
+    } while(value && (numBytes < 4));
+
+    while(numBytes--) writeByte(writer, bytes[numBytes] | (numBytes ? 0x80 : 0x00));
+}
+
+
+//**** Private
+static void writeHeader(midiWriter_t * writer, uint16_t format, uint16_t numTracks, uint16_t timeDivision)
+{
+    writeBytes(writer, (const uint8_t *)"MThd", 4);
+    writeBigEndian(writer, 6, 4);
+    writeBigEndian(writer, format, 2);
+    writeBigEndian(writer, numTracks, 2);
+    writeBigEndian(writer, timeDivision, 2);
+}
+
+
+//**** Private
+static void beginTrack(midiWriter_t * writer)
+{
+    writeBytes(writer, (const uint8_t *)"MTrk", 4);
+    writer->trackStart = writer->length;
+    writeBigEndian(writer, 0, 4); //Patched by endTrack
+}
+
+
+//**** Private
+static void endTrack(midiWriter_t * writer, uint32_t delta)
+{
+    uint32_t trackLength;
+
+    writeVariableLength(writer, delta);
+    writeByte(writer, 0xFF);
+    writeByte(writer, 0x2F);
+    writeByte(writer, 0x00);
+
+    trackLength = writer->length - writer->trackStart - 4;
+    if(writer->length <= writer->maxLength)
+    {
+        for(uint8_t i = 0; i < 4; i++) writer->base[writer->trackStart + i] = (uint8_t)(trackLength >> (24 - (i * 8)));
+    }
+}
+
+
+//**** Private
+static void writeSysEx(midiWriter_t * writer, uint32_t delta, uint8_t status, uint32_t numBytes, uint32_t seed, bool endsMessage)
+{
+    writeVariableLength(writer, delta);
+    writeByte(writer, status);
+    writeVariableLength(writer, numBytes);
+
+    for(uint32_t i = 0; i < numBytes; i++)
+    {
+        if((status == 0xF0) && (i == 0)) writeByte(writer, 0x43);
+        else if(endsMessage && (i == (numBytes - 1))) writeByte(writer, 0xF7);
+        else writeByte(writer, (uint8_t)((seed + (i * 7)) & 0x7F));
+    }
+}
+
+
+//**** Private
+static void writeTempo(midiWriter_t * writer, uint32_t delta, uint32_t microSecondsPerQuaterNote)
+{
+    writeVariableLength(writer, delta);
+    writeByte(writer, 0xFF);
+    writeByte(writer, 0x51);
+    writeByte(writer, 0x03);
+    writeBigEndian(writer, microSecondsPerQuaterNote, 3);
+}
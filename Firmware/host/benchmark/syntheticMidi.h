@@ -0,0 +1,28 @@
+#ifndef SYNTHETIC_MIDI_H
+#define SYNTHETIC_MIDI_H
+
+#include <stdint.h>
+
+//Builds standard midi files in memory for the benchmark. Both return
+//the file length in bytes, or 0 if 'maxLength' is too small.
+
+//Format 1, 'numTracks' tracks of notes every 'ticksPerNote' ticks, all
+//tracks in step so every note lands as a burst of events. Each track
+//also sets a program, volume and pan, and moves modulation and pitch bend.
+//With 'numPorts' above 1 each track starts with a midiPort meta event,
+//spreading the tracks round the ports (track % numPorts).
+uint32_t syntheticMidi_denseTracks(uint8_t * out, uint32_t maxLength, uint16_t numTracks, uint32_t notesPerTrack, uint32_t ticksPerNote, uint8_t numPorts);
+
+//Format 0, 'numEvents' note events spaced ~2ms apart with a set tempo
+//every beat. The exact time of every event (worked out independently of
+//the tempo map, in double precision) is written to 'referenceTimes'.
+//Format 1, a track of notes on every beat (each held for half a beat)
+//and a track of sysex on the same port: a 'patchBytes' message on every
+//beat, and every 'bulkInterval' beats a 'bulkBytes' dump sent as one
+//message split over four packets (0xF0 then 0xF7 continuations). The
+//patches fit in the gaps between the notes, the bulk dumps can't.
+uint32_t syntheticMidi_sysExDumps(uint8_t * out, uint32_t maxLength, uint32_t numBeats, uint32_t patchBytes, uint32_t bulkBytes, uint32_t bulkInterval);
+
+uint32_t syntheticMidi_tempoSweep(uint8_t * out, uint32_t maxLength, uint32_t numEvents, double * referenceTimes);
+
+#endif
@@ -0,0 +1,422 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "bleUpload.h"
+
+#define SONG_BYTES (1024 * 1024)            //As the firmware's PSRAM upload buffer
+#define CONNECTION_INTERVAL_US 15000
+#define WRITE_DROP_INTERVAL 997             //Every this many writes never reach the device (host buffers full)
+#define ACK_DROP_INTERVAL 97                //And every this many acks never reach the client
+#define POLL_EVENTS 4                       //Connection events the client waits, out of credit, before asking for an ack
+#define MAX_EVENTS 1000000                  //Gives up on an upload that stalls for good
+#define MAX_PENDING_ACKS 64
+#define LEGACY_PAYLOAD_BYTES 510            //Song bytes per write on the event characteristic
+#define LEGACY_WRITE_BYTES 512
+#define CPU_REPEATS 20                      //Whole uploads timed back to back for the cpu cost
+#define CPU_MTU 517
+#define MBUF_SEGMENT_BYTES 128              //Data per mbuf in the modelled chain (the stack's msys block size)
+#define MAX_SEGMENTS (((BLE_UPLOAD_OFFSET_BYTES + BLE_UPLOAD_MAX_CHUNK_BYTES) / MBUF_SEGMENT_BYTES) + 1)
+#define STAGING_BYTES 512                   //The event characteristic's flattening buffer
+
+typedef struct
+{
+    const char * name;
+    uint16_t mtu;
+    uint8_t writesPerEvent;                 //Writes without response the link carries each connection event
+} linkConfig_t;
+
+typedef struct
+{
+    uint8_t data[BLE_UPLOAD_ACK_LENGTH];
+    uint16_t length;
+} pendingAck_t;
+
+//A write as the stack hands it over, split across mbufs
+typedef struct
+{
+    const uint8_t * segments[MAX_SEGMENTS];
+    uint16_t segmentLengths[MAX_SEGMENTS];
+    uint8_t numSegments;
+} packetChain_t;
+
+//The client's side: as a phone app would keep it
+typedef struct
+{
+    uint32_t nextOffset;
+    uint32_t received;                      //As of the last ack
+    uint32_t windowEnd;
+    uint16_t chunkBytes;
+    uint8_t numGaps;
+    bool isPolling;
+    uint32_t stalledEvents;
+    uint32_t numWrites;
+    uint32_t numPolls;
+    uint32_t bytesSent;                     //Payload, retransmits included
+} uploadClient_t;
+
+
+static uint8_t runLink(const linkConfig_t * config);
+static void sendChunk(uploadClient_t * client, bool isPoll, uint32_t * numDroppedWrites);
+static void takeAck(uploadClient_t * client, const uint8_t * ack);
+static uint8_t runCpuCheck(void);
+static double timeUploads(bool isStaged, uint32_t * numStagedBytes);
+static void makeChain(packetChain_t * chain, const uint8_t * packet, uint16_t packetLength);
+static uint8_t copyFromChain(const void * packet, uint16_t sourceOffset, uint16_t length, uint8_t * destination);
+static double getLegacySeconds(uint16_t mtu);
+static uint32_t readLittleEndian(const uint8_t * source, uint8_t numBytes);
+static void writeLittleEndian(uint8_t * destination, uint32_t value, uint8_t numBytes);
+static double getSeconds(void);
+
+
+static const linkConfig_t linkConfigs[] = {
+    {"default mtu", 23, 6},
+    {"mtu 185 (iOS)", 185, 6},
+    {"mtu 247 (data length extension)", 247, 6},
+    {"mtu 517 (android)", 517, 4},
+};
+
+static bleUpload_t upload;
+static uint8_t song[SONG_BYTES];
+static uint8_t uploadBuffer[SONG_BYTES];
+static uint8_t packet[BLE_UPLOAD_OFFSET_BYTES + BLE_UPLOAD_MAX_CHUNK_BYTES];
+static uint8_t packets[SONG_BYTES + (((SONG_BYTES / 64) + 1) * BLE_UPLOAD_OFFSET_BYTES)]; //The whole song as writes, for the cpu check
+static uint8_t staging[STAGING_BYTES];
+static pendingAck_t pendingAcks[MAX_PENDING_ACKS];
+static uint32_t numPendingAcks;
+static uint32_t numAcksDelivered;
+
+
+
+
+//*************************
+//******** MAIN ***********
+//*************************
+int main(void)
+{
+    // Loops a 1MB song through bleUpload at each link config, against a
+    // model of the connection events. Returns non-zero if any upload came
+    // out different, stalled, or was no faster than the acked protocol.
+    uint32_t seed = 12345;
+    uint8_t failed = 0;
+
+    for(uint32_t i = 0; i < SONG_BYTES; i++)
+    {
+        seed = (seed * 1103515245) + 12345;
+        song[i] = (uint8_t)(seed >> 16);
+    }
+
+    printf("Upload of %d bytes, %d ms connection interval, every %dth write and %dth ack lost\n",
+           SONG_BYTES, CONNECTION_INTERVAL_US / 1000, WRITE_DROP_INTERVAL, ACK_DROP_INTERVAL);
+
+    for(uint32_t i = 0; i < (sizeof(linkConfigs) / sizeof(linkConfigs[0])); i++) failed |= runLink(&linkConfigs[i]);
+    failed |= runCpuCheck();
+
+    return failed;
+}
+
+
+
+
+//****************************
+//******** SCENARIOS *********
+//****************************
+static uint8_t runLink(const linkConfig_t * config)
+{
+    // One connection event at a time: the acks the device notified during
+    // the last event reach the client first, then the client sends what
+    // its credit allows. The upload is done when the client has the ack
+    // for the last byte.
+    uploadClient_t client;
+    pendingAck_t delivered[MAX_PENDING_ACKS];
+    uint32_t numDelivered;
+    uint32_t numDroppedWrites = 0;
+    uint32_t numEvents = 0;
+    uint32_t sent;
+    double seconds;
+    double legacySeconds;
+    uint8_t failed = 0;
+
+    memset(&client, 0, sizeof(uploadClient_t));
+    memset(uploadBuffer, 0, SONG_BYTES);
+    numPendingAcks = 0;
+    numAcksDelivered = 0;
+
+    if(bleUpload_begin(&upload, uploadBuffer, SONG_BYTES, SONG_BYTES, config->mtu))
+    {
+        printf("\n== %s ==\n  FAILED to begin\n", config->name);
+        return 1;
+    }
+    pendingAcks[0].length = bleUpload_makeAck(&upload, pendingAcks[0].data);
+    numPendingAcks = 1;
+
+    while((client.received < SONG_BYTES) && (numEvents < MAX_EVENTS))
+    {
+        numEvents++;
+        numDelivered = numPendingAcks;
+        memcpy(delivered, pendingAcks, numPendingAcks * sizeof(pendingAck_t));
+        numPendingAcks = 0;
+
+        for(uint32_t i = 0; i < numDelivered; i++)
+        {
+            if(((++numAcksDelivered) % ACK_DROP_INTERVAL) == 0) continue;
+            takeAck(&client, delivered[i].data);
+        }
+        if(client.received == SONG_BYTES) break;
+
+        for(sent = 0; (sent < config->writesPerEvent) && (client.nextOffset < client.windowEnd); sent++) sendChunk(&client, false, &numDroppedWrites);
+
+        if(sent != 0) client.stalledEvents = 0;
+        else if((++client.stalledEvents) >= POLL_EVENTS)
+        {
+            //Out of credit with no ack coming, the last one (or the
+            //chunks after it) must have gone missing
+            client.stalledEvents = 0;
+            client.isPolling = true;
+            client.numPolls++;
+            sendChunk(&client, true, &numDroppedWrites);
+        }
+    }
+
+    seconds = numEvents * (CONNECTION_INTERVAL_US * 1e-6);
+    legacySeconds = getLegacySeconds(config->mtu);
+
+    printf("\n== %s ==\n", config->name);
+    printf("  chunk %d bytes, %ld writes (%ld lost), %ld polls, %.1f%% retransmitted\n", upload.chunkBytes, (long)client.numWrites, (long)numDroppedWrites,
+           (long)client.numPolls, 100.0 * (client.bytesSent - SONG_BYTES) / SONG_BYTES);
+    printf("  device: %ld chunks, %ld rejected, %ld duplicates, %ld acks (%ld for gaps)\n", (long)upload.stats.numChunks, (long)upload.stats.numRejected,
+           (long)upload.stats.numDuplicates, (long)upload.stats.numAcks, (long)upload.stats.numGapAcks);
+    printf("  %.2f s, %.1f KB/s - acked writes on the event characteristic take %.2f s, %.1f KB/s\n",
+           seconds, SONG_BYTES / 1024.0 / seconds, legacySeconds, SONG_BYTES / 1024.0 / legacySeconds);
+
+    if(numEvents >= MAX_EVENTS)
+    {
+        printf("  FAILED, stalled at %ld bytes\n", (long)upload.received);
+        failed = 1;
+    }
+    if(!bleUpload_isComplete(&upload) || (memcmp(uploadBuffer, song, SONG_BYTES) != 0))
+    {
+        printf("  FAILED, the upload doesn't match the song\n");
+        failed = 1;
+    }
+    if(seconds >= legacySeconds)
+    {
+        printf("  FAILED, no faster than the acked writes\n");
+        failed = 1;
+    }
+
+    return failed;
+}
+
+
+static void sendChunk(uploadClient_t * client, bool isPoll, uint32_t * numDroppedWrites)
+{
+    // One write without response, the next chunk the credit allows or
+    // for a poll an empty one
+    uint32_t payloadLength = 0;
+
+    if(!isPoll)
+    {
+        payloadLength = client->windowEnd - client->nextOffset;
+        if(payloadLength > client->chunkBytes) payloadLength = client->chunkBytes;
+    }
+
+    writeLittleEndian(packet, client->nextOffset, 4);
+    memcpy(&packet[BLE_UPLOAD_OFFSET_BYTES], &song[client->nextOffset], payloadLength);
+    client->nextOffset += payloadLength;
+    client->bytesSent += payloadLength;
+
+    if(((++client->numWrites) % WRITE_DROP_INTERVAL) == 0)
+    {
+        (*numDroppedWrites)++;
+        return;
+    }
+
+    //As receiveUploadChunk in gatt_svr.c
+    bleUpload_receive(&upload, packet, BLE_UPLOAD_OFFSET_BYTES + payloadLength, bleUpload_copyFlat);
+    if(bleUpload_isAckDue(&upload) && (numPendingAcks < MAX_PENDING_ACKS))
+    {
+        pendingAcks[numPendingAcks].length = bleUpload_makeAck(&upload, pendingAcks[numPendingAcks].data);
+        numPendingAcks++;
+    }
+}
+
+
+static void takeAck(uploadClient_t * client, const uint8_t * ack)
+{
+    // Goes back to the received offset when the gap count moves on, or
+    // when this answers a poll - whatever was in flight has arrived by
+    // then, so anything past the received offset was lost
+    client->received = readLittleEndian(&ack[0], 4);
+    client->windowEnd = readLittleEndian(&ack[4], 4);
+    client->chunkBytes = readLittleEndian(&ack[8], 2);
+
+    if((ack[10] != client->numGaps) || client->isPolling || (client->nextOffset < client->received)) client->nextOffset = client->received;
+    client->numGaps = ack[10];
+    client->isPolling = false;
+}
+
+
+static uint8_t runCpuCheck(void)
+{
+    // What the device spends per write, with no losses at the largest
+    // chunk: the payload copied from the mbuf chain straight into the
+    // buffer, against flattening it first as the event characteristic
+    // does. The writes are laid out ahead of time, only receiving counts.
+    uint16_t chunkBytes = bleUpload_getChunkBytes(CPU_MTU);
+    uint32_t packetsLength = 0;
+    uint32_t payloadLength;
+    uint32_t numStagedBytes;
+    double stagedSeconds;
+    double directSeconds;
+    double stagedBytesPerPacket;
+    double directBytesPerPacket;
+    uint8_t failed = 0;
+
+    for(uint32_t offset = 0; offset < SONG_BYTES; offset += payloadLength)
+    {
+        payloadLength = ((SONG_BYTES - offset) > chunkBytes) ? chunkBytes : (SONG_BYTES - offset);
+        writeLittleEndian(&packets[packetsLength], offset, 4);
+        memcpy(&packets[packetsLength + BLE_UPLOAD_OFFSET_BYTES], &song[offset], payloadLength);
+        packetsLength += BLE_UPLOAD_OFFSET_BYTES + payloadLength;
+    }
+
+    stagedSeconds = timeUploads(true, &numStagedBytes);
+    stagedBytesPerPacket = (double)(upload.stats.numBytesCopied + numStagedBytes) / upload.stats.numPackets;
+    failed |= !bleUpload_isComplete(&upload) || (memcmp(uploadBuffer, song, SONG_BYTES) != 0);
+
+    directSeconds = timeUploads(false, &numStagedBytes);
+    directBytesPerPacket = (double)upload.stats.numBytesCopied / upload.stats.numPackets;
+    failed |= !bleUpload_isComplete(&upload) || (memcmp(uploadBuffer, song, SONG_BYTES) != 0);
+
+    printf("\n== host cpu, %d byte chunks in %d byte mbufs ==\n", chunkBytes, MBUF_SEGMENT_BYTES);
+    printf("  flattened first: %.0f ns, %.1f bytes copied per write\n", stagedSeconds * 1e9 / upload.stats.numPackets, stagedBytesPerPacket);
+    printf("  straight from the chain: %.0f ns, %.1f bytes copied per write (%.2fx)\n", directSeconds * 1e9 / upload.stats.numPackets,
+           directBytesPerPacket, stagedSeconds / directSeconds);
+
+    if(failed) printf("  FAILED, the upload doesn't match the song\n");
+    if(directBytesPerPacket != ((double)packetsLength / upload.stats.numPackets))
+    {
+        printf("  FAILED, each byte should be copied once\n");
+        failed = 1;
+    }
+
+    return failed;
+}
+
+
+static double timeUploads(bool isStaged, uint32_t * numStagedBytes)
+{
+    // CPU_REPEATS whole uploads from 'packets', the stats are the last one's
+    packetChain_t chain;
+    uint16_t chunkBytes = bleUpload_getChunkBytes(CPU_MTU);
+    uint32_t packetOffset;
+    uint16_t packetLength;
+    uint32_t offset;
+    double start;
+
+    *numStagedBytes = 0;
+    start = getSeconds();
+    for(uint32_t repeat = 0; repeat < CPU_REPEATS; repeat++)
+    {
+        bleUpload_begin(&upload, uploadBuffer, SONG_BYTES, SONG_BYTES, CPU_MTU);
+        *numStagedBytes = 0;
+        packetOffset = 0;
+        for(offset = 0; offset < SONG_BYTES; offset += packetLength - BLE_UPLOAD_OFFSET_BYTES)
+        {
+            packetLength = BLE_UPLOAD_OFFSET_BYTES + (((SONG_BYTES - offset) > chunkBytes) ? chunkBytes : (SONG_BYTES - offset));
+            makeChain(&chain, &packets[packetOffset], packetLength);
+            if(isStaged)
+            {
+                //As gatt_svr_chr_write (ble_hs_mbuf_to_flat)
+                copyFromChain(&chain, 0, packetLength, staging);
+                *numStagedBytes += packetLength;
+                bleUpload_receive(&upload, staging, packetLength, bleUpload_copyFlat);
+            }
+            else bleUpload_receive(&upload, &chain, packetLength, copyFromChain);
+            if(bleUpload_isAckDue(&upload)) bleUpload_makeAck(&upload, pendingAcks[0].data);
+            packetOffset += packetLength;
+        }
+    }
+
+    return getSeconds() - start;
+}
+
+
+
+
+//*************************
+//******** HELPERS ********
+//*************************
+static double getLegacySeconds(uint16_t mtu)
+{
+    // At best: a 512 byte write with response waits a connection event
+    // for the response, and past the mtu it goes as a long write - a
+    // prepare write for each piece and an execute, each acked
+    uint32_t numWrites = (SONG_BYTES + LEGACY_PAYLOAD_BYTES - 1) / LEGACY_PAYLOAD_BYTES;
+    uint32_t eventsPerWrite = 1;
+
+    if((LEGACY_WRITE_BYTES + 3) > mtu) eventsPerWrite = ((LEGACY_WRITE_BYTES + (mtu - 5) - 1) / (mtu - 5)) + 1;
+
+    return (double)numWrites * eventsPerWrite * (CONNECTION_INTERVAL_US * 1e-6);
+}
+
+
+static void makeChain(packetChain_t * chain, const uint8_t * packet, uint16_t packetLength)
+{
+    chain->numSegments = 0;
+    for(uint16_t offset = 0; offset < packetLength; offset += MBUF_SEGMENT_BYTES)
+    {
+        chain->segments[chain->numSegments] = &packet[offset];
+        chain->segmentLengths[chain->numSegments] = ((packetLength - offset) > MBUF_SEGMENT_BYTES) ? MBUF_SEGMENT_BYTES : (packetLength - offset);
+        chain->numSegments++;
+    }
+}
+
+
+static uint8_t copyFromChain(const void * packet, uint16_t sourceOffset, uint16_t length, uint8_t * destination)
+{
+    // As os_mbuf_copydata: skips whole segments to the offset, then copies
+    // a segment at a time
+    const packetChain_t * chain = (const packetChain_t *)packet;
+    uint16_t copyLength;
+    uint8_t segment = 0;
+
+    while((segment < chain->numSegments) && (sourceOffset >= chain->segmentLengths[segment])) sourceOffset -= chain->segmentLengths[segment++];
+
+    while(length > 0)
+    {
+        if(segment >= chain->numSegments) return 1;
+        copyLength = chain->segmentLengths[segment] - sourceOffset;
+        if(copyLength > length) copyLength = length;
+        memcpy(destination, chain->segments[segment] + sourceOffset, copyLength);
+        destination += copyLength;
+        length -= copyLength;
+        sourceOffset = 0;
+        segment++;
+    }
+
+    return 0;
+}
+
+
+static uint32_t readLittleEndian(const uint8_t * source, uint8_t numBytes)
+{
+    uint32_t value = 0;
+    for(uint8_t i = 0; i < numBytes; i++) value |= (uint32_t)source[i] << (8 * i);
+    return value;
+}
+
+
+static void writeLittleEndian(uint8_t * destination, uint32_t value, uint8_t numBytes)
+{
+    for(uint8_t i = 0; i < numBytes; i++) destination[i] = (uint8_t)(value >> (8 * i));
+}
+
+
+static double getSeconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + (now.tv_nsec * 1e-9);
+}
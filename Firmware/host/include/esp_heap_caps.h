@@ -0,0 +1,16 @@
+#ifndef HOST_ESP_HEAP_CAPS_H
+#define HOST_ESP_HEAP_CAPS_H
+
+//Host stand-in, every capability maps onto the one host heap
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#define MALLOC_CAP_8BIT (1 << 2)
+#define MALLOC_CAP_SPIRAM (1 << 10)
+#define MALLOC_CAP_INTERNAL (1 << 11)
+
+static inline void * heap_caps_malloc(size_t size, uint32_t caps) { (void)caps; return malloc(size); }
+static inline void heap_caps_free(void * ptr) { free(ptr); }
+
+#endif
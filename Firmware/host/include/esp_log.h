@@ -0,0 +1,19 @@
+#ifndef HOST_ESP_LOG_H
+#define HOST_ESP_LOG_H
+
+//Host stand-in for the IDF logger. Errors always go to stderr, info
+//logs are compiled out unless HOST_LOG_INFO is defined - printing on
+//every event would swamp anything the benchmark is trying to measure.
+
+#include <stdio.h>
+
+#define ESP_LOGE(tag, format, ...) fprintf(stderr, "E (%s) " format "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...) fprintf(stderr, "W (%s) " format "\n", tag, ##__VA_ARGS__)
+
+#ifdef HOST_LOG_INFO
+#define ESP_LOGI(tag, format, ...) printf("I (%s) " format "\n", tag, ##__VA_ARGS__)
+#else
+#define ESP_LOGI(tag, format, ...) do { } while(0)
+#endif
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef HOST_FREERTOS_H
+#define HOST_FREERTOS_H
+
+//Just enough of the FreeRTOS types for the playback core to compile on
+//the host. Nothing is scheduled, the benchmark calls everything directly.
+
+#include <stdint.h>
+
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+typedef uint8_t StackType_t;
+
+#define pdFALSE 0
+#define pdTRUE 1
+#define portMAX_DELAY 0xFFFFFFFF
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+
+#endif
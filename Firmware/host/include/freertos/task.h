@@ -0,0 +1,22 @@
+#ifndef HOST_FREERTOS_TASK_H
+#define HOST_FREERTOS_TASK_H
+
+#include "freertos/FreeRTOS.h"
+
+typedef void * TaskHandle_t;
+typedef void (*TaskFunction_t)(void *);
+typedef struct { int unused; } StaticTask_t;
+
+//Tasks never run on the host, creation just hands back a dummy
+//handle. Whatever a task would have done (e.g. draining the trace
+//ring) the benchmark does itself, outside of the measured code.
+static inline TaskHandle_t xTaskCreateStaticPinnedToCore(TaskFunction_t function, const char * name, uint32_t stackDepth, void * param,
+                                                         UBaseType_t priority, StackType_t * stack, StaticTask_t * taskBuffer, BaseType_t core)
+{
+    (void)function; (void)name; (void)stackDepth; (void)param; (void)priority; (void)stack; (void)core;
+    return (TaskHandle_t)taskBuffer;
+}
+
+static inline void vTaskDelay(TickType_t ticks) { (void)ticks; }
+
+#endif
@@ -0,0 +1,76 @@
+#include <stdio.h>
+#include <string.h>
+#include "hostBleQueue.h"
+#include "spscRing.h"
+
+static spscRing_t appRing;
+static bleToAppQueueItem_t appRingStorage[BLE_TO_APP_RING_LENGTH];
+static bool isRingReady = false;
+
+static void initRing(void);
+
+
+//**** Public
+bool hostBleQueue_send(const bleToAppQueueItem_t * item)
+{
+    initRing();
+    return spscRing_push(&appRing, item);
+}
+
+
+//**** Public
+bool hostBleQueue_receive(bleToAppQueueItem_t * item)
+{
+    initRing();
+    return spscRing_pop(&appRing, item);
+}
+
+
+//**** Public
+uint32_t hostBleQueue_writePlaybackPayload(const uint8_t * fileData, uint32_t fileLength, uint32_t offset, uint8_t * uploadBuffer)
+{
+    // One characteristic write from the client, handled the way
+    // gatt_svr.c does: payload copied straight into the upload buffer,
+    // opcode 1 for the first payload and 2 for every one after it.
+    // Returns the number of file bytes consumed, 0 if the queue is full.
+    bleToAppQueueItem_t queueItem;
+    uint32_t length = fileLength - offset;
+
+    if(length > HOST_BLE_PAYLOAD_BYTES) length = HOST_BLE_PAYLOAD_BYTES;
+
+    memset(&queueItem, 0, sizeof(bleToAppQueueItem_t));
+    queueItem.opcode = (offset == 0) ? 1 : 2;
+    queueItem.dataLength = length;
+
+    initRing();
+    if(spscRing_freeSlots(&appRing) == 0) return 0; //Refused, as gatt_svr.c does
+
+    memcpy(uploadBuffer + offset, fileData + offset, length);
+    hostBleQueue_send(&queueItem);
+
+    return length;
+}
+
+
+//**** Public
+bool hostBleQueue_sendCommand(uint8_t opcode)
+{
+    bleToAppQueueItem_t queueItem;
+
+    memset(&queueItem, 0, sizeof(bleToAppQueueItem_t));
+    queueItem.opcode = opcode;
+
+    return hostBleQueue_send(&queueItem);
+}
+
+
+
+
+
+//**** Private
+static void initRing(void)
+{
+    if(isRingReady) return;
+    spscRing_init(&appRing, appRingStorage, sizeof(bleToAppQueueItem_t), BLE_TO_APP_RING_LENGTH);
+    isRingReady = true;
+}
@@ -0,0 +1,20 @@
+#ifndef HOST_BLE_QUEUE_H
+#define HOST_BLE_QUEUE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "blePeripheralServer.h"
+
+//Host stand-in for the app ring and the playback upload path in
+//gatt_svr.c - payloads are copied into the upload buffer and announced
+//with the same opcodes the firmware's system loop handles. A full ring
+//refuses the write, as the firmware does, and the client writes it again.
+
+#define HOST_BLE_PAYLOAD_BYTES 510      //Playback bytes per characteristic write
+
+bool hostBleQueue_send(const bleToAppQueueItem_t * item);
+bool hostBleQueue_receive(bleToAppQueueItem_t * item);
+uint32_t hostBleQueue_writePlaybackPayload(const uint8_t * fileData, uint32_t fileLength, uint32_t offset, uint8_t * uploadBuffer);
+bool hostBleQueue_sendCommand(uint8_t opcode);
+
+#endif
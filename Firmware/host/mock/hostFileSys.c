@@ -0,0 +1,115 @@
+#include <stdio.h>
+#include <string.h>
+#include "hostFileSys.h"
+
+static char storedFileName[MAX_FILENAME_CHARS];
+static const uint8_t * storedData = NULL;
+static uint32_t storedLength = 0;
+static bool isFileOpen = false;
+static uint8_t * writeBuffer = NULL;
+static uint32_t writeBufferSize = 0;
+
+
+//**** Public
+void hostFileSys_setFile(const char * fileName, const uint8_t * data, uint32_t length)
+{
+    strncpy(storedFileName, fileName, MAX_FILENAME_CHARS - 1);
+    storedData = data;
+    storedLength = length;
+    isFileOpen = false;
+}
+
+
+//**** Public
+void hostFileSys_setWriteBuffer(uint8_t * buffer, uint32_t size)
+{
+    writeBuffer = buffer;
+    writeBufferSize = size;
+}
+
+
+//**** Public
+uint32_t hostFileSys_getFile(const char * fileName, const uint8_t ** data)
+{
+    if((storedData == NULL) || (strcmp(fileName, storedFileName) != 0)) return 0;
+
+    *data = storedData;
+    return storedLength;
+}
+
+
+//**** Public
+uint8_t fileSys_openFileRW(char * fileName, bool createNew)
+{
+    if((storedData != NULL) && (strcmp(fileName, storedFileName) == 0))
+    {
+        isFileOpen = true;
+        return 0;
+    }
+
+    if(!createNew || (writeBuffer == NULL)) return 1;
+
+    hostFileSys_setFile(fileName, writeBuffer, 0);
+    isFileOpen = true;
+    return 0;
+}
+
+
+//**** Public
+uint8_t fileSys_readFileAt(uint32_t offset, uint8_t * dataBuffer, uint16_t maxBytes, uint16_t * numBytesRead)
+{
+    *numBytesRead = 0;
+
+    if(!isFileOpen || (dataBuffer == NULL)) return 1;
+    if(offset >= storedLength) return 0;
+
+    *numBytesRead = ((storedLength - offset) < maxBytes) ? (uint16_t)(storedLength - offset) : maxBytes;
+    memcpy(dataBuffer, storedData + offset, *numBytesRead);
+
+    return 0;
+}
+
+
+//**** Public
+uint8_t fileSys_writeFile(uint8_t * data, uint32_t numBytes, bool closeOnExit)
+{
+    // Only files created here can be written, they're in the write buffer
+    if(!isFileOpen || (storedData != writeBuffer) || ((storedLength + numBytes) > writeBufferSize)) return 1;
+
+    memcpy(writeBuffer + storedLength, data, numBytes);
+    storedLength += numBytes;
+
+    if(closeOnExit) fileSys_closeFile();
+    return 0;
+}
+
+
+//**** Public
+uint8_t fileSys_writeFileAt(uint32_t offset, uint8_t * data, uint32_t numBytes)
+{
+    if(!isFileOpen || (storedData != writeBuffer) || ((offset + numBytes) > storedLength)) return 1;
+
+    memcpy(writeBuffer + offset, data, numBytes);
+    return 0;
+}
+
+
+//**** Public
+uint8_t fileSys_deleteFile(char * fileName)
+{
+    if(isFileOpen || (storedData == NULL) || (strcmp(fileName, storedFileName) != 0)) return 1;
+
+    storedData = NULL;
+    storedLength = 0;
+    return 0;
+}
+
+
+//**** Public
+uint8_t fileSys_closeFile(void)
+{
+    if(!isFileOpen) return 1;
+
+    isFileOpen = false;
+    return 0;
+}
@@ -0,0 +1,16 @@
+#ifndef HOST_FILE_SYS_H
+#define HOST_FILE_SYS_H
+
+#include <stdint.h>
+#include "fileSys.h"
+
+//Host stand-in for the littlefs backed fileSys component, holding a
+//single file in memory. Only what the playback stream and the recorder
+//use is provided. Files created (opened with createNew) are written to
+//the buffer given to hostFileSys_setWriteBuffer, replacing the file.
+
+void hostFileSys_setFile(const char * fileName, const uint8_t * data, uint32_t length);
+void hostFileSys_setWriteBuffer(uint8_t * buffer, uint32_t size);
+uint32_t hostFileSys_getFile(const char * fileName, const uint8_t ** data);
+
+#endif
@@ -0,0 +1,235 @@
+#include <stdio.h>
+#include <string.h>
+#include "hostLowLevel.h"
+
+static uint64_t virtualTime = 0;
+static uint64_t alarmDeadline = 0;
+static bool isAlarmArmed = false;
+static uint64_t lineFreeTime[MIDI_OUTPUT_NUM_PORTS]; //When each wire finishes the last byte queued
+
+static hostUartByte_t * capture = NULL;
+static uint32_t captureSize = 0;
+static uint32_t numCaptured = 0;
+static hostUartStats_t uartStats;
+
+static midiInputByte_t midiIn[MIDI_OUTPUT_NUM_PORTS][HOST_MIDI_IN_BYTES];
+static uint32_t midiInHead[MIDI_OUTPUT_NUM_PORTS];
+static uint32_t midiInTail[MIDI_OUTPUT_NUM_PORTS];
+static uint32_t midiInNotified[MIDI_OUTPUT_NUM_PORTS]; //Bytes up to here have had their arrival wake
+static bool isMidiInEnabled[MIDI_OUTPUT_NUM_PORTS];
+static midiInputStats_t midiInStats[MIDI_OUTPUT_NUM_PORTS];
+
+
+//**** Public
+void hostLowLevel_reset(uint64_t startTime, hostUartByte_t * captureBuffer, uint32_t maxCaptured)
+{
+    virtualTime = startTime;
+    for(uint8_t port = 0; port < MIDI_OUTPUT_NUM_PORTS; port++) lineFreeTime[port] = startTime;
+    isAlarmArmed = false;
+    capture = captureBuffer;
+    captureSize = maxCaptured;
+    numCaptured = 0;
+    memset(&uartStats, 0, sizeof(hostUartStats_t));
+    for(uint8_t port = 0; port < MIDI_OUTPUT_NUM_PORTS; port++) midiInTail[port] = midiInNotified[port] = midiInHead[port];
+    memset(midiInStats, 0, sizeof(midiInStats));
+}
+
+
+//**** Public
+uint64_t hostLowLevel_getTime(void)
+{
+    return virtualTime;
+}
+
+
+//**** Public
+void hostLowLevel_advanceTo(uint64_t time)
+{
+    if(time > virtualTime) virtualTime = time; //Never runs backwards, same as the gptimer
+}
+
+
+//**** Public
+bool hostLowLevel_takeAlarm(uint64_t * deadline)
+{
+    // Stands in for the alarm ISR, the caller advances
+    // the clock to 'deadline' (plus any wake latency)
+    if(!isAlarmArmed) return false;
+
+    *deadline = alarmDeadline;
+    isAlarmArmed = false;
+    return true;
+}
+
+
+//**** Public
+bool hostLowLevel_takeWake(uint64_t * wakeTime, bool * isMidiIn)
+{
+    // Whichever comes first, the alarm waking the playback task or the
+    // uart handing over a byte on an enabled midi in (its stop bit done),
+    // which wakes the midi in task. An alarm later than the byte stays
+    // armed. 'isMidiIn' tells the caller which of the two it was
+    uint64_t arrival = UINT64_MAX;
+    uint8_t arrivalPort = 0;
+    const midiInputByte_t * next;
+
+    for(uint8_t port = 0; port < MIDI_OUTPUT_NUM_PORTS; port++)
+    {
+        if(!isMidiInEnabled[port] || (midiInNotified[port] == midiInHead[port])) continue;
+        next = &midiIn[port][midiInNotified[port] & (HOST_MIDI_IN_BYTES - 1)];
+        if((next->time + HOST_UART_US_PER_BYTE) < arrival)
+        {
+            arrival = next->time + HOST_UART_US_PER_BYTE;
+            arrivalPort = port;
+        }
+    }
+
+    if((arrival != UINT64_MAX) && (!isAlarmArmed || (arrival < alarmDeadline)))
+    {
+        midiInNotified[arrivalPort]++;
+        *wakeTime = arrival;
+        *isMidiIn = true;
+        return true;
+    }
+
+    *isMidiIn = false;
+    return hostLowLevel_takeAlarm(wakeTime);
+}
+
+
+//**** Public
+uint32_t hostLowLevel_getNumCaptured(void)
+{
+    return numCaptured;
+}
+
+
+//**** Public
+const hostUartStats_t * hostLowLevel_getUartStats(void)
+{
+    return &uartStats;
+}
+
+
+
+
+//**** Public
+void hostLowLevel_receiveMidiIn(uint8_t port, uint64_t startBitTime, uint8_t byte)
+{
+    // Bytes must be given in order, readMidiIn hands each one over once
+    // the virtual clock has passed its stop bit. Nothing is received
+    // while the port's input is disabled, as with the edge interrupt off
+    if(!isMidiInEnabled[port]) return;
+
+    if((midiInHead[port] - midiInTail[port]) >= HOST_MIDI_IN_BYTES)
+    {
+        midiInStats[port].numTimestampOverflows++;
+        return;
+    }
+
+    midiIn[port][midiInHead[port] & (HOST_MIDI_IN_BYTES - 1)].time = startBitTime;
+    midiIn[port][midiInHead[port] & (HOST_MIDI_IN_BYTES - 1)].byte = byte;
+    midiInHead[port]++;
+}
+
+
+
+
+//************************************
+//****** systemLowLevel.h MOCKS ******
+//************************************
+void initSystemLowLevel(TaskHandle_t deltaTimerTask)
+{
+    (void)deltaTimerTask;
+}
+
+
+uint64_t getDeltaTimerNow(void)
+{
+    return virtualTime;
+}
+
+
+void setDeltaTimerDeadline(uint64_t deadline)
+{
+    alarmDeadline = deadline;
+    isAlarmArmed = true;
+}
+
+
+void writeMidiOut(uint8_t port, const uint8_t * data, uint32_t length)
+{
+    // uart_write_bytes only returns once everything fits in the tx
+    // buffering, so a write into a full buffer blocks the caller -
+    // which here means virtual time moves on until there is room.
+    // Ports only share the clock, each has a wire and buffer of its own
+    uint64_t bufferedUntil;
+    uint64_t wireTime;
+
+    uartStats.numWrites++;
+
+    for(uint32_t i = 0; i < length; i++)
+    {
+        if(lineFreeTime[port] < virtualTime) lineFreeTime[port] = virtualTime;
+
+        bufferedUntil = virtualTime + ((uint64_t)HOST_UART_TX_BUFFER_BYTES * HOST_UART_US_PER_BYTE);
+        if(lineFreeTime[port] >= bufferedUntil)
+        {
+            if(i == 0) uartStats.numBlockedWrites++;
+            uartStats.totalBlockedTime += (lineFreeTime[port] - bufferedUntil) + HOST_UART_US_PER_BYTE;
+            virtualTime = lineFreeTime[port] - ((uint64_t)(HOST_UART_TX_BUFFER_BYTES - 1) * HOST_UART_US_PER_BYTE);
+        }
+
+        wireTime = lineFreeTime[port];
+        lineFreeTime[port] += HOST_UART_US_PER_BYTE;
+        uartStats.numBytes++;
+        uartStats.numPortBytes[port]++;
+
+        if(numCaptured < captureSize)
+        {
+            capture[numCaptured].writeTime = virtualTime;
+            capture[numCaptured].wireTime = wireTime;
+            capture[numCaptured].port = port;
+            capture[numCaptured].byte = data[i];
+            numCaptured++;
+        }
+    }
+}
+
+
+void initMidiIn(void)
+{
+}
+
+
+void enableMidiIn(uint8_t port, bool enable)
+{
+    isMidiInEnabled[port] = enable;
+    midiInTail[port] = midiInNotified[port] = midiInHead[port];
+}
+
+
+uint32_t readMidiIn(uint8_t port, midiInputByte_t * bytes, uint32_t maxBytes)
+{
+    uint32_t numRead = 0;
+    const midiInputByte_t * received;
+
+    while((numRead < maxBytes) && (midiInTail[port] != midiInHead[port]))
+    {
+        received = &midiIn[port][midiInTail[port] & (HOST_MIDI_IN_BYTES - 1)];
+        if((received->time + HOST_UART_US_PER_BYTE) > virtualTime) break; //Still arriving
+
+        bytes[numRead++] = *received;
+        midiInTail[port]++;
+        if((int32_t)(midiInNotified[port] - midiInTail[port]) < 0) midiInNotified[port] = midiInTail[port];
+    }
+    midiInStats[port].numBytes += numRead;
+
+    return numRead;
+}
+
+
+const midiInputStats_t * getMidiInStats(uint8_t port)
+{
+    return &midiInStats[port];
+}
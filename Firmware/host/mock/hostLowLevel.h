@@ -0,0 +1,49 @@
+#ifndef HOST_LOW_LEVEL_H
+#define HOST_LOW_LEVEL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "systemLowLevel.h"
+
+//Host implementation of systemLowLevel.h. The delta timer is a virtual
+//clock that only moves when the benchmark moves it, so runs are exactly
+//repeatable. Each port's uart is modelled as a 31250 baud wire behind the
+//same amount of tx buffering the driver is installed with, every byte
+//written is captured (all ports in one buffer, in write order) along with
+//its port, the time it was written and the time it starts going out on
+//its wire. Midi in is fed by the benchmark, each byte given along with
+//the time its start bit interrupt would have timed it at - the uart
+//handing the byte over is a wake of its own, standing in for waitMidiIn
+//returning to the midi in task (see hostLowLevel_takeWake).
+
+#define HOST_UART_US_PER_BYTE MIDI_UART_US_PER_BYTE
+#define HOST_UART_TX_BUFFER_BYTES (MIDI_UART_TX_BUFFER_BYTES + 128) //Driver tx ring + hardware fifo
+#define HOST_MIDI_IN_BYTES 4096 //Input bytes waiting to be read on each port, MUST be a power of two
+
+typedef struct
+{
+    uint64_t writeTime;                     //Virtual time writeMidiOut was called
+    uint64_t wireTime;                      //Virtual time the byte starts on the wire
+    uint8_t port;
+    uint8_t byte;
+} hostUartByte_t;
+
+typedef struct
+{
+    uint32_t numWrites;                     //writeMidiOut calls
+    uint32_t numBytes;                      //Bytes written (captured or not)
+    uint32_t numPortBytes[MIDI_OUTPUT_NUM_PORTS];
+    uint32_t numBlockedWrites;              //Writes that found the tx buffer full
+    uint64_t totalBlockedTime;              //Virtual time spent blocked in writeMidiOut (uS)
+} hostUartStats_t;
+
+void hostLowLevel_reset(uint64_t startTime, hostUartByte_t * captureBuffer, uint32_t captureSize);
+uint64_t hostLowLevel_getTime(void);
+void hostLowLevel_advanceTo(uint64_t time);
+bool hostLowLevel_takeAlarm(uint64_t * deadline);
+bool hostLowLevel_takeWake(uint64_t * wakeTime, bool * isMidiIn);
+uint32_t hostLowLevel_getNumCaptured(void);
+const hostUartStats_t * hostLowLevel_getUartStats(void);
+void hostLowLevel_receiveMidiIn(uint8_t port, uint64_t startBitTime, uint8_t byte);
+
+#endif
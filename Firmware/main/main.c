@@ -55,15 +55,14 @@ void app_main(void)
 
 static uint8_t initRTOSTasks(void)
 {
-    uint8_t btQueueItem[20];
+    bleToAppQueueItem_t btQueueItem;
 
     //------------------------------------------------------------
     //---- BLE PERIPERAL / GATT SERVER TASK SETUP & INITIALIZATION 
     //------------------------------------------------------------
-    blePeriph_bleToAppQueue = xQueueCreate(10, sizeof(bleToAppQueueItem_t));
     blePeriph_appToBleQueue = xQueueCreate(10, sizeof(uint8_t));
 
-    if(blePeriph_bleToAppQueue == 0 || blePeriph_appToBleQueue == 0)
+    if(blePeriphAPI_initAppRing() || blePeriph_appToBleQueue == 0)
     {
         ESP_LOGE(LOG_TAG, "Bluetooth queue creation failure");
         return 1;
@@ -80,7 +79,7 @@ static uint8_t initRTOSTasks(void)
     }
 
     //See the ble component for more info on system ble usage
-    if(xQueueReceive(blePeriph_bleToAppQueue, btQueueItem, pdMS_TO_TICKS(5000)) == pdFALSE) 
+    if(!blePeriphAPI_receive(&btQueueItem, pdMS_TO_TICKS(5000))) 
     {
         ESP_LOGE(LOG_TAG, "Bluetooth client task failed to respond after creation");
         return 1; 